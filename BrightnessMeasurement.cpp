@@ -22,72 +22,169 @@
 #include "RasterUtilities.h"
 #include "SpatialDataView.h"
 #include "SpatialDataWindow.h"
+#include "StringUtilities.h"
+#include "LayerList.h"
 #include "switchOnEncoding.h"
 #include "BrightnessMeasurement.h"
 #include "BrightnessMeasurementDlg.h"
+#include "imagelib.h"
+#include "centroidlib.h"
+#include "photometrylib.h"
+#include "registrationlib.h"
+#include "starlib.h"
 
-
+#include <algorithm>
 #include <limits>
+#include <math.h>
+#include <sstream>
+#include <stdio.h>
 
 REGISTER_PLUGIN_BASIC(OpticksAstronomy, BrightnessMeasurement);
 
 namespace
 {
-   
-   void GetGrayScale(double *t1, double *t2, EncodingType type)
-   {
-   	double minGrayVal = 0.0;
-   	double maxGrayVal = 255.0;
-   	
-   	if (type == INT1UBYTE)
-	  {
-	  	maxGrayVal = 255;
-	  	minGrayVal = 0;
-	  }
-		
-		if (type == INT1SBYTE)
-	  {
-	  	maxGrayVal = 127;
-	  	minGrayVal = -128;
-	  }
-	  
-	  if (type == INT2UBYTES)
-	  {
-	  	maxGrayVal = 65535;
-	  	minGrayVal = 0;
-	  }
-	  
-	  if (type == INT2SBYTES)
-	  {
-	  	maxGrayVal = 32767;
-	  	minGrayVal = -32768;
-	  }
-	  
-	  *t1 = minGrayVal;
-	  *t2 = maxGrayVal;
-	 }
-   
-   void InitializeData(DataAccessor pSrcAcc, double *pBuffer, unsigned int rows, unsigned int cols, EncodingType type)
+   #define MAX_CATALOG_STARS  500
+   #define MINIMUM_RADIUS_LIMIT  10.0
+   #define TIME_SERIES_MEMORY_LIMIT  (256.0*1024*1024)
+   #define MAGNITUDE_ERROR_SCALE  1.0857   //2.5/ln(10), turning a relative flux error into magnitudes
+
+   //A frame of the series, in memory only while its batch is measured
+   typedef struct _SeriesFrame
+   {
+      RasterElement *pElement;
+      EncodingType type;
+      int rows;
+      int cols;
+      double *pData;
+      bool registered;
+      std::vector<PhotometryResult> results;
+   } SeriesFrame;
+
+   typedef struct _SeriesBand
+   {
+      SeriesFrame *pFrames;
+      const StarCatalog *pReferenceCatalog;
+      int rows;                              //of the reference frame
+      int cols;
+      const std::vector<double> *pPositions; //column, row pairs on the reference frame
+      const StarDetection *pDetection;
+      const CentroidOptions *pCentroidOptions;
+      const RansacOptions *pRansacOptions;
+      const PhotometryOptions *pPhotometryOptions;
+   } SeriesBand;
+
+   //Register a frame on the reference, carry the star positions onto it, re-centre them and measure them
+   void seriesBand(void *pContext, int startFrame, int endFrame)
    {
-	  double pixelVal;
-	  unsigned int nCount = 0;
+      const SeriesBand *pBand = reinterpret_cast<const SeriesBand*>(pContext);
+      unsigned int nStars = pBand->pPositions->size()/2;
 
+      for (int f=startFrame; f<endFrame; f++)
+      {
+         SeriesFrame *pFrame = pBand->pFrames + f;
+         std::vector<StarInfo> stars;
+         StarCatalog catalog;
+         TransformModel transform;
+         double mapping[2][3];
+
+         DetectStars(pFrame->pData, pFrame->rows, pFrame->cols, pBand->pDetection, &stars);
+         RefineStarCentroids(pFrame->pData, pFrame->rows, pFrame->cols, pBand->pCentroidOptions, &stars);
+         BuildStarCatalog(stars, pFrame->rows, pFrame->cols, 0.0, MAX_CATALOG_STARS, MINIMUM_RADIUS_LIMIT, &catalog);
+
+         pFrame->registered = RegisterStarCatalogs(pBand->pReferenceCatalog, &catalog, pBand->rows, pBand->cols,
+                                                   pBand->pRansacOptions, &transform, NULL) &&
+                              GetPixelMapping(&transform, pBand->rows, pBand->cols, mapping);
+         if (!pFrame->registered)
+         {
+            continue;
+         }
+
+         std::vector<double> guesses(2*nStars);
+         for (unsigned int s=0; s<nStars; s++)
+         {
+            double col = (*pBand->pPositions)[2*s], row = (*pBand->pPositions)[2*s+1];
+            guesses[2*s] = mapping[0][0]*col + mapping[0][1]*row + mapping[0][2];
+            guesses[2*s+1] = mapping[1][0]*col + mapping[1][1]*row + mapping[1][2];
+         }
 
-	  for (unsigned int i=0; i<rows; i++)
-	  {
-		  for (unsigned int j=0; j<cols; j++)
-		  {
-			  pSrcAcc->toPixel(i, j);
-              VERIFYNRV(pSrcAcc.isValid());
-		      pixelVal = Service<ModelServices>()->getDataValue(type, pSrcAcc->getColumn(), COMPLEX_MAGNITUDE, 0);
+         //The transform places the stars to a fraction of a pixel; the centroid follows any residual drift
+         std::vector<Centroid> centroids(nStars);
+         MeasureCentroids(pFrame->pData, pFrame->rows, pFrame->cols, reinterpret_cast<const double (*)[2]>(&guesses[0]),
+                          nStars, pBand->pCentroidOptions, &centroids[0]);
+         for (unsigned int s=0; s<nStars; s++)
+         {
+            if (centroids[s].valid)
+            {
+               guesses[2*s] = centroids[s].x;
+               guesses[2*s+1] = centroids[s].y;
+            }
+         }
 
-			  *(pBuffer + nCount) = pixelVal;
-			  nCount++;
-		  }
-	  }
+         pFrame->results.resize(nStars);
+         MeasurePhotometry(pFrame->pData, pFrame->rows, pFrame->cols, reinterpret_cast<const double (*)[2]>(&guesses[0]),
+                           nStars, pBand->pPhotometryOptions, &pFrame->results[0]);
+      }
    }
-}
 
+   //Column, row pairs separated by commas, semicolons or spaces
+   bool ParseStarPositions(const std::string &text, std::vector<double> *pPositions)
+   {
+      std::string numbers = text;
+      std::replace(numbers.begin(), numbers.end(), ',', ' ');
+      std::replace(numbers.begin(), numbers.end(), ';', ' ');
+
+      std::istringstream stream(numbers);
+      double value;
+      pPositions->clear();
+      while (stream >> value)
+      {
+         pPositions->push_back(value);
+      }
+
+      return stream.eof() && (pPositions->size() >= 4) && (pPositions->size()%2 == 0);
+   }
+
+   //One line of the light curve: the target against the summed comparison stars
+   std::string LightCurveRow(unsigned int nFrame, const SeriesFrame &frame)
+   {
+      const std::vector<PhotometryResult> &results = frame.results;
+      double compFlux = 0.0, compVar = 0.0;
+      bool bValid = results[0].valid;
+      for (unsigned int s=1; s<results.size(); s++)
+      {
+         compFlux += results[s].flux;
+         compVar += results[s].fluxError*results[s].fluxError;
+         bValid = bValid && results[s].valid;
+      }
+
+      //Element names are file paths, which may hold commas or quotes: quote the field and double its quotes
+      std::string name = frame.pElement->getName();
+      std::string quoted = "\"";
+      for (unsigned int i=0; i<name.size(); i++)
+      {
+         quoted += (name[i] == '"') ? std::string("\"\"") : std::string(1, name[i]);
+      }
+      quoted += "\"";
+
+      std::ostringstream line;
+      line.setf(std::ios::fixed);
+      line.precision(4);
+      line << nFrame << ',' << quoted << ',' << results[0].flux << ',' << results[0].fluxError << ',' << compFlux << ',';
+      if (bValid && (compFlux > 0.0))
+      {
+         double relError = sqrt(pow(results[0].fluxError/results[0].flux, 2) + compVar/(compFlux*compFlux));
+         line.precision(5);
+         line << -2.5*log10(results[0].flux/compFlux) << ',' << MAGNITUDE_ERROR_SCALE*relError;
+      }
+      else
+      {
+         line << ',';
+      }
+      line << '\n';
+
+      return line.str();
+   }
+};
 
 BrightnessMeasurement::BrightnessMeasurement()
 {
@@ -117,6 +214,14 @@ bool BrightnessMeasurement::getInputSpecification(PlugInArgList*& pInArgList)
    VERIFY(pInArgList = Service<PlugInManagerServices>()->getPlugInArgList());
    pInArgList->addArg<Progress>(Executable::ProgressArg(), NULL, "Progress reporter");
    pInArgList->addArg<RasterElement>(Executable::DataElementArg(), "Perform speckle remove on this data element");
+   pInArgList->addArg<double>("Minimum Gray Value", NULL, "Lower bound of the dynamic range, derived from the data if not set");
+   pInArgList->addArg<double>("Maximum Gray Value", NULL, "Upper bound of the dynamic range, derived from the data if not set");
+   pInArgList->addArg<bool>("Time Series", NULL, "Measure the stars across every open frame instead of interactively");
+   pInArgList->addArg<std::string>("Star Positions", NULL, "Column, row pairs on the input element: the target, then the comparison stars");
+   pInArgList->addArg<std::string>("Light Curve File", NULL, "CSV file the light curve is written to");
+   pInArgList->addArg<double>("Aperture Radius", NULL, "Radius of the star aperture in pixels");
+   pInArgList->addArg<double>("Sky Inner Radius", NULL, "Inner radius of the sky annulus in pixels");
+   pInArgList->addArg<double>("Sky Outer Radius", NULL, "Outer radius of the sky annulus in pixels");
    return true;
 }
 
@@ -124,6 +229,7 @@ bool BrightnessMeasurement::getOutputSpecification(PlugInArgList*& pOutArgList)
 {
    VERIFY(pOutArgList = Service<PlugInManagerServices>()->getPlugInArgList());
    pOutArgList->addArg<RasterElement>("Result", NULL);
+   pOutArgList->addArg<std::string>("Light Curve", NULL, "The light curve of the time series as CSV text");
    return true;
 }
 
@@ -146,6 +252,16 @@ bool BrightnessMeasurement::execute(PlugInArgList* pInArgList, PlugInArgList* pO
       }
       return false;
    }
+
+   bool bTimeSeries = false;
+   pInArgList->getPlugInArgValue("Time Series", bTimeSeries);
+   if (bTimeSeries)
+   {
+      bool bSuccess = executeTimeSeries(pInArgList, pOutArgList, pCube, pProgress);
+      pStep->finalize(bSuccess ? Message::Success : Message::Failure);
+      return bSuccess;
+   }
+
    RasterDataDescriptor* pDesc = static_cast<RasterDataDescriptor*>(pCube->getDataDescriptor());
    VERIFY(pDesc != NULL);
    EncodingType ResultType = pDesc->getDataType();
@@ -163,11 +279,34 @@ bool BrightnessMeasurement::execute(PlugInArgList* pInArgList, PlugInArgList* pO
    
    double minGrayValue = 0.0;
    double maxGrayValue = 255.0;
-   InitializeData(pSrcAcc, pOriginalImage, pDesc->getRowCount(), pDesc->getColumnCount(), pDesc->getDataType());
-   GetGrayScale(&minGrayValue, &maxGrayValue, pDesc->getDataType());
+   if (!ReadImageRows(pSrcAcc, pDesc->getDataType(), 0, pDesc->getRowCount(), pDesc->getColumnCount(), pOriginalImage))
+   {
+      std::string msg = "Unable to access the cube data.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      return false;
+   }
+
+   //8/16-bit data uses the range of the type, int32 and float data the range of the data unless configured
+   GetGrayScale(pDesc->getDataType(), pOriginalImage, pDesc->getRowCount()*pDesc->getColumnCount(), &minGrayValue, &maxGrayValue);
+   pInArgList->getPlugInArgValue("Minimum Gray Value", minGrayValue);
+   pInArgList->getPlugInArgValue("Maximum Gray Value", maxGrayValue);
+   if (maxGrayValue <= minGrayValue)
+   {
+      std::string msg = "The maximum gray value must be larger than the minimum gray value.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      return false;
+   }
    
    Service<DesktopServices> pDesktop;
-   BrightnessMeasurementDlg dlg(pDesktop->getMainWidget(), pOriginalImage, pDesc->getColumnCount(), pDesc->getRowCount(),  minGrayValue, maxGrayValue, pDesc->getDataType());
+   BrightnessMeasurementDlg dlg(pDesktop->getMainWidget(), pOriginalImage, pDesc->getColumnCount(), pDesc->getRowCount(),  minGrayValue, maxGrayValue, pCube);
    int stat = dlg.exec();
    if (stat != QDialog::Accepted)
    {
@@ -183,3 +322,247 @@ bool BrightnessMeasurement::execute(PlugInArgList* pInArgList, PlugInArgList* pO
 
    return true;
 }
+
+bool BrightnessMeasurement::executeTimeSeries(PlugInArgList* pInArgList, PlugInArgList* pOutArgList, RasterElement* pCube,
+                                              Progress* pProgress)
+{
+   StepResource pStep("Time Series Photometry", "app", "5C3B2E0A-9F4D-4C61-B7A8-2D1E6F0C8B93");
+
+   std::string positionText;
+   std::vector<double> positions;
+   pInArgList->getPlugInArgValue("Star Positions", positionText);
+   if (!ParseStarPositions(positionText, &positions))
+   {
+      std::string msg = "The star positions must list a target and at least one comparison star as column, row pairs.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      return false;
+   }
+
+   PhotometryOptions photometryOptions;
+   GetDefaultPhotometryOptions(&photometryOptions);
+   pInArgList->getPlugInArgValue("Aperture Radius", photometryOptions.apertureRadius);
+   pInArgList->getPlugInArgValue("Sky Inner Radius", photometryOptions.skyInnerRadius);
+   pInArgList->getPlugInArgValue("Sky Outer Radius", photometryOptions.skyOuterRadius);
+   if ((photometryOptions.apertureRadius <= 0.0) || (photometryOptions.skyOuterRadius <= photometryOptions.skyInnerRadius))
+   {
+      std::string msg = "The aperture radius must be positive and the sky annulus must not be empty.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      return false;
+   }
+
+   //Every open spatial data window holds a frame; the input element is the reference the positions are given on
+   std::vector<Window*> windows;
+   Service<DesktopServices>()->getWindows(SPATIAL_DATA_WINDOW, windows);
+   std::vector<RasterElement*> elements(1, pCube);
+   for (unsigned int i = 0; i < windows.size(); ++i)
+   {
+       SpatialDataWindow* pWindow = dynamic_cast<SpatialDataWindow*>(windows[i]);
+       if (pWindow == NULL)
+       {
+           continue;
+       }
+       LayerList* pList = pWindow->getSpatialDataView()->getLayerList();
+       RasterElement* pElement = pList->getPrimaryRasterElement();
+       if ((pElement != NULL) && (std::find(elements.begin(), elements.end(), pElement) == elements.end()))
+       {
+           elements.push_back(pElement);
+       }
+   }
+
+   StarDetection detection;
+   GetDefaultStarDetection(&detection);
+   CentroidOptions centroidOptions;
+   GetDefaultCentroidOptions(&centroidOptions);
+   RansacOptions ransacOptions;
+   GetDefaultRansacOptions(&ransacOptions);
+   StarCatalog referenceCatalog;
+
+   RasterDataDescriptor* pDesc = static_cast<RasterDataDescriptor*>(pCube->getDataDescriptor());
+   VERIFY(pDesc != NULL);
+
+   SeriesBand band;
+   band.pReferenceCatalog = &referenceCatalog;
+   band.rows = pDesc->getRowCount();
+   band.cols = pDesc->getColumnCount();
+   band.pPositions = &positions;
+   band.pDetection = &detection;
+   band.pCentroidOptions = &centroidOptions;
+   band.pRansacOptions = &ransacOptions;
+   band.pPhotometryOptions = &photometryOptions;
+
+   //Frames are read one after the other and measured in parallel batches whose buffers and detection scratch fit the
+   //memory limit together
+   std::vector<SeriesFrame> batch;
+   std::string lightCurve = "Frame,Name,Target Flux,Target Error,Comparison Flux,Differential Magnitude,Magnitude Error\n";
+   unsigned int nMeasured = 0, nSkipped = 0;
+
+   int nThreads = GetBandThreadCount();
+   for (unsigned int start = 0; start < elements.size(); start += batch.size())
+   {
+      double batchBytes = 0.0;
+      batch.clear();
+
+      while (start + batch.size() < elements.size())
+      {
+         unsigned int i = batch.size();
+         RasterDataDescriptor* pFrameDesc = static_cast<RasterDataDescriptor*>(elements[start+i]->getDataDescriptor());
+         VERIFY(pFrameDesc != NULL);
+
+         //A frame larger than the limit still forms a batch of its own. The frames are measured one per thread, so
+         //up to a thread's worth of them also hold the detection scratch at once.
+         double frameBytes = sizeof(double)*static_cast<double>(pFrameDesc->getRowCount())*pFrameDesc->getColumnCount();
+         if (static_cast<int>(batch.size()) < nThreads)
+         {
+            frameBytes += GetStarDetectionBytes(pFrameDesc->getRowCount(), pFrameDesc->getColumnCount(), &detection);
+         }
+         if (!batch.empty() && (batchBytes + frameBytes > TIME_SERIES_MEMORY_LIMIT))
+         {
+            break;
+         }
+         batchBytes += frameBytes;
+
+         if (pProgress != NULL)
+         {
+            pProgress->updateProgress("Reading frame " + StringUtilities::toDisplayString(start+i+1),
+                                      (start + i) * 100 / elements.size(), NORMAL);
+         }
+
+         batch.push_back(SeriesFrame());
+         SeriesFrame &frame = batch.back();
+         frame.pElement = elements[start+i];
+         frame.type = pFrameDesc->getDataType();
+         frame.rows = pFrameDesc->getRowCount();
+         frame.cols = pFrameDesc->getColumnCount();
+         frame.registered = false;
+
+         FactoryResource<DataRequest> pRequest;
+         pRequest->setInterleaveFormat(BSQ);
+         DataAccessor pSrcAcc = frame.pElement->getDataAccessor(pRequest.release());
+
+         frame.pData = (double *)malloc(sizeof(double)*frame.rows*frame.cols);
+         if ((frame.pData == NULL) || !ReadImageRows(pSrcAcc, frame.type, 0, frame.rows, frame.cols, frame.pData))
+         {
+            std::string msg = "Unable to access the data of " + frame.pElement->getName() + ".";
+            pStep->finalize(Message::Failure, msg);
+            if (pProgress != NULL) 
+            {
+               pProgress->updateProgress(msg, 0, ERRORS);
+            }
+            for (unsigned int j = 0; j < batch.size(); ++j)
+            {
+               free(batch[j].pData);
+            }
+            return false;
+         }
+      }
+
+      if (start == 0)
+      {
+         //The reference supplies the catalog the others register on and maps onto itself
+         std::vector<StarInfo> stars;
+         DetectStars(batch[0].pData, band.rows, band.cols, &detection, &stars);
+         RefineStarCentroids(batch[0].pData, band.rows, band.cols, &centroidOptions, &stars);
+         BuildStarCatalog(stars, band.rows, band.cols, 0.0, MAX_CATALOG_STARS, MINIMUM_RADIUS_LIMIT, &referenceCatalog);
+
+         //The user positions are only a click away from the stars; centroid them as the other frames are, and map
+         //the centroids onto those frames
+         unsigned int nStars = positions.size()/2;
+         std::vector<Centroid> centroids(nStars);
+         MeasureCentroids(batch[0].pData, band.rows, band.cols, reinterpret_cast<const double (*)[2]>(&positions[0]),
+                          nStars, &centroidOptions, &centroids[0]);
+         for (unsigned int s=0; s<nStars; s++)
+         {
+            if (centroids[s].valid)
+            {
+               positions[2*s] = centroids[s].x;
+               positions[2*s+1] = centroids[s].y;
+            }
+         }
+
+         batch[0].registered = true;
+         batch[0].results.resize(nStars);
+         MeasurePhotometry(batch[0].pData, band.rows, band.cols, reinterpret_cast<const double (*)[2]>(&positions[0]),
+                           nStars, &photometryOptions, &batch[0].results[0]);
+      }
+
+      //One band per frame; the detection, centroids and photometry inside a band then run on its own thread
+      unsigned int nBatch = batch.size();
+      band.pFrames = &batch[0];
+      if (start == 0)
+      {
+         band.pFrames++;
+         nBatch--;
+      }
+      RunRowBands(seriesBand, &band, nBatch, 1);
+
+      for (unsigned int i = 0; i < batch.size(); ++i)
+      {
+         free(batch[i].pData);
+         if (batch[i].registered)
+         {
+            lightCurve += LightCurveRow(start + i, batch[i]);
+            nMeasured++;
+         }
+         else
+         {
+            nSkipped++;
+         }
+      }
+
+      if (isAborted())
+      {
+         std::string msg = getName() + " has been aborted.";
+         pStep->finalize(Message::Abort, msg);
+         if (pProgress != NULL)
+         {
+            pProgress->updateProgress(msg, 0, ABORT);
+         }
+         return false;
+      }
+   }
+
+   std::string fileName;
+   pInArgList->getPlugInArgValue("Light Curve File", fileName);
+   if (!fileName.empty())
+   {
+      FILE *pFile = fopen(fileName.c_str(), "w");
+      if ((pFile == NULL) || (fputs(lightCurve.c_str(), pFile) < 0))
+      {
+         std::string msg = "Unable to write the light curve to " + fileName + ".";
+         pStep->finalize(Message::Failure, msg);
+         if (pProgress != NULL) 
+         {
+            pProgress->updateProgress(msg, 0, ERRORS);
+         }
+         if (pFile != NULL)
+         {
+            fclose(pFile);
+         }
+         return false;
+      }
+      fclose(pFile);
+   }
+
+   pOutArgList->setPlugInArgValue("Light Curve", &lightCurve);
+
+   std::string msg = "Time series photometry is complete.\n " + StringUtilities::toDisplayString(nMeasured) + " frames measured";
+   if (nSkipped > 0)
+   {
+      msg += ", " + StringUtilities::toDisplayString(nSkipped) + " could not be registered";
+   }
+   if (pProgress != NULL)
+   {
+      pProgress->updateProgress(msg, 100, NORMAL);
+   }
+   pStep->finalize();
+
+   return true;
+}
@@ -3,6 +3,9 @@
 
 #include "ExecutableShell.h"
 
+class Progress;
+class RasterElement;
+
 class BrightnessMeasurement : public ExecutableShell
 {
 public:
@@ -12,6 +15,9 @@ public:
    virtual bool getInputSpecification(PlugInArgList*& pInArgList);
    virtual bool getOutputSpecification(PlugInArgList*& pOutArgList);
    virtual bool execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgList);
+
+   //Measure the stars of the input element across every open frame and emit a light curve
+   bool executeTimeSeries(PlugInArgList* pInArgList, PlugInArgList* pOutArgList, RasterElement* pCube, Progress* pProgress);
    
    double *pOriginalImage;
 };
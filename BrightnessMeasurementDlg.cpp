@@ -10,6 +10,8 @@
 #include "AppAssert.h"
 #include "AppVerify.h"
 #include "BrightnessMeasurementDlg.h"
+#include "centroidlib.h"
+#include "photometrylib.h"
 
 
 #include <QtGui/QLabel>
@@ -22,16 +24,21 @@
 #include <QtGui/QEvent.h>
 #include <QtGui/QPainter.h>
 
+#include <algorithm>
+
 
 using namespace std;
 
 #define MAX_INNER_RADIUS 10
 #define MAX_OUTTER_RADIUS 25
-#define MEAN_STAR_DIFFERENCE_THRESHOLD   0.1
-#define MEAN_SKY_DIFFERENCE_THRESHOLD   0.05
-
-BrightnessMeasurementDlg::BrightnessMeasurementDlg(QWidget* pParent, double *pBuffer, int imgWidth, int imgHeight, double t1, double t2, EncodingType type) : QDialog(pParent),
-   pStarPosition(NULL), pStarBrightness(NULL), pSkyBrightness(NULL), pInRadius(NULL), pOutRadius(NULL), pCompute(NULL), imageLabel(NULL), qImage(NULL), pMode(NULL), pStarIndex(NULL)
+#define DISPLAY_TILE_SIZE 256
+#define MAX_DISPLAY_TILES 64         //16 MB of tiles
+#define DEFAULT_VIEW_SIZE 2048       //the dialog opens at the first zoom level no larger than this
+#define MIN_VIEW_SIZE 256            //zoom out until the image is this small
+
+BrightnessMeasurementDlg::BrightnessMeasurementDlg(QWidget* pParent, double *pBuffer, int imgWidth, int imgHeight, double t1, double t2,
+   const RasterElement *pElement) : QDialog(pParent),
+   pStarPosition(NULL), pStarBrightness(NULL), pSkyBrightness(NULL), pInRadius(NULL), pOutRadius(NULL), pCompute(NULL), imageLabel(NULL), pMode(NULL), pStarIndex(NULL), pZoom(NULL)
 {
    setWindowTitle("Brightness Measurement");
    
@@ -47,46 +54,43 @@ BrightnessMeasurementDlg::BrightnessMeasurementDlg(QWidget* pParent, double *pBu
    
    mInnerRadius = 2;
    mOutterRadius = 8;
+   mSkyRadius = 2;
    
    mInnerRadius_2 = 2;
    mOutterRadius_2 = 8;
+   mSkyRadius_2 = 2;
    
    mPosX = -1;
    mPosY = -1;
    
    mPosX_2 = -1;
    mPosY_2 = -1;
+
+   mStarX = mStarY = -1.0;
+   mStarX_2 = mStarY_2 = -1.0;
    
    mMaxGrayLevel = t2 - t1;
 
-   DisplayBuffer = (unsigned char *)malloc(sizeof(unsigned char)*mWidth*mHeight*4);
-   unsigned long nCount= 0, nIndex = 0;
-   for (nIndex=0; nIndex<mWidth*mHeight; nIndex++)
+   //Stretch the gray scale of the data, whatever the encoding, to the 8-bit display range through a table indexed by the
+   //scaled value, so painting a tile costs one multiply and one lookup per pixel
+   mLUTScale = (STRETCH_LUT_SIZE - 1)/mMaxGrayLevel;
+   for (int i=0; i<STRETCH_LUT_SIZE; i++)
    {
-   	 double tempData = pImage[nIndex];
-		
-		 if (type == INT1SBYTE)
-	   {
-	       tempData = tempData + 128;
-	   }
-	  
-	   if (type == INT2UBYTES)
-	   {
-	  	 tempData = tempData/255;
-	   }
-	  
-	   if (type == INT2SBYTES)
-	   {
-	  	  tempData = (tempData + 32768)/255;
-	   }
-	   
-	   DisplayBuffer[nCount] = tempData;
-	   DisplayBuffer[nCount+1] = tempData;
-	   DisplayBuffer[nCount+2] = tempData;
-	   DisplayBuffer[nCount+3] = 0xFF;
-	   nCount += 4;
+      int gray = i*255/(STRETCH_LUT_SIZE - 1);
+      mStretchLUT[i] = qRgb(gray, gray, gray);
    }
 
+   //Zoomed-out views come from the element's cached pyramid, or from one over the buffer without an element. Levels
+   //the cache does not hold yet are reduced from the buffer rather than read from the element again. The dialog is
+   //modal, so nothing else can drop the pyramid from the cache meanwhile.
+   InitImagePyramid(&mLocalPyramid, pImage, mHeight, mWidth);
+   mpPyramid = (pElement != NULL) ? GetElementPyramid(pElement, pImage) : NULL;
+   if (mpPyramid == NULL)
+   {
+      mpPyramid = &mLocalPyramid;
+   }
+   mZoomLevel = GetPyramidLevelFor(mHeight, mWidth, DEFAULT_VIEW_SIZE);
+
    QGridLayout* pLayout = new QGridLayout(this);
    pLayout->setMargin(10);
    pLayout->setSpacing(5);
@@ -140,8 +144,20 @@ BrightnessMeasurementDlg::BrightnessMeasurementDlg(QWidget* pParent, double *pBu
    pLayout->addWidget(pSkyBrightness, 6, 10, 1, 2);
    
 
+   QLabel* pLableZoom = new QLabel("Zoom:", this);
+   pLayout->addWidget(pLableZoom, 7, 10);
+
+   pZoom = new QComboBox(this);
+   for (int level=0; level<=GetPyramidLevelFor(mHeight, mWidth, MIN_VIEW_SIZE); level++)
+   {
+      pZoom->addItem(QString::number(100.0/(1 << level)) + "%");
+   }
+   pZoom->setCurrentIndex(std::min(mZoomLevel, pZoom->count() - 1));
+   mZoomLevel = pZoom->currentIndex();
+   pLayout->addWidget(pZoom, 7, 11);
+
    QHBoxLayout* pRespLayout = new QHBoxLayout;
-   pLayout->addLayout(pRespLayout, 7, 10, 1, 2);
+   pLayout->addLayout(pRespLayout, 8, 10, 1, 2);
 
    pCompute = new QPushButton("Compute", this);
    pRespLayout->addStretch();
@@ -155,6 +171,7 @@ BrightnessMeasurementDlg::BrightnessMeasurementDlg(QWidget* pParent, double *pBu
    
    connect(pMode, SIGNAL(currentIndexChanged(int)), this, SLOT(setMeasurementMode(int)));
    connect(pStarIndex, SIGNAL(currentIndexChanged(int)), this, SLOT(setStarIndex(int)));
+   connect(pZoom, SIGNAL(currentIndexChanged(int)), this, SLOT(setZoom(int)));
 
    connect(pInRadius,  SIGNAL(valueChanged(double)), this, SLOT(setInnerRadius(double)));
    connect(pOutRadius, SIGNAL(valueChanged(double)), this, SLOT(setOutterRadius(double)));
@@ -163,18 +180,16 @@ BrightnessMeasurementDlg::BrightnessMeasurementDlg(QWidget* pParent, double *pBu
    imageLabel->setBackgroundRole(QPalette::Base);
    imageLabel->setSizePolicy(QSizePolicy::Ignored, QSizePolicy::Ignored);
    imageLabel->installEventFilter(this);
-   	
 
-   qImage = new QImage(DisplayBuffer, mWidth, mHeight, QImage::Format_RGB32);
-   
-    imageLabel->setPixmap(QPixmap::fromImage(*qImage));
-    imageLabel->adjustSize();
+   int levelRows, levelCols;
+   GetPyramidLevelSize(mHeight, mWidth, mZoomLevel, &levelRows, &levelCols);
+   imageLabel->resize(levelCols, levelRows);
    	
    	scrollArea = new QScrollArea;
     scrollArea->setBackgroundRole(QPalette::Dark);
     scrollArea->setWidget(imageLabel);
     
-    pLayout->addWidget(scrollArea, 0, 0, 8, 10);
+    pLayout->addWidget(scrollArea, 0, 0, 9, 10);
    
     resize(600, 300);
 
@@ -182,7 +197,6 @@ BrightnessMeasurementDlg::BrightnessMeasurementDlg(QWidget* pParent, double *pBu
 
 BrightnessMeasurementDlg::~BrightnessMeasurementDlg()
 {
-	free(DisplayBuffer);
 }
 
 void BrightnessMeasurementDlg::setMeasurementMode(int nIndex)
@@ -196,9 +210,11 @@ void BrightnessMeasurementDlg::setMeasurementMode(int nIndex)
 	{
 		mInnerRadius = 2;
         mOutterRadius = 8;
+        mSkyRadius = 2;
    
         mInnerRadius_2 = 2;
         mOutterRadius_2 = 8;
+        mSkyRadius_2 = 2;
    
         mPosX = -1;
         mPosY = -1;
@@ -245,6 +261,23 @@ void BrightnessMeasurementDlg::setStarIndex(int nIndex)
     mStarIndex = nIndex;
 }
 
+void BrightnessMeasurementDlg::setZoom(int nIndex)
+{
+	if ((nIndex < 0) || (nIndex == mZoomLevel))
+	{
+		return;
+	}
+
+	mZoomLevel = nIndex;
+
+	int levelRows, levelCols;
+	GetPyramidLevelSize(mHeight, mWidth, mZoomLevel, &levelRows, &levelCols);
+	imageLabel->resize(levelCols, levelRows);
+
+	imageLabel->update();
+	imageLabel->repaint();
+}
+
 void BrightnessMeasurementDlg::setInnerRadius(double dVal)
 {
 	if (mMode == 0)
@@ -300,45 +333,22 @@ void BrightnessMeasurementDlg::ComputeBrightness(void)
 
 	if (mMode == 0)
 	{
-		double dSkyBrightness;
-		double dStarBrightness;
-		int nCount = 0;
-		
-		dStarBrightness = CalculateMeanValue(mPosX, mPosY, 0, mInnerRadius, mHeight, mWidth, pImage, &nCount);
-		dStarBrightness = (dStarBrightness-mMinGrayValue)/(mMaxGrayValue - mMinGrayValue)*nCount;
-
-		dSkyBrightness = CalculateSkyBrightness(mPosX, mPosY, mInnerRadius, mOutterRadius, mHeight, mWidth, pImage);
-		dStarBrightness = dStarBrightness - (dSkyBrightness-mMinGrayValue)/(mMaxGrayValue - mMinGrayValue)*nCount;
-		dStarBrightness = 2.5*log10(dStarBrightness);
+		PhotometryResult star;
+		MeasureStar(mStarX, mStarY, mInnerRadius, mSkyRadius, mOutterRadius, &star);
 
+		double dStarBrightness = 2.5*log10(star.flux/(mMaxGrayValue - mMinGrayValue));
 		sprintf(strPos, "Star Brightness: %.2f\0",dStarBrightness);
 	}
 	else
 	{
-		double dSkyBrightness;
-		double dStarBrightness;
-		int nCount = 0;
-
 		if ((mPosX_2 < 0) || (mPosY_2 < 0))
 		    return;
-		
-		dStarBrightness = CalculateMeanValue(mPosX, mPosY, 0, mInnerRadius, mHeight, mWidth, pImage, &nCount);
-		dStarBrightness = (dStarBrightness-mMinGrayValue)/(mMaxGrayValue - mMinGrayValue)*nCount;
-
-		dSkyBrightness = CalculateSkyBrightness(mPosX, mPosY, mInnerRadius, mOutterRadius, mHeight, mWidth, pImage);
-		dStarBrightness = dStarBrightness - (dSkyBrightness-mMinGrayValue)/(mMaxGrayValue - mMinGrayValue)*nCount;
 
-		double dSkyBrightness2;
-		double dStarBrightness2;
-		int nCount2 = 0;
-		
-		dStarBrightness2 = CalculateMeanValue(mPosX_2, mPosY_2, 0, mInnerRadius_2, mHeight, mWidth, pImage, &nCount2);
-		dStarBrightness2 = (dStarBrightness2-mMinGrayValue)/(mMaxGrayValue - mMinGrayValue)*nCount2;
-		
-		dSkyBrightness2 = CalculateSkyBrightness(mPosX_2, mPosY_2, mInnerRadius_2, mOutterRadius_2, mHeight, mWidth, pImage);
-		dStarBrightness2 = dStarBrightness2 - (dSkyBrightness2-mMinGrayValue)/(mMaxGrayValue - mMinGrayValue)*nCount2;
+		PhotometryResult star, star2;
+		MeasureStar(mStarX, mStarY, mInnerRadius, mSkyRadius, mOutterRadius, &star);
+		MeasureStar(mStarX_2, mStarY_2, mInnerRadius_2, mSkyRadius_2, mOutterRadius_2, &star2);
 
-        dStarBrightness = 2.5*log10(dStarBrightness/dStarBrightness2);
+		double dStarBrightness = 2.5*log10(star.flux/star2.flux);
 		sprintf(strPos, "Relative Brightness: %.2f\0",dStarBrightness);
 	}
 
@@ -360,18 +370,26 @@ bool BrightnessMeasurementDlg::eventFilter(QObject* watched, QEvent* pEvent)
 	if ( pEvent->type() == QEvent::MouseButtonPress )
 	{
         const QMouseEvent* const me = static_cast<const QMouseEvent*>( pEvent );
-		x = me->x();
-		y = me->y();
-
-		ModifyCenter(&x, &y, mHeight, mWidth, pImage);
+		x = me->x() << mZoomLevel;
+		y = me->y() << mZoomLevel;
+
+		//Move the click onto the star: the brightest pixel nearby, then the fitted centre of its profile
+		CentroidOptions options;
+		GetDefaultCentroidOptions(&options);
+		double guess[1][2] = {{static_cast<double>(x), static_cast<double>(y)}};
+		Centroid centroid;
+		MeasureCentroids(pImage, mHeight, mWidth, guess, 1, &options, &centroid);
+		x = static_cast<int>(floor(centroid.x + 0.5));
+		y = static_cast<int>(floor(centroid.y + 0.5));
     
 		if (mMode == 0)
 		{
 	        mPosX = x;
 	        mPosY = y;
+	        mStarX = centroid.x;
+	        mStarY = centroid.y;
 
-			mInnerRadius = CalculateInnerRadius(x, y, mHeight, mWidth, mMaxGrayLevel, pImage);
-		    mOutterRadius = CalculateOutterRadius(x, y, mInnerRadius+2, mHeight, mWidth, mMaxGrayLevel, pImage);
+			EstimateRadii(centroid.x, centroid.y, &mInnerRadius, &mSkyRadius, &mOutterRadius);
 
 		    pInRadius->setValue(mInnerRadius);
 		    pOutRadius->setValue(mOutterRadius);
@@ -382,9 +400,10 @@ bool BrightnessMeasurementDlg::eventFilter(QObject* watched, QEvent* pEvent)
 			{
 				mPosX = x;
 	            mPosY = y;
+	            mStarX = centroid.x;
+	            mStarY = centroid.y;
 
-				mInnerRadius = CalculateInnerRadius(x, y, mHeight, mWidth, mMaxGrayLevel, pImage);
-		        mOutterRadius = CalculateOutterRadius(x, y, mInnerRadius+2, mHeight, mWidth, mMaxGrayLevel, pImage);
+				EstimateRadii(centroid.x, centroid.y, &mInnerRadius, &mSkyRadius, &mOutterRadius);
 
 		        pInRadius->setValue(mInnerRadius);
 		        pOutRadius->setValue(mOutterRadius);
@@ -393,16 +412,17 @@ bool BrightnessMeasurementDlg::eventFilter(QObject* watched, QEvent* pEvent)
 			{
 				mPosX_2 = x;
 	            mPosY_2 = y;
+	            mStarX_2 = centroid.x;
+	            mStarY_2 = centroid.y;
 
-				mInnerRadius_2 = CalculateInnerRadius(x, y, mHeight, mWidth, mMaxGrayLevel, pImage);
-		        mOutterRadius_2 = CalculateOutterRadius(x, y, mInnerRadius_2+2, mHeight, mWidth, mMaxGrayLevel, pImage);
+				EstimateRadii(centroid.x, centroid.y, &mInnerRadius_2, &mSkyRadius_2, &mOutterRadius_2);
 
 		        pInRadius->setValue(mInnerRadius_2);
 		        pOutRadius->setValue(mOutterRadius_2);
 			}
 		}
 
-	    sprintf(strPos, "Star position: %d, %d\0",x, y);
+	    sprintf(strPos, "Star position: %.2f, %.2f\0", centroid.x, centroid.y);
 	
 
 	    pStarPosition->setText(strPos);
@@ -415,276 +435,138 @@ bool BrightnessMeasurementDlg::eventFilter(QObject* watched, QEvent* pEvent)
 	if ( pEvent->type() == QEvent::Paint )
 	{
 		QPainter painter(imageLabel);
-	        
-	    painter.drawPixmap(0, 0, mWidth, mHeight, QPixmap::fromImage(*qImage));
 
-		if (mMode == 0)
+		//Only the tiles the exposed area touches are drawn, rendered the first time they are seen
+		int levelRows, levelCols;
+		GetPyramidLevelSize(mHeight, mWidth, mZoomLevel, &levelRows, &levelCols);
+		QRect area = static_cast<QPaintEvent*>(pEvent)->rect().intersected(QRect(0, 0, levelCols, levelRows));
+		if (!area.isEmpty())
 		{
-		    if (mPosX > 0 && mPosY > 0)
-		    {  
-                QPoint pPoint(mPosX , mPosY);
-                painter.setPen( QPen(Qt::white, 1, Qt::SolidLine, Qt::RoundCap));
-                painter.drawEllipse(pPoint, (int)mInnerRadius , (int)mInnerRadius);
-			    painter.drawEllipse(pPoint, (int)mOutterRadius , (int)mOutterRadius);
+			for (int tileRow = area.top()/DISPLAY_TILE_SIZE; tileRow <= area.bottom()/DISPLAY_TILE_SIZE; tileRow++)
+			{
+				for (int tileCol = area.left()/DISPLAY_TILE_SIZE; tileCol <= area.right()/DISPLAY_TILE_SIZE; tileCol++)
+				{
+					QPixmap tile;
+					if (GetDisplayTile(tileRow, tileCol, &tile))
+					{
+						painter.drawPixmap(tileCol*DISPLAY_TILE_SIZE, tileRow*DISPLAY_TILE_SIZE, tile);
+					}
+				}
 			}
 		}
-		else
+
+		if (mPosX > 0 && mPosY > 0)
 		{
-			if (mPosX > 0 && mPosY > 0)
-		    {  
-                QPoint pPoint(mPosX , mPosY);
-                painter.setPen( QPen(Qt::white, 1, Qt::SolidLine, Qt::RoundCap));
-                painter.drawEllipse(pPoint, (int)mInnerRadius , (int)mInnerRadius);
-			    painter.drawEllipse(pPoint, (int)mOutterRadius , (int)mOutterRadius);
-			}
+			DrawApertures(painter, mStarX, mStarY, mInnerRadius, mSkyRadius, mOutterRadius);
+		}
 
-			if (mPosX_2 > 0 && mPosY_2 > 0)
-		    {  
-                QPoint pPoint(mPosX_2 , mPosY_2);
-                painter.setPen( QPen(Qt::white, 1, Qt::SolidLine, Qt::RoundCap));
-                painter.drawEllipse(pPoint, (int)mInnerRadius_2 , (int)mInnerRadius_2);
-			    painter.drawEllipse(pPoint, (int)mOutterRadius_2 , (int)mOutterRadius_2);
-			}
+		if ((mMode != 0) && (mPosX_2 > 0 && mPosY_2 > 0))
+		{
+			DrawApertures(painter, mStarX_2, mStarY_2, mInnerRadius_2, mSkyRadius_2, mOutterRadius_2);
 		}
-			
 	}
 
     return true;
 }
 
-int BrightnessMeasurementDlg::CalculateInnerRadius(int x, int y, int rows, int cols, double maxGrayVal, double *pBuffer)
+const double *BrightnessMeasurementDlg::GetDisplayLevel(int level, int *pRows, int *pCols)
 {
-	double prevMean = -1;
-	double currMean = 0;
-	int nPixels;
-	int i;
-	  
-    for (i=1; i<MAX_INNER_RADIUS; i++)
+    return GetPyramidLevel(mpPyramid, level, pRows, pCols);
+}
+
+bool BrightnessMeasurementDlg::GetDisplayTile(int tileRow, int tileCol, QPixmap *pTile)
+{
+    for (std::list<DisplayTile>::iterator it = mTiles.begin(); it != mTiles.end(); ++it)
     {
-        currMean = CalculateMeanValue(x, y, 0, i, rows, cols, pBuffer, &nPixels);
-        
-        if (i > 1)
+        if ((it->level == mZoomLevel) && (it->tileRow == tileRow) && (it->tileCol == tileCol))
         {
-            if (abs(prevMean - currMean)/maxGrayVal > MEAN_STAR_DIFFERENCE_THRESHOLD)
-            {
-                break;
-            }
+            mTiles.splice(mTiles.begin(), mTiles, it);
+            *pTile = mTiles.front().pixmap;
+            return true;
         }
-        
-        prevMean = currMean;
-        
     }
-    
-    return i+1;
-}
 
-int BrightnessMeasurementDlg::CalculateOutterRadius(int x, int y, int inRadius, int rows, int cols, double maxGrayVal, double *pBuffer)
-{
-	double prevMean = -1;
-	double currMean = 0;
-	int nPixels;
-	int i;
+    int rows, cols;
+    const double *pLevel = GetDisplayLevel(mZoomLevel, &rows, &cols);
+    int startRow = tileRow*DISPLAY_TILE_SIZE, startCol = tileCol*DISPLAY_TILE_SIZE;
+    if ((pLevel == NULL) || (startRow >= rows) || (startCol >= cols))
+    {
+        return false;
+    }
 
-    for (i=inRadius; i<MAX_OUTTER_RADIUS; i+=3)
+    int nRows = std::min(DISPLAY_TILE_SIZE, rows - startRow), nCols = std::min(DISPLAY_TILE_SIZE, cols - startCol);
+    QImage image(nCols, nRows, QImage::Format_RGB32);
+    for (int i=0; i<nRows; i++)
     {
-        currMean = CalculateMeanValue(x, y, inRadius, i, rows, cols, pBuffer, &nPixels);
-        
-        if (i > inRadius)
+        const double *pSrc = pLevel + (startRow + i)*cols + startCol;
+        QRgb *pLine = reinterpret_cast<QRgb*>(image.scanLine(i));
+        for (int j=0; j<nCols; j++)
         {
-            if (abs(prevMean - currMean)/maxGrayVal > MEAN_SKY_DIFFERENCE_THRESHOLD)
-            {
-                break;
-            }
+            //NaN fails the comparison and shows black with the values below the range
+            double index = (pSrc[j] - mMinGrayValue)*mLUTScale;
+            pLine[j] = mStretchLUT[(index > 0.0) ? static_cast<int>(std::min(index, STRETCH_LUT_SIZE - 1.0)) : 0];
         }
-        
-        prevMean = currMean;
-        
     }
-    
-    return i;
-}    	
 
-            
-double BrightnessMeasurementDlg::CalculateMeanValue(int x, int y, int inRadius, int outRadius, int rows, int cols, double *pBuffer, int *nPixels)
-{
-    int currentX = x - outRadius;
-    int currentY = y - outRadius;
-    int currentDist;
-    int nCount = 0;
-    double meanValue = 0.0;
-    
-    for (int i=0; i<outRadius*2+1; i++)
+    DisplayTile tile;
+    tile.level = mZoomLevel;
+    tile.tileRow = tileRow;
+    tile.tileCol = tileCol;
+    tile.pixmap = QPixmap::fromImage(image);
+    mTiles.push_front(tile);
+    if (mTiles.size() > MAX_DISPLAY_TILES)
     {
-    	currentY = y - outRadius;
-    	  
-        for (int j=0; j<outRadius*2+1; j++)
-        {   
-            if ((currentX <0) || (currentX >= cols))
-            {
-                continue;
-            }
-            
-            if ((currentY <0) || (currentY >= rows))
-            {
-                continue;
-            }
-            
-            currentDist = (currentX - x)*(currentX - x) + (currentY - y)*(currentY - y);
-            
-            if ((currentDist < inRadius*inRadius) || (currentDist > outRadius*outRadius))
-            {
-                continue;
-            }
-            
-            meanValue = meanValue + pBuffer[cols*currentY + currentX];
-            nCount++;
-            
-            currentY++;
-            
-        }
-        
-        currentX++;
+        mTiles.pop_back();
     }
-    
-    *nPixels = nCount;
-    meanValue = meanValue/nCount;
-    
-    return meanValue;
-    
+
+    *pTile = tile.pixmap;
+    return true;
 }
 
-void BrightnessMeasurementDlg::ModifyCenter(int *x, int *y, int rows, int cols, double *pBuffer)
+void BrightnessMeasurementDlg::DrawApertures(QPainter &painter, double x, double y, double inRadius, double skyRadius,
+                                             double outRadius)
 {
-	int outRadius = 2;
-	int currentX = *x - outRadius;
-    int currentY = *y - outRadius;
-	int finalX = *x;
-	int finalY = *y;
-
-    double maxValue = -std::numeric_limits<double>::max();;
-	double temp;
-    
-    for (int i=0; i<outRadius*2+1; i++)
+    //Pixel i of a zoom level lies on pixel i << level of the image
+    double scale = 1.0/(1 << mZoomLevel);
+    QPointF centre(x*scale, y*scale);
+
+    painter.setPen( QPen(Qt::white, 1, Qt::SolidLine, Qt::RoundCap));
+    painter.drawEllipse(centre, inRadius*scale, inRadius*scale);
+    painter.drawEllipse(centre, outRadius*scale, outRadius*scale);
+
+    //The sky annulus starts at the dashed circle when it lies beyond the aperture
+    if ((skyRadius > inRadius) && (skyRadius < outRadius))
     {
-    	currentY = *y - outRadius;
-    	  
-        for (int j=0; j<outRadius*2+1; j++)
-        {   
-            if ((currentX <0) || (currentX >= cols))
-            {
-                continue;
-            }
-            
-            if ((currentY <0) || (currentY >= rows))
-            {
-                continue;
-            }
-            
-            temp = pBuffer[cols*currentY + currentX];
-            if (temp > maxValue)
-			{
-				maxValue = temp;
-				finalX = currentX;
-				finalY = currentY;
-			}
-            
-            currentY++;
-            
-        }
-        
-        currentX++;
+        painter.setPen( QPen(Qt::white, 1, Qt::DashLine, Qt::RoundCap));
+        painter.drawEllipse(centre, skyRadius*scale, skyRadius*scale);
     }
-
-	*x = finalX;
-	*y = finalY;
-    
-    return ;
 }
 
-void BrightnessMeasurementDlg::SortData(double *pData, int len)
+void BrightnessMeasurementDlg::EstimateRadii(double x, double y, double *pInRadius, double *pSkyRadius, double *pOutRadius)
 {
-	  double temp;
-	  int nIndex;
-	  
-	  for (int i=0; i<len; i++)
-	  {
-	  	  temp = pData[i];
-	  	  nIndex = i;
-	  	  
-	      for (int j=i+1; j< len; j++)
-	      {
-	          if (pData[j] < temp)
-	          {
-	              temp = pData[j];
-	              nIndex = j;
-	          }
-	      }
-	      
-	      if (i != nIndex)
-	      {
-	          pData[nIndex] = pData[i];
-	          pData[i] = temp;
-	      }
-	  }
-}
+    double position[1][2] = {{x, y}};
+    ApertureSize size;
+    EstimateApertureSizes(pImage, mHeight, mWidth, position, 1, MAX_OUTTER_RADIUS, &size);
 
+    *pInRadius = std::min(std::max(size.apertureRadius, 1.0), static_cast<double>(MAX_INNER_RADIUS));
+    *pOutRadius = std::min(std::max(size.skyOuterRadius, *pInRadius + 1.0), static_cast<double>(MAX_OUTTER_RADIUS));
 
-double BrightnessMeasurementDlg::CalculateSkyBrightness(int x, int y, int inRadius, int outRadius, int rows, int cols, double *pBuffer)
+    //The profile puts the sky beyond the light the aperture leaves out; keep the annulus at least a pixel wide
+    *pSkyRadius = std::min(std::max(size.skyInnerRadius, *pInRadius), *pOutRadius - 1.0);
+}
+
+void BrightnessMeasurementDlg::MeasureStar(double x, double y, double inRadius, double skyRadius, double outRadius,
+                                           PhotometryResult *pResult)
 {
-    int currentX = x - outRadius;
-    int currentY = y - outRadius;
-    int currentDist;
-    int nCount = 0;
-    double meanValue = 0.0;
-    double pData[(2*MAX_OUTTER_RADIUS+1)*(2*MAX_OUTTER_RADIUS+1)];
-    
-    for (int i=0; i<outRadius*2+1; i++)
-    {
-    	currentY = y - outRadius;
-    	  
-        for (int j=0; j<outRadius*2+1; j++)
-        {   
-            if ((currentX <0) || (currentX >= cols))
-            {
-                continue;
-            }
-            
-            if ((currentY <0) || (currentY >= rows))
-            {
-                continue;
-            }
-            
-            currentDist = (currentX - x)*(currentX - x) + (currentY - y)*(currentY - y);
-            
-            if ((currentDist < inRadius*inRadius) || (currentDist > outRadius*outRadius))
-            {
-                continue;
-            }
-            
-            pData[nCount] = pBuffer[cols*currentY + currentX];
-            nCount++;
-            
-            currentY++;
-            
-        }
-        
-        currentX++;
-    }
-    
-    SortData(pData, nCount);
-    
-    int t1 = 0.2*nCount;
-    int t2 = 0.8*nCount;
-    
-    nCount = 0;
-    for (int i=t1; i<=t2; i++)
-    {
-        meanValue = meanValue + pData[i];
-        nCount++;
-    }
-    
-    meanValue = meanValue/nCount;
-    
-    return meanValue;
-    
-}
\ No newline at end of file
+    //The sky annulus starts where the profile reached the sky, or at the aperture if the outer radius has since been
+    //brought inside that, and a fifth of it is trimmed at either end
+    PhotometryOptions options;
+    GetDefaultPhotometryOptions(&options);
+    options.apertureRadius = inRadius;
+    options.skyInnerRadius = ((skyRadius > inRadius) && (skyRadius < outRadius)) ? skyRadius : inRadius;
+    options.skyOuterRadius = outRadius;
+    options.skyTrim = 0.2;
+
+    double position[1][2] = {{x, y}};
+    MeasurePhotometry(pImage, mHeight, mWidth, position, 1, &options, pResult);
+}
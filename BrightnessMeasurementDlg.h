@@ -11,7 +11,14 @@
 #define BRIGHTNESS_MEASUREMENT_DLG_H
 
 #include <QtGui/QDialog>
+#include <QtGui/QPixmap>
 #include "TypesFile.h"
+#include "photometrylib.h"
+#include "pyramidlib.h"
+
+#include <list>
+
+#define STRETCH_LUT_SIZE 4096
 
 
 class QDoubleSpinBox;
@@ -20,13 +27,26 @@ class QPushButton;
 class QScrollArea;
 class QScrollBar;
 class QComboBox;
+class QPainter;
+class RasterElement;
+
+//A rendered square of the display at one zoom level
+typedef struct _DisplayTile DisplayTile;
+struct _DisplayTile
+{
+   int level;
+   int tileRow;
+   int tileCol;
+   QPixmap pixmap;
+};
 
 class BrightnessMeasurementDlg : public QDialog
 {
    Q_OBJECT
 
 public:
-   BrightnessMeasurementDlg(QWidget* pParent, double *pBuffer, int imgWidth, int imgHeight, double t1, double t2, EncodingType type); 
+   BrightnessMeasurementDlg(QWidget* pParent, double *pBuffer, int imgWidth, int imgHeight, double t1, double t2,
+                            const RasterElement *pElement = NULL); 
    ~BrightnessMeasurementDlg();
 
 private slots:
@@ -36,6 +56,7 @@ private slots:
    
    void setMeasurementMode(int nIndex);
    void setStarIndex(int nIndex);
+   void setZoom(int nIndex);
 
 public:
    
@@ -45,6 +66,7 @@ public:
    
    QComboBox         *pMode;
    QComboBox         *pStarIndex;
+   QComboBox         *pZoom;
    
    QDoubleSpinBox    *pInRadius;
    QDoubleSpinBox    *pOutRadius;
@@ -53,28 +75,35 @@ public:
    
    QLabel *imageLabel;
    QScrollArea *scrollArea;
-   QImage      *qImage;
 
-   double CalculateMeanValue(int x, int y, int inRadius, int outRadius, int rows, int cols, double *pBuffer, int *nPixels);
-   int CalculateInnerRadius(int x, int y, int rows, int cols, double maxGrayVal, double *pBuffer);
-   int CalculateOutterRadius(int x, int y, int inRadius, int rows, int cols, double maxGrayVal, double *pBuffer);
+   const double *GetDisplayLevel(int level, int *pRows, int *pCols);
+   bool GetDisplayTile(int tileRow, int tileCol, QPixmap *pTile);
+   void DrawApertures(QPainter &painter, double x, double y, double inRadius, double skyRadius, double outRadius);
 
-   void ModifyCenter(int *x, int *y, int rows, int cols, double *pBuffer);
-   void SortData(double *pData, int len);
-   double CalculateSkyBrightness(int x, int y, int inRadius, int outRadius, int rows, int cols, double *pBuffer);
+   void EstimateRadii(double x, double y, double *pInRadius, double *pSkyRadius, double *pOutRadius);
+
+   void MeasureStar(double x, double y, double inRadius, double skyRadius, double outRadius, PhotometryResult *pResult);
 
 private:
 	double mInnerRadius;
 	double mOutterRadius;
+	double mSkyRadius;       //inner radius of the sky annulus, from the star's radial profile
 	
 	double mInnerRadius_2;
 	double mOutterRadius_2;
+	double mSkyRadius_2;
 	
 	int mPosX;
 	int mPosY;
 	
 	int mPosX_2;
 	int mPosY_2;
+
+	double mStarX;
+	double mStarY;
+
+	double mStarX_2;
+	double mStarY_2;
 	
 	int mMode;
 	int mStarIndex;
@@ -83,7 +112,6 @@ private:
 	double mSkyBrightness;
 	
 	double *pImage;
-	unsigned char *DisplayBuffer;
 	int    mWidth;
 	int    mHeight;
 
@@ -91,6 +119,15 @@ private:
 	double mMinGrayValue;
 	double mMaxGrayValue;
 
+	//Display: the zoom level is a level of the image pyramid, whose pixels are stretched through the LUT into tiles
+	//that are kept between paints
+	ImagePyramid mLocalPyramid;
+	ImagePyramid *mpPyramid;
+	int mZoomLevel;
+	unsigned int mStretchLUT[STRETCH_LUT_SIZE];
+	double mLUTScale;
+	std::list<DisplayTile> mTiles;
+
 protected:
      bool eventFilter(QObject *obj, QEvent *pEvent);
 
@@ -25,6 +25,7 @@
 #include "switchOnEncoding.h"
 #include "Deconvolution.h"
 #include "DeconvolutionDlg.h"
+#include "imagelib.h"
 
 #include <limits>
 
@@ -71,68 +72,6 @@ namespace
         return retVal;
    }
    
-   void GetGrayScale(double *t1, double *t2, EncodingType type)
-   {
-   	double minGrayVal = 0.0;
-   	double maxGrayVal = 255.0;
-   	
-   	if (type == INT1UBYTE)
-	  {
-	  	maxGrayVal = 255;
-	  	minGrayVal = 0;
-	  }
-		
-		if (type == INT1SBYTE)
-	  {
-	  	maxGrayVal = 127;
-	  	minGrayVal = -128;
-	  }
-	  
-	  if (type == INT2UBYTES)
-	  {
-	  	maxGrayVal = 65535;
-	  	minGrayVal = 0;
-	  }
-	  
-	  if (type == INT2SBYTES)
-	  {
-	  	maxGrayVal = 32767;
-	  	minGrayVal = -32768;
-	  }
-	  
-	  *t1 = minGrayVal;
-	  *t2 = maxGrayVal;
-	 }
-   
-   void InitializeData(DataAccessor pSrcAcc, double *pBuffer, double *pOrigData, unsigned int rows, unsigned int cols, EncodingType type)
-   {
-	  double pixelVal;
-	  unsigned int nCount = 0;
-
-
-	  for (unsigned int i=0; i<rows; i++)
-	  {
-		  for (unsigned int j=0; j<cols; j++)
-		  {
-			  pSrcAcc->toPixel(i, j);
-              VERIFYNRV(pSrcAcc.isValid());
-		      pixelVal = Service<ModelServices>()->getDataValue(type, pSrcAcc->getColumn(), COMPLEX_MAGNITUDE, 0);
-
-			  *(pBuffer + nCount) = pixelVal;
-			  *(pOrigData + nCount) = pixelVal;
-			  nCount++;
-		  }
-	  }
-   }
-
-   template<typename T>
-   void restoreImageValue(T* pData, double *pSrc)
-   {
-	   double pixelVal = *pSrc;
-
-	   *pData = static_cast<T>(pixelVal);
-   }
-
    //Convolution function, using Gaussian function as point spread function
    void ConvolutionFunc(double *OrigData, double *ConvoData, int rowSize, int colSize, double sigmaVal, double minGrayVal, double maxGrayVal, int windowSize)
    {
@@ -225,7 +164,7 @@ namespace
                    }
 
            
-                   temp = abs(NewData[i*cols+j] - OrigData[i*cols+j]);
+                   temp = fabs(NewData[i*cols+j] - OrigData[i*cols+j]);
                    if (temp > miniVal)
                    { 
                        miniVal = temp;
@@ -259,7 +198,7 @@ namespace
                    }
 
            
-                   temp = abs(NewData[i*cols+j] - OrigData[i*cols+j]);
+                   temp = fabs(NewData[i*cols+j] - OrigData[i*cols+j]);
                    if (temp > miniVal)
                    { 
                        miniVal = temp;
@@ -301,6 +240,8 @@ bool Deconvolution::getInputSpecification(PlugInArgList*& pInArgList)
    VERIFY(pInArgList = Service<PlugInManagerServices>()->getPlugInArgList());
    pInArgList->addArg<Progress>(Executable::ProgressArg(), NULL, "Progress reporter");
    pInArgList->addArg<RasterElement>(Executable::DataElementArg(), "Perform speckle remove on this data element");
+   pInArgList->addArg<double>("Minimum Gray Value", NULL, "Lower bound of the dynamic range, derived from the data if not set");
+   pInArgList->addArg<double>("Maximum Gray Value", NULL, "Upper bound of the dynamic range, derived from the data if not set");
    return true;
 }
 
@@ -391,8 +332,39 @@ bool Deconvolution::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgLis
    double *ConvoData = (double *)malloc(sizeof(double)*pDesc->getRowCount()*pDesc->getColumnCount());
    double *pTempData;
 
-   InitializeData(pSrcAcc, pOriginalImage, OrigData, pDesc->getRowCount(), pDesc->getColumnCount(), pDesc->getDataType());
-   GetGrayScale(&minGrayValue, &maxGrayValue, pDesc->getDataType());
+   unsigned int nPixels = pDesc->getRowCount()*pDesc->getColumnCount();
+   if (!ReadImageRows(pSrcAcc, pDesc->getDataType(), 0, pDesc->getRowCount(), pDesc->getColumnCount(), pOriginalImage))
+   {
+      std::string msg = "Unable to access the cube data.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      free(OrigData);
+      free(NewData);
+      free(ConvoData);
+      return false;
+   }
+   memcpy(OrigData, pOriginalImage, sizeof(double)*nPixels);
+
+   //8/16-bit data uses the range of the type, int32 and float data the range of the data unless configured
+   GetGrayScale(pDesc->getDataType(), pOriginalImage, nPixels, &minGrayValue, &maxGrayValue);
+   pInArgList->getPlugInArgValue("Minimum Gray Value", minGrayValue);
+   pInArgList->getPlugInArgValue("Maximum Gray Value", maxGrayValue);
+   if (maxGrayValue <= minGrayValue)
+   {
+      std::string msg = "The maximum gray value must be larger than the minimum gray value.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      free(OrigData);
+      free(NewData);
+      free(ConvoData);
+      return false;
+   }
    
    //Perform deconvolution iteratively
    for (int num = 0; num < MAX_ITERATION_NUMBER; num++)
@@ -437,29 +409,17 @@ bool Deconvolution::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgLis
 
 
    //Output result
-   unsigned int nCount = 0;
-   for (int i = 0; i < pDesc->getRowCount(); i++)
+   if (!pDestAcc.isValid() ||
+       !WriteImageRows(pDestAcc, ResultType, 0, pDesc->getRowCount(), pDesc->getColumnCount(), OrigData))
    {
-       for (int j = 0; j < pDesc->getColumnCount(); j++)		   
-	   {		   
-		   if (!pDestAcc.isValid())
-           {       
-		       std::string msg = "Unable to access the cube data.";        
-			   pStep->finalize(Message::Failure, msg);
-                       
-			   if (pProgress != NULL)                      
-			   {         
-			       pProgress->updateProgress(msg, 0, ERRORS);       
-			   }   
-			   free(OrigData);                  
-			   return false;              
-		   }
-			   
-		   pDestAcc->toPixel(i, j);	
-		   switchOnEncoding(ResultType, restoreImageValue, pDestAcc->getColumn(), (OrigData+nCount));
-		   nCount++;
-
-	   }
+      std::string msg = "Unable to access the cube data.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL)
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      free(OrigData);
+      return false;
    }
    
    free(OrigData);  
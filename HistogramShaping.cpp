@@ -22,119 +22,107 @@
 #include "RasterUtilities.h"
 #include "SpatialDataView.h"
 #include "SpatialDataWindow.h"
-#include "switchOnEncoding.h"
 #include "HistogramShaping.h"
 #include "HistogramShapingDlg.h"
-#include <limits>
+#include "histogramlib.h"
+#include "imagelib.h"
 #include <algorithm>
+#include <limits>
+#include <list>
+#include <string.h>
+#include <vector>
 
 REGISTER_PLUGIN_BASIC(OpticksAstronomy, HistogramShaping);
 
+#define STRIP_ROWS 1024
+#define HISTOGRAM_CACHE_SIZE 4
+#define PREVIEW_SIZE 256
+
 namespace
 {
-   template<typename T>
-   void calculateHistogram(T* pData, unsigned int *pHisto, unsigned int &pvMin, unsigned int &pvMax)
+   //Histograms of an element as last computed, with a decimated copy of its pixels for the dialog preview
+   typedef struct _HistogramCacheEntry
    {
-      unsigned int pixelValue = static_cast<unsigned int>(*pData);
-      pHisto[pixelValue] = pHisto[pixelValue]+1;
-      
-      pvMin = std::min(pvMin, pixelValue);
-      pvMax = std::max(pvMax, pixelValue);
-   }
-   
-   double GaussianFunc(unsigned int pv, unsigned int pvMax, double meanVal, double sigma)
+      const RasterElement *pElement;
+      unsigned int rows;
+      unsigned int cols;
+      unsigned int bands;
+      EncodingType type;
+      unsigned int revision;
+      HistogramBinning binning;
+      double peakValue;
+      std::vector<unsigned int> cdf;
+      std::vector<unsigned char> preview;
+      unsigned int previewRows;
+      unsigned int previewCols;
+   } HistogramCacheEntry;
+
+   //Most recently used first
+   std::list<HistogramCacheEntry> gHistogramCache;
+
+   HistogramCacheEntry *FindCachedHistogram(const RasterElement *pElement, unsigned int rows, unsigned int cols, unsigned int bands,
+                                            EncodingType type, unsigned int revision)
    {
-       double dpv = static_cast<double>(pv);
-       double dpvMax = static_cast<double>(pvMax);
-       double val = (dpv/dpvMax - meanVal)/sigma;
-       val = val*val;
-       val = exp(-val/2);
+      for (std::list<HistogramCacheEntry>::iterator it = gHistogramCache.begin(); it != gHistogramCache.end(); ++it)
+      {
+         if ((it->pElement == pElement) && (it->rows == rows) && (it->cols == cols) && (it->bands == bands) &&
+             (it->type == type) &&
+             (it->revision == revision))
+         {
+            gHistogramCache.splice(gHistogramCache.begin(), gHistogramCache, it);
+            return &gHistogramCache.front();
+         }
+      }
 
-       return val;
+      return NULL;
    }
 
-   double GetMaxGrayScale(unsigned int *pHisto, unsigned int pvMax)
+   HistogramCacheEntry *StoreCachedHistogram(const HistogramCacheEntry &entry)
    {
-	   unsigned int pv = 0;
-	   unsigned int peakValue = 0;
-	   double maxGrayValue = 0;
-
-	   for (pv = 0; pv < pvMax; pv++)
-       {
-		   if (pHisto[pv] > maxGrayValue)
-		   {
-			   peakValue = pv;
-			   maxGrayValue = pHisto[pv];
-		   }
-       }
-	   peakValue = peakValue/pvMax;
-
-	   return peakValue;
+      //An element whose pixels changed keeps a stale entry, replace it
+      for (std::list<HistogramCacheEntry>::iterator it = gHistogramCache.begin(); it != gHistogramCache.end(); )
+      {
+         if (it->pElement == entry.pElement)
+         {
+            it = gHistogramCache.erase(it);
+         }
+         else
+         {
+            ++it;
+         }
+      }
+
+      gHistogramCache.push_front(entry);
+      while (gHistogramCache.size() > HISTOGRAM_CACHE_SIZE)
+      {
+         gHistogramCache.pop_back();
+      }
+
+      return &gHistogramCache.front();
    }
 
-   
-   void HistogramReshape(unsigned int *pHisto, double *pTarget, unsigned int *pLUT, unsigned int pvMax, double meanVal, double sigma)
+   void ReleaseTiles(std::vector<TiledHistogram> &tiles, unsigned int nTiles)
    {
-       unsigned int histoSum = 0;
-       unsigned int pv = 0;
-       double ratio = 0;
-	   
-       
-       for (pv = 0; pv < pvMax; pv++)
-       {
-           histoSum = histoSum + pHisto[pv];
-       	   pHisto[pv] = histoSum;
-
-       }
-       
-       for (pv = 0; pv < pvMax; pv++)
-       {
-           pTarget[pv] = GaussianFunc(pv, pvMax, meanVal, sigma);
-       }
-       
-       double targetSum = 0;
-       for (pv = 0; pv < pvMax; pv++)
-       {
-           targetSum = targetSum + pTarget[pv];
-       	   pTarget[pv] = targetSum;
-       }
-       
-       ratio = histoSum/targetSum;
-       for (pv = 0; pv < pvMax; pv++)
-       {
-           pTarget[pv] = ratio*pTarget[pv];
-       }
-       
-       unsigned int pvNew = 0;
-       for (pv = 0; pv < pvMax; pv++)
-       {
-       	   while ((pvNew < pvMax) && (pTarget[pvNew] < pHisto[pv]))
-       	   {
-       	       pvNew++;
-       	   }
-       	   
-       	   pLUT[pv] = pvNew;
-       }
-	   
+      for (unsigned int i=0; i<nTiles; i++)
+      {
+         ReleaseTiledHistogram(&tiles[i]);
+      }
    }
-   
-         
 
-   template<typename T>
-   void updatePixel(T* pData, DataAccessor pSrcAcc, unsigned int *pLUT, int row, int col, EncodingType type)
+   //Keep every step-th pixel of every step-th row of a strip of stored pixels
+   void DecimateRows(const unsigned char *pStrip, unsigned int startRow, unsigned int nRows, unsigned int cols,
+                     unsigned int bytesPerPixel, unsigned int step, unsigned char *pPreview, unsigned int previewCols)
    {
-   	   unsigned int originalVal = 0;
-       unsigned int targetVal = 0;
-       
-       pSrcAcc->toPixel(row, col);
-       VERIFYNRV(pSrcAcc.isValid());
-       
-       originalVal = Service<ModelServices>()->getDataValue(type, pSrcAcc->getColumn(), COMPLEX_MAGNITUDE, 0);
-       
-       targetVal = *(pLUT+originalVal);
-
-	   *pData = static_cast<T>(targetVal);
+      for (unsigned int i = (step - startRow%step)%step; i < nRows; i += step)
+      {
+         const unsigned char *pRow = pStrip + i*cols*bytesPerPixel;
+         unsigned char *pOut = pPreview + ((startRow + i)/step)*previewCols*bytesPerPixel;
 
+         for (unsigned int j=0; j<previewCols; j++)
+         {
+            memcpy(pOut + j*bytesPerPixel, pRow + j*step*bytesPerPixel, bytesPerPixel);
+         }
+      }
    }
 };
 
@@ -195,12 +183,19 @@ bool HistogramShaping::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArg
    VERIFY(pDesc != NULL);
    EncodingType ResultType = pDesc->getDataType();
 
+   unsigned int rowCount = pDesc->getRowCount();
+   unsigned int colCount = pDesc->getColumnCount();
+   unsigned int bandCount = std::max(1u, pDesc->getBandCount());
+   unsigned int bytesPerElement = pDesc->getBytesPerElement();
+   unsigned int rowBytes = colCount*bandCount*bytesPerElement;
+
+   //Band-interleaved rows carry every band of a pixel together, so one sweep of the data serves all bands
    FactoryResource<DataRequest> pRequest;
-   pRequest->setInterleaveFormat(BSQ);
+   pRequest->setInterleaveFormat(BIP);
    DataAccessor pSrcAcc = pCube->getDataAccessor(pRequest.release());
 
    ModelResource<RasterElement> pResultCube(RasterUtilities::createRasterElement(pCube->getName() +
-      "_Histogram_Shaping_Result", pDesc->getRowCount(), pDesc->getColumnCount(), ResultType));
+      "_Histogram_Shaping_Result", rowCount, colCount, bandCount, ResultType, BIP));
    if (pResultCube.get() == NULL)
    {
       std::string msg = "A raster cube could not be created.";
@@ -212,86 +207,210 @@ bool HistogramShaping::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArg
       return false;
    }
    FactoryResource<DataRequest> pResultRequest;
+   pResultRequest->setInterleaveFormat(BIP);
    pResultRequest->setWritable(true);
    DataAccessor pDestAcc = pResultCube->getDataAccessor(pResultRequest.release());
    
-   unsigned int pvMin = std::numeric_limits<unsigned int>::max();
-   unsigned int pvMax = 0;
-   unsigned maxGrayValue = 65535;
    double sigma = 3.0;
    double meanVal = 0.5;
 
-   if (ResultType == INT1UBYTE)
-   {
-	   maxGrayValue = 255;
-   }
-   else if (ResultType == INT1SBYTE)
-   {
-	   maxGrayValue = 127;
-   }
-   else if (ResultType == INT2UBYTES)   
-   {
-       maxGrayValue = 65535;
-   }
-   else if (ResultType == INT2SBYTES)
-   {
-	   maxGrayValue = 32767;
-   }
-   else
+   bool fixedBins = HasFixedGrayScale(ResultType);
+   if (!fixedBins && !HasDataBinning(ResultType))
    {
-	   return false;
+      std::string msg = "Histogram shaping does not support complex data.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      return false;
    }
 
-   unsigned int *HistgramArray = (unsigned int *)calloc(sizeof(unsigned int), (maxGrayValue+1));
-   for (unsigned int row = 0; row < pDesc->getRowCount(); ++row)
+   unsigned int stripRows = std::min(rowCount, static_cast<unsigned int>(STRIP_ROWS));
+
+   //An unchanged element keeps the histogram of an earlier run, so re-shaping it skips straight to the dialog
+   unsigned int revision = GetElementRevision(pCube);
+   HistogramCacheEntry *pEntry = FindCachedHistogram(pCube, rowCount, colCount, bandCount, ResultType, revision);
+   if (pEntry == NULL)
    {
-       if (isAborted())
-       {
-          std::string msg = getName() + " has been aborted.";
-          pStep->finalize(Message::Abort, msg);
+      std::vector<unsigned char> strip(stripRows*rowBytes);
+      std::vector<unsigned char> planes((bandCount > 1) ? stripRows*rowBytes : 0);
+      std::vector<double> luminance((bandCount > 1) ? stripRows*colCount : 0);
+
+      //Float and 32-bit data are binned over their own range, found by a first streaming pass
+      HistogramBinning binning;
+      int progressBase = 0;
+      if (fixedBins)
+      {
+         GetIntegerBinning(ResultType, &binning);
+      }
+      else
+      {
+         double minVal = std::numeric_limits<double>::max();
+         double maxVal = -std::numeric_limits<double>::max();
+         for (unsigned int startRow = 0; startRow < rowCount; startRow += STRIP_ROWS)
+         {
+             if (isAborted())
+             {
+                std::string msg = getName() + " has been aborted.";
+                pStep->finalize(Message::Abort, msg);
+                if (pProgress != NULL)
+                {
+                   pProgress->updateProgress(msg, 0, ABORT);
+                }
+                return false;
+             }
+
+             unsigned int nRows = std::min(static_cast<unsigned int>(STRIP_ROWS), rowCount - startRow);
+             CopyImageRows(pSrcAcc, startRow, nRows, rowBytes, &strip[0]);
+             FindDataRange(&strip[0], nRows*colCount*bandCount, ResultType, &minVal, &maxVal);
+
+             if (pProgress != NULL)
+             {
+                pProgress->updateProgress("Finding data range", (startRow + nRows)*25/rowCount, NORMAL);
+             }
+         }
+
+         GetDataBinning(ResultType, minVal, maxVal, &binning);
+         progressBase = 25;
+      }
+
+      //One histogram per band, then one of the luminance for multi-band data
+      unsigned int nBins = binning.nBins;
+      unsigned int nHistograms = (bandCount > 1) ? bandCount + 1 : 1;
+      std::vector<unsigned int> histograms(nHistograms*nBins, 0);
+
+      //Decimated copy of the image for the dialog preview, built along with the histogram
+      unsigned int previewStep = (std::max(rowCount, colCount) + PREVIEW_SIZE - 1)/PREVIEW_SIZE;
+      unsigned int previewRows = (rowCount + previewStep - 1)/previewStep;
+      unsigned int previewCols = (colCount + previewStep - 1)/previewStep;
+      std::vector<unsigned char> preview(previewRows*previewCols*bandCount*bytesPerElement);
+
+      //Copy strips of stored pixels and histogram them by row bands on all cores
+      for (unsigned int startRow = 0; startRow < rowCount; startRow += STRIP_ROWS)
+      {
+          if (isAborted())
+          {
+             std::string msg = getName() + " has been aborted.";
+             pStep->finalize(Message::Abort, msg);
+             if (pProgress != NULL)
+             {
+                pProgress->updateProgress(msg, 0, ABORT);
+             }
+             return false;
+          }
+
+          unsigned int nRows = std::min(static_cast<unsigned int>(STRIP_ROWS), rowCount - startRow);
+          CopyImageRows(pSrcAcc, startRow, nRows, rowBytes, &strip[0]);
+          if (bandCount > 1)
+          {
+             DeinterleavePixels(&strip[0], nRows*colCount, bandCount, bytesPerElement, &planes[0]);
+             BuildBandHistograms(&binning, bandCount, &planes[0], nRows, colCount, &luminance[0], &histograms[0]);
+          }
+          else
+          {
+             BuildHistogram(&strip[0], nRows, colCount, bytesPerElement, &binning, &histograms[0]);
+          }
+          DecimateRows(&strip[0], startRow, nRows, colCount, bandCount*bytesPerElement, previewStep, &preview[0], previewCols);
+
           if (pProgress != NULL)
           {
-             pProgress->updateProgress(msg, 0, ABORT);
+             pProgress->updateProgress("Calculating histogram", progressBase + (startRow + nRows)*(50-progressBase)/rowCount, NORMAL);
           }
-          free(HistgramArray);
-          return false;
-       }
-       for (unsigned int col = 0; col < pDesc->getColumnCount(); ++col)
-       {
-           switchOnEncoding(pDesc->getDataType(), calculateHistogram, pSrcAcc->getColumn(), HistgramArray, pvMin, pvMax);
-           pSrcAcc->nextColumn();
-       }
-       pSrcAcc->nextRow();
+      }
+
+      HistogramCacheEntry entry;
+      entry.pElement = pCube;
+      entry.rows = rowCount;
+      entry.cols = colCount;
+      entry.bands = bandCount;
+      entry.type = ResultType;
+      entry.revision = revision;
+      entry.binning = binning;
+      entry.peakValue = GetHistogramPeak(&histograms[(nHistograms-1)*nBins], nBins);
+      entry.cdf.resize(nHistograms*nBins);
+      for (unsigned int i=0; i<nHistograms; i++)
+      {
+         CumulateHistogram(&histograms[i*nBins], &entry.cdf[i*nBins], nBins);
+      }
+      entry.preview.swap(preview);
+      entry.previewRows = previewRows;
+      entry.previewCols = previewCols;
+
+      pEntry = StoreCachedHistogram(entry);
    }
-   pvMax = maxGrayValue;
 
-   
-   meanVal = GetMaxGrayScale(HistgramArray, pvMax);
-     
+   HistogramBinning binning = pEntry->binning;
+   unsigned int nBins = binning.nBins;
+   meanVal = pEntry->peakValue;
 
    Service<DesktopServices> pDesktop;
-   HistogramShapingDlg dlg(pDesktop->getMainWidget(), meanVal);
+   HistogramShapingDlg dlg(pDesktop->getMainWidget(), meanVal, &binning, bandCount, &pEntry->cdf[0], &pEntry->preview[0],
+                           pEntry->previewRows, pEntry->previewCols, bytesPerElement);
    int stat = dlg.exec();
    if (stat == QDialog::Accepted)
    {
    	 
 	  sigma = dlg.getSigmaValue();
 	  meanVal = dlg.getMeanValue();  
+
+      BandShaping shaping;
+      shaping.binning = binning;
+      GetLuminanceBinning(&binning, &shaping.lumBinning);
+      shaping.nBands = bandCount;
+      shaping.cols = colCount;
+      shaping.bytesPerElement = bytesPerElement;
+      shaping.linked = (bandCount > 1) && (dlg.getBandLinking() == 1);
+      shaping.pTiles = NULL;
+
+      //Linked shaping maps the luminance alone, whose histogram follows those of the bands
+      unsigned int nChannels = GetChannelCount(&shaping);
+      std::vector<unsigned int> PixelMap(nChannels*nBins);
+      std::vector<double> TargetHistogram(nBins);
+      for (unsigned int channel = 0; channel < nChannels; channel++)
+      {
+         unsigned int histogram = shaping.linked ? bandCount : channel;
+         HistogramReshapeCdf(&pEntry->cdf[histogram*nBins], &TargetHistogram[0], &PixelMap[channel*nBins], nBins, meanVal, sigma);
+      }
+      shaping.pLUT = &PixelMap[0];
       
-      double *TargetHistogram = (double *)calloc(sizeof(double), (maxGrayValue+1));
-      unsigned int *PixelMap = ( unsigned int *)calloc(sizeof(unsigned int), (maxGrayValue+1));
-      
-      HistogramReshape(HistgramArray, TargetHistogram, PixelMap, pvMax, meanVal, sigma);
-      
-      free(TargetHistogram);
-      free(HistgramArray);
-      
-      //Output the value 
-      for (unsigned int m = 0; m < pDesc->getRowCount(); m++)
+      //Map strips of stored pixels through the LUTs and write them back as whole rows
+      std::vector<unsigned char> srcStrip(stripRows*rowBytes);
+      std::vector<unsigned char> destStrip(stripRows*rowBytes);
+      std::vector<unsigned char> srcPlanes((bandCount > 1) ? stripRows*rowBytes : 0);
+      std::vector<unsigned char> destPlanes((bandCount > 1) ? stripRows*rowBytes : 0);
+      std::vector<double> luminance((bandCount > 1) ? stripRows*colCount : 0);
+      std::vector<double> mappedLuminance(shaping.linked ? stripRows*colCount : 0);
+
+      std::vector<TiledHistogram> tiles;
+      if (dlg.getShapingMode() == 1)
+      {
+          tiles.resize(nChannels);
+          for (unsigned int channel = 0; channel < nChannels; channel++)
+          {
+              if (!CreateTiledHistogram(shaping.linked ? &shaping.lumBinning : &binning, rowCount, colCount,
+                                        dlg.getTilesAcross(), &tiles[channel]))
+              {
+                  std::string msg = "Unable to allocate the tile histograms.";
+                  pStep->finalize(Message::Failure, msg);
+                  if (pProgress != NULL) 
+                  {
+                      pProgress->updateProgress(msg, 0, ERRORS);
+                  }
+                  ReleaseTiles(tiles, channel);
+                  return false;
+              }
+          }
+          shaping.pTiles = &tiles[0];
+      }
+
+      //The tiled mode needs a histogram per tile, accumulated in a second pass once the tile grid is known
+      int progressBase = 50;
+      if (shaping.pTiles != NULL)
       {
-	      for (unsigned int n = 0; n < pDesc->getColumnCount(); n++)
-	      {
-		      if (isAborted())
+          for (unsigned int startRow = 0; startRow < rowCount; startRow += STRIP_ROWS)
+          {
+              if (isAborted())
               {
                   std::string msg = getName() + " has been aborted.";
                   pStep->finalize(Message::Abort, msg);
@@ -299,31 +418,83 @@ bool HistogramShaping::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArg
                   {
                       pProgress->updateProgress(msg, 0, ABORT);
                   }
+                  ReleaseTiles(tiles, nChannels);
                   return false;
               }
-				      
-			  if (!pDestAcc.isValid())
+
+              unsigned int nRows = std::min(static_cast<unsigned int>(STRIP_ROWS), rowCount - startRow);
+              CopyImageRows(pSrcAcc, startRow, nRows, rowBytes, &srcStrip[0]);
+              if (bandCount > 1)
               {
-                  std::string msg = "Unable to access the cube data.";
-                  pStep->finalize(Message::Failure, msg);
-                  if (pProgress != NULL) 
-                  {
-                      pProgress->updateProgress(msg, 0, ERRORS);
-                   }
-                   return false;
-               }
-
-				       
-			  switchOnEncoding(ResultType, updatePixel, pDestAcc->getColumn(), pSrcAcc, PixelMap, m, n, pDesc->getDataType());       
-			  pDestAcc->nextColumn();
-				   
-		  }
-				   
-		  pDestAcc->nextRow();
-		  
-	  }  
-		  
-	  free(PixelMap);
+                  DeinterleavePixels(&srcStrip[0], nRows*colCount, bandCount, bytesPerElement, &srcPlanes[0]);
+                  AccumulateTiledBands(&shaping, &srcPlanes[0], startRow, nRows, &luminance[0]);
+              }
+              else
+              {
+                  AccumulateTiledBands(&shaping, &srcStrip[0], startRow, nRows, NULL);
+              }
+
+              if (pProgress != NULL)
+              {
+                  pProgress->updateProgress("Calculating tile histograms", 50 + (startRow + nRows)*25/rowCount, NORMAL);
+              }
+          }
+
+          for (unsigned int channel = 0; channel < nChannels; channel++)
+          {
+              ReshapeTiles(&tiles[channel], meanVal, sigma, dlg.getClipLimit());
+          }
+          progressBase = 75;
+      }
+
+      for (unsigned int startRow = 0; startRow < rowCount; startRow += STRIP_ROWS)
+      {
+          if (isAborted())
+          {
+              std::string msg = getName() + " has been aborted.";
+              pStep->finalize(Message::Abort, msg);
+              if (pProgress != NULL)
+              {
+                  pProgress->updateProgress(msg, 0, ABORT);
+              }
+              ReleaseTiles(tiles, tiles.size());
+              return false;
+          }
+
+          if (!pDestAcc.isValid())
+          {
+              std::string msg = "Unable to access the cube data.";
+              pStep->finalize(Message::Failure, msg);
+              if (pProgress != NULL) 
+              {
+                  pProgress->updateProgress(msg, 0, ERRORS);
+              }
+              ReleaseTiles(tiles, tiles.size());
+              return false;
+          }
+
+          unsigned int nRows = std::min(static_cast<unsigned int>(STRIP_ROWS), rowCount - startRow);
+          CopyImageRows(pSrcAcc, startRow, nRows, rowBytes, &srcStrip[0]);
+          if (bandCount > 1)
+          {
+              DeinterleavePixels(&srcStrip[0], nRows*colCount, bandCount, bytesPerElement, &srcPlanes[0]);
+              ShapeBands(&shaping, &srcPlanes[0], &destPlanes[0], startRow, nRows, &luminance[0],
+                         shaping.linked ? &mappedLuminance[0] : NULL);
+              InterleavePixels(&destPlanes[0], nRows*colCount, bandCount, bytesPerElement, &destStrip[0]);
+          }
+          else
+          {
+              ShapeBands(&shaping, &srcStrip[0], &destStrip[0], startRow, nRows, NULL, NULL);
+          }
+          StoreImageRows(pDestAcc, startRow, nRows, rowBytes, &destStrip[0]);
+
+          if (pProgress != NULL)
+          {
+              pProgress->updateProgress("Applying histogram shaping", progressBase + (startRow + nRows)*(100-progressBase)/rowCount, NORMAL);
+          }
+      }
+
+      ReleaseTiles(tiles, tiles.size());
 
       if (!isBatch())
       {
@@ -355,9 +526,5 @@ bool HistogramShaping::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArg
 
       pStep->finalize();
    }
-   else
-   {
-	   free(HistgramArray);
-   }
    return true;
 }
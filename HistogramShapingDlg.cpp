@@ -10,21 +10,58 @@
 #include "AppAssert.h"
 #include "AppVerify.h"
 #include "HistogramShapingDlg.h"
+#include "imagelib.h"
 
+#include <QtGui/QComboBox>
 #include <QtGui/QDoubleSpinBox>
 #include <QtGui/QLabel>
+#include <QtGui/QImage>
 #include <QtGui/QLayout>
+#include <QtGui/QPainter>
+#include <QtGui/QPixmap>
 #include <QtGui/QPushButton>
+#include <QtGui/QSpinBox>
+
+#include <algorithm>
 
 using namespace std;
 
-HistogramShapingDlg::HistogramShapingDlg(QWidget* pParent, double peakValue) : QDialog(pParent),
-   mMeanValueBox(NULL), mSigmaValueBox(NULL)
+#define HISTOGRAM_PLOT_WIDTH 256
+#define HISTOGRAM_PLOT_HEIGHT 100
+
+HistogramShapingDlg::HistogramShapingDlg(QWidget* pParent, double peakValue, const HistogramBinning *pBinning, unsigned int nBands,
+                                         const unsigned int *pCdf, const unsigned char *pPreview, unsigned int previewRows,
+                                         unsigned int previewCols, unsigned int bytesPerElement) : QDialog(pParent),
+   mMeanValueBox(NULL), mSigmaValueBox(NULL), mModeMenu(NULL), mTilesAcrossBox(NULL), mClipLimitBox(NULL), mBandLinkingMenu(NULL),
+   mHistogramLabel(NULL), mPreviewLabel(NULL), mpBinning(pBinning), mBands(nBands), mpCdf(pCdf),
+   mPreviewRows(previewRows), mPreviewCols(previewCols), mBytesPerElement(bytesPerElement)
 {
    setWindowTitle("Gaussian Histogram Shaping");
    
    mMeanValue  = peakValue;
    mSigmaValue = 3.0;
+   mShapingMode = 0;
+   mTilesAcross = 8;
+   mClipLimit = 3.0;
+   mBandLinking = 0;
+
+   //The preview is shaped band by band like the image, so split its interleaved pixels once
+   unsigned int nPixels = previewRows*previewCols;
+   mPreviewPlanes.resize(nPixels*nBands*bytesPerElement);
+   if (nPixels > 0)
+   {
+      DeinterleavePixels(pPreview, nPixels, nBands, bytesPerElement, &mPreviewPlanes[0]);
+   }
+
+   mLUT.resize(nBands*pBinning->nBins);
+   mTarget.resize(pBinning->nBins);
+   mMappedHistogram.resize(pBinning->nBins);
+   mPlotColumns.resize(HISTOGRAM_PLOT_WIDTH);
+   mMappedPlanes.resize(nPixels*nBands*bytesPerElement);
+   mLuminance.resize(nPixels);
+   mMappedLuminance.resize(nPixels);
+   mPreviewValues.resize(nPixels);
+   mDisplayBuffer.resize(nPixels*4);
 
    QGridLayout* pLayout = new QGridLayout(this);
    pLayout->setMargin(10);
@@ -50,8 +87,61 @@ HistogramShapingDlg::HistogramShapingDlg(QWidget* pParent, double peakValue) : Q
    pLayout->addWidget(mSigmaValueBox, 1, 1, 1, 2);
 
 
+   QLabel* pLable3 = new QLabel("Mode: ", this);
+   pLayout->addWidget(pLable3, 2, 0);
+
+   mModeMenu = new QComboBox(this);
+   mModeMenu->addItem("Global");
+   mModeMenu->addItem("Tiled Adaptive");
+   mModeMenu->setCurrentIndex(0);
+   pLayout->addWidget(mModeMenu, 2, 1, 1, 2);
+
+
+   QLabel* pLable4 = new QLabel("Tiles Across: ", this);
+   pLayout->addWidget(pLable4, 3, 0);
+
+   mTilesAcrossBox = new QSpinBox(this);
+   mTilesAcrossBox->setRange(2, 32);
+   mTilesAcrossBox->setValue(mTilesAcross);
+   mTilesAcrossBox->setEnabled(false);
+   pLayout->addWidget(mTilesAcrossBox, 3, 1, 1, 2);
+
+
+   QLabel* pLable5 = new QLabel("Clip Limit: ", this);
+   pLayout->addWidget(pLable5, 4, 0);
+
+   mClipLimitBox = new QDoubleSpinBox(this);
+   mClipLimitBox->setRange(0, 20);
+   mClipLimitBox->setSingleStep(0.5);
+   mClipLimitBox->setValue(mClipLimit);
+   mClipLimitBox->setToolTip("Tile histogram bins are clipped at this multiple of their mean count, 0 disables clipping");
+   mClipLimitBox->setEnabled(false);
+   pLayout->addWidget(mClipLimitBox, 4, 1, 1, 2);
+
+
+   QLabel* pLable6 = new QLabel("Bands: ", this);
+   pLayout->addWidget(pLable6, 5, 0);
+
+   mBandLinkingMenu = new QComboBox(this);
+   mBandLinkingMenu->addItem("Per Band");
+   mBandLinkingMenu->addItem("Linked Luminance");
+   mBandLinkingMenu->setCurrentIndex(0);
+   mBandLinkingMenu->setToolTip("Linked luminance shapes the mean of the bands and scales every band by the same gain, keeping colours");
+   mBandLinkingMenu->setEnabled(nBands > 1);
+   pLayout->addWidget(mBandLinkingMenu, 5, 1, 1, 2);
+
+
+   mHistogramLabel = new QLabel(this);
+   mHistogramLabel->setFixedSize(HISTOGRAM_PLOT_WIDTH, HISTOGRAM_PLOT_HEIGHT);
+   pLayout->addWidget(mHistogramLabel, 6, 0, 1, 3);
+
+   mPreviewLabel = new QLabel(this);
+   mPreviewLabel->setFixedSize(previewCols, previewRows);
+   pLayout->addWidget(mPreviewLabel, 0, 3, 7, 1);
+
+
    QHBoxLayout* pRespLayout = new QHBoxLayout;
-   pLayout->addLayout(pRespLayout, 2, 0, 1, 3);
+   pLayout->addLayout(pRespLayout, 7, 0, 1, 4);
 
    QPushButton* pAccept = new QPushButton("OK", this);
    pRespLayout->addStretch();
@@ -65,6 +155,12 @@ HistogramShapingDlg::HistogramShapingDlg(QWidget* pParent, double peakValue) : Q
    
    connect(mMeanValueBox, SIGNAL(valueChanged(double)), this, SLOT(setMeanValue(double)));
    connect(mSigmaValueBox, SIGNAL(valueChanged(double)), this, SLOT(setSigmaValueBox(double)));
+   connect(mModeMenu, SIGNAL(currentIndexChanged(int)), this, SLOT(setShapingMode(int)));
+   connect(mTilesAcrossBox, SIGNAL(valueChanged(int)), this, SLOT(setTilesAcross(int)));
+   connect(mClipLimitBox, SIGNAL(valueChanged(double)), this, SLOT(setClipLimit(double)));
+   connect(mBandLinkingMenu, SIGNAL(currentIndexChanged(int)), this, SLOT(setBandLinking(int)));
+
+   updatePreview();
   
 }
 
@@ -74,11 +170,41 @@ HistogramShapingDlg::HistogramShapingDlg(QWidget* pParent, double peakValue) : Q
 void HistogramShapingDlg::setMeanValue(double t)
 {
 	mMeanValue = t;
+	updatePreview();
 }
 
 void HistogramShapingDlg::setSigmaValueBox(double t)
 {
 	mSigmaValue = t;
+	updatePreview();
+}
+
+void HistogramShapingDlg::setShapingMode(int nIndex)
+{
+	mShapingMode = nIndex;
+
+	//Only the tiled mode uses the tile controls
+	mTilesAcrossBox->setEnabled(nIndex == 1);
+	mClipLimitBox->setEnabled(nIndex == 1);
+	updatePreview();
+}
+
+void HistogramShapingDlg::setTilesAcross(int n)
+{
+	mTilesAcross = n;
+	updatePreview();
+}
+
+void HistogramShapingDlg::setClipLimit(double t)
+{
+	mClipLimit = t;
+	updatePreview();
+}
+
+void HistogramShapingDlg::setBandLinking(int nIndex)
+{
+	mBandLinking = nIndex;
+	updatePreview();
 }
 
 
@@ -93,5 +219,141 @@ double HistogramShapingDlg::getSigmaValue()
 	return mSigmaValue;
 }
 
+int HistogramShapingDlg::getShapingMode()
+{
+	return mShapingMode;
+}
+
+int HistogramShapingDlg::getTilesAcross()
+{
+	return mTilesAcross;
+}
+
+double HistogramShapingDlg::getClipLimit()
+{
+	return mClipLimit;
+}
+
+int HistogramShapingDlg::getBandLinking()
+{
+	return mBandLinking;
+}
+
+//Re-shape from the cached cumulative histograms and map the decimated image, both cheap enough for every change
+void HistogramShapingDlg::updatePreview()
+{
+	unsigned int nBins = mpBinning->nBins;
+	unsigned int nPixels = mPreviewRows*mPreviewCols;
+
+	BandShaping shaping;
+	shaping.binning = *mpBinning;
+	GetLuminanceBinning(mpBinning, &shaping.lumBinning);
+	shaping.nBands = mBands;
+	shaping.cols = mPreviewCols;
+	shaping.bytesPerElement = mBytesPerElement;
+	shaping.linked = (mBands > 1) && (mBandLinking == 1);
+	shaping.pLUT = &mLUT[0];
+	shaping.pTiles = NULL;
+
+	//Histogram of the shaped image, summed over the channels and binned into the columns of the plot
+	unsigned int nChannels = GetChannelCount(&shaping);
+	std::fill(mPlotColumns.begin(), mPlotColumns.end(), 0);
+	for (unsigned int channel=0; channel<nChannels; channel++)
+	{
+		const unsigned int *pCdf = mpCdf + (shaping.linked ? mBands : channel)*nBins;
+		HistogramReshapeCdf(pCdf, &mTarget[0], &mLUT[channel*nBins], nBins, mMeanValue, mSigmaValue);
+		MappedHistogram(pCdf, &mLUT[channel*nBins], nBins, &mMappedHistogram[0]);
+
+		for (unsigned int bin=0; bin<nBins; bin++)
+		{
+			mPlotColumns[static_cast<unsigned int>(static_cast<double>(bin)*HISTOGRAM_PLOT_WIDTH/nBins)] += mMappedHistogram[bin];
+		}
+	}
+
+	unsigned int maxCount = std::max(1u, *std::max_element(mPlotColumns.begin(), mPlotColumns.end()));
+	QPixmap plot(HISTOGRAM_PLOT_WIDTH, HISTOGRAM_PLOT_HEIGHT);
+	plot.fill(Qt::white);
+	QPainter painter(&plot);
+	painter.setPen(Qt::black);
+	for (unsigned int col=0; col<HISTOGRAM_PLOT_WIDTH; col++)
+	{
+		int height = static_cast<int>(static_cast<double>(mPlotColumns[col])*HISTOGRAM_PLOT_HEIGHT/maxCount);
+		painter.drawLine(col, HISTOGRAM_PLOT_HEIGHT-1, col, HISTOGRAM_PLOT_HEIGHT-1-height);
+	}
+	painter.end();
+	mHistogramLabel->setPixmap(plot);
+
+	if (nPixels == 0)
+	{
+		return;
+	}
+
+	//The tiled preview builds its tile LUTs from the decimated image itself
+	std::vector<TiledHistogram> tiles;
+	if (mShapingMode == 1)
+	{
+		tiles.resize(nChannels);
+		for (unsigned int channel=0; channel<nChannels; channel++)
+		{
+			if (!CreateTiledHistogram(shaping.linked ? &shaping.lumBinning : mpBinning, mPreviewRows, mPreviewCols, mTilesAcross, &tiles[channel]))
+			{
+				for (unsigned int i=0; i<channel; i++)
+				{
+					ReleaseTiledHistogram(&tiles[i]);
+				}
+				return;
+			}
+		}
+		shaping.pTiles = &tiles[0];
+
+		AccumulateTiledBands(&shaping, &mPreviewPlanes[0], 0, mPreviewRows, &mLuminance[0]);
+		for (unsigned int channel=0; channel<nChannels; channel++)
+		{
+			ReshapeTiles(&tiles[channel], mMeanValue, mSigmaValue, mClipLimit);
+		}
+	}
 
+	ShapeBands(&shaping, &mPreviewPlanes[0], &mMappedPlanes[0], 0, mPreviewRows, &mLuminance[0], &mMappedLuminance[0]);
+
+	for (unsigned int i=0; i<tiles.size(); i++)
+	{
+		ReleaseTiledHistogram(&tiles[i]);
+	}
+
+	double minVal = mpBinning->minVal;
+	double maxVal = mpBinning->minVal + nBins*mpBinning->binWidth;
+	if (HasFixedGrayScale(mpBinning->type))
+	{
+		GetTypeRange(mpBinning->type, &minVal, &maxVal);
+	}
+	double displayScale = 255.0/(maxVal - minVal);
+
+	//Three or more bands are shown as RGB from the first three, otherwise as gray. RGB32 pixels are stored B, G, R, A.
+	unsigned int nDisplayBands = (mBands >= 3) ? 3 : 1;
+	for (unsigned int band=0; band<nDisplayBands; band++)
+	{
+		UnpackPixels(&mMappedPlanes[band*nPixels*mBytesPerElement], mpBinning->type, nPixels, &mPreviewValues[0]);
+
+		for (unsigned int nIndex=0; nIndex<nPixels; nIndex++)
+		{
+			double tempData = (mPreviewValues[nIndex] - minVal)*displayScale;
+			unsigned char displayVal = static_cast<unsigned char>(std::min(std::max(tempData, 0.0), 255.0));
+
+			if (nDisplayBands == 1)
+			{
+				mDisplayBuffer[4*nIndex] = displayVal;
+				mDisplayBuffer[4*nIndex+1] = displayVal;
+				mDisplayBuffer[4*nIndex+2] = displayVal;
+			}
+			else
+			{
+				mDisplayBuffer[4*nIndex+2-band] = displayVal;
+			}
+			mDisplayBuffer[4*nIndex+3] = 0xFF;
+		}
+	}
+
+	QImage image(&mDisplayBuffer[0], mPreviewCols, mPreviewRows, QImage::Format_RGB32);
+	mPreviewLabel->setPixmap(QPixmap::fromImage(image));
+}
 
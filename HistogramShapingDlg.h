@@ -11,32 +11,77 @@
 #define HISTOGRAM_SHAPING_DLG_H
 
 #include <QtGui/QDialog>
+#include "histogramlib.h"
 
+#include <vector>
 
+class QComboBox;
 class QDoubleSpinBox;
+class QLabel;
+class QSpinBox;
 
 class HistogramShapingDlg : public QDialog
 {
    Q_OBJECT
 
 public:
-   HistogramShapingDlg(QWidget* pParent, double peakValue); 
+   HistogramShapingDlg(QWidget* pParent, double peakValue, const HistogramBinning *pBinning, unsigned int nBands, const unsigned int *pCdf,
+                       const unsigned char *pPreview, unsigned int previewRows, unsigned int previewCols, unsigned int bytesPerElement); 
 
 
 private slots:
    void setMeanValue(double t);
    void setSigmaValueBox(double t);
+   void setShapingMode(int nIndex);
+   void setTilesAcross(int n);
+   void setClipLimit(double t);
+   void setBandLinking(int nIndex);
 
 public:
    QDoubleSpinBox* mMeanValueBox;
    QDoubleSpinBox* mSigmaValueBox;
+   QComboBox* mModeMenu;
+   QSpinBox* mTilesAcrossBox;
+   QDoubleSpinBox* mClipLimitBox;
+   QComboBox* mBandLinkingMenu;
+   QLabel* mHistogramLabel;
+   QLabel* mPreviewLabel;
 
    double getMeanValue();
    double getSigmaValue();
+   int getShapingMode();
+   int getTilesAcross();
+   double getClipLimit();
+   int getBandLinking();
 
 private:
    double mMeanValue;
    double mSigmaValue;
+   int mShapingMode;
+   int mTilesAcross;
+   double mClipLimit;
+   int mBandLinking;
+
+   //Cached histograms and decimated image the preview is computed from
+   const HistogramBinning *mpBinning;
+   unsigned int mBands;
+   const unsigned int *mpCdf;
+   unsigned int mPreviewRows;
+   unsigned int mPreviewCols;
+   unsigned int mBytesPerElement;
+
+   std::vector<unsigned char> mPreviewPlanes;
+   std::vector<unsigned int> mLUT;
+   std::vector<double> mTarget;
+   std::vector<unsigned int> mMappedHistogram;
+   std::vector<unsigned int> mPlotColumns;
+   std::vector<unsigned char> mMappedPlanes;
+   std::vector<double> mLuminance;
+   std::vector<double> mMappedLuminance;
+   std::vector<double> mPreviewValues;
+   std::vector<unsigned char> mDisplayBuffer;
+
+   void updatePreview();
 };
 
 #endif
@@ -27,6 +27,12 @@
 #include "ImageRegistration.h"
 #include "StringUtilities.h"
 #include "LayerList.h"
+#include "imagelib.h"
+#include "centroidlib.h"
+#include "pyramidlib.h"
+#include "registrationlib.h"
+#include "starlib.h"
+#include <algorithm>
 #include <limits>
 
 REGISTER_PLUGIN_BASIC(OpticksAstronomy, ImageRegistration);
@@ -34,28 +40,18 @@ REGISTER_PLUGIN_BASIC(OpticksAstronomy, ImageRegistration);
 namespace
 {
 
-   #define MAX_WINDOW_SIZE 10
-   #define MAX_DIFFERENCE_THRESHOLD 0.35
-   #define MINIMUM_RADIUS_LIMIT  100
-   #define MAX_STAR_NUMBERS  20
+   #define MAX_CATALOG_STARS  500
+   #define MINIMUM_RADIUS_LIMIT  10.0
+   #define REGISTRATION_INTERPOLATION  INTERPOLATION_BICUBIC
+   #define COARSE_STAR_SIZE  1024   //stars are matched on the first pyramid level no larger than this
    
-   #define MAX_MATCHING_ERROR  300
+   //Stars of the master and reference frames
+   StarCatalog gCatalogMas;
+   StarCatalog gCatalogRef;
    
-   int nCountMas;
-   int nStarPositionsMas[MAX_STAR_NUMBERS][2] = {0};
-   long nStarListMas[MAX_STAR_NUMBERS][MAX_STAR_NUMBERS-1] = {0};
-   double nStarGrayValueMas[MAX_STAR_NUMBERS] = {0};
-
-   int nCountRef;
-   int nStarPositionsRef[MAX_STAR_NUMBERS][2] = {0};
-   long nStarListRef[MAX_STAR_NUMBERS][MAX_STAR_NUMBERS-1] = {0};
-   double nStarGrayValueRef[MAX_STAR_NUMBERS] = {0};
+   std::vector<StarMatch> gMatchingStarList;
+   TransformModel gTransform;
    
-   int nMatchingStarList[MAX_STAR_NUMBERS][3] = {0};
-   double shiftX, shiftY, dScale;
-   double matrixT[2][2];
-   
-   double gMinGrayValue,gMaxGrayValue;
 
    
    int round(double number)
@@ -66,518 +62,97 @@ namespace
 	   return intVal;
    }
 
-   void DrawStars(double *pBuffer, DataAccessor pSrcAccRef, EncodingType type, double T[][2], int rows, int cols)
+   //Resample the reference onto the master grid through the inverse transform and add it to the master
+   bool AddAlignedImage(double *pBuffer, const double *pBufferRef, int rowsRef, int colsRef, const TransformModel *pTransform, int rows, int cols)
    {
-       int i, j;
-	   double pixelVal;
-	   double Y[2], Z[2];
-	   int rowIndex, colIndex;
-
-	   for (i=0; i<rows; i++)
-	   {
-		   for (j=0; j<cols; j++)
-		   {
-   	           pSrcAccRef->toPixel(i, j);
-	           pixelVal = Service<ModelServices>()->getDataValue(type, pSrcAccRef->getColumn(), COMPLEX_MAGNITUDE, 0);
-
-               Y[0] = j-cols/2; Y[1] = -i+rows/2;
-			   Z[0] = Y[0]*T[0][0] + Y[1]*T[1][0] + shiftX;
-			   Z[1] = Y[0]*T[0][1] + Y[1]*T[1][1] + shiftY;
-
-               //Z = Y * T + [shiftX, shiftY];
-        
-			   rowIndex = round(-Z[1] +rows/2);
-               colIndex = round(Z[0] + cols/2);
-        
-               if ((rowIndex < 0) || (rowIndex >= rows))
-                   continue;
-        
-               if ((colIndex < 0) || (colIndex >= cols))
-                   continue;
-        
-               pBuffer[rowIndex*cols+ colIndex] += pixelVal;
-			   //pBuffer[rowIndex*cols+ colIndex] = pBuffer[rowIndex*cols+ colIndex]/2;
-
-			   //pBuffer[rowIndex*cols+ colIndex] = pixelVal;
-
-			  
-			   if (pBuffer[rowIndex*cols+ colIndex] > gMaxGrayValue)
-				   pBuffer[rowIndex*cols+ colIndex] = gMaxGrayValue;
-
-			   if (pBuffer[rowIndex*cols+ colIndex] < gMinGrayValue)
-				   pBuffer[rowIndex*cols+ colIndex] = gMinGrayValue;
-		   }
-	   }
-   }
-   
-   void GetGrayScale(EncodingType type)
-   {
-   	double minGrayVal = 0.0;
-   	double maxGrayVal = 255.0;
-   	
-   	if (type == INT1UBYTE)
-	  {
-	  	maxGrayVal = 255;
-	  	minGrayVal = 0;
-	  }
-		
-		if (type == INT1SBYTE)
-	  {
-	  	maxGrayVal = 127;
-	  	minGrayVal = -128;
-	  }
-	  
-	  if (type == INT2UBYTES)
-	  {
-	  	maxGrayVal = 65535;
-	  	minGrayVal = 0;
-	  }
-	  
-	  if (type == INT2SBYTES)
-	  {
-	  	maxGrayVal = 32767;
-	  	minGrayVal = -32768;
-	  }
-	  
-	  gMinGrayValue = minGrayVal;
-	  gMaxGrayValue = maxGrayVal;
-	 }
-   
-   template<typename T>
-
-   void updatePixel(T* pData, double *pBuffer, int row, int col, int rowSize, int colSize)
-   {
-       
-       double pixelVal = pBuffer[row*colSize+col];
-	   pixelVal = pixelVal;
-
-	    *pData = static_cast<T>(pixelVal);
-
-   }
-    
-   
-   double svd2D(double A[][2], double T[][2])
-   {
-       double B[2][2] = {0.0};
-       double C[2][2] = {0.0};
-       
-       B[0][0] = A[0][0]*A[0][0]+A[1][0]*A[1][0]; 
-       B[0][1] = A[0][0]*A[0][1]+A[1][0]*A[1][1]; 
-       B[1][1] = A[0][1]*A[0][1]+A[1][1]*A[1][1];
-        
-       C[0][0] = A[0][0]*A[0][0]+A[0][1]*A[0][1]; 
-       C[0][1] = A[0][0]*A[1][0]+A[0][1]*A[1][1]; 
-       	
-       double t = B[0][0]+B[1][1]; 
-       double d = B[0][0]*B[1][1]-B[0][1]*B[0][1]; 
-       double r1 = (t+sqrt(t*t-4*d))/2; 
-       double r2 = d/r1; 
-       double h = sqrt(B[0][1]*B[0][1]+(r1-B[0][0])*(r1-B[0][0])); 
-       
-       double Q1[2][2] = {0.0};
-       double Q2[2][2] = {0.0};
-       
-       Q2[0][0] = B[0][1]/h; 
-       Q2[1][1] = Q2[0][0]; 
-       Q2[1][0] = (r1-B[0][0])/h; 
-       Q2[0][1] = -Q2[1][0]; 
-
-       double k = sqrt(C[0][1]*C[0][1]+(r1-C[0][0])*(r1-C[0][0])); 
-       Q1[0][0] = C[0][1]/k; 
-       Q1[1][1] = Q1[0][0]; 
-       Q1[1][0] = (r1-C[0][0])/k; 
-       Q1[0][1] = -Q1[1][0]; 
-       	
-       double temp = Q1[0][1];
-       Q1[0][1] = Q1[1][0];
-       Q1[1][0] = temp;
-       T[0][0] = Q2[0][0]*Q1[0][0] + Q2[0][1]*Q1[1][0];
-       T[1][1] = Q2[1][0]*Q1[0][1] + Q2[1][1]*Q1[1][1];
-       T[0][1] = Q2[0][0]*Q1[0][1] + Q2[0][1]*Q1[1][1];
-       T[1][0] = Q2[1][0]*Q1[0][0] + Q2[1][1]*Q1[1][0];
-
-       return (sqrt(r1)+ sqrt(r2));
-   }
-   
-   void procrustes(double X[][2], double Y[][2], int len)
-   {
-       int n = len;
-       double muX1 = 0, muX2 = 0;
-       double muY1 = 0, muY2 = 0;
-       double ssqX1 = 0, ssqX2 = 0;
-       double ssqY1 = 0, ssqY2 = 0;
-       
-       double matrixA[2][2] = {0.0};
-       
-       double X0[MAX_STAR_NUMBERS][2] = {0.0};
-       double Y0[MAX_STAR_NUMBERS][2] = {0.0};
-
-       //center at the origin
-       for (int i=0; i<n; i++)
-       { 
-           muX1 = muX1 + X[i][0];
-           muX2 = muX2 + X[i][1];
-           muY1 = muY1 + Y[i][0];
-           muY2 = muY2 + Y[i][1];
-       }
-       
-       muX1 = muX1/n;
-       muX2 = muX2/n;
-       muY1 = muY1/n;
-       muY2 = muY2/n;      
-
-       for (int i=0; i<n; i++)
+       double mapping[2][3];
+       if (!GetPixelMapping(pTransform, rows, cols, mapping))
        {
-           X0[i][0] = X[i][0] - muX1;
-           X0[i][1] = X[i][1] - muX2;
-           Y0[i][0] = Y[i][0] - muY1;
-           Y0[i][1] = Y[i][1] - muY2;
+           return false;
        }
-       
-       for (int i=0; i<n; i++)
-       {
-           ssqX1 += X0[i][0]*X0[i][0];
-           ssqX2 += X0[i][1]*X0[i][1];
-           ssqY1 += Y0[i][0]*Y0[i][0];
-           ssqY2 += Y0[i][1]*Y0[i][1];
-       }
-
 
-       // the "centered" Frobenius norm
-       double normX = sqrt((ssqX1 + ssqX2));
-       double normY = sqrt((ssqY1 + ssqY2));
-
-       //scale to equal (unit) norm
-       for (int i=0; i<n; i++)
+       double *pAligned = (double *)malloc(sizeof(double)*rows*cols);
+       if (pAligned == NULL)
        {
-           X0[i][0] = X0[i][0] / normX;
-           X0[i][1] = X0[i][1] / normX;
-           Y0[i][0] = Y0[i][0] / normY;
-           Y0[i][1] = Y0[i][1] / normY;
+           return false;
        }
 
-       //optimum rotation matrix of Y
-       for (int i=0; i<n; i++)
-       {
-           matrixA[0][0] += X0[i][0]*Y0[i][0];
-           matrixA[0][1] += X0[i][0]*Y0[i][1];
-           matrixA[1][0] += X0[i][1]*Y0[i][0];
-           matrixA[1][1] += X0[i][1]*Y0[i][1];
-       }
-       
-       double trsAA = svd2D(matrixA, matrixT);
-     
-       dScale = trsAA * normX / normY;
-
-       shiftX = muX1 - dScale*(muY1*matrixT[0][0] + muY2*matrixT[1][0]);
-       shiftY = muX2 - dScale*(muY1*matrixT[0][1] + muY2*matrixT[1][1]);
+       //Master pixels the reference does not cover get nothing added
+       WarpImage(pBufferRef, rowsRef, colsRef, mapping, REGISTRATION_INTERPOLATION, 0.0, pAligned, rows, cols);
 
-   }
-   
-   void GetParameters(int rows, int cols)
-   {
-       double X[MAX_STAR_NUMBERS][2];
-       double Y[MAX_STAR_NUMBERS][2];
-	   int k;
-	   int nIndex = 0;
-
-	   int nCount  = std::min(nCountMas, nCountRef);
-
-       for (nIndex=0; nIndex<nCount; nIndex++)
-	   {
-		   if (nMatchingStarList[nIndex][2] > MAX_MATCHING_ERROR*nCount)
-		       break;
-	   }
-
-	   nCount = std::max(3, nIndex);
-
-       for (int i=0; i<nCount; i++)
-       {
-       	   k = nMatchingStarList[i][0];
-           X[i][0] = nStarPositionsMas[k][1]-cols/2;
-           X[i][1] = -nStarPositionsMas[k][0]+rows/2;
-           
-           k = nMatchingStarList[i][1];
-           Y[i][0] = nStarPositionsRef[k][1]-cols/2;
-           Y[i][1] = -nStarPositionsRef[k][0]+rows/2;
-       }
-       
-       procrustes(X, Y, nCount);
-   }
-   
-   
-   int FindMatchingStar(int nMasIndex, long *nError)
-   {
-       int nCount = nCountMas-1;
-       int nRefIndex = -1;
-       
-       if (nCountRef < nCountMas)
-       {
-           nCount = nCountRef - 1;
-       }
-       
-       long temp = 0;       
-       long nErrorNumber = std::numeric_limits<long>::max();//MAX_MATCHING_ERROR*nCount;
-       
-       //Find reference star 
-       for (int i=0; i<nCountRef; i++)
+       for (int i=0; i<rows*cols; i++)
        {
-       	   temp = 0;
-       	   
-       	   for (int j=0; j<nCount; j++)
-       	   {
-               temp = temp + abs(nStarListMas[nMasIndex][j] - nStarListRef[i][j]);
-           }
-           
-           if (temp < nErrorNumber)
-           {
-               nErrorNumber = temp;
-               nRefIndex = i;
-           }
+           pBuffer[i] += pAligned[i];
        }
 
-	   *nError = nErrorNumber;
-       
-       return nRefIndex;
-       
+       free(pAligned);
+       return true;
    }
    
-   void GetMatchingStars()
+   //Catalog of the brightest stars lying in the central part of the image, where both frames are likely to overlap.
+   //Detections closer than MINIMUM_RADIUS_LIMIT to a brighter star are merged into it.
+   void SelectStars(const std::vector<StarInfo> &stars, int rowSize, int colSize, StarCatalog &catalog)
    {
-   	   long nError;
-   	   int nRefIndex;
-   	   int k, nIndex = -1;
-   	   
-       for (int i=0; i<nCountMas; i++)
-       {
-           nRefIndex = FindMatchingStar(i, &nError);
-           
-           k = 0;
-           for (k=0; k<=nIndex; k++)
-           {
-               if (nMatchingStarList[k][2] > nError)
-               {
-                   break;
-               }
-           }
-         
-           for (int m=nIndex+1; m>k;m--)
-           {
-		       nMatchingStarList[m][0] = nMatchingStarList[m-1][0];
-			   nMatchingStarList[m][1] = nMatchingStarList[m-1][1];
-			   nMatchingStarList[m][2] = nMatchingStarList[m-1][2];
-		   }
-			   
-		   nMatchingStarList[k][0] = i;
-		   nMatchingStarList[k][1] = nRefIndex;
-		   nMatchingStarList[k][2] = nError;
-			     
-		   nIndex++;
-		     
-		}
+      BuildStarCatalog(stars, rowSize, colSize, 0.2, MAX_CATALOG_STARS, MINIMUM_RADIUS_LIMIT, &catalog);
    }
 
-   void GetNeighborStars(int nCount, int nStarPositions[][2], long nStarList[][MAX_STAR_NUMBERS-1])
+   //Measure the stars matched on a pyramid level again at full resolution, starting from their level positions scaled
+   //up, and fit the transform to the refined pairs. Pixel (i, j) of a level lies on pixel (i, j)*2^level of the image.
+   bool RefineStarTransform(const double *pBuffer, int rows, int cols, const double *pBufferRef, int rowsRef, int colsRef,
+                            int level, const CentroidOptions *pCentroidOptions, const RansacOptions *pOptions,
+                            TransformModel *pTransform)
    {
-	   int currentRow, currentCol;
-	   int nIndex;
-	   int k;
+      unsigned int nCount = gMatchingStarList.size();
+      double scale = static_cast<double>(1 << level);
 
-	   for (int i=0; i<nCount; i++)
-       {
-		   currentRow = nStarPositions[i][0];
-		   currentCol = nStarPositions[i][1];
-		   nIndex = -1;
-
-           for (int j=0; j<nCount; j++)
-		   {
-			   if (i==j)
-			   {
-				   continue;
-			   }
-
-			   int rowIndex = nStarPositions[j][0];
-			   int colIndex = nStarPositions[j][1];
-			   long  nDist = (rowIndex - currentRow)*(rowIndex - currentRow);
-			   nDist += (colIndex - currentCol)*(colIndex - currentCol);
-
-               k = 0;
-               for (k=0; k<=nIndex; k++)
-               {
-                   if (nStarList[i][k] > nDist)
-                   {
-                       break;
-                   }
-               }
-         
-               for (int m=nIndex+1; m>k;m--)
-               {
-			       nStarList[i][m] = nStarList[i][m-1];
-			   }
-			   nStarList[i][k] = nDist;
-
-			   nIndex++;
-		   }
-		   
-       }
-   }
+      //The level positions are good to about a level pixel, so the search reaches that far
+      CentroidOptions centroidOptions = *pCentroidOptions;
+      centroidOptions.searchRadius = std::max(centroidOptions.searchRadius, 1 << level);
 
-   void GetAllNeighborStars()
-   {
-	   GetNeighborStars(nCountMas, nStarPositionsMas, nStarListMas);
-	   GetNeighborStars(nCountRef, nStarPositionsRef, nStarListRef);
-   }
-   
-   void ModifyCenter(DataAccessor pSrcAcc, EncodingType type, int windowSize, int nCount, int nStarPositions[][2])
-   {
-       int m, n, i, j;
-       int row, col;
-       int rowIndex, colIndex;
-       
-       double windowVal[MAX_WINDOW_SIZE*2+1][MAX_WINDOW_SIZE*2+1];
-       
-       for (int k=0; k<nCount; k++)
-       {
-		   double maxVal = -std::numeric_limits<double>::max();;
-
-           row = nStarPositions[k][0];
-           col = nStarPositions[k][1];
-           
-           m = 0;
-           for (i=row - windowSize; i<= row + windowSize; i++)
-	       {
-		       n = 0;
-		       for (j=col - windowSize; j<= col + windowSize; j++)
-			   {
-		           pSrcAcc->toPixel(i, j);
-                   VERIFYNRV(pSrcAcc.isValid());
-			 
-			       windowVal[m][n] = Service<ModelServices>()->getDataValue(type, pSrcAcc->getColumn(), COMPLEX_MAGNITUDE, 0);
-			 		 	
-			       if (maxVal < windowVal[m][n])	
-			       {	
-				       maxVal = windowVal[m][n];
-				       rowIndex = row - windowSize + m;
-				       colIndex = col - windowSize + n;	
-			       }
-			       n++;
-		       }
-		       m++;
-	       }
-	         
-	       nStarPositions[k][0] = rowIndex;
-           nStarPositions[k][1] = colIndex;
-	   }
-   }
+      std::vector<double> guesses(2*nCount);
+      std::vector<double> guessesRef(2*nCount);
+      for (unsigned int i=0; i<nCount; i++)
+      {
+         const StarInfo &starMas = gCatalogMas.stars[gMatchingStarList[i].nIndex];
+         const StarInfo &starRef = gCatalogRef.stars[gMatchingStarList[i].nRefIndex];
+         guesses[2*i] = starMas.x*scale;
+         guesses[2*i+1] = starMas.y*scale;
+         guessesRef[2*i] = starRef.x*scale;
+         guessesRef[2*i+1] = starRef.y*scale;
+      }
 
-   
-   int locateStarPosition(DataAccessor pSrcAcc, int row, int col, int rowSize, int colSize, EncodingType type, int windowSize, int nCount, int nStarPositions[][2], double *nStarGrayValue)
-   {
-	  int i, j, m, n;
-	  int rowIndex, colIndex;
-	  double minVal = std::numeric_limits<double>::max();
-      double maxVal = -minVal;
-    
-	  double pixelVal = 0.0;
-	  double diffVal = 0.0;
-
-
-	  double windowVal[MAX_WINDOW_SIZE*2+1][MAX_WINDOW_SIZE*2+1];
-	  
-	  if ((row < 0.2*rowSize) || (row > 0.8*rowSize))
-	  	return nCount;
-	  	
-	  if ((col < 0.2*colSize) || (col > 0.8*colSize))
-	  	return nCount;
-
-	  //Get the pixels in the window
-	  m = 0;
-	  for (i=row - windowSize; i<= row + windowSize; i++)
-	  {
-		  n = 0;
-		  for (j=col - windowSize; j<= col + windowSize; j++)
-		  {
-			 if ((i < 0) || (i >=rowSize))
-			 {
-				 continue;
-			 }
-
-			 if ((j < 0) || (j >=colSize))
-			 {
-				 continue;
-			 }
-
-
-			 pSrcAcc->toPixel(i, j);
-             //VERIFYNRV(pSrcAcc.isValid());
-			 windowVal[m][n] = Service<ModelServices>()->getDataValue(type, pSrcAcc->getColumn(), COMPLEX_MAGNITUDE, 0);
-			 
-			 if (minVal > windowVal[m][n])	
-			 {
-				 minVal = windowVal[m][n];	
-			 }
-			 	
-			 	
-			 if (maxVal < windowVal[m][n])	
-			 {	
-				 maxVal = windowVal[m][n];
-				 rowIndex = row - windowSize + m;
-				 colIndex = col - windowSize + n;	
-			 }
-			 n++;
-		  }
-		  m++;
-	  }
-	  
-	  
-	  if (abs(maxVal - minVal) > MAX_DIFFERENCE_THRESHOLD*(gMaxGrayValue - gMinGrayValue))
-	  {
-	      for (int k=0; k<nCount; k++)
-	      {
-	      	  if (k >= MAX_STAR_NUMBERS)
-	      	  {
-	      	  	   return nCount;
-	      	  }
-	      	  
-	      	  double nDist = (rowIndex-nStarPositions[k][0])*(rowIndex-nStarPositions[k][0]);
-	      	  nDist += (colIndex-nStarPositions[k][1])*(colIndex-nStarPositions[k][1]);
-	          if (nDist < MINIMUM_RADIUS_LIMIT) 
-	          {
-	          	if (nStarGrayValue[k] < maxVal)
-	          	{
-	          	    nStarPositions[k][0] = rowIndex;
-	                nStarPositions[k][1] = colIndex;
-	                nStarGrayValue[k] = maxVal;
-	            }	          		
-	          	return nCount;
-	          } 
-	      }
-
-	      
-	      nStarPositions[nCount][0] = rowIndex;
-	      nStarPositions[nCount][1] = colIndex;
-	      nStarGrayValue[nCount] = maxVal;
-	          
-	      nCount++;   
-	  }
-
-	  return nCount;
+      std::vector<Centroid> centroids(nCount);
+      std::vector<Centroid> centroidsRef(nCount);
+      MeasureCentroids(pBuffer, rows, cols, reinterpret_cast<const double (*)[2]>(&guesses[0]), nCount, &centroidOptions,
+                       &centroids[0]);
+      MeasureCentroids(pBufferRef, rowsRef, colsRef, reinterpret_cast<const double (*)[2]>(&guessesRef[0]), nCount,
+                       &centroidOptions, &centroidsRef[0]);
 
-   }
+      //Same centred coordinates as RegisterStarCatalogs
+      std::vector<double> X, Y;
+      for (unsigned int i=0; i<nCount; i++)
+      {
+         if (!centroids[i].valid || !centroidsRef[i].valid)
+         {
+            continue;
+         }
 
-   void locateAllStarPosition(DataAccessor pSrcAccMas, DataAccessor pSrcAccRef, int row, int col, int rowSize, int colSize, EncodingType type, int windowSize, double *pBuffer)
-   {
-	   pSrcAccMas->toPixel(row, col);
-      
-	   pBuffer[row*colSize+col] = Service<ModelServices>()->getDataValue(type, pSrcAccMas->getColumn(), COMPLEX_MAGNITUDE, 0);
+         X.push_back(centroids[i].x-cols/2);
+         X.push_back(-centroids[i].y+rows/2);
+         Y.push_back(centroidsRef[i].x-cols/2);
+         Y.push_back(-centroidsRef[i].y+rows/2);
+      }
 
-	   nCountMas = locateStarPosition(pSrcAccMas, row, col, rowSize, colSize, type, windowSize,  nCountMas, nStarPositionsMas, nStarGrayValueMas);
+      int nValid = X.size()/2;
+      if (nValid < 3)
+      {
+         return false;
+      }
 
-	   nCountRef = locateStarPosition(pSrcAccRef, row, col, rowSize, colSize, type, windowSize,  nCountRef, nStarPositionsRef, nStarGrayValueRef);
+      return EstimateTransform(reinterpret_cast<const double (*)[2]>(&X[0]), reinterpret_cast<const double (*)[2]>(&Y[0]),
+                               nValid, pOptions, pTransform, NULL);
    }
 
-   
-   
 };
 
 ImageRegistration::ImageRegistration()
@@ -604,6 +179,8 @@ bool ImageRegistration::getInputSpecification(PlugInArgList*& pInArgList)
    VERIFY(pInArgList = Service<PlugInManagerServices>()->getPlugInArgList());
    pInArgList->addArg<Progress>(Executable::ProgressArg(), NULL, "Progress reporter");
    pInArgList->addArg<RasterElement>(Executable::DataElementArg(), "Perform image registration on this data element");
+   pInArgList->addArg<bool>("Phase Correlation", NULL, "Register by phase correlation instead of stars, for planetary and lunar images; also used when the stars cannot be registered");
+   pInArgList->addArg<bool>("Log Polar", NULL, "Let phase correlation also estimate rotation and scale");
    return true;
 }
 
@@ -611,6 +188,11 @@ bool ImageRegistration::getOutputSpecification(PlugInArgList*& pOutArgList)
 {
    VERIFY(pOutArgList = Service<PlugInManagerServices>()->getPlugInArgList());
    pOutArgList->addArg<RasterElement>("Result", NULL);
+   pOutArgList->addArg<double>("Translation X", NULL, "Shift of the reference image in pixels");
+   pOutArgList->addArg<double>("Translation Y", NULL, "Shift of the reference image in pixels, pointing up");
+   pOutArgList->addArg<double>("Rotation", NULL, "Counter-clockwise rotation of the reference image in degrees");
+   pOutArgList->addArg<double>("Scale", NULL, "Scale of the reference image");
+   pOutArgList->addArg<double>("Residual", NULL, "RMS residual of the matched stars in pixels, 0 for phase correlation");
    return true;
 }
 
@@ -652,6 +234,9 @@ bool ImageRegistration::execute(PlugInArgList* pInArgList, PlugInArgList* pOutAr
    }
    RasterDataDescriptor* pDesc = static_cast<RasterDataDescriptor*>(pCube->getDataDescriptor());
    VERIFY(pDesc != NULL);
+   RasterDataDescriptor* pDescRef = static_cast<RasterDataDescriptor*>(pCubeRef->getDataDescriptor());
+   VERIFY(pDescRef != NULL);
+   EncodingType typeRef = pDescRef->getDataType();
    
    EncodingType ResultType = pDesc->getDataType();
    if (pDesc->getDataType() == INT4SCOMPLEX)
@@ -694,82 +279,170 @@ bool ImageRegistration::execute(PlugInArgList* pInArgList, PlugInArgList* pOutAr
    pResultRequest->setWritable(true);
    DataAccessor pDestAcc = pResultCube->getDataAccessor(pResultRequest.release());
    
-   nCountMas = 0;
-   nCountRef = 0;
-   int windowSize = 6;
-   double *pBuffer = (double *)calloc(pDesc->getRowCount()*pDesc->getColumnCount(), sizeof(double));
+   int rows = pDesc->getRowCount();
+   int cols = pDesc->getColumnCount();
+   int rowsRef = pDescRef->getRowCount();
+   int colsRef = pDescRef->getColumnCount();
+   double *pBuffer = (double *)calloc(rows*cols, sizeof(double));
+   double *pBufferRef = (double *)calloc(rowsRef*colsRef, sizeof(double));
+
+   if ((pBuffer == NULL) || (pBufferRef == NULL) ||
+       !ReadImageRows(pSrcAcc, pDesc->getDataType(), 0, rows, cols, pBuffer) ||
+       !ReadImageRows(pSrcAccRef, typeRef, 0, rowsRef, colsRef, pBufferRef))
+   {
+      std::string msg = "Unable to access the cube data.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      free(pBuffer);
+      free(pBufferRef);
+      return false;
+   }
 
-   GetGrayScale(pDesc->getDataType());
+   bool bPhaseCorrelation = false;
+   PhaseCorrelationOptions phaseOptions;
+   GetDefaultPhaseCorrelationOptions(&phaseOptions);
+   pInArgList->getPlugInArgValue("Phase Correlation", bPhaseCorrelation);
+   pInArgList->getPlugInArgValue("Log Polar", phaseOptions.logPolar);
+
+   //Both images are already in memory, so the coarse levels are reduced from the buffers. The levels are kept per
+   //element, so registering further frames against the same master reuses its pyramid.
+   ImagePyramid *pPyramid = GetElementPyramid(pCube, pBuffer);
+   ImagePyramid *pPyramidRef = GetElementPyramid(pCubeRef, pBufferRef);
+   if ((pPyramid == NULL) || (pPyramidRef == NULL))
+   {
+      std::string msg = "Unable to access the cube data.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      free(pBuffer);
+      free(pBufferRef);
+      return false;
+   }
 
-   
-   for (unsigned int row = 0; row < pDesc->getRowCount(); ++row)
+   std::string starMsg;
+   if (!bPhaseCorrelation)
    {
-	   if (pProgress != NULL)
-       {
-           pProgress->updateProgress("Image registration", row * 100 / pDesc->getRowCount(), NORMAL);
-       }
-       if (isAborted())
-       {
-          std::string msg = getName() + " has been aborted.";
-          pStep->finalize(Message::Abort, msg);
-          if (pProgress != NULL)
-          {
-             pProgress->updateProgress(msg, 0, ABORT);
-          }
-          return false;
-       }
-       for (unsigned int col = 0; col < pDesc->getColumnCount(); ++col)
-       {
-	       locateAllStarPosition(pSrcAcc, pSrcAccRef, row, col, pDesc->getRowCount(), pDesc->getColumnCount(), pDesc->getDataType(), windowSize, pBuffer);
-       }
+      StarDetection detection;
+      GetDefaultStarDetection(&detection);
+      CentroidOptions centroidOptions;
+      GetDefaultCentroidOptions(&centroidOptions);
+      std::vector<StarInfo> stars;
+
+      //Coarse to fine: the stars are detected and matched on a reduced level, then the matched pairs are measured
+      //again at full resolution for the final transform
+      int level = GetPyramidLevelFor(rows, cols, COARSE_STAR_SIZE);
+      int levelRows, levelCols, levelRowsRef, levelColsRef;
+      const double *pLevel = GetPyramidLevel(pPyramid, level, &levelRows, &levelCols);
+      const double *pLevelRef = GetPyramidLevel(pPyramidRef, level, &levelRowsRef, &levelColsRef);
+      if ((pLevel == NULL) || (pLevelRef == NULL))
+      {
+         std::string msg = "Unable to reduce the images.";
+         pStep->finalize(Message::Failure, msg);
+         if (pProgress != NULL) 
+         {
+            pProgress->updateProgress(msg, 0, ERRORS);
+         }
+         free(pBuffer);
+         free(pBufferRef);
+         return false;
+      }
+
+      if (pProgress != NULL)
+      {
+         pProgress->updateProgress("Detecting stars", 0, NORMAL);
+      }
+      DetectStars(pLevel, levelRows, levelCols, &detection, &stars);
+      RefineStarCentroids(pLevel, levelRows, levelCols, &centroidOptions, &stars);
+      SelectStars(stars, levelRows, levelCols, gCatalogMas);
+
+      if (isAborted())
+      {
+         std::string msg = getName() + " has been aborted.";
+         pStep->finalize(Message::Abort, msg);
+         if (pProgress != NULL)
+         {
+            pProgress->updateProgress(msg, 0, ABORT);
+         }
+         free(pBuffer);
+         free(pBufferRef);
+         return false;
+      }
+
+      if (pProgress != NULL)
+      {
+         pProgress->updateProgress("Detecting stars", 50, NORMAL);
+      }
+      DetectStars(pLevelRef, levelRowsRef, levelColsRef, &detection, &stars);
+      RefineStarCentroids(pLevelRef, levelRowsRef, levelColsRef, &centroidOptions, &stars);
+      SelectStars(stars, levelRowsRef, levelColsRef, gCatalogRef);
+
+      RansacOptions options;
+      GetDefaultRansacOptions(&options);
+      gMatchingStarList.clear();
+      if ((gCatalogMas.stars.size() < 3) || (gCatalogRef.stars.size() < 3))
+      {
+         starMsg = "Too few stars were found to register the images.";
+      }
+      else if (!RegisterStarCatalogs(&gCatalogMas, &gCatalogRef, levelRows, levelCols, &options, &gTransform, &gMatchingStarList))
+      {
+         starMsg = (gMatchingStarList.size() < 3) ? "The stars of the two images could not be matched." :
+                   "No consistent transform was found between the two images.";
+      }
+      else if ((level > 0) &&
+               !RefineStarTransform(pBuffer, rows, cols, pBufferRef, rowsRef, colsRef, level, &centroidOptions, &options, &gTransform))
+      {
+         starMsg = "The matched stars could not be measured at full resolution.";
+      }
+
+      //Planetary and lunar images have no stars to match, or only a few moons that move between frames
+      bPhaseCorrelation = !starMsg.empty();
    }
 
-   ModifyCenter(pSrcAcc, pDesc->getDataType(), windowSize, nCountMas, nStarPositionsMas);
-   ModifyCenter(pSrcAccRef, pDesc->getDataType(), windowSize, nCountRef, nStarPositionsRef);
+   double peak = 0.0;
+   if (bPhaseCorrelation)
+   {
+      if (pProgress != NULL)
+      {
+         pProgress->updateProgress("Registering by phase correlation", 75, NORMAL);
+      }
 
-   GetAllNeighborStars();
-   GetMatchingStars();
-   
-   GetParameters(pDesc->getRowCount(), pDesc->getColumnCount());
+      if (!RegisterPhaseCorrelation(pBuffer, pPyramid, pBufferRef, pPyramidRef, &phaseOptions, &gTransform, &peak))
+      {
+         std::string msg = starMsg.empty() ? "The images could not be registered by phase correlation." :
+                           starMsg + " The images could not be registered by phase correlation either.";
+         pStep->finalize(Message::Failure, msg);
+         if (pProgress != NULL) 
+         {
+            pProgress->updateProgress(msg, 0, ERRORS);
+         }
+         free(pBuffer);
+         free(pBufferRef);
+         return false;
+      }
+   }
   
-   DrawStars(pBuffer, pSrcAccRef, pDesc->getDataType(), matrixT, pDesc->getRowCount(), pDesc->getColumnCount());
+   //The sum is clamped to the range of the output type when it is written
+   bool bAligned = AddAlignedImage(pBuffer, pBufferRef, rowsRef, colsRef, &gTransform, rows, cols);
+   free(pBufferRef);
 
    //Output the value 
-      for (unsigned int m = 0; m < pDesc->getRowCount(); m++)
+   if (!bAligned || !pDestAcc.isValid() ||
+       !WriteImageRows(pDestAcc, ResultType, 0, pDesc->getRowCount(), pDesc->getColumnCount(), pBuffer))
+   {
+      std::string msg = "Unable to access the cube data.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
       {
-	      for (unsigned int n = 0; n < pDesc->getColumnCount(); n++)
-	      {
-		      if (isAborted())
-              {
-                  std::string msg = getName() + " has been aborted.";
-                  pStep->finalize(Message::Abort, msg);
-                  if (pProgress != NULL)
-                  {
-                      pProgress->updateProgress(msg, 0, ABORT);
-                  }
-                  return false;
-              }
-				      
-			  if (!pDestAcc.isValid())
-              {
-                  std::string msg = "Unable to access the cube data.";
-                  pStep->finalize(Message::Failure, msg);
-                  if (pProgress != NULL) 
-                  {
-                      pProgress->updateProgress(msg, 0, ERRORS);
-                   }
-                   return false;
-               }
-
-				       
-			  switchOnEncoding(ResultType, updatePixel, pDestAcc->getColumn(), pBuffer, m, n, pDesc->getRowCount(), pDesc->getColumnCount());       
-			  pDestAcc->nextColumn();
-				   
-		  }
-				   
-		  pDestAcc->nextRow();
-		  
-	  }
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      free(pBuffer);
+      return false;
+   }
    free(pBuffer);
    
 
@@ -797,10 +470,20 @@ bool ImageRegistration::execute(PlugInArgList* pInArgList, PlugInArgList* pOutAr
       pView->createLayer(RASTER, pResultCube.get());
    }
 
-   double theta = std::acos(matrixT[0][0])*180.0/3.1415926;
+   double theta = gTransform.rotation*180.0/3.1415926;
 
-   std::string msg = "Image Registration is complete.\n Translation x = " +  StringUtilities::toDisplayString(round(shiftX)) + ", y = " + 
-	                 StringUtilities::toDisplayString(round(shiftY)) + ", rotation = " + StringUtilities::toDisplayString(round(theta)) + " degree";
+   std::string msg = "Image Registration is complete.\n Translation x = " +  StringUtilities::toDisplayString(round(gTransform.shiftX)) + ", y = " + 
+	                 StringUtilities::toDisplayString(round(gTransform.shiftY)) + ", rotation = " + StringUtilities::toDisplayString(round(theta)) + " degree" +
+	                 ", scale = " + StringUtilities::toDisplayString(gTransform.scale) + ", residual = " +
+	                 StringUtilities::toDisplayString(gTransform.rmsResidual) + " pixel from " +
+	                 StringUtilities::toDisplayString(gTransform.nInliers) + " stars";
+   if (bPhaseCorrelation)
+   {
+      msg = "Image Registration is complete.\n Translation x = " + StringUtilities::toDisplayString(gTransform.shiftX) + ", y = " +
+            StringUtilities::toDisplayString(gTransform.shiftY) + ", rotation = " + StringUtilities::toDisplayString(theta) + " degree" +
+            ", scale = " + StringUtilities::toDisplayString(gTransform.scale) + " from phase correlation, peak = " +
+            StringUtilities::toDisplayString(peak);
+   }
    if (pProgress != NULL)
    {
 	   
@@ -808,6 +491,11 @@ bool ImageRegistration::execute(PlugInArgList* pInArgList, PlugInArgList* pOutAr
    }
 
    pOutArgList->setPlugInArgValue("Image Registration Result", pResultCube.release());
+   pOutArgList->setPlugInArgValue("Translation X", &gTransform.shiftX);
+   pOutArgList->setPlugInArgValue("Translation Y", &gTransform.shiftY);
+   pOutArgList->setPlugInArgValue("Rotation", &theta);
+   pOutArgList->setPlugInArgValue("Scale", &gTransform.scale);
+   pOutArgList->setPlugInArgValue("Residual", &gTransform.rmsResidual);
 
    pStep->finalize();
 
@@ -0,0 +1,497 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from   
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "DataAccessor.h"
+#include "DataAccessorImpl.h"
+#include "DataRequest.h"
+#include "DesktopServices.h"
+#include "MessageLogResource.h"
+#include "ObjectResource.h"
+#include "PlugInArgList.h"
+#include "PlugInManagerServices.h"
+#include "PlugInRegistration.h"
+#include "Progress.h"
+#include "RasterDataDescriptor.h"
+#include "RasterElement.h"
+#include "RasterUtilities.h"
+#include "SpatialDataView.h"
+#include "SpatialDataWindow.h"
+#include "ImageStacking.h"
+#include "ImageStackingDlg.h"
+#include "StringUtilities.h"
+#include "LayerList.h"
+#include "imagelib.h"
+#include "centroidlib.h"
+#include "registrationlib.h"
+#include "stacklib.h"
+#include "starlib.h"
+
+#include <algorithm>
+#include <limits>
+#include <math.h>
+#include <string.h>
+
+REGISTER_PLUGIN_BASIC(OpticksAstronomy, ImageStacking);
+
+namespace
+{
+   #define MAX_CATALOG_STARS  500
+   #define MINIMUM_RADIUS_LIMIT  10.0
+   #define STACK_MEMORY_LIMIT  (256.0*1024*1024)
+   #define MIN_STRIP_ROWS  16
+   #define WARP_MARGIN_ROWS  4
+   #define STACK_TILE_SIZE  512
+
+   //A frame to stack and the mapping from the pixels of the reference onto it
+   typedef struct _StackFrame
+   {
+      RasterElement *pElement;
+      DataAccessor *pAcc;
+      EncodingType type;
+      int rows;
+      int cols;
+      double mapping[2][3];
+   } StackFrame;
+
+   //Source window [*pTop, *pBottom) x [*pLeft, *pRight) a tile of output pixels samples from a frame, with room for the
+   //widest kernel. Its size follows the size of the tile whatever the rotation of the frame.
+   bool GetSourceWindow(const StackFrame &frame, int startRow, int endRow, int startCol, int endCol, int *pTop, int *pBottom,
+                        int *pLeft, int *pRight)
+   {
+      double minRow = std::numeric_limits<double>::max();
+      double maxRow = -minRow;
+      double minCol = minRow;
+      double maxCol = -minRow;
+
+      //The mapping is affine, so the extremes lie on the corners of the tile
+      int corners[4][2] = {{startRow, startCol}, {startRow, endCol-1}, {endRow-1, startCol}, {endRow-1, endCol-1}};
+      for (int i=0; i<4; i++)
+      {
+         double srcCol = frame.mapping[0][0]*corners[i][1] + frame.mapping[0][1]*corners[i][0] + frame.mapping[0][2];
+         double srcRow = frame.mapping[1][0]*corners[i][1] + frame.mapping[1][1]*corners[i][0] + frame.mapping[1][2];
+         minRow = std::min(minRow, srcRow);
+         maxRow = std::max(maxRow, srcRow);
+         minCol = std::min(minCol, srcCol);
+         maxCol = std::max(maxCol, srcCol);
+      }
+
+      *pTop = std::max(0, static_cast<int>(floor(minRow)) - WARP_MARGIN_ROWS);
+      *pBottom = std::min(frame.rows, static_cast<int>(ceil(maxRow)) + WARP_MARGIN_ROWS + 1);
+      *pLeft = std::max(0, static_cast<int>(floor(minCol)) - WARP_MARGIN_ROWS);
+      *pRight = std::min(frame.cols, static_cast<int>(ceil(maxCol)) + WARP_MARGIN_ROWS + 1);
+
+      return (*pTop < *pBottom) && (*pLeft < *pRight);
+   }
+
+   //Index of name in a list of choices as the dialog menus order them, or -1
+   int FindChoice(const std::string &name, const char *const *pChoices, int nChoices)
+   {
+      for (int i=0; i<nChoices; i++)
+      {
+         if (name == pChoices[i])
+         {
+            return i;
+         }
+      }
+      return -1;
+   }
+
+   const char *const gCombineNames[] = {"Mean", "Median", "Sigma Clipping", "Winsorized Sigma Clipping"};
+   const char *const gInterpolationNames[] = {"Nearest", "Bilinear", "Bicubic", "Lanczos"};
+
+   void ReleaseFrames(std::vector<StackFrame> &frames)
+   {
+      for (unsigned int i=0; i<frames.size(); i++)
+      {
+         delete frames[i].pAcc;
+      }
+      frames.clear();
+   }
+};
+
+ImageStacking::ImageStacking()
+{
+   setDescriptorId("{0E410CAE-E260-446C-A4BF-43D806237893}");
+   setName("Image Stacking");
+   setDescription("Register and stack astronomical frames");
+   setCreator("Yiwei Zhang");
+   setVersion("Sample");
+   setCopyright("Copyright (C) 2008, Ball Aerospace & Technologies Corp.");
+   setProductionStatus(false);
+   setType("Sample");
+   setSubtype("Image Registration");
+   setMenuLocation("[Astronomy]/Image Stacking");
+   setAbortSupported(true);
+}
+
+ImageStacking::~ImageStacking()
+{
+}
+
+bool ImageStacking::getInputSpecification(PlugInArgList*& pInArgList)
+{
+   VERIFY(pInArgList = Service<PlugInManagerServices>()->getPlugInArgList());
+   pInArgList->addArg<Progress>(Executable::ProgressArg(), NULL, "Progress reporter");
+   pInArgList->addArg<RasterElement>(Executable::DataElementArg(), "Reference frame the other frames are registered to");
+   pInArgList->addArg<std::string>("Combine Method", NULL, "Mean, Median, Sigma Clipping or Winsorized Sigma Clipping; Sigma Clipping if not set");
+   pInArgList->addArg<double>("Kappa", NULL, "Clipping threshold in units of sigma for the clipping methods; 3 if not set");
+   pInArgList->addArg<std::string>("Interpolation", NULL, "Nearest, Bilinear, Bicubic or Lanczos; Bicubic if not set");
+   return true;
+}
+
+bool ImageStacking::getOutputSpecification(PlugInArgList*& pOutArgList)
+{
+   VERIFY(pOutArgList = Service<PlugInManagerServices>()->getPlugInArgList());
+   pOutArgList->addArg<RasterElement>("Result", NULL);
+   return true;
+}
+
+bool ImageStacking::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgList)
+{
+   StepResource pStep("Image Stacking", "app", "3DD6BFD8-00E4-4528-9622-23184F38DFE9");
+   if (pInArgList == NULL || pOutArgList == NULL)
+   {
+      return false;
+   }
+   Progress* pProgress = pInArgList->getPlugInArgValue<Progress>(Executable::ProgressArg());
+   RasterElement* pCube = pInArgList->getPlugInArgValue<RasterElement>(Executable::DataElementArg());
+
+   //Every open spatial data window holds a frame; the input element, or else the first frame, is the reference
+   std::vector<Window*> windows;
+   Service<DesktopServices>()->getWindows(SPATIAL_DATA_WINDOW, windows);
+   std::vector<RasterElement*> elements;
+   for (unsigned int i = 0; i < windows.size(); ++i)
+   {
+       SpatialDataWindow* pWindow = dynamic_cast<SpatialDataWindow*>(windows[i]);
+       if (pWindow == NULL)
+       {
+           continue;
+       }
+       LayerList* pList = pWindow->getSpatialDataView()->getLayerList();
+       RasterElement* pElement = pList->getPrimaryRasterElement();
+       if ((pElement != NULL) && (std::find(elements.begin(), elements.end(), pElement) == elements.end()))
+       {
+           elements.push_back(pElement);
+       }
+   }
+
+   std::vector<RasterElement*>::iterator pReference = std::find(elements.begin(), elements.end(), pCube);
+   if (pReference != elements.end())
+   {
+      std::iter_swap(elements.begin(), pReference);
+   }
+
+   if (elements.size() < 2)
+   {
+      std::string msg = "At least two frames must be open to stack.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      return false;
+   }
+
+   std::string combineName = gCombineNames[COMBINE_SIGMA_CLIP];
+   double kappa = 3.0;
+   std::string interpolationName = gInterpolationNames[INTERPOLATION_BICUBIC];
+   pInArgList->getPlugInArgValue("Combine Method", combineName);
+   pInArgList->getPlugInArgValue("Kappa", kappa);
+   pInArgList->getPlugInArgValue("Interpolation", interpolationName);
+
+   int combineMethod = FindChoice(combineName, gCombineNames, sizeof(gCombineNames)/sizeof(gCombineNames[0]));
+   int interpolation = FindChoice(interpolationName, gInterpolationNames, sizeof(gInterpolationNames)/sizeof(gInterpolationNames[0]));
+   if ((combineMethod < 0) || (interpolation < 0) || !(kappa > 0.0))
+   {
+      std::string msg = "Unknown combine method or interpolation, or a kappa that is not positive.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      return false;
+   }
+
+   if (!isBatch())
+   {
+      Service<DesktopServices> pDesktop;
+      ImageStackingDlg dlg(pDesktop->getMainWidget(), elements.size());
+      int stat = dlg.exec();
+      if (stat != QDialog::Accepted)
+      {
+         return true;
+      }
+
+      combineMethod = dlg.getCombineMethod();
+      kappa = dlg.getKappaValue();
+      interpolation = dlg.getInterpolation();
+   }
+
+   RasterDataDescriptor* pDesc = static_cast<RasterDataDescriptor*>(elements[0]->getDataDescriptor());
+   VERIFY(pDesc != NULL);
+   int rows = pDesc->getRowCount();
+   int cols = pDesc->getColumnCount();
+
+   //Registration pass: one frame in memory at a time, each matched against the stars of the reference
+   StarDetection detection;
+   GetDefaultStarDetection(&detection);
+   CentroidOptions centroidOptions;
+   GetDefaultCentroidOptions(&centroidOptions);
+   RansacOptions options;
+   GetDefaultRansacOptions(&options);
+
+   StarCatalog referenceCatalog;
+   std::vector<StarInfo> stars;
+   std::vector<StackFrame> frames;
+   unsigned int nSkipped = 0;
+
+   for (unsigned int i = 0; i < elements.size(); ++i)
+   {
+      if (pProgress != NULL)
+      {
+         pProgress->updateProgress("Registering frame " + StringUtilities::toDisplayString(i+1), i * 50 / elements.size(), NORMAL);
+      }
+      if (isAborted())
+      {
+         std::string msg = getName() + " has been aborted.";
+         pStep->finalize(Message::Abort, msg);
+         if (pProgress != NULL)
+         {
+            pProgress->updateProgress(msg, 0, ABORT);
+         }
+         ReleaseFrames(frames);
+         return false;
+      }
+
+      RasterDataDescriptor* pFrameDesc = static_cast<RasterDataDescriptor*>(elements[i]->getDataDescriptor());
+      VERIFY(pFrameDesc != NULL);
+
+      StackFrame frame;
+      frame.pElement = elements[i];
+      frame.type = pFrameDesc->getDataType();
+      frame.rows = pFrameDesc->getRowCount();
+      frame.cols = pFrameDesc->getColumnCount();
+
+      FactoryResource<DataRequest> pRequest;
+      pRequest->setInterleaveFormat(BSQ);
+      frame.pAcc = new DataAccessor(elements[i]->getDataAccessor(pRequest.release()));
+
+      double *pBuffer = (double *)malloc(sizeof(double)*frame.rows*frame.cols);
+      if ((pBuffer == NULL) || !ReadImageRows(*frame.pAcc, frame.type, 0, frame.rows, frame.cols, pBuffer))
+      {
+         std::string msg = "Unable to access the data of " + elements[i]->getName() + ".";
+         pStep->finalize(Message::Failure, msg);
+         if (pProgress != NULL) 
+         {
+            pProgress->updateProgress(msg, 0, ERRORS);
+         }
+         free(pBuffer);
+         delete frame.pAcc;
+         ReleaseFrames(frames);
+         return false;
+      }
+
+      DetectStars(pBuffer, frame.rows, frame.cols, &detection, &stars);
+      RefineStarCentroids(pBuffer, frame.rows, frame.cols, &centroidOptions, &stars);
+      free(pBuffer);
+
+      TransformModel transform;
+      bool bRegistered = true;
+      if (i == 0)
+      {
+         BuildStarCatalog(stars, frame.rows, frame.cols, 0.0, MAX_CATALOG_STARS, MINIMUM_RADIUS_LIMIT, &referenceCatalog);
+
+         //The reference maps onto itself
+         TransformModel identity = {{{1.0, 0.0}, {0.0, 1.0}}, 0.0, 0.0, 0.0, 1.0, 0.0, 0, 0, false};
+         transform = identity;
+      }
+      else
+      {
+         StarCatalog catalog;
+         BuildStarCatalog(stars, frame.rows, frame.cols, 0.0, MAX_CATALOG_STARS, MINIMUM_RADIUS_LIMIT, &catalog);
+         bRegistered = RegisterStarCatalogs(&referenceCatalog, &catalog, rows, cols, &options, &transform, NULL);
+      }
+
+      if (!bRegistered || !GetPixelMapping(&transform, rows, cols, frame.mapping))
+      {
+         //A frame that cannot be registered is left out rather than smearing the stack
+         nSkipped++;
+         delete frame.pAcc;
+         continue;
+      }
+
+      frames.push_back(frame);
+   }
+
+   if (frames.size() < 2)
+   {
+      std::string msg = "Fewer than two frames could be registered.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      ReleaseFrames(frames);
+      return false;
+   }
+
+   //The stack keeps the fractional values the combination produces
+   ModelResource<RasterElement> pResultCube(RasterUtilities::createRasterElement(elements[0]->getName() +
+      "_Image_Stacking_Result", rows, cols, FLT4BYTES));
+   if (pResultCube.get() == NULL)
+   {
+      std::string msg = "A raster cube could not be created.";
+      pStep->finalize(Message::Failure, msg);
+      if (pProgress != NULL) 
+      {
+         pProgress->updateProgress(msg, 0, ERRORS);
+      }
+      ReleaseFrames(frames);
+      return false;
+   }
+
+   FactoryResource<DataRequest> pResultRequest;
+   pResultRequest->setWritable(true);
+   DataAccessor pDestAcc = pResultCube->getDataAccessor(pResultRequest.release());
+
+   //Combination pass: strips of output rows, each frame read once per strip and warped onto it
+   unsigned int nFrames = frames.size();
+   int stripRows = GetStackStripRows(nFrames, rows, cols, STACK_MEMORY_LIMIT, MIN_STRIP_ROWS);
+   std::vector<double> planes(nFrames*stripRows*cols);
+   std::vector<double> result(stripRows*cols);
+   std::vector<double> tile(STACK_TILE_SIZE*STACK_TILE_SIZE);
+   std::vector<double> source;
+
+   for (int startRow = 0; startRow < rows; startRow += stripRows)
+   {
+      int nRows = std::min(stripRows, rows - startRow);
+
+      if (pProgress != NULL)
+      {
+         pProgress->updateProgress("Stacking frames", 50 + startRow * 50 / rows, NORMAL);
+      }
+      if (isAborted())
+      {
+         std::string msg = getName() + " has been aborted.";
+         pStep->finalize(Message::Abort, msg);
+         if (pProgress != NULL)
+         {
+            pProgress->updateProgress(msg, 0, ABORT);
+         }
+         ReleaseFrames(frames);
+         return false;
+      }
+
+      //Each frame is warped tile by tile, so the source read for a tile stays small even for a frame turned on its side
+      for (unsigned int f = 0; f < nFrames; ++f)
+      {
+         const StackFrame &frame = frames[f];
+         double *pPlane = &planes[f*nRows*cols];
+
+         for (int tileRow = startRow; tileRow < startRow + nRows; tileRow += STACK_TILE_SIZE)
+         {
+            int tileRows = std::min(STACK_TILE_SIZE, startRow + nRows - tileRow);
+
+            for (int tileCol = 0; tileCol < cols; tileCol += STACK_TILE_SIZE)
+            {
+               int tileCols = std::min(STACK_TILE_SIZE, cols - tileCol);
+               int top, bottom, left, right;
+
+               if (!GetSourceWindow(frame, tileRow, tileRow + tileRows, tileCol, tileCol + tileCols, &top, &bottom, &left, &right))
+               {
+                  std::fill(tile.begin(), tile.begin() + tileRows*tileCols, std::numeric_limits<double>::quiet_NaN());
+               }
+               else
+               {
+                  source.resize((bottom - top)*(right - left));
+                  if (!ReadImageBlock(*frame.pAcc, frame.type, top, bottom - top, left, right - left, &source[0]))
+                  {
+                     std::string msg = "Unable to access the data of " + frame.pElement->getName() + ".";
+                     pStep->finalize(Message::Failure, msg);
+                     if (pProgress != NULL) 
+                     {
+                        pProgress->updateProgress(msg, 0, ERRORS);
+                     }
+                     ReleaseFrames(frames);
+                     return false;
+                  }
+
+                  //Shift the mapping to the origin of the tile and of the window read
+                  double mapping[2][3];
+                  memcpy(mapping, frame.mapping, sizeof(mapping));
+                  mapping[0][2] += mapping[0][0]*tileCol + mapping[0][1]*tileRow - left;
+                  mapping[1][2] += mapping[1][0]*tileCol + mapping[1][1]*tileRow - top;
+
+                  WarpImage(&source[0], bottom - top, right - left, mapping, interpolation, std::numeric_limits<double>::quiet_NaN(),
+                            &tile[0], tileRows, tileCols);
+               }
+
+               for (int i = 0; i < tileRows; ++i)
+               {
+                  memcpy(pPlane + (tileRow - startRow + i)*cols + tileCol, &tile[i*tileCols], sizeof(double)*tileCols);
+               }
+            }
+         }
+      }
+
+      CombineFrames(&planes[0], nFrames, nRows, cols, combineMethod, kappa, &result[0]);
+
+      if (!pDestAcc.isValid() || !WriteImageRows(pDestAcc, FLT4BYTES, startRow, nRows, cols, &result[0]))
+      {
+         std::string msg = "Unable to access the cube data.";
+         pStep->finalize(Message::Failure, msg);
+         if (pProgress != NULL) 
+         {
+            pProgress->updateProgress(msg, 0, ERRORS);
+         }
+         ReleaseFrames(frames);
+         return false;
+      }
+   }
+
+   ReleaseFrames(frames);
+
+   if (!isBatch())
+   {
+      Service<DesktopServices> pDesktop;
+
+      SpatialDataWindow* pWindow = static_cast<SpatialDataWindow*>(pDesktop->createWindow(pResultCube->getName(),
+         SPATIAL_DATA_WINDOW));
+
+      SpatialDataView* pView = (pWindow == NULL) ? NULL : pWindow->getSpatialDataView();
+      if (pView == NULL)
+      {
+         std::string msg = "Unable to create view.";
+         pStep->finalize(Message::Failure, msg);
+         if (pProgress != NULL) 
+         {
+            pProgress->updateProgress(msg, 0, ERRORS);
+         }
+         return false;
+      }
+
+      pView->setPrimaryRasterElement(pResultCube.get());
+      pView->createLayer(RASTER, pResultCube.get());
+   }
+
+   std::string msg = "Image Stacking is complete.\n " + StringUtilities::toDisplayString(nFrames) + " frames stacked";
+   if (nSkipped > 0)
+   {
+      msg += ", " + StringUtilities::toDisplayString(nSkipped) + " frames could not be registered";
+   }
+   if (pProgress != NULL)
+   {
+      pProgress->updateProgress(msg, 100, NORMAL);
+   }
+
+   pOutArgList->setPlugInArgValue("Result", pResultCube.release());
+
+   pStep->finalize();
+   return true;
+}
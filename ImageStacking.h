@@ -0,0 +1,18 @@
+#ifndef ZYW_IMAGE_STACKING_H
+#define ZYW_IMAGE_STACKING_H
+
+#include "ExecutableShell.h"
+
+class ImageStacking : public ExecutableShell
+{
+public:
+   ImageStacking();
+   virtual ~ImageStacking();
+
+   virtual bool getInputSpecification(PlugInArgList*& pInArgList);
+   virtual bool getOutputSpecification(PlugInArgList*& pOutArgList);
+   virtual bool execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgList);
+   
+};
+
+#endif
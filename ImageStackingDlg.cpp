@@ -0,0 +1,127 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from   
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "AppAssert.h"
+#include "AppVerify.h"
+#include "ImageStackingDlg.h"
+#include "registrationlib.h"
+#include "stacklib.h"
+
+
+#include <QtGui/QLabel>
+#include <QtGui/QLayout>
+#include <QtGui/QPushButton>
+#include <QtGui/QComboBox>
+#include <QtGui/QDoubleSpinBox>
+
+
+using namespace std;
+
+ImageStackingDlg::ImageStackingDlg(QWidget* pParent, unsigned int nFrames) : QDialog(pParent),
+   pCombineMenu(NULL), pKappaPara(NULL), pInterpolationMenu(NULL)
+{
+   setWindowTitle("Image Stacking Setting");
+
+   mCombineMethod = COMBINE_SIGMA_CLIP; 
+   mKappaVal = 3.0;
+   mInterpolation = INTERPOLATION_BICUBIC;
+
+   QGridLayout* pLayout = new QGridLayout(this);
+   pLayout->setMargin(10);
+   pLayout->setSpacing(5);
+
+   QLabel* pLableFrames = new QLabel(QString("Frames: %1, registered to the first").arg(static_cast<int>(nFrames)), this);
+   pLayout->addWidget(pLableFrames, 0, 0, 1, 3);
+
+   QLabel* pLableMode = new QLabel("Combine", this);
+   pLayout->addWidget(pLableMode, 1, 0);
+
+   pCombineMenu = new QComboBox(this);
+   pCombineMenu->addItem("Mean");
+   pCombineMenu->addItem("Median");
+   pCombineMenu->addItem("Sigma Clipping");
+   pCombineMenu->addItem("Winsorized Sigma Clipping");
+   pCombineMenu->setCurrentIndex(mCombineMethod);
+   pLayout->addWidget(pCombineMenu, 1, 1, 1, 2);
+
+   QLabel* pLable1 = new QLabel("Kappa", this);
+   pLayout->addWidget(pLable1, 2, 0);
+   
+   pKappaPara = new QDoubleSpinBox(this);
+   pKappaPara->setRange(1, 10);
+   pKappaPara->setSingleStep(0.1);
+   pKappaPara->setValue(mKappaVal);
+   pKappaPara->setToolTip("Values farther than kappa sigma from the median are rejected");
+   pLayout->addWidget(pKappaPara, 2, 1, 1, 2);
+
+   QLabel* pLable2 = new QLabel("Interpolation", this);
+   pLayout->addWidget(pLable2, 3, 0);
+
+   pInterpolationMenu = new QComboBox(this);
+   pInterpolationMenu->addItem("Nearest");
+   pInterpolationMenu->addItem("Bilinear");
+   pInterpolationMenu->addItem("Bicubic");
+   pInterpolationMenu->addItem("Lanczos");
+   pInterpolationMenu->setCurrentIndex(mInterpolation);
+   pLayout->addWidget(pInterpolationMenu, 3, 1, 1, 2);
+   
+
+   QHBoxLayout* pRespLayout = new QHBoxLayout;
+   pLayout->addLayout(pRespLayout, 4, 0, 1, 3);
+
+   QPushButton* pAccept = new QPushButton("OK", this);
+   pRespLayout->addStretch();
+   pRespLayout->addWidget(pAccept);
+
+   QPushButton* pReject = new QPushButton("Cancel", this);
+   pRespLayout->addWidget(pReject);
+
+   connect(pAccept, SIGNAL(clicked()), this, SLOT(accept()));
+   connect(pReject, SIGNAL(clicked()), this, SLOT(reject()));
+   
+
+   connect(pCombineMenu, SIGNAL(currentIndexChanged(int)), this, SLOT(setCombineMethod(int)));
+   connect(pKappaPara, SIGNAL(valueChanged(double)), this, SLOT(setKappaValue(double)));
+   connect(pInterpolationMenu, SIGNAL(currentIndexChanged(int)), this, SLOT(setInterpolation(int)));
+}
+
+
+void ImageStackingDlg::setCombineMethod(int nIndex)
+{
+	mCombineMethod = nIndex;
+
+	//Kappa only applies to the clipping methods
+	pKappaPara->setEnabled((nIndex == COMBINE_SIGMA_CLIP) || (nIndex == COMBINE_WINSORIZED));
+}
+
+void ImageStackingDlg::setKappaValue(double dVal)
+{
+	mKappaVal = dVal;
+}
+
+void ImageStackingDlg::setInterpolation(int nIndex)
+{
+	mInterpolation = nIndex;
+}
+
+int ImageStackingDlg::getCombineMethod()
+{
+	return mCombineMethod;
+}
+
+double ImageStackingDlg::getKappaValue()
+{
+	return mKappaVal;
+}
+
+int ImageStackingDlg::getInterpolation()
+{
+	return mInterpolation;
+}
+
@@ -0,0 +1,46 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from   
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef IMAGE_STACKING_DLG_H
+#define IMAGE_STACKING_DLG_H
+
+#include <QtGui/QDialog>
+
+class QComboBox;
+class QDoubleSpinBox;
+
+class ImageStackingDlg : public QDialog
+{
+   Q_OBJECT
+
+public:
+   ImageStackingDlg(QWidget* pParent, unsigned int nFrames); 
+
+
+private slots:
+   void setCombineMethod(int nIndex);
+   void setKappaValue(double dVal);
+   void setInterpolation(int nIndex);
+
+public:
+   QComboBox    *pCombineMenu;
+   QDoubleSpinBox    *pKappaPara;
+   QComboBox    *pInterpolationMenu;
+   
+   int getCombineMethod();
+   double getKappaValue();
+   int getInterpolation();
+
+private:
+	int mCombineMethod;
+	double mKappaVal;
+	int mInterpolation;
+};
+
+#endif
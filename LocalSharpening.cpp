@@ -25,213 +25,251 @@
 #include "switchOnEncoding.h"
 #include "LocalSharpening.h"
 #include "LocalSharpeningDlg.h"
+#include "imagelib.h"
 #include <limits>
+#include <algorithm>
 
 REGISTER_PLUGIN_BASIC(OpticksAstronomy, LocalSharpening);
 
 namespace
 {
 
-   #define MAX_WINDOW_SIZE 7
+   #define STRIP_ROWS 1024
+   #define MIN_BAND_ROWS 32
+   #define NUM_SNR_SCALES 4
+   #define NOISE_SAMPLE_ROWS 32
    
-   template<typename T>
-   void localExtremeSharpening(T* pData, DataAccessor pSrcAcc, int row, int col, int rowSize, int colSize, EncodingType type, int windowSize)
+   //Rows [inStart, inStart+inRows) of the image are held in pIn, rows [outStart, outStart+outRows) are written to pOut.
+   //The window extremes come from a running min/max over the input rows, so the cost per pixel does not depend on the window size.
+   void localExtremeSharpening(const double *pIn, int inStart, int inRows, int outStart, int outRows, int rowSize, int colSize, 
+                               int windowSize, double *pMin, double *pMax, double *pOut)
    {
-	  int i, j, m, n;
-	  double minVal = std::numeric_limits<double>::max();
-      double maxVal = -minVal;
-    
-	  double pixelVal = 0.0;
-	  double diffVal = 0.0;
-
+	  int row, col;
+	  double minVal, maxVal, pixelVal;
 
-	  double windowVal[MAX_WINDOW_SIZE*2+1][MAX_WINDOW_SIZE*2+1];
-
-	  if ((col-windowSize < 0) || (col+windowSize > colSize - 1))
-	  {
-		  pSrcAcc->toPixel(row, col);
-          VERIFYNRV(pSrcAcc.isValid());
-		  pixelVal = Service<ModelServices>()->getDataValue(type, pSrcAcc->getColumn(), COMPLEX_MAGNITUDE, 0);
-          *pData = static_cast<T>(pixelVal);
-		  return;
-	  }
+	  RunningMinMax2D(pIn, inRows, colSize, windowSize, pMin, pMax);
 
-	  if ((row-windowSize < 0) || (row+windowSize > rowSize - 1))
+	  for (row = outStart; row < outStart + outRows; row++)
 	  {
-		  pSrcAcc->toPixel(row, col);
-          VERIFYNRV(pSrcAcc.isValid());
-		  pixelVal = Service<ModelServices>()->getDataValue(type, pSrcAcc->getColumn(), COMPLEX_MAGNITUDE, 0);
-          *pData = static_cast<T>(pixelVal);
-		  return;
-	  }
+		  const double *pRow = pIn + (row - inStart)*colSize;
+		  const double *pRowMin = pMin + (row - inStart)*colSize;
+		  const double *pRowMax = pMax + (row - inStart)*colSize;
+		  double *pDst = pOut + (row - outStart)*colSize;
 
-	  //Get the pixels in the window
-	  m = 0;
-	  for (i=row - windowSize; i<= row + windowSize; i++)
-	  {
-		  n = 0;
-		  for (j=col - windowSize; j<= col + windowSize; j++)
+		  for (col = 0; col < colSize; col++)
 		  {
-			 pSrcAcc->toPixel(i, j);
-             VERIFYNRV(pSrcAcc.isValid());
-			 windowVal[m][n] = Service<ModelServices>()->getDataValue(type, pSrcAcc->getColumn(), COMPLEX_MAGNITUDE, 0);
-			 
-			 if (minVal > windowVal[m][n])	
-			 {
-				 minVal = windowVal[m][n];	
-			 }
-			 	
-			 	
-			 if (maxVal < windowVal[m][n])	
-			 {	
-				 maxVal = windowVal[m][n];	
-			 }
-			 n++;
+			  pixelVal = pRow[col];
+
+			  if ((col-windowSize < 0) || (col+windowSize > colSize - 1) ||
+			      (row-windowSize < 0) || (row+windowSize > rowSize - 1))
+			  {
+				  pDst[col] = pixelVal;
+				  continue;
+			  }
+
+			  minVal = pRowMin[col];
+			  maxVal = pRowMax[col];
+
+			  if (pixelVal - minVal <= maxVal - pixelVal)
+			  {
+				  pDst[col] = minVal;
+			  }
+			  else	
+			  {
+				  pDst[col] = maxVal;	
+			  }
 		  }
-		  m++;
-	  }
-	  pixelVal = windowVal[windowSize][windowSize];
-
-	  if (pixelVal - minVal <= maxVal - pixelVal)
-	  {
-		  pixelVal = minVal;
-      }
-      else	
-	  {
-		  pixelVal = maxVal;	
 	  }
-
-	  *pData = static_cast<T>(pixelVal);
    }
    
-   
-
-   template<typename T>
-   void localAdaptiveSharpening(T* pData, DataAccessor pSrcAcc, int row, int col, int rowSize, int colSize, EncodingType type, int windowSize, double contrastVal)
+   //Local mean and sigma come from summed-area tables of the input rows, so the cost per pixel does not depend on the window size
+   void localAdaptiveSharpening(const double *pIn, int inStart, int inRows, int outStart, int outRows, int rowSize, int colSize, 
+                                int windowSize, double contrastVal, double *pSum, double *pSumSq, double *pOut)
    {
-	  int i, j, m, n;
+	  int row, col;
 	  double meanVal = 0.0;
 	  double sigmaVal = 0.0;
 	  double pixelVal = 0.0;
 	  double diffVal = 0.0;
 
-
-	  double windowVal[MAX_WINDOW_SIZE*2+1][MAX_WINDOW_SIZE*2+1];
-
-	  if ((col-windowSize < 0) || (col+windowSize > colSize - 1))
+	  //Centre the data on the mean of the first input row to keep the sums of squares accurate
+	  double offset = 0.0;
+	  for (col = 0; col < colSize; col++)
 	  {
-		  pSrcAcc->toPixel(row, col);
-          VERIFYNRV(pSrcAcc.isValid());
-		  pixelVal = Service<ModelServices>()->getDataValue(type, pSrcAcc->getColumn(), COMPLEX_MAGNITUDE, 0);
-          *pData = static_cast<T>(pixelVal);
-		  return;
+		  offset += pIn[col];
 	  }
+	  offset = offset/colSize;
+	  BuildIntegralImages(pIn, inRows, colSize, offset, pSum, pSumSq);
 
-	  if ((row-windowSize < 0) || (row+windowSize > rowSize - 1))
+	  for (row = outStart; row < outStart + outRows; row++)
 	  {
-		  pSrcAcc->toPixel(row, col);
-          VERIFYNRV(pSrcAcc.isValid());
-		  pixelVal = Service<ModelServices>()->getDataValue(type, pSrcAcc->getColumn(), COMPLEX_MAGNITUDE, 0);
-          *pData = static_cast<T>(pixelVal);
-		  return;
-	  }
+		  const double *pRow = pIn + (row - inStart)*colSize;
+		  double *pDst = pOut + (row - outStart)*colSize;
 
-	  //Get the pixels in the window
-	  m = 0;
-	  for (i=row - windowSize; i<= row + windowSize; i++)
-	  {
-		  n = 0;
-		  for (j=col - windowSize; j<= col + windowSize; j++)
+		  for (col = 0; col < colSize; col++)
 		  {
-			 pSrcAcc->toPixel(i, j);
-             VERIFYNRV(pSrcAcc.isValid());
-			 windowVal[m][n] = Service<ModelServices>()->getDataValue(type, pSrcAcc->getColumn(), COMPLEX_MAGNITUDE, 0);
-			 n++;
+			  pixelVal = pRow[col];
+
+			  if ((col-windowSize < 0) || (col+windowSize > colSize - 1) ||
+			      (row-windowSize < 0) || (row+windowSize > rowSize - 1))
+			  {
+				  pDst[col] = pixelVal;
+				  continue;
+			  }
+
+			  WindowStatistics(pSum, pSumSq, colSize, row - windowSize - inStart, col - windowSize, 
+			                   row + windowSize - inStart, col + windowSize, offset, &meanVal, &sigmaVal);
+			  diffVal = pixelVal - meanVal;
+
+			  //A flat window has nothing to sharpen
+			  if (sigmaVal > 0)
+			  {
+				  pixelVal = pixelVal + diffVal*contrastVal/sigmaVal;
+			  }
+
+			  pDst[col] = pixelVal;
 		  }
-		  m++;
 	  }
-	  pixelVal = windowVal[windowSize][windowSize];
+   }
+
+   //Adaptive sharpening whose window and gain follow the local SNR. Starting from the smallest scale, the first window whose
+   //sigma stands snrThreshold above the noise is used, the largest one otherwise, and the gain is shrunk by 1 - noise^2/sigma^2
+   //so that flat sky, where sigma is close to the noise, is left alone.
+   void localSnrAdaptiveSharpening(const double *pIn, int inStart, int inRows, int outStart, int outRows, int rowSize, int colSize, 
+                                   int windowSize, double contrastVal, double noiseSigma, double snrThreshold, 
+                                   double *pSum, double *pSumSq, double *pOut)
+   {
+	  int row, col, k, w;
+	  int nScales = 0;
+	  int scales[NUM_SNR_SCALES];
+	  double meanVal = 0.0;
+	  double sigmaVal = 0.0;
+	  double pixelVal = 0.0;
+	  double gainVal = 0.0;
+	  double noiseVar = noiseSigma*noiseSigma;
 
-	  //Calculate the mean value
-	  for (m = 0; m< 2*windowSize+1; m++)
+	  //Half window sizes from the smallest to the selected one, halving each time
+	  for (w = windowSize; (w >= 1) && (nScales < NUM_SNR_SCALES); w = w/2)
 	  {
-		  for (n=0; n<2*windowSize+1; n++)
-		  {
-			  meanVal = meanVal + windowVal[m][n];		  
-		  }
+		  nScales++;
 	  }
-	  meanVal = meanVal/((2*windowSize+1)*(2*windowSize+1));
-	  diffVal = pixelVal - meanVal;
-
-	  //Calculate the sigma value
-	  for (m = 0; m< 2*windowSize+1; m++)
+	  for (k = nScales-1, w = windowSize; k >= 0; k--, w = w/2)
 	  {
-		  for (n=0; n<2*windowSize+1; n++)
-		  {
-			  sigmaVal = sigmaVal + (windowVal[m][n]-meanVal)*(windowVal[m][n]-meanVal);		  
-		  }
+		  scales[k] = w;
 	  }
-	  sigmaVal = sigmaVal/((2*windowSize+1)*(2*windowSize+1)-1);
-	  sigmaVal = sqrt(sigmaVal);
-
-	  pixelVal = pixelVal + diffVal*contrastVal/sigmaVal;
 
-	 
-	  if (type == INT1UBYTE)
+	  double offset = 0.0;
+	  for (col = 0; col < colSize; col++)
 	  {
-		  if (pixelVal > 255)
-	      {
-			  pixelVal = 255;
-		  }
-
-		  if (pixelVal < 0)
-		  {
-			  pixelVal = 0;
-		  }
+		  offset += pIn[col];
 	  }
-	  
-	  if (type == INT1SBYTE)
+	  offset = offset/colSize;
+	  BuildIntegralImages(pIn, inRows, colSize, offset, pSum, pSumSq);
+
+	  for (row = outStart; row < outStart + outRows; row++)
 	  {
-		  if (pixelVal > 127)
-	      {
-			  pixelVal = 127;
-		  }
+		  const double *pRow = pIn + (row - inStart)*colSize;
+		  double *pDst = pOut + (row - outStart)*colSize;
 
-		  if (pixelVal < -127)
+		  for (col = 0; col < colSize; col++)
 		  {
-			  pixelVal = -127;
+			  pixelVal = pRow[col];
+
+			  if ((col-windowSize < 0) || (col+windowSize > colSize - 1) ||
+			      (row-windowSize < 0) || (row+windowSize > rowSize - 1))
+			  {
+				  pDst[col] = pixelVal;
+				  continue;
+			  }
+
+			  for (k = 0; k < nScales; k++)
+			  {
+				  w = scales[k];
+				  WindowStatistics(pSum, pSumSq, colSize, row - w - inStart, col - w, row + w - inStart, col + w, 
+				                   offset, &meanVal, &sigmaVal);
+
+				  if (sigmaVal >= snrThreshold*noiseSigma)
+				  {
+					  break;
+				  }
+			  }
+
+			  if (sigmaVal > 0)
+			  {
+				  gainVal = std::max(0.0, 1.0 - noiseVar/(sigmaVal*sigmaVal));
+				  pixelVal = pixelVal + gainVal*(pixelVal - meanVal)*contrastVal/sigmaVal;
+			  }
+
+			  pDst[col] = pixelVal;
 		  }
 	  }
+   }
 
-	  
-	  if (type == INT2UBYTES)
+   //A strip held in memory, shared read-only by the row bands working on it
+   typedef struct _SharpeningStrip
+   {
+	  const double *pIn;
+	  int inStart;
+	  int inRows;
+	  int outStart;
+	  double *pOut;
+	  int rowSize;
+	  int colSize;
+	  int windowSize;
+	  int filterType;
+	  double contrastVal;
+	  double noiseSigma;
+	  double snrThreshold;
+   } SharpeningStrip;
+
+   //Sharpen output rows [startRow, endRow) of the strip (relative to outStart), with private working buffers
+   void sharpenBand(void *pContext, int startRow, int endRow)
+   {
+	  SharpeningStrip *pStrip = static_cast<SharpeningStrip*>(pContext);
+	  int colSize = pStrip->colSize;
+	  int outStart = pStrip->outStart + startRow;
+	  int outRows = endRow - startRow;
+
+	  //Rows of the band plus the window halo, limited to what the strip holds
+	  int inStart = std::max(pStrip->inStart, outStart - pStrip->windowSize);
+	  int inEnd = std::min(pStrip->inStart + pStrip->inRows, outStart + outRows + pStrip->windowSize);
+	  int inRows = inEnd - inStart;
+	  const double *pIn = pStrip->pIn + (inStart - pStrip->inStart)*colSize;
+	  double *pOut = pStrip->pOut + startRow*colSize;
+
+	  if (pStrip->filterType == 0)
 	  {
-		  if (pixelVal > 65535)
-	      {
-			  pixelVal = 65535;
-		  }
+		  double *pSum = (double *)malloc(sizeof(double)*(inRows+1)*(colSize+1));
+		  double *pSumSq = (double *)malloc(sizeof(double)*(inRows+1)*(colSize+1));
 
-		  if (pixelVal < 0)
-		  {
-			  pixelVal = 0;
-		  }
-	  }
+		  localAdaptiveSharpening(pIn, inStart, inRows, outStart, outRows, pStrip->rowSize, colSize, pStrip->windowSize, 
+		                          pStrip->contrastVal, pSum, pSumSq, pOut);
 
-	  if (type == INT2SBYTES)
+		  free(pSum);
+		  free(pSumSq);
+	  }
+	  else if (pStrip->filterType == 2)
 	  {
-		  if (pixelVal > 32767)
-	      {
-			  pixelVal = 32767;
-		  }
+		  double *pSum = (double *)malloc(sizeof(double)*(inRows+1)*(colSize+1));
+		  double *pSumSq = (double *)malloc(sizeof(double)*(inRows+1)*(colSize+1));
 
-		  if (pixelVal < -32767)
-		  {
-			  pixelVal = -32767;
-		  }
+		  localSnrAdaptiveSharpening(pIn, inStart, inRows, outStart, outRows, pStrip->rowSize, colSize, pStrip->windowSize, 
+		                             pStrip->contrastVal, pStrip->noiseSigma, pStrip->snrThreshold, pSum, pSumSq, pOut);
+
+		  free(pSum);
+		  free(pSumSq);
 	  }
-	  
-       *pData = static_cast<T>(pixelVal);
+	  else
+	  {
+		  double *pMin = (double *)malloc(sizeof(double)*inRows*colSize);
+		  double *pMax = (double *)malloc(sizeof(double)*inRows*colSize);
+
+		  localExtremeSharpening(pIn, inStart, inRows, outStart, outRows, pStrip->rowSize, colSize, pStrip->windowSize, 
+		                         pMin, pMax, pOut);
 
+		  free(pMin);
+		  free(pMax);
+	  }
    }
 };
 
@@ -328,15 +366,57 @@ bool LocalSharpening::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgL
 	   return true;
    }
    double contrastVal = dlg.getContrastValue();
+   double snrThreshold = dlg.getSnrThreshold();
    int nFilterType = dlg.getCurrentFilterType();
    int windowSize = dlg.getCurrentWindowSize();
    windowSize = (windowSize-1)/2;
 
-   for (unsigned int row = 0; row < pDesc->getRowCount(); ++row)
+   int rowSize = pDesc->getRowCount();
+   int colSize = pDesc->getColumnCount();
+   int stripRows = std::min(STRIP_ROWS, rowSize);
+   int maxInRows = std::min(stripRows + 2*windowSize, rowSize);
+
+   //Each strip is read with a halo of windowSize rows above and below it
+   double *pInBuffer = (double *)malloc(sizeof(double)*maxInRows*colSize);
+   double *pOutBuffer = (double *)malloc(sizeof(double)*stripRows*colSize);
+   SharpeningStrip strip;
+   strip.pIn = pInBuffer;
+   strip.pOut = pOutBuffer;
+   strip.rowSize = rowSize;
+   strip.colSize = colSize;
+   strip.windowSize = windowSize;
+   strip.filterType = nFilterType;
+   strip.contrastVal = contrastVal;
+   strip.snrThreshold = snrThreshold;
+   strip.noiseSigma = 0.0;
+
+   //The SNR driven mode needs the noise of the whole image, estimated from rows sampled across it
+   if (nFilterType == 2)
+   {
+      int nSampleRows = std::min(NOISE_SAMPLE_ROWS, rowSize);
+      for (int k = 0; k < nSampleRows; k++)
+      {
+         if (!ReadImageRows(pSrcAcc, pDesc->getDataType(), k*rowSize/nSampleRows, 1, colSize, pInBuffer + k*colSize))
+         {
+            std::string msg = "Unable to access the cube data.";
+            pStep->finalize(Message::Failure, msg);
+            if (pProgress != NULL) 
+            {
+               pProgress->updateProgress(msg, 0, ERRORS);
+            }
+            free(pInBuffer);
+            free(pOutBuffer);
+            return false;
+         }
+      }
+      strip.noiseSigma = EstimateNoiseSigma(pInBuffer, nSampleRows, colSize);
+   }
+
+   for (int outStart = 0; outStart < rowSize; outStart += stripRows)
    {
       if (pProgress != NULL)
       {
-         pProgress->updateProgress("Local sharpening", row * 100 / pDesc->getRowCount(), NORMAL);
+         pProgress->updateProgress("Local sharpening", outStart * 100 / rowSize, NORMAL);
       }
       if (isAborted())
       {
@@ -346,9 +426,16 @@ bool LocalSharpening::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgL
          {
             pProgress->updateProgress(msg, 0, ABORT);
          }
+         free(pInBuffer);
+         free(pOutBuffer);
          return false;
       }
-      if (!pDestAcc.isValid())
+
+      int outRows = std::min(stripRows, rowSize - outStart);
+      int inStart = std::max(0, outStart - windowSize);
+      int inRows = std::min(rowSize, outStart + outRows + windowSize) - inStart;
+
+      if (!pDestAcc.isValid() || !ReadImageRows(pSrcAcc, pDesc->getDataType(), inStart, inRows, colSize, pInBuffer))
       {
          std::string msg = "Unable to access the cube data.";
          pStep->finalize(Message::Failure, msg);
@@ -356,27 +443,34 @@ bool LocalSharpening::execute(PlugInArgList* pInArgList, PlugInArgList* pOutArgL
          {
             pProgress->updateProgress(msg, 0, ERRORS);
          }
+         free(pInBuffer);
+         free(pOutBuffer);
          return false;
       }
-      for (unsigned int col = 0; col < pDesc->getColumnCount(); ++col)
+
+      //Bands of the strip run in parallel, the strip is then written in bulk
+      strip.inStart = inStart;
+      strip.inRows = inRows;
+      strip.outStart = outStart;
+      RunRowBands(sharpenBand, &strip, outRows, MIN_BAND_ROWS);
+
+      if (!WriteImageRows(pDestAcc, ResultType, outStart, outRows, colSize, pOutBuffer))
       {
-		  if (nFilterType == 0)
-		  {
-			  switchOnEncoding(ResultType, localAdaptiveSharpening, pDestAcc->getColumn(), pSrcAcc, row, col,
-                               pDesc->getRowCount(), pDesc->getColumnCount(), pDesc->getDataType(), windowSize, contrastVal);
-		  }
-		  else
-		  {
-           
-			  switchOnEncoding(ResultType, localExtremeSharpening, pDestAcc->getColumn(), pSrcAcc, row, col,
-                               pDesc->getRowCount(), pDesc->getColumnCount(), pDesc->getDataType(), windowSize);
-		  }
-		  pDestAcc->nextColumn();
+         std::string msg = "Unable to access the cube data.";
+         pStep->finalize(Message::Failure, msg);
+         if (pProgress != NULL) 
+         {
+            pProgress->updateProgress(msg, 0, ERRORS);
+         }
+         free(pInBuffer);
+         free(pOutBuffer);
+         return false;
       }
-
-      pDestAcc->nextRow();
    }
 
+   free(pInBuffer);
+   free(pOutBuffer);
+
 
    if (!isBatch())
    {
@@ -22,13 +22,14 @@
 using namespace std;
 
 LocalSharpeningDlg::LocalSharpeningDlg(QWidget* pParent) : QDialog(pParent),
-   pFilterMenu(NULL), pWindowSizeMenu(NULL), pContrastSlider(NULL)
+   pFilterMenu(NULL), pWindowSizeMenu(NULL), pContrastSlider(NULL), pSnrThresholdBox(NULL)
 {
    setWindowTitle("Local Sharpening");
 
    mFilterType = 0; 
    mCurrentWindowSize = 7;
    mContrastVal = 8.0;
+   mSnrThreshold = 3.0;
 
    QGridLayout* pLayout = new QGridLayout(this);
    pLayout->setMargin(10);
@@ -40,6 +41,7 @@ LocalSharpeningDlg::LocalSharpeningDlg(QWidget* pParent) : QDialog(pParent),
    pFilterMenu = new QComboBox(this);
    pFilterMenu->addItem("Adaptive Sharpening");
    pFilterMenu->addItem("Extreme Value Operator");
+   pFilterMenu->addItem("SNR Adaptive Sharpening");
    pFilterMenu->setCurrentIndex(0);
    pLayout->addWidget(pFilterMenu, 0, 1, 1, 2);
 
@@ -51,6 +53,10 @@ LocalSharpeningDlg::LocalSharpeningDlg(QWidget* pParent) : QDialog(pParent),
    pWindowSizeMenu->addItem("7");
    pWindowSizeMenu->addItem("9");
    pWindowSizeMenu->addItem("11");
+   pWindowSizeMenu->addItem("15");
+   pWindowSizeMenu->addItem("21");
+   pWindowSizeMenu->addItem("31");
+   pWindowSizeMenu->addItem("51");
 
    pWindowSizeMenu->setCurrentIndex(1);
    pLayout->addWidget(pWindowSizeMenu, 1, 1, 1, 2);
@@ -65,6 +71,15 @@ LocalSharpeningDlg::LocalSharpeningDlg(QWidget* pParent) : QDialog(pParent),
    pContrastSlider->setValue(mContrastVal);
    pLayout->addWidget(pContrastSlider, 2, 1, 1, 2);
    
+   QLabel* pLable4 = new QLabel("SNR Threshold", this);
+   pLayout->addWidget(pLable4, 3, 0, 1, 2);
+
+   pSnrThresholdBox = new QDoubleSpinBox(this);
+   pSnrThresholdBox->setRange(1, 10);
+   pSnrThresholdBox->setSingleStep(0.5);
+   pSnrThresholdBox->setValue(mSnrThreshold);
+   pSnrThresholdBox->setEnabled(false);
+   pLayout->addWidget(pSnrThresholdBox, 3, 1, 1, 2);
 
    QHBoxLayout* pRespLayout = new QHBoxLayout;
    pLayout->addLayout(pRespLayout, 4, 0, 1, 3);
@@ -83,6 +98,7 @@ LocalSharpeningDlg::LocalSharpeningDlg(QWidget* pParent) : QDialog(pParent),
    connect(pFilterMenu, SIGNAL(currentIndexChanged(int)), this, SLOT(setCurrentFilter(int)));
    connect(pWindowSizeMenu, SIGNAL(currentIndexChanged(int)), this, SLOT(setCurrentWindowSize(int)));
    connect(pContrastSlider, SIGNAL(valueChanged(double)), this, SLOT(setContrastValue(double)));
+   connect(pSnrThresholdBox, SIGNAL(valueChanged(double)), this, SLOT(setSnrThreshold(double)));
 }
 
 
@@ -92,31 +108,24 @@ void LocalSharpeningDlg::setContrastValue(double dVal)
 		
 }
 
+void LocalSharpeningDlg::setSnrThreshold(double dVal)
+{
+	mSnrThreshold = dVal;
+		
+}
+
 void LocalSharpeningDlg::setCurrentFilter(int nIndex)
 {
 	mFilterType = nIndex;
+
+	//Only the SNR driven mode uses the threshold
+	pSnrThresholdBox->setEnabled(nIndex == 2);
 		
 }
 
 void LocalSharpeningDlg::setCurrentWindowSize(int nIndex)
 {
-	if (0 == nIndex)
-	{
-		mCurrentWindowSize = 5;
-	}
-	else if (1 == nIndex)
-	{
-		mCurrentWindowSize = 7;
-	}
-	else if (2 == nIndex)
-	{
-		mCurrentWindowSize = 9;
-	}
-	else
-	{
-		mCurrentWindowSize = 11;
-	}
-
+	mCurrentWindowSize = pWindowSizeMenu->itemText(nIndex).toInt();
 		
 }
 
@@ -136,3 +145,8 @@ double LocalSharpeningDlg::getContrastValue()
 	return mContrastVal;
 }
 
+double LocalSharpeningDlg::getSnrThreshold()
+{
+	return mSnrThreshold;
+}
+
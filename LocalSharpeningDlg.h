@@ -27,19 +27,23 @@ private slots:
    void setCurrentFilter(int nIndex);
    void setCurrentWindowSize(int nIndex);
    void setContrastValue(double dVal);
+   void setSnrThreshold(double dVal);
 
 public:
    QComboBox    *pFilterMenu;
    QComboBox    *pWindowSizeMenu;
    QDoubleSpinBox    *pContrastSlider;
+   QDoubleSpinBox    *pSnrThresholdBox;
    int getCurrentFilterType();
    int getCurrentWindowSize();
    double getContrastValue();
+   double getSnrThreshold();
 
 private:
 	int mCurrentWindowSize;
 	int mFilterType;
 	double mContrastVal;
+	double mSnrThreshold;
 };
 
 #endif
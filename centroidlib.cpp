@@ -0,0 +1,531 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "centroidlib.h"
+#include "imagelib.h"
+
+#include <algorithm>
+#include <math.h>
+#include <string.h>
+
+#define DEFAULT_CENTROID_RADIUS 5
+#define DEFAULT_SEARCH_RADIUS 2
+#define DEFAULT_CENTROID_ITERATIONS 20
+#define MIN_CENTROID_BAND_STARS 16
+#define MAX_FIT_PARAMS 6
+#define FIT_CONVERGENCE 1e-6
+#define SIGMA_TO_FWHM 2.3548200450309493
+
+namespace
+{
+   //Pixels of the box around a star, flattened with their offsets so the fits loop over plain arrays
+   typedef struct _StarBox
+   {
+      std::vector<double> values;
+      std::vector<double> cols;
+      std::vector<double> rows;
+      double background;
+      double peak;           //brightest pixel above the background
+      int centreRow;         //pixel the box is centred on
+      int centreCol;
+   } StarBox;
+
+   double Median(std::vector<double> &values)
+   {
+      if (values.empty())
+      {
+         return 0.0;
+      }
+
+      unsigned int half = values.size()/2;
+      std::nth_element(values.begin(), values.begin() + half, values.end());
+      return values[half];
+   }
+
+   //Brightest pixel within searchRadius of the guess
+   void FindPeak(const double *pData, int rows, int cols, double x, double y, int searchRadius, int *pRow, int *pCol)
+   {
+      int row0 = std::min(std::max(static_cast<int>(floor(y + 0.5)), 0), rows - 1);
+      int col0 = std::min(std::max(static_cast<int>(floor(x + 0.5)), 0), cols - 1);
+      double maxValue = pData[row0*cols + col0];
+      *pRow = row0;
+      *pCol = col0;
+
+      for (int i=std::max(0, row0 - searchRadius); i<=std::min(rows - 1, row0 + searchRadius); i++)
+      {
+         for (int j=std::max(0, col0 - searchRadius); j<=std::min(cols - 1, col0 + searchRadius); j++)
+         {
+            if (pData[i*cols + j] > maxValue)
+            {
+               maxValue = pData[i*cols + j];
+               *pRow = i;
+               *pCol = j;
+            }
+         }
+      }
+   }
+
+   //Box of (2*radius+1)^2 pixels around (row, col), clipped to the image. The background is the median of its border.
+   void ExtractBox(const double *pData, int rows, int cols, int row, int col, int radius, StarBox *pBox)
+   {
+      int top = std::max(0, row - radius), bottom = std::min(rows - 1, row + radius);
+      int left = std::max(0, col - radius), right = std::min(cols - 1, col + radius);
+
+      pBox->values.clear();
+      pBox->cols.clear();
+      pBox->rows.clear();
+      std::vector<double> border;
+
+      for (int i=top; i<=bottom; i++)
+      {
+         for (int j=left; j<=right; j++)
+         {
+            double val = pData[i*cols + j];
+            pBox->values.push_back(val);
+            pBox->rows.push_back(i);
+            pBox->cols.push_back(j);
+            if ((i == top) || (i == bottom) || (j == left) || (j == right))
+            {
+               border.push_back(val);
+            }
+         }
+      }
+
+      pBox->background = Median(border);
+      pBox->centreRow = row;
+      pBox->centreCol = col;
+      pBox->peak = *std::max_element(pBox->values.begin(), pBox->values.end()) - pBox->background;
+   }
+
+   //Moments of the pixels above the background, recentring the box on the centroid until it stays on the same pixel
+   bool MeasureMoments(const double *pData, int rows, int cols, int radius, int maxIterations, StarBox *pBox, Centroid *pResult)
+   {
+      for (int nIteration=1; ; nIteration++)
+      {
+         double sum = 0.0, sumX = 0.0, sumY = 0.0, sumR2 = 0.0;
+         for (unsigned int i=0; i<pBox->values.size(); i++)
+         {
+            double w = pBox->values[i] - pBox->background;
+            if (w > 0.0)
+            {
+               sum += w;
+               sumX += w*pBox->cols[i];
+               sumY += w*pBox->rows[i];
+            }
+         }
+
+         if (sum <= 0.0)
+         {
+            return false;
+         }
+
+         double x = sumX/sum, y = sumY/sum;
+         for (unsigned int i=0; i<pBox->values.size(); i++)
+         {
+            double w = pBox->values[i] - pBox->background;
+            if (w > 0.0)
+            {
+               sumR2 += w*((pBox->cols[i] - x)*(pBox->cols[i] - x) + (pBox->rows[i] - y)*(pBox->rows[i] - y));
+            }
+         }
+
+         pResult->x = x;
+         pResult->y = y;
+         pResult->fwhm = SIGMA_TO_FWHM*sqrt(sumR2/(2*sum));
+         pResult->amplitude = pBox->peak;
+         pResult->background = pBox->background;
+
+         int row = static_cast<int>(floor(y + 0.5)), col = static_cast<int>(floor(x + 0.5));
+         if ((nIteration >= maxIterations) || ((row == pBox->centreRow) && (col == pBox->centreCol)))
+         {
+            return true;
+         }
+         ExtractBox(pData, rows, cols, row, col, radius, pBox);
+      }
+   }
+
+   //Vertex of the quadratic surface through the 3x3 neighbourhood of the peak pixel
+   bool MeasureQuadratic(const double *pData, int rows, int cols, const StarBox *pBox, Centroid *pResult)
+   {
+      int r = pBox->centreRow, c = pBox->centreCol;
+      if ((r < 1) || (c < 1) || (r >= rows - 1) || (c >= cols - 1))
+      {
+         return false;
+      }
+
+      const double *p = pData + r*cols + c;
+      double gx = (p[1] - p[-1])/2;
+      double gy = (p[cols] - p[-cols])/2;
+      double hxx = p[1] - 2*p[0] + p[-1];
+      double hyy = p[cols] - 2*p[0] + p[-cols];
+      double hxy = (p[cols+1] - p[cols-1] - p[-cols+1] + p[-cols-1])/4;
+
+      //Newton step to the stationary point; a surface that is not a maximum falls back to the separable parabolas
+      double det = hxx*hyy - hxy*hxy;
+      double dx, dy;
+      if ((hxx < 0.0) && (det > 0.0))
+      {
+         dx = -(hyy*gx - hxy*gy)/det;
+         dy = -(hxx*gy - hxy*gx)/det;
+      }
+      else
+      {
+         dx = (hxx < 0.0) ? -gx/hxx : 0.0;
+         dy = (hyy < 0.0) ? -gy/hyy : 0.0;
+      }
+
+      dx = std::min(0.5, std::max(-0.5, dx));
+      dy = std::min(0.5, std::max(-0.5, dy));
+
+      pResult->x = c + dx;
+      pResult->y = r + dy;
+      pResult->amplitude = p[0] + (gx*dx + gy*dy)/2 - pBox->background;
+      pResult->background = pBox->background;
+
+      return true;
+   }
+
+   //Solve the n x n system A x = b by Gaussian elimination with partial pivoting; A and b are overwritten
+   bool SolveLinear(double A[][MAX_FIT_PARAMS], double *b, int n, double *x)
+   {
+      for (int k=0; k<n; k++)
+      {
+         int pivot = k;
+         for (int i=k+1; i<n; i++)
+         {
+            if (fabs(A[i][k]) > fabs(A[pivot][k]))
+            {
+               pivot = i;
+            }
+         }
+         if (fabs(A[pivot][k]) < 1e-300)
+         {
+            return false;
+         }
+
+         if (pivot != k)
+         {
+            for (int j=0; j<n; j++)
+            {
+               std::swap(A[k][j], A[pivot][j]);
+            }
+            std::swap(b[k], b[pivot]);
+         }
+
+         for (int i=k+1; i<n; i++)
+         {
+            double f = A[i][k]/A[k][k];
+            for (int j=k; j<n; j++)
+            {
+               A[i][j] -= f*A[k][j];
+            }
+            b[i] -= f*b[k];
+         }
+      }
+
+      for (int i=n-1; i>=0; i--)
+      {
+         double sum = b[i];
+         for (int j=i+1; j<n; j++)
+         {
+            sum -= A[i][j]*x[j];
+         }
+         x[i] = sum/A[i][i];
+      }
+
+      return true;
+   }
+
+   //Model value and derivatives at a pixel. Parameters: background, amplitude, x0, y0, then sigma for the Gaussian or
+   //alpha and beta for the Moffat profile.
+   double ProfileValue(bool bMoffat, const double *p, double col, double row, double *pGrad)
+   {
+      double dx = col - p[2], dy = row - p[3];
+      double r2 = dx*dx + dy*dy;
+
+      if (!bMoffat)
+      {
+         double s2 = p[4]*p[4];
+         double e = exp(-r2/(2*s2));
+         double f = p[1]*e;
+         pGrad[0] = 1.0;
+         pGrad[1] = e;
+         pGrad[2] = f*dx/s2;
+         pGrad[3] = f*dy/s2;
+         pGrad[4] = f*r2/(s2*p[4]);
+         return p[0] + f;
+      }
+
+      double a2 = p[4]*p[4];
+      double u = 1.0 + r2/a2;
+      double g = pow(u, -p[5]);
+      double f = p[1]*g;
+      double dfdr2 = -p[5]*f/(u*a2);
+      pGrad[0] = 1.0;
+      pGrad[1] = g;
+      pGrad[2] = -2*dx*dfdr2;
+      pGrad[3] = -2*dy*dfdr2;
+      pGrad[4] = 2*p[5]*f*r2/(u*a2*p[4]);
+      pGrad[5] = -f*log(u);
+      return p[0] + f;
+   }
+
+   //Levenberg-Marquardt fit of the profile to the box pixels
+   bool FitProfile(bool bMoffat, const StarBox *pBox, int maxIterations, double *pParams)
+   {
+      int nParams = bMoffat ? 6 : 5;
+      int nPixels = pBox->values.size();
+      if (nPixels <= nParams)
+      {
+         return false;
+      }
+
+      double grad[MAX_FIT_PARAMS];
+      double lambda = 1e-3;
+      double chi2 = 0.0;
+      for (int i=0; i<nPixels; i++)
+      {
+         double res = pBox->values[i] - ProfileValue(bMoffat, pParams, pBox->cols[i], pBox->rows[i], grad);
+         chi2 += res*res;
+      }
+
+      for (int nIteration=0; nIteration<maxIterations; nIteration++)
+      {
+         double A[MAX_FIT_PARAMS][MAX_FIT_PARAMS];
+         double b[MAX_FIT_PARAMS];
+         memset(A, 0, sizeof(A));
+         memset(b, 0, sizeof(b));
+
+         for (int i=0; i<nPixels; i++)
+         {
+            double res = pBox->values[i] - ProfileValue(bMoffat, pParams, pBox->cols[i], pBox->rows[i], grad);
+            for (int r=0; r<nParams; r++)
+            {
+               b[r] += grad[r]*res;
+               for (int c=0; c<=r; c++)
+               {
+                  A[r][c] += grad[r]*grad[c];
+               }
+            }
+         }
+
+         //Damped steps until one lowers the residual
+         bool bImproved = false;
+         while (!bImproved && (lambda < 1e10))
+         {
+            double M[MAX_FIT_PARAMS][MAX_FIT_PARAMS];
+            double v[MAX_FIT_PARAMS];
+            double step[MAX_FIT_PARAMS];
+            for (int r=0; r<nParams; r++)
+            {
+               for (int c=0; c<=r; c++)
+               {
+                  M[r][c] = A[r][c];
+                  M[c][r] = A[r][c];
+               }
+               M[r][r] = A[r][r]*(1.0 + lambda);
+               v[r] = b[r];
+            }
+
+            if (!SolveLinear(M, v, nParams, step))
+            {
+               return false;
+            }
+
+            double trial[MAX_FIT_PARAMS];
+            for (int r=0; r<nParams; r++)
+            {
+               trial[r] = pParams[r] + step[r];
+            }
+
+            double trialChi2 = 0.0;
+            bool bValid = (trial[4] > 0.1) && (!bMoffat || (trial[5] > 0.5));
+            for (int i=0; bValid && (i<nPixels); i++)
+            {
+               double res = pBox->values[i] - ProfileValue(bMoffat, trial, pBox->cols[i], pBox->rows[i], grad);
+               trialChi2 += res*res;
+            }
+
+            if (bValid && (trialChi2 <= chi2))
+            {
+               bool bConverged = (chi2 - trialChi2 <= FIT_CONVERGENCE*chi2);
+               memcpy(pParams, trial, sizeof(double)*nParams);
+               chi2 = trialChi2;
+               lambda = std::max(1e-7, lambda/10);
+               bImproved = true;
+               if (bConverged)
+               {
+                  return true;
+               }
+            }
+            else
+            {
+               lambda *= 10;
+            }
+         }
+
+         if (!bImproved)
+         {
+            //No step lowers the residual: the fit sits at the minimum
+            return true;
+         }
+      }
+
+      return true;
+   }
+
+   bool MeasureStar(const double *pData, int rows, int cols, double x, double y, const CentroidOptions *pOptions, StarBox *pBox,
+                    Centroid *pResult)
+   {
+      int peakRow, peakCol;
+      FindPeak(pData, rows, cols, x, y, pOptions->searchRadius, &peakRow, &peakCol);
+      ExtractBox(pData, rows, cols, peakRow, peakCol, pOptions->radius, pBox);
+
+      pResult->x = x;
+      pResult->y = y;
+      pResult->beta = 0.0;
+      pResult->fwhm = 0.0;
+      if (pBox->peak <= 0.0)
+      {
+         return false;
+      }
+
+      if (pOptions->method == CENTROID_QUADRATIC)
+      {
+         return MeasureQuadratic(pData, rows, cols, pBox, pResult);
+      }
+
+      Centroid moments = *pResult;
+      if (!MeasureMoments(pData, rows, cols, pOptions->radius, pOptions->maxIterations, pBox, &moments))
+      {
+         return false;
+      }
+      if (pOptions->method == CENTROID_MOMENTS)
+      {
+         *pResult = moments;
+         return true;
+      }
+
+      //The fits start from the moments, with a width matching their FWHM
+      bool bMoffat = (pOptions->method == CENTROID_MOFFAT);
+      double sigma = std::max(0.5, moments.fwhm/SIGMA_TO_FWHM);
+      double params[MAX_FIT_PARAMS] = {pBox->background, pBox->peak, moments.x, moments.y, sigma, 2.5};
+      if (bMoffat)
+      {
+         //alpha of a beta = 2.5 Moffat with the same FWHM
+         params[4] = moments.fwhm/(2*sqrt(pow(2.0, 1/params[5]) - 1));
+      }
+
+      if (!FitProfile(bMoffat, pBox, pOptions->maxIterations, params) ||
+          (fabs(params[2] - moments.x) > pOptions->radius) || (fabs(params[3] - moments.y) > pOptions->radius) ||
+          (params[1] <= 0.0))
+      {
+         return false;
+      }
+
+      pResult->x = params[2];
+      pResult->y = params[3];
+      pResult->background = params[0];
+      pResult->amplitude = params[1];
+      if (bMoffat)
+      {
+         pResult->beta = params[5];
+         pResult->fwhm = 2*params[4]*sqrt(pow(2.0, 1/params[5]) - 1);
+      }
+      else
+      {
+         pResult->fwhm = SIGMA_TO_FWHM*params[4];
+      }
+
+      return true;
+   }
+
+   typedef struct _CentroidBand
+   {
+      const double *pData;
+      int rows;
+      int cols;
+      const double (*pGuesses)[2];
+      const CentroidOptions *pOptions;
+      Centroid *pResults;
+   } CentroidBand;
+
+   void centroidBand(void *pContext, int startStar, int endStar)
+   {
+      const CentroidBand *pBand = reinterpret_cast<const CentroidBand*>(pContext);
+      StarBox box;
+
+      for (int i=startStar; i<endStar; i++)
+      {
+         Centroid *pResult = pBand->pResults + i;
+         pResult->valid = MeasureStar(pBand->pData, pBand->rows, pBand->cols, pBand->pGuesses[i][0], pBand->pGuesses[i][1],
+                                      pBand->pOptions, &box, pResult);
+         if (!pResult->valid)
+         {
+            pResult->x = pBand->pGuesses[i][0];
+            pResult->y = pBand->pGuesses[i][1];
+         }
+      }
+   }
+};
+
+void GetDefaultCentroidOptions(CentroidOptions *pOptions)
+{
+   pOptions->method = CENTROID_GAUSSIAN;
+   pOptions->radius = DEFAULT_CENTROID_RADIUS;
+   pOptions->searchRadius = DEFAULT_SEARCH_RADIUS;
+   pOptions->maxIterations = DEFAULT_CENTROID_ITERATIONS;
+}
+
+void MeasureCentroids(const double *pData, int rows, int cols, const double (*pGuesses)[2], unsigned int n,
+                      const CentroidOptions *pOptions, Centroid *pResults)
+{
+   if ((n == 0) || (rows <= 0) || (cols <= 0))
+   {
+      return;
+   }
+
+   CentroidBand band;
+   band.pData = pData;
+   band.rows = rows;
+   band.cols = cols;
+   band.pGuesses = pGuesses;
+   band.pOptions = pOptions;
+   band.pResults = pResults;
+
+   RunRowBands(centroidBand, &band, n, MIN_CENTROID_BAND_STARS);
+}
+
+void RefineStarCentroids(const double *pData, int rows, int cols, const CentroidOptions *pOptions, std::vector<StarInfo> *pStars)
+{
+   unsigned int n = pStars->size();
+   if (n == 0)
+   {
+      return;
+   }
+
+   std::vector<double> guesses(2*n);
+   for (unsigned int i=0; i<n; i++)
+   {
+      guesses[2*i] = (*pStars)[i].x;
+      guesses[2*i+1] = (*pStars)[i].y;
+   }
+
+   std::vector<Centroid> results(n);
+   MeasureCentroids(pData, rows, cols, reinterpret_cast<const double (*)[2]>(&guesses[0]), n, pOptions, &results[0]);
+
+   for (unsigned int i=0; i<n; i++)
+   {
+      if (results[i].valid)
+      {
+         (*pStars)[i].x = results[i].x;
+         (*pStars)[i].y = results[i].y;
+      }
+   }
+}
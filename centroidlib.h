@@ -0,0 +1,55 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _CENTROIDLIB_H_
+#define _CENTROIDLIB_H_
+
+#include "starlib.h"
+
+#include <vector>
+
+//How a star position is measured
+#define CENTROID_MOMENTS 0     //intensity-weighted first moments above the local background
+#define CENTROID_QUADRATIC 1   //vertex of the quadratic surface through the 3x3 pixels around the peak, in closed form
+#define CENTROID_GAUSSIAN 2    //least-squares fit of a circular 2-D Gaussian on a background
+#define CENTROID_MOFFAT 3      //least-squares fit of a circular Moffat profile on a background
+
+typedef struct _CentroidOptions CentroidOptions;
+struct _CentroidOptions
+{
+   int method;
+   int radius;            //the star is measured over the (2*radius+1)^2 box around it
+   int searchRadius;      //the guess is first moved to the brightest pixel within this many pixels
+   int maxIterations;     //of the recentring of the moments and of the least-squares fits
+};
+
+typedef struct _Centroid Centroid;
+struct _Centroid
+{
+   double x;              //column, pixel centres at integer positions
+   double y;              //row
+   double amplitude;      //peak above the background, fitted or measured
+   double background;     //median of the box border, or fitted
+   double fwhm;           //full width at half maximum in pixels, from the second moments or the fit
+   double beta;           //Moffat exponent, 0 for the other methods
+   bool valid;            //false when the box holds no signal or the fit did not converge; x and y keep the guess
+};
+
+void GetDefaultCentroidOptions(CentroidOptions *pOptions);
+
+//Measure n stars of a rows x cols image from guessed positions (column, row). Each star is independent, so the list is
+//split in bands run on the thread pool. The fits start from the moments, and stars too close to the border for the box
+//are measured over the part of it inside the image.
+void MeasureCentroids(const double *pData, int rows, int cols, const double (*pGuesses)[2], unsigned int n,
+                      const CentroidOptions *pOptions, Centroid *pResults);
+
+//Move the stars of a detection list to their measured positions; stars whose measurement fails keep their own
+void RefineStarCentroids(const double *pData, int rows, int cols, const CentroidOptions *pOptions, std::vector<StarInfo> *pStars);
+
+#endif
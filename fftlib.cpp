@@ -0,0 +1,184 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "fftlib.h"
+#include "imagelib.h"
+
+#include <algorithm>
+#include <math.h>
+#include <vector>
+
+#define MIN_FFT_BAND_ROWS 16
+#define PI 3.14159265358979323846
+
+namespace
+{
+   //Iterative radix-2 transform of n contiguous points; pCos/pSin hold the n/2 twiddle factors
+   void FFT1D(double *pRe, double *pIm, int n, const double *pCos, const double *pSin, bool bInverse)
+   {
+      //Bit-reversal permutation
+      for (int i=1, j=0; i<n; i++)
+      {
+         int bit = n >> 1;
+         for (; j & bit; bit >>= 1)
+         {
+            j ^= bit;
+         }
+         j ^= bit;
+
+         if (i < j)
+         {
+            double temp = pRe[i];
+            pRe[i] = pRe[j];
+            pRe[j] = temp;
+            temp = pIm[i];
+            pIm[i] = pIm[j];
+            pIm[j] = temp;
+         }
+      }
+
+      double sign = bInverse ? 1.0 : -1.0;
+      for (int len=2; len<=n; len<<=1)
+      {
+         int half = len >> 1;
+         int step = n/len;
+         for (int i=0; i<n; i+=len)
+         {
+            for (int k=0; k<half; k++)
+            {
+               double wr = pCos[k*step];
+               double wi = sign*pSin[k*step];
+               int a = i + k;
+               int b = a + half;
+
+               double tr = pRe[b]*wr - pIm[b]*wi;
+               double ti = pRe[b]*wi + pIm[b]*wr;
+               pRe[b] = pRe[a] - tr;
+               pIm[b] = pIm[a] - ti;
+               pRe[a] += tr;
+               pIm[a] += ti;
+            }
+         }
+      }
+   }
+
+   typedef struct _FFTBand
+   {
+      double *pRe;
+      double *pIm;
+      int rows;
+      int cols;
+      const double *pCos;
+      const double *pSin;
+      bool bInverse;
+   } FFTBand;
+
+   void rowBand(void *pContext, int startRow, int endRow)
+   {
+      const FFTBand *pBand = reinterpret_cast<const FFTBand*>(pContext);
+
+      for (int row=startRow; row<endRow; row++)
+      {
+         FFT1D(pBand->pRe + row*pBand->cols, pBand->pIm + row*pBand->cols, pBand->cols, pBand->pCos, pBand->pSin,
+               pBand->bInverse);
+      }
+   }
+
+   //Columns are gathered into a contiguous buffer so the butterflies stay in cache
+   void columnBand(void *pContext, int startCol, int endCol)
+   {
+      const FFTBand *pBand = reinterpret_cast<const FFTBand*>(pContext);
+      int rows = pBand->rows;
+      int cols = pBand->cols;
+      std::vector<double> re(rows);
+      std::vector<double> im(rows);
+
+      for (int col=startCol; col<endCol; col++)
+      {
+         for (int row=0; row<rows; row++)
+         {
+            re[row] = pBand->pRe[row*cols + col];
+            im[row] = pBand->pIm[row*cols + col];
+         }
+
+         FFT1D(&re[0], &im[0], rows, pBand->pCos, pBand->pSin, pBand->bInverse);
+
+         for (int row=0; row<rows; row++)
+         {
+            pBand->pRe[row*cols + col] = re[row];
+            pBand->pIm[row*cols + col] = im[row];
+         }
+      }
+   }
+
+   void BuildTwiddles(int n, std::vector<double> &cosTable, std::vector<double> &sinTable)
+   {
+      cosTable.resize(std::max(1, n/2));
+      sinTable.resize(std::max(1, n/2));
+      for (int k=0; k<n/2; k++)
+      {
+         cosTable[k] = cos(2*PI*k/n);
+         sinTable[k] = sin(2*PI*k/n);
+      }
+   }
+};
+
+int NextPowerOfTwo(int n)
+{
+   int nPower = 1;
+   while (nPower < n)
+   {
+      nPower <<= 1;
+   }
+
+   return nPower;
+}
+
+bool IsPowerOfTwo(int n)
+{
+   return (n > 0) && ((n & (n - 1)) == 0);
+}
+
+bool FFT2D(double *pRe, double *pIm, int rows, int cols, bool bInverse)
+{
+   if (!IsPowerOfTwo(rows) || !IsPowerOfTwo(cols))
+   {
+      return false;
+   }
+
+   FFTBand band;
+   band.pRe = pRe;
+   band.pIm = pIm;
+   band.rows = rows;
+   band.cols = cols;
+   band.bInverse = bInverse;
+
+   std::vector<double> cosTable, sinTable;
+   BuildTwiddles(cols, cosTable, sinTable);
+   band.pCos = &cosTable[0];
+   band.pSin = &sinTable[0];
+   RunRowBands(rowBand, &band, rows, MIN_FFT_BAND_ROWS);
+
+   BuildTwiddles(rows, cosTable, sinTable);
+   band.pCos = &cosTable[0];
+   band.pSin = &sinTable[0];
+   RunRowBands(columnBand, &band, cols, MIN_FFT_BAND_ROWS);
+
+   if (bInverse)
+   {
+      double scale = 1.0/(static_cast<double>(rows)*cols);
+      for (int i=0; i<rows*cols; i++)
+      {
+         pRe[i] *= scale;
+         pIm[i] *= scale;
+      }
+   }
+
+   return true;
+}
@@ -0,0 +1,22 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _FFTLIB_H_
+#define _FFTLIB_H_
+
+//Smallest power of two not below n
+int NextPowerOfTwo(int n);
+
+bool IsPowerOfTwo(int n);
+
+//In-place 2D FFT of a rows x cols complex array held as separate real and imaginary planes. Both sides must be powers
+//of two. The inverse transform is scaled by 1/(rows*cols). The row and column passes run in bands on the thread pool.
+bool FFT2D(double *pRe, double *pIm, int rows, int cols, bool bInverse);
+
+#endif
@@ -0,0 +1,1009 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "histogramlib.h"
+#include "imagelib.h"
+
+#include <QtCore/QMutex>
+
+#include <algorithm>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define MIN_HISTOGRAM_BAND_ROWS 64
+#define NARROW_BINS 256
+#define NARROW_MIN_PIXELS 4096
+#define TILE_HISTOGRAM_BINS 4096
+
+namespace
+{
+   //Consecutive pixels of smooth images often share a value. Spreading them over four sub-histograms keeps
+   //neighbouring increments off the same counter, so they do not wait on each other's store.
+   template<typename T>
+   void AccumulateNarrowKernel(const T *pData, unsigned int nPixels, int offset, unsigned int *pHisto)
+   {
+      unsigned int subHisto[4][NARROW_BINS];
+      memset(subHisto, 0, sizeof(subHisto));
+
+      unsigned int i = 0;
+      for (; i+4 <= nPixels; i += 4)
+      {
+         subHisto[0][static_cast<int>(pData[i]) + offset]++;
+         subHisto[1][static_cast<int>(pData[i+1]) + offset]++;
+         subHisto[2][static_cast<int>(pData[i+2]) + offset]++;
+         subHisto[3][static_cast<int>(pData[i+3]) + offset]++;
+      }
+      for (; i < nPixels; i++)
+      {
+         subHisto[0][static_cast<int>(pData[i]) + offset]++;
+      }
+
+      for (int bin=0; bin<NARROW_BINS; bin++)
+      {
+         pHisto[bin] += subHisto[0][bin] + subHisto[1][bin] + subHisto[2][bin] + subHisto[3][bin];
+      }
+   }
+
+   template<typename T>
+   void AccumulateWideKernel(const T *pData, unsigned int nPixels, int offset, unsigned int *pHisto)
+   {
+      for (unsigned int i=0; i<nPixels; i++)
+      {
+         pHisto[static_cast<int>(pData[i]) + offset]++;
+      }
+   }
+
+   //Bins of integer data are values shifted by offset, so mapping a pixel is a single gather
+   template<typename T>
+   void ApplyLUTKernel(const T *pSrc, T *pDst, unsigned int nPixels, int offset, const unsigned int *pLUT)
+   {
+      for (unsigned int i=0; i<nPixels; i++)
+      {
+         pDst[i] = static_cast<T>(static_cast<int>(pLUT[static_cast<int>(pSrc[i]) + offset]) - offset);
+      }
+   }
+
+   template<typename T>
+   void AccumulateBinnedKernel(const T *pData, unsigned int nPixels, double minVal, double scale, unsigned int nBins, unsigned int *pHisto)
+   {
+      for (unsigned int i=0; i<nPixels; i++)
+      {
+         double pos = (pData[i] - minVal)*scale;
+         if (!(pos >= 0.0))
+         {
+            continue;
+         }
+
+         pHisto[std::min(static_cast<unsigned int>(pos), nBins-1)]++;
+      }
+   }
+
+   template<typename T>
+   void FindRangeKernel(const T *pData, unsigned int nPixels, double *pMin, double *pMax)
+   {
+      double minVal = *pMin;
+      double maxVal = *pMax;
+
+      for (unsigned int i=0; i<nPixels; i++)
+      {
+         double val = static_cast<double>(pData[i]);
+         if (val < minVal)
+         {
+            minVal = val;
+         }
+         if (val > maxVal)
+         {
+            maxVal = val;
+         }
+      }
+
+      *pMin = minVal;
+      *pMax = maxVal;
+   }
+
+   //Piecewise-linear mapping: the edges of bin k go to the mapped edges of the LUT and a pixel is interpolated
+   //by its position inside the bin. Takes and returns positions in units of bins.
+   inline double MapBinPosition(double pos, const unsigned int *pLUT, unsigned int nBins)
+   {
+      unsigned int bin = std::min(static_cast<unsigned int>(pos), nBins-1);
+      double lowEdge = (bin == 0) ? 0.0 : pLUT[bin-1] + 1.0;
+      double highEdge = pLUT[bin] + 1.0;
+      double frac = std::min(pos - bin, 1.0);
+
+      return lowEdge + frac*(highEdge - lowEdge);
+   }
+
+   //Values are clamped to the input range so integer output cannot overflow
+   template<typename T>
+   void ApplyBinnedKernel(const T *pSrc, T *pDst, unsigned int nPixels, const HistogramBinning *pBinning, const unsigned int *pLUT,
+                          bool roundOutput)
+   {
+      double scale = 1.0/pBinning->binWidth;
+      double maxVal = pBinning->minVal + pBinning->nBins*pBinning->binWidth;
+
+      for (unsigned int i=0; i<nPixels; i++)
+      {
+         double pos = (pSrc[i] - pBinning->minVal)*scale;
+         if (!(pos >= 0.0))
+         {
+            pDst[i] = pSrc[i];
+            continue;
+         }
+
+         double val = pBinning->minVal + MapBinPosition(pos, pLUT, pBinning->nBins)*pBinning->binWidth;
+         val = std::min(std::max(val, pBinning->minVal), maxVal);
+         if (roundOutput)
+         {
+            val = floor(val + 0.5);
+         }
+
+         pDst[i] = static_cast<T>(val);
+      }
+   }
+
+   //Blend the mappings of the four tiles whose centres surround each pixel. Integer pixels are taken to cover
+   //[v, v+1) so that they land in the middle of their bin rather than on its lower edge.
+   template<typename T>
+   void ApplyTiledKernel(const T *pSrc, T *pDst, unsigned int row, const TiledHistogram *pTiles, const unsigned int *pTileX0,
+                         const unsigned int *pTileX1, const double *pWeightX, bool integerData, double lowVal, double highVal)
+   {
+      const HistogramBinning *pBinning = &pTiles->binning;
+      unsigned int nBins = pBinning->nBins;
+      double scale = 1.0/pBinning->binWidth;
+      double half = integerData ? 0.5 : 0.0;
+
+      double centreY = (row + 0.5)*pTiles->tilesDown/pTiles->imageRows - 0.5;
+      unsigned int tileY0 = (centreY <= 0.0) ? 0 : static_cast<unsigned int>(centreY);
+      unsigned int tileY1 = std::min(tileY0 + 1, pTiles->tilesDown - 1);
+      double weightY = std::min(std::max(centreY - tileY0, 0.0), 1.0);
+
+      const unsigned int *pLUTRow0 = pTiles->pLUT + tileY0*pTiles->tilesAcross*nBins;
+      const unsigned int *pLUTRow1 = pTiles->pLUT + tileY1*pTiles->tilesAcross*nBins;
+
+      for (unsigned int col=0; col<pTiles->imageCols; col++)
+      {
+         double pos = (pSrc[col] + half - pBinning->minVal)*scale;
+         if (!(pos >= 0.0))
+         {
+            pDst[col] = pSrc[col];
+            continue;
+         }
+
+         unsigned int offset0 = pTileX0[col]*nBins;
+         unsigned int offset1 = pTileX1[col]*nBins;
+         double weightX = pWeightX[col];
+
+         double top = (1.0-weightX)*MapBinPosition(pos, pLUTRow0 + offset0, nBins) + weightX*MapBinPosition(pos, pLUTRow0 + offset1, nBins);
+         double bottom = (1.0-weightX)*MapBinPosition(pos, pLUTRow1 + offset0, nBins) + weightX*MapBinPosition(pos, pLUTRow1 + offset1, nBins);
+
+         double val = pBinning->minVal + ((1.0-weightY)*top + weightY*bottom)*pBinning->binWidth - half;
+         val = std::min(std::max(val, lowVal), highVal);
+         if (integerData)
+         {
+            val = floor(val + 0.5);
+         }
+
+         pDst[col] = static_cast<T>(val);
+      }
+   }
+
+   typedef struct _HistogramBand
+   {
+      const unsigned char *pData;
+      unsigned int rowBytes;
+      unsigned int cols;
+      const HistogramBinning *pBinning;
+      unsigned int *pHisto;
+      QMutex *pMutex;
+   } HistogramBand;
+
+   void accumulateBand(void *pContext, int startRow, int endRow)
+   {
+      HistogramBand *pBand = reinterpret_cast<HistogramBand*>(pContext);
+      unsigned int nBins = pBand->pBinning->nBins;
+
+      unsigned int *pPrivate = (unsigned int *)calloc(sizeof(unsigned int), nBins);
+      if (pPrivate == NULL)
+      {
+         return;
+      }
+
+      //Rows are contiguous in the block, so the whole band is one run of pixels
+      AccumulateHistogram(pBand->pData + startRow*pBand->rowBytes, (endRow-startRow)*pBand->cols, pBand->pBinning, pPrivate);
+
+      pBand->pMutex->lock();
+      for (unsigned int bin=0; bin<nBins; bin++)
+      {
+         pBand->pHisto[bin] += pPrivate[bin];
+      }
+      pBand->pMutex->unlock();
+
+      free(pPrivate);
+   }
+
+   typedef struct _LUTBand
+   {
+      const unsigned char *pSrc;
+      unsigned char *pDst;
+      unsigned int rowBytes;
+      unsigned int cols;
+      const HistogramBinning *pBinning;
+      const unsigned int *pLUT;
+   } LUTBand;
+
+   void applyLUTBand(void *pContext, int startRow, int endRow)
+   {
+      LUTBand *pBand = reinterpret_cast<LUTBand*>(pContext);
+      const unsigned char *pSrc = pBand->pSrc + startRow*pBand->rowBytes;
+      unsigned char *pDst = pBand->pDst + startRow*pBand->rowBytes;
+      unsigned int nPixels = (endRow-startRow)*pBand->cols;
+      int offset = -static_cast<int>(pBand->pBinning->minVal);
+
+      switch (pBand->pBinning->type)
+      {
+      case INT1UBYTE:
+         ApplyLUTKernel(reinterpret_cast<const unsigned char*>(pSrc), reinterpret_cast<unsigned char*>(pDst), nPixels, offset, pBand->pLUT);
+         break;
+      case INT1SBYTE:
+         ApplyLUTKernel(reinterpret_cast<const signed char*>(pSrc), reinterpret_cast<signed char*>(pDst), nPixels, offset, pBand->pLUT);
+         break;
+      case INT2UBYTES:
+         ApplyLUTKernel(reinterpret_cast<const unsigned short*>(pSrc), reinterpret_cast<unsigned short*>(pDst), nPixels, offset, pBand->pLUT);
+         break;
+      case INT2SBYTES:
+         ApplyLUTKernel(reinterpret_cast<const signed short*>(pSrc), reinterpret_cast<signed short*>(pDst), nPixels, offset, pBand->pLUT);
+         break;
+      case INT4SBYTES:
+         ApplyBinnedKernel(reinterpret_cast<const int*>(pSrc), reinterpret_cast<int*>(pDst), nPixels, pBand->pBinning, pBand->pLUT, true);
+         break;
+      case INT4UBYTES:
+         ApplyBinnedKernel(reinterpret_cast<const unsigned int*>(pSrc), reinterpret_cast<unsigned int*>(pDst), nPixels, pBand->pBinning, pBand->pLUT, true);
+         break;
+      case FLT4BYTES:
+         ApplyBinnedKernel(reinterpret_cast<const float*>(pSrc), reinterpret_cast<float*>(pDst), nPixels, pBand->pBinning, pBand->pLUT, false);
+         break;
+      case FLT8BYTES:
+         ApplyBinnedKernel(reinterpret_cast<const double*>(pSrc), reinterpret_cast<double*>(pDst), nPixels, pBand->pBinning, pBand->pLUT, false);
+         break;
+      default:
+         break;
+      }
+   }
+
+   typedef struct _TileColumnBand
+   {
+      const unsigned char *pData;
+      unsigned int startRow;
+      unsigned int nRows;
+      unsigned int bytesPerElement;
+      TiledHistogram *pTiles;
+   } TileColumnBand;
+
+   //Each band owns whole tile columns, so no two threads ever touch the same tile histogram
+   void accumulateTileColumns(void *pContext, int startTile, int endTile)
+   {
+      TileColumnBand *pBand = reinterpret_cast<TileColumnBand*>(pContext);
+      TiledHistogram *pTiles = pBand->pTiles;
+      unsigned int nBins = pTiles->binning.nBins;
+      unsigned int rowBytes = pTiles->imageCols*pBand->bytesPerElement;
+
+      for (unsigned int i=0; i<pBand->nRows; i++)
+      {
+         unsigned int row = pBand->startRow + i;
+         unsigned int tileY = row*pTiles->tilesDown/pTiles->imageRows;
+         const unsigned char *pRow = pBand->pData + i*rowBytes;
+
+         for (int tileX = startTile; tileX < endTile; tileX++)
+         {
+            unsigned int startCol = tileX*pTiles->imageCols/pTiles->tilesAcross;
+            unsigned int endCol = (tileX+1)*pTiles->imageCols/pTiles->tilesAcross;
+            unsigned int *pHisto = pTiles->pHisto + (tileY*pTiles->tilesAcross + tileX)*nBins;
+
+            AccumulateHistogram(pRow + startCol*pBand->bytesPerElement, endCol - startCol, &pTiles->binning, pHisto);
+         }
+      }
+   }
+
+   typedef struct _TileReshape
+   {
+      TiledHistogram *pTiles;
+      double meanVal;
+      double sigma;
+      double clipLimit;
+   } TileReshape;
+
+   //Clip every bin at clipLimit times the mean bin count and spread the excess evenly over all bins
+   void ClipHistogram(unsigned int *pHisto, unsigned int nBins, unsigned int nPixels, double clipLimit)
+   {
+      unsigned int limit = std::max(1u, static_cast<unsigned int>(clipLimit*nPixels/nBins));
+      unsigned int excess = 0;
+      unsigned int bin;
+
+      for (bin=0; bin<nBins; bin++)
+      {
+         if (pHisto[bin] > limit)
+         {
+            excess += pHisto[bin] - limit;
+            pHisto[bin] = limit;
+         }
+      }
+
+      unsigned int increment = excess/nBins;
+      unsigned int remainder = excess%nBins;
+      for (bin=0; bin<nBins; bin++)
+      {
+         pHisto[bin] += increment;
+      }
+      if (remainder > 0)
+      {
+         unsigned int step = nBins/remainder;
+         for (bin=0; (bin<nBins) && (remainder>0); bin += step, remainder--)
+         {
+            pHisto[bin]++;
+         }
+      }
+   }
+
+   void reshapeTiles(void *pContext, int startTile, int endTile)
+   {
+      TileReshape *pReshape = reinterpret_cast<TileReshape*>(pContext);
+      TiledHistogram *pTiles = pReshape->pTiles;
+      unsigned int nBins = pTiles->binning.nBins;
+
+      double *pTarget = (double *)malloc(nBins*sizeof(double));
+      if (pTarget == NULL)
+      {
+         return;
+      }
+
+      for (int tile = startTile; tile < endTile; tile++)
+      {
+         unsigned int *pHisto = pTiles->pHisto + tile*nBins;
+         if (pReshape->clipLimit > 0.0)
+         {
+            unsigned int nPixels = 0;
+            for (unsigned int bin=0; bin<nBins; bin++)
+            {
+               nPixels += pHisto[bin];
+            }
+            ClipHistogram(pHisto, nBins, nPixels, pReshape->clipLimit);
+         }
+
+         HistogramReshape(pHisto, pTarget, pTiles->pLUT + tile*nBins, nBins, pReshape->meanVal, pReshape->sigma);
+      }
+
+      free(pTarget);
+   }
+
+   typedef struct _TiledLUTBand
+   {
+      const unsigned char *pSrc;
+      unsigned char *pDst;
+      unsigned int startRow;
+      unsigned int bytesPerElement;
+      const TiledHistogram *pTiles;
+   } TiledLUTBand;
+
+   void applyTiledBand(void *pContext, int startRow, int endRow)
+   {
+      TiledLUTBand *pBand = reinterpret_cast<TiledLUTBand*>(pContext);
+      const TiledHistogram *pTiles = pBand->pTiles;
+      unsigned int cols = pTiles->imageCols;
+      unsigned int rowBytes = cols*pBand->bytesPerElement;
+
+      unsigned int *pTileX0 = (unsigned int *)malloc(cols*sizeof(unsigned int));
+      unsigned int *pTileX1 = (unsigned int *)malloc(cols*sizeof(unsigned int));
+      double *pWeightX = (double *)malloc(cols*sizeof(double));
+      if ((pTileX0 == NULL) || (pTileX1 == NULL) || (pWeightX == NULL))
+      {
+         free(pTileX0);
+         free(pTileX1);
+         free(pWeightX);
+         return;
+      }
+
+      //Horizontal tile neighbours and weights are the same for every row
+      for (unsigned int col=0; col<cols; col++)
+      {
+         double centreX = (col + 0.5)*pTiles->tilesAcross/cols - 0.5;
+         pTileX0[col] = (centreX <= 0.0) ? 0 : static_cast<unsigned int>(centreX);
+         pTileX1[col] = std::min(pTileX0[col] + 1, pTiles->tilesAcross - 1);
+         pWeightX[col] = std::min(std::max(centreX - pTileX0[col], 0.0), 1.0);
+      }
+
+      EncodingType type = pTiles->binning.type;
+      bool integerData = (type != FLT4BYTES) && (type != FLT8BYTES);
+      double lowVal = pTiles->binning.minVal;
+      double highVal = pTiles->binning.minVal + pTiles->binning.nBins*pTiles->binning.binWidth;
+      if (HasFixedGrayScale(type))
+      {
+         GetTypeRange(type, &lowVal, &highVal);
+      }
+
+      for (int i = startRow; i < endRow; i++)
+      {
+         const unsigned char *pSrc = pBand->pSrc + i*rowBytes;
+         unsigned char *pDst = pBand->pDst + i*rowBytes;
+         unsigned int row = pBand->startRow + i;
+
+         switch (type)
+         {
+         case INT1UBYTE:
+            ApplyTiledKernel(reinterpret_cast<const unsigned char*>(pSrc), reinterpret_cast<unsigned char*>(pDst), row, pTiles, pTileX0, pTileX1, pWeightX, integerData, lowVal, highVal);
+            break;
+         case INT1SBYTE:
+            ApplyTiledKernel(reinterpret_cast<const signed char*>(pSrc), reinterpret_cast<signed char*>(pDst), row, pTiles, pTileX0, pTileX1, pWeightX, integerData, lowVal, highVal);
+            break;
+         case INT2UBYTES:
+            ApplyTiledKernel(reinterpret_cast<const unsigned short*>(pSrc), reinterpret_cast<unsigned short*>(pDst), row, pTiles, pTileX0, pTileX1, pWeightX, integerData, lowVal, highVal);
+            break;
+         case INT2SBYTES:
+            ApplyTiledKernel(reinterpret_cast<const signed short*>(pSrc), reinterpret_cast<signed short*>(pDst), row, pTiles, pTileX0, pTileX1, pWeightX, integerData, lowVal, highVal);
+            break;
+         case INT4SBYTES:
+            ApplyTiledKernel(reinterpret_cast<const int*>(pSrc), reinterpret_cast<int*>(pDst), row, pTiles, pTileX0, pTileX1, pWeightX, integerData, lowVal, highVal);
+            break;
+         case INT4UBYTES:
+            ApplyTiledKernel(reinterpret_cast<const unsigned int*>(pSrc), reinterpret_cast<unsigned int*>(pDst), row, pTiles, pTileX0, pTileX1, pWeightX, integerData, lowVal, highVal);
+            break;
+         case FLT4BYTES:
+            ApplyTiledKernel(reinterpret_cast<const float*>(pSrc), reinterpret_cast<float*>(pDst), row, pTiles, pTileX0, pTileX1, pWeightX, integerData, lowVal, highVal);
+            break;
+         case FLT8BYTES:
+            ApplyTiledKernel(reinterpret_cast<const double*>(pSrc), reinterpret_cast<double*>(pDst), row, pTiles, pTileX0, pTileX1, pWeightX, integerData, lowVal, highVal);
+            break;
+         default:
+            break;
+         }
+      }
+
+      free(pTileX0);
+      free(pTileX1);
+      free(pWeightX);
+   }
+
+   template<typename T>
+   void AddLuminanceKernel(const T *pPlane, unsigned int nPixels, double weight, double *pLum)
+   {
+      for (unsigned int i=0; i<nPixels; i++)
+      {
+         pLum[i] += weight*pPlane[i];
+      }
+   }
+
+   //Scale a band by the gain applied to the luminance so that band ratios, hence colours, are kept.
+   //Non-positive luminance has no meaningful ratio and is shifted instead.
+   template<typename T>
+   void ScaleBandKernel(const T *pIn, T *pOut, unsigned int nPixels, const double *pLum, const double *pMappedLum,
+                        double lowVal, double highVal, bool roundOutput)
+   {
+      for (unsigned int i=0; i<nPixels; i++)
+      {
+         double val = (pLum[i] > 0.0) ? pIn[i]*pMappedLum[i]/pLum[i] : pIn[i] + (pMappedLum[i] - pLum[i]);
+         val = std::min(std::max(val, lowVal), highVal);
+         if (roundOutput)
+         {
+            val = floor(val + 0.5);
+         }
+
+         pOut[i] = static_cast<T>(val);
+      }
+   }
+
+   typedef struct _LuminanceBand
+   {
+      const BandShaping *pShaping;
+      const unsigned char *pPlanes;
+      unsigned char *pOutPlanes;
+      unsigned int nPixels;
+      const double *pLum;
+      const double *pMappedLum;
+   } LuminanceBand;
+
+   void scaleLuminanceBand(void *pContext, int startRow, int endRow)
+   {
+      LuminanceBand *pBand = reinterpret_cast<LuminanceBand*>(pContext);
+      const BandShaping *pShaping = pBand->pShaping;
+      EncodingType type = pShaping->binning.type;
+      unsigned int bytesPerElement = pShaping->bytesPerElement;
+      unsigned int offset = startRow*pShaping->cols;
+      unsigned int nPixels = (endRow-startRow)*pShaping->cols;
+
+      double lowVal;
+      double highVal;
+      GetTypeRange(type, &lowVal, &highVal);
+      bool roundOutput = (type != FLT4BYTES) && (type != FLT8BYTES);
+
+      const double *pLum = pBand->pLum + offset;
+      const double *pMappedLum = pBand->pMappedLum + offset;
+
+      for (unsigned int band=0; band<pShaping->nBands; band++)
+      {
+         const unsigned char *pIn = pBand->pPlanes + (band*pBand->nPixels + offset)*bytesPerElement;
+         unsigned char *pOut = pBand->pOutPlanes + (band*pBand->nPixels + offset)*bytesPerElement;
+
+         switch (type)
+         {
+         case INT1UBYTE:
+            ScaleBandKernel(reinterpret_cast<const unsigned char*>(pIn), reinterpret_cast<unsigned char*>(pOut), nPixels, pLum, pMappedLum, lowVal, highVal, roundOutput);
+            break;
+         case INT1SBYTE:
+            ScaleBandKernel(reinterpret_cast<const signed char*>(pIn), reinterpret_cast<signed char*>(pOut), nPixels, pLum, pMappedLum, lowVal, highVal, roundOutput);
+            break;
+         case INT2UBYTES:
+            ScaleBandKernel(reinterpret_cast<const unsigned short*>(pIn), reinterpret_cast<unsigned short*>(pOut), nPixels, pLum, pMappedLum, lowVal, highVal, roundOutput);
+            break;
+         case INT2SBYTES:
+            ScaleBandKernel(reinterpret_cast<const signed short*>(pIn), reinterpret_cast<signed short*>(pOut), nPixels, pLum, pMappedLum, lowVal, highVal, roundOutput);
+            break;
+         case INT4SBYTES:
+            ScaleBandKernel(reinterpret_cast<const int*>(pIn), reinterpret_cast<int*>(pOut), nPixels, pLum, pMappedLum, lowVal, highVal, roundOutput);
+            break;
+         case INT4UBYTES:
+            ScaleBandKernel(reinterpret_cast<const unsigned int*>(pIn), reinterpret_cast<unsigned int*>(pOut), nPixels, pLum, pMappedLum, lowVal, highVal, roundOutput);
+            break;
+         case FLT4BYTES:
+            ScaleBandKernel(reinterpret_cast<const float*>(pIn), reinterpret_cast<float*>(pOut), nPixels, pLum, pMappedLum, lowVal, highVal, roundOutput);
+            break;
+         case FLT8BYTES:
+            ScaleBandKernel(reinterpret_cast<const double*>(pIn), reinterpret_cast<double*>(pOut), nPixels, pLum, pMappedLum, lowVal, highVal, roundOutput);
+            break;
+         default:
+            break;
+         }
+      }
+   }
+};
+
+bool GetIntegerBinning(EncodingType type, HistogramBinning *pBinning)
+{
+   if (!HasFixedGrayScale(type))
+   {
+      return false;
+   }
+
+   double maxVal;
+   GetTypeRange(type, &pBinning->minVal, &maxVal);
+
+   pBinning->type = type;
+   pBinning->nBins = static_cast<unsigned int>(maxVal - pBinning->minVal) + 1;
+   pBinning->binWidth = 1.0;
+
+   return true;
+}
+
+bool HasDataBinning(EncodingType type)
+{
+   return (type == INT4SBYTES) || (type == INT4UBYTES) || (type == FLT4BYTES) || (type == FLT8BYTES);
+}
+
+void FindDataRange(const void *pData, unsigned int nPixels, EncodingType type, double *pMin, double *pMax)
+{
+   switch (type)
+   {
+   case INT4SBYTES:
+      FindRangeKernel(reinterpret_cast<const int*>(pData), nPixels, pMin, pMax);
+      break;
+   case INT4UBYTES:
+      FindRangeKernel(reinterpret_cast<const unsigned int*>(pData), nPixels, pMin, pMax);
+      break;
+   case FLT4BYTES:
+      FindRangeKernel(reinterpret_cast<const float*>(pData), nPixels, pMin, pMax);
+      break;
+   case FLT8BYTES:
+      FindRangeKernel(reinterpret_cast<const double*>(pData), nPixels, pMin, pMax);
+      break;
+   default:
+      break;
+   }
+}
+
+void GetDataBinning(EncodingType type, double minVal, double maxVal, HistogramBinning *pBinning)
+{
+   //No valid pixel at all, or a constant image: one populated bin is all there is to map
+   if (maxVal < minVal)
+   {
+      minVal = maxVal = 0.0;
+   }
+
+   pBinning->type = type;
+   pBinning->nBins = FLOAT_HISTOGRAM_BINS;
+   pBinning->minVal = minVal;
+   pBinning->binWidth = (maxVal > minVal) ? (maxVal - minVal)/FLOAT_HISTOGRAM_BINS : 1.0;
+}
+
+void AccumulateHistogram(const void *pData, unsigned int nPixels, const HistogramBinning *pBinning, unsigned int *pHisto)
+{
+   int offset = -static_cast<int>(pBinning->minVal);
+   double scale = 1.0/pBinning->binWidth;
+   bool unitBins = (pBinning->binWidth == 1.0);
+
+   switch (pBinning->type)
+   {
+   case INT1UBYTE:
+      if (unitBins && (nPixels >= NARROW_MIN_PIXELS))
+      {
+         AccumulateNarrowKernel(reinterpret_cast<const unsigned char*>(pData), nPixels, offset, pHisto);
+      }
+      else
+      {
+         AccumulateWideKernel(reinterpret_cast<const unsigned char*>(pData), nPixels, offset, pHisto);
+      }
+      break;
+   case INT1SBYTE:
+      if (unitBins && (nPixels >= NARROW_MIN_PIXELS))
+      {
+         AccumulateNarrowKernel(reinterpret_cast<const signed char*>(pData), nPixels, offset, pHisto);
+      }
+      else
+      {
+         AccumulateWideKernel(reinterpret_cast<const signed char*>(pData), nPixels, offset, pHisto);
+      }
+      break;
+   case INT2UBYTES:
+      if (unitBins)
+      {
+         AccumulateWideKernel(reinterpret_cast<const unsigned short*>(pData), nPixels, offset, pHisto);
+      }
+      else
+      {
+         AccumulateBinnedKernel(reinterpret_cast<const unsigned short*>(pData), nPixels, pBinning->minVal, scale, pBinning->nBins, pHisto);
+      }
+      break;
+   case INT2SBYTES:
+      if (unitBins)
+      {
+         AccumulateWideKernel(reinterpret_cast<const signed short*>(pData), nPixels, offset, pHisto);
+      }
+      else
+      {
+         AccumulateBinnedKernel(reinterpret_cast<const signed short*>(pData), nPixels, pBinning->minVal, scale, pBinning->nBins, pHisto);
+      }
+      break;
+   case INT4SBYTES:
+      AccumulateBinnedKernel(reinterpret_cast<const int*>(pData), nPixels, pBinning->minVal, scale, pBinning->nBins, pHisto);
+      break;
+   case INT4UBYTES:
+      AccumulateBinnedKernel(reinterpret_cast<const unsigned int*>(pData), nPixels, pBinning->minVal, scale, pBinning->nBins, pHisto);
+      break;
+   case FLT4BYTES:
+      AccumulateBinnedKernel(reinterpret_cast<const float*>(pData), nPixels, pBinning->minVal, scale, pBinning->nBins, pHisto);
+      break;
+   case FLT8BYTES:
+      AccumulateBinnedKernel(reinterpret_cast<const double*>(pData), nPixels, pBinning->minVal, scale, pBinning->nBins, pHisto);
+      break;
+   default:
+      break;
+   }
+}
+
+void BuildHistogram(const void *pData, unsigned int rows, unsigned int cols, unsigned int bytesPerElement,
+                    const HistogramBinning *pBinning, unsigned int *pHisto)
+{
+   QMutex mutex;
+
+   HistogramBand band;
+   band.pData = reinterpret_cast<const unsigned char*>(pData);
+   band.rowBytes = cols*bytesPerElement;
+   band.cols = cols;
+   band.pBinning = pBinning;
+   band.pHisto = pHisto;
+   band.pMutex = &mutex;
+
+   RunRowBands(accumulateBand, &band, rows, MIN_HISTOGRAM_BAND_ROWS);
+}
+
+double GetHistogramPeak(const unsigned int *pHisto, unsigned int nBins)
+{
+   unsigned int peakBin = 0;
+
+   for (unsigned int bin=1; bin<nBins; bin++)
+   {
+      if (pHisto[bin] > pHisto[peakBin])
+      {
+         peakBin = bin;
+      }
+   }
+
+   return static_cast<double>(peakBin)/(nBins-1);
+}
+
+void CumulateHistogram(const unsigned int *pHisto, unsigned int *pCdf, unsigned int nBins)
+{
+   unsigned int histoSum = 0;
+
+   for (unsigned int pv = 0; pv < nBins; pv++)
+   {
+      histoSum = histoSum + pHisto[pv];
+      pCdf[pv] = histoSum;
+   }
+}
+
+void HistogramReshapeCdf(const unsigned int *pCdf, double *pTarget, unsigned int *pLUT, unsigned int nBins, double meanVal, double sigma)
+{
+   double targetSum = 0;
+   double pvMax = static_cast<double>(std::max(nBins-1, 1u));
+   unsigned int pv;
+
+   for (pv = 0; pv < nBins; pv++)
+   {
+      double val = (pv/pvMax - meanVal)/sigma;
+      targetSum = targetSum + exp(-val*val/2);
+      pTarget[pv] = targetSum;
+   }
+
+   double ratio = pCdf[nBins-1]/targetSum;
+   for (pv = 0; pv < nBins; pv++)
+   {
+      pTarget[pv] = ratio*pTarget[pv];
+   }
+
+   unsigned int pvNew = 0;
+   for (pv = 0; pv < nBins; pv++)
+   {
+      while ((pvNew < nBins-1) && (pTarget[pvNew] < pCdf[pv]))
+      {
+         pvNew++;
+      }
+
+      pLUT[pv] = pvNew;
+   }
+}
+
+void HistogramReshape(unsigned int *pHisto, double *pTarget, unsigned int *pLUT, unsigned int nBins, double meanVal, double sigma)
+{
+   CumulateHistogram(pHisto, pHisto, nBins);
+   HistogramReshapeCdf(pHisto, pTarget, pLUT, nBins, meanVal, sigma);
+}
+
+void MappedHistogram(const unsigned int *pCdf, const unsigned int *pLUT, unsigned int nBins, unsigned int *pMapped)
+{
+   memset(pMapped, 0, nBins*sizeof(unsigned int));
+
+   unsigned int previous = 0;
+   for (unsigned int pv = 0; pv < nBins; pv++)
+   {
+      pMapped[pLUT[pv]] += pCdf[pv] - previous;
+      previous = pCdf[pv];
+   }
+}
+
+void ApplyHistogramLUT(const void *pSrc, void *pDst, unsigned int rows, unsigned int cols, unsigned int bytesPerElement,
+                       const HistogramBinning *pBinning, const unsigned int *pLUT)
+{
+   LUTBand band;
+   band.pSrc = reinterpret_cast<const unsigned char*>(pSrc);
+   band.pDst = reinterpret_cast<unsigned char*>(pDst);
+   band.rowBytes = cols*bytesPerElement;
+   band.cols = cols;
+   band.pBinning = pBinning;
+   band.pLUT = pLUT;
+
+   RunRowBands(applyLUTBand, &band, rows, MIN_HISTOGRAM_BAND_ROWS);
+}
+
+bool CreateTiledHistogram(const HistogramBinning *pBinning, unsigned int rows, unsigned int cols, unsigned int tilesAcross,
+                          TiledHistogram *pTiles)
+{
+   //Tiles share the value range of the whole image, with fewer bins so that each one still holds a few pixels
+   pTiles->binning = *pBinning;
+   pTiles->binning.nBins = std::min(pBinning->nBins, static_cast<unsigned int>(TILE_HISTOGRAM_BINS));
+   pTiles->binning.binWidth = pBinning->nBins*pBinning->binWidth/pTiles->binning.nBins;
+
+   pTiles->imageRows = rows;
+   pTiles->imageCols = cols;
+   pTiles->tilesAcross = std::max(1u, std::min(tilesAcross, cols));
+   pTiles->tilesDown = static_cast<unsigned int>(floor(static_cast<double>(pTiles->tilesAcross)*rows/cols + 0.5));
+   pTiles->tilesDown = std::max(1u, std::min(pTiles->tilesDown, rows));
+
+   unsigned int nEntries = pTiles->tilesDown*pTiles->tilesAcross*pTiles->binning.nBins;
+   pTiles->pHisto = (unsigned int *)calloc(sizeof(unsigned int), nEntries);
+   pTiles->pLUT = (unsigned int *)calloc(sizeof(unsigned int), nEntries);
+   if ((pTiles->pHisto == NULL) || (pTiles->pLUT == NULL))
+   {
+      ReleaseTiledHistogram(pTiles);
+      return false;
+   }
+
+   return true;
+}
+
+void AccumulateTiledHistogram(const void *pData, unsigned int startRow, unsigned int nRows, unsigned int bytesPerElement,
+                              TiledHistogram *pTiles)
+{
+   TileColumnBand band;
+   band.pData = reinterpret_cast<const unsigned char*>(pData);
+   band.startRow = startRow;
+   band.nRows = nRows;
+   band.bytesPerElement = bytesPerElement;
+   band.pTiles = pTiles;
+
+   RunRowBands(accumulateTileColumns, &band, pTiles->tilesAcross, 1);
+}
+
+void ReshapeTiles(TiledHistogram *pTiles, double meanVal, double sigma, double clipLimit)
+{
+   TileReshape reshape;
+   reshape.pTiles = pTiles;
+   reshape.meanVal = meanVal;
+   reshape.sigma = sigma;
+   reshape.clipLimit = clipLimit;
+
+   RunRowBands(reshapeTiles, &reshape, pTiles->tilesDown*pTiles->tilesAcross, 1);
+}
+
+void ApplyTiledLUT(const void *pSrc, void *pDst, unsigned int startRow, unsigned int nRows, unsigned int bytesPerElement,
+                   const TiledHistogram *pTiles)
+{
+   TiledLUTBand band;
+   band.pSrc = reinterpret_cast<const unsigned char*>(pSrc);
+   band.pDst = reinterpret_cast<unsigned char*>(pDst);
+   band.startRow = startRow;
+   band.bytesPerElement = bytesPerElement;
+   band.pTiles = pTiles;
+
+   RunRowBands(applyTiledBand, &band, nRows, MIN_HISTOGRAM_BAND_ROWS);
+}
+
+void ReleaseTiledHistogram(TiledHistogram *pTiles)
+{
+   free(pTiles->pHisto);
+   free(pTiles->pLUT);
+   pTiles->pHisto = NULL;
+   pTiles->pLUT = NULL;
+}
+
+void GetLuminanceBinning(const HistogramBinning *pBinning, HistogramBinning *pLumBinning)
+{
+   *pLumBinning = *pBinning;
+   pLumBinning->type = FLT8BYTES;
+
+   //Unshifted, a double on an integer bin edge would map to the lower edge of its bin, LUT[v-1]+1 rather than LUT[v]
+   if (HasFixedGrayScale(pBinning->type))
+   {
+      pLumBinning->minVal -= 0.5;
+   }
+}
+
+void ComputeLuminance(const void *pPlanes, EncodingType type, unsigned int nPixels, unsigned int nBands, double *pLum)
+{
+   const unsigned char *pData = reinterpret_cast<const unsigned char*>(pPlanes);
+   unsigned int planeBytes = nPixels*GetTypeSize(type);
+   double weight = 1.0/nBands;
+
+   memset(pLum, 0, nPixels*sizeof(double));
+   for (unsigned int band=0; band<nBands; band++)
+   {
+      const unsigned char *pPlane = pData + band*planeBytes;
+
+      switch (type)
+      {
+      case INT1UBYTE:
+         AddLuminanceKernel(reinterpret_cast<const unsigned char*>(pPlane), nPixels, weight, pLum);
+         break;
+      case INT1SBYTE:
+         AddLuminanceKernel(reinterpret_cast<const signed char*>(pPlane), nPixels, weight, pLum);
+         break;
+      case INT2UBYTES:
+         AddLuminanceKernel(reinterpret_cast<const unsigned short*>(pPlane), nPixels, weight, pLum);
+         break;
+      case INT2SBYTES:
+         AddLuminanceKernel(reinterpret_cast<const signed short*>(pPlane), nPixels, weight, pLum);
+         break;
+      case INT4SBYTES:
+         AddLuminanceKernel(reinterpret_cast<const int*>(pPlane), nPixels, weight, pLum);
+         break;
+      case INT4UBYTES:
+         AddLuminanceKernel(reinterpret_cast<const unsigned int*>(pPlane), nPixels, weight, pLum);
+         break;
+      case FLT4BYTES:
+         AddLuminanceKernel(reinterpret_cast<const float*>(pPlane), nPixels, weight, pLum);
+         break;
+      case FLT8BYTES:
+         AddLuminanceKernel(reinterpret_cast<const double*>(pPlane), nPixels, weight, pLum);
+         break;
+      default:
+         break;
+      }
+   }
+}
+
+void BuildBandHistograms(const HistogramBinning *pBinning, unsigned int nBands, const void *pPlanes, unsigned int rows,
+                         unsigned int cols, double *pLum, unsigned int *pHistos)
+{
+   const unsigned char *pData = reinterpret_cast<const unsigned char*>(pPlanes);
+   unsigned int bytesPerElement = GetTypeSize(pBinning->type);
+   unsigned int nPixels = rows*cols;
+
+   for (unsigned int band=0; band<nBands; band++)
+   {
+      BuildHistogram(pData + band*nPixels*bytesPerElement, rows, cols, bytesPerElement, pBinning, pHistos + band*pBinning->nBins);
+   }
+
+   if (nBands > 1)
+   {
+      HistogramBinning lumBinning;
+      GetLuminanceBinning(pBinning, &lumBinning);
+
+      ComputeLuminance(pPlanes, pBinning->type, nPixels, nBands, pLum);
+      BuildHistogram(pLum, rows, cols, sizeof(double), &lumBinning, pHistos + nBands*pBinning->nBins);
+   }
+}
+
+unsigned int GetChannelCount(const BandShaping *pShaping)
+{
+   return pShaping->linked ? 1 : pShaping->nBands;
+}
+
+void AccumulateTiledBands(const BandShaping *pShaping, const void *pPlanes, unsigned int startRow, unsigned int nRows, double *pLum)
+{
+   const unsigned char *pData = reinterpret_cast<const unsigned char*>(pPlanes);
+   unsigned int nPixels = nRows*pShaping->cols;
+
+   if (pShaping->linked)
+   {
+      ComputeLuminance(pPlanes, pShaping->binning.type, nPixels, pShaping->nBands, pLum);
+      AccumulateTiledHistogram(pLum, startRow, nRows, sizeof(double), &pShaping->pTiles[0]);
+      return;
+   }
+
+   for (unsigned int band=0; band<pShaping->nBands; band++)
+   {
+      AccumulateTiledHistogram(pData + band*nPixels*pShaping->bytesPerElement, startRow, nRows, pShaping->bytesPerElement,
+                               &pShaping->pTiles[band]);
+   }
+}
+
+void ShapeBands(const BandShaping *pShaping, const void *pPlanes, void *pOutPlanes, unsigned int startRow, unsigned int nRows,
+                double *pLum, double *pMappedLum)
+{
+   const unsigned char *pData = reinterpret_cast<const unsigned char*>(pPlanes);
+   unsigned char *pOut = reinterpret_cast<unsigned char*>(pOutPlanes);
+   unsigned int nPixels = nRows*pShaping->cols;
+   unsigned int nBins = pShaping->binning.nBins;
+
+   if (pShaping->linked)
+   {
+      ComputeLuminance(pPlanes, pShaping->binning.type, nPixels, pShaping->nBands, pLum);
+      if (pShaping->pTiles != NULL)
+      {
+         ApplyTiledLUT(pLum, pMappedLum, startRow, nRows, sizeof(double), &pShaping->pTiles[0]);
+      }
+      else
+      {
+         ApplyHistogramLUT(pLum, pMappedLum, nRows, pShaping->cols, sizeof(double), &pShaping->lumBinning, pShaping->pLUT);
+      }
+
+      LuminanceBand band;
+      band.pShaping = pShaping;
+      band.pPlanes = pData;
+      band.pOutPlanes = pOut;
+      band.nPixels = nPixels;
+      band.pLum = pLum;
+      band.pMappedLum = pMappedLum;
+
+      RunRowBands(scaleLuminanceBand, &band, nRows, MIN_HISTOGRAM_BAND_ROWS);
+      return;
+   }
+
+   for (unsigned int band=0; band<pShaping->nBands; band++)
+   {
+      unsigned int planeOffset = band*nPixels*pShaping->bytesPerElement;
+      if (pShaping->pTiles != NULL)
+      {
+         ApplyTiledLUT(pData + planeOffset, pOut + planeOffset, startRow, nRows, pShaping->bytesPerElement, &pShaping->pTiles[band]);
+      }
+      else
+      {
+         ApplyHistogramLUT(pData + planeOffset, pOut + planeOffset, nRows, pShaping->cols, pShaping->bytesPerElement,
+                           &pShaping->binning, pShaping->pLUT + band*nBins);
+      }
+   }
+}
@@ -0,0 +1,136 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _HISTOGRAMLIB_H_
+#define _HISTOGRAMLIB_H_
+
+#include "TypesFile.h"
+
+#define FLOAT_HISTOGRAM_BINS 65536
+
+typedef struct _HistogramBinning HistogramBinning;
+struct _HistogramBinning
+{
+   EncodingType type;
+   unsigned int nBins;
+   double minVal;     //value at the start of bin 0
+   double binWidth;
+};
+
+//Histograms and LUTs of a tilesDown x tilesAcross grid of tiles, stored tile by tile in row-major order
+typedef struct _TiledHistogram TiledHistogram;
+struct _TiledHistogram
+{
+   HistogramBinning binning;  //binning shared by every tile
+   unsigned int imageRows;
+   unsigned int imageCols;
+   unsigned int tilesDown;
+   unsigned int tilesAcross;
+   unsigned int *pHisto;
+   unsigned int *pLUT;
+};
+
+//How the bands of a cube are shaped: each through its own LUT, or all scaled by the shaped luminance
+typedef struct _BandShaping BandShaping;
+struct _BandShaping
+{
+   HistogramBinning binning;     //binning of the stored bands
+   HistogramBinning lumBinning;  //binning of the luminance plane
+   unsigned int nBands;
+   unsigned int cols;
+   unsigned int bytesPerElement;
+   bool linked;                  //shape the luminance and scale every band by the same gain
+   const unsigned int *pLUT;     //one LUT per channel, the bands or the luminance alone when linked
+   TiledHistogram *pTiles;       //one tiled histogram per channel in the tiled mode, NULL for a global mapping
+};
+
+//One bin per value for the 8/16-bit integer encodings, signed values offset so the minimum lands in bin 0.
+//Returns false for the other encodings.
+bool GetIntegerBinning(EncodingType type, HistogramBinning *pBinning);
+
+//True for the float and 32-bit integer encodings, which are binned over the range of the data
+bool HasDataBinning(EncodingType type);
+
+//Widen [*pMin, *pMax] to cover nPixels stored pixels of a data-binned encoding; NaNs are ignored
+void FindDataRange(const void *pData, unsigned int nPixels, EncodingType type, double *pMin, double *pMax);
+
+//FLOAT_HISTOGRAM_BINS equal bins spanning [minVal, maxVal]
+void GetDataBinning(EncodingType type, double minVal, double maxVal, HistogramBinning *pBinning);
+
+//Add nPixels stored pixels of the binning's encoding to pHisto
+void AccumulateHistogram(const void *pData, unsigned int nPixels, const HistogramBinning *pBinning, unsigned int *pHisto);
+
+//Add a rows x cols block of stored pixels to pHisto. Row bands are accumulated on a thread pool into
+//private histograms, which are merged into pHisto once a band is done.
+void BuildHistogram(const void *pData, unsigned int rows, unsigned int cols, unsigned int bytesPerElement,
+                    const HistogramBinning *pBinning, unsigned int *pHisto);
+
+//Most populated bin as a fraction of the gray scale
+double GetHistogramPeak(const unsigned int *pHisto, unsigned int nBins);
+
+//Cumulative distribution of a histogram; pCdf may be pHisto
+void CumulateHistogram(const unsigned int *pHisto, unsigned int *pCdf, unsigned int nBins);
+
+//Map every bin onto the bin where the cumulative histogram meets that of a Gaussian of the given mean and sigma
+//(both relative to the gray scale). pTarget receives the scaled Gaussian CDF. Only touches nBins entries, so it is
+//cheap enough to rerun on every parameter change.
+void HistogramReshapeCdf(const unsigned int *pCdf, double *pTarget, unsigned int *pLUT, unsigned int nBins, double meanVal, double sigma);
+
+//HistogramReshapeCdf on a histogram, which is turned into its cumulative sum
+void HistogramReshape(unsigned int *pHisto, double *pTarget, unsigned int *pLUT, unsigned int nBins, double meanVal, double sigma);
+
+//Histogram of the image after mapping it through pLUT
+void MappedHistogram(const unsigned int *pCdf, const unsigned int *pLUT, unsigned int nBins, unsigned int *pMapped);
+
+//Map a rows x cols block of stored pixels through a bin LUT into pDst, in the same encoding.
+//Data-binned pixels are interpolated linearly between the mapped edges of their bin. Row bands run on the thread pool.
+void ApplyHistogramLUT(const void *pSrc, void *pDst, unsigned int rows, unsigned int cols, unsigned int bytesPerElement,
+                       const HistogramBinning *pBinning, const unsigned int *pLUT);
+
+//Tiled histogram of a rows x cols image over the range of pBinning, with tilesAcross tiles per row and about square tiles
+bool CreateTiledHistogram(const HistogramBinning *pBinning, unsigned int rows, unsigned int cols, unsigned int tilesAcross,
+                          TiledHistogram *pTiles);
+
+//Add a block of nRows stored image rows starting at startRow; tile columns are accumulated in parallel
+void AccumulateTiledHistogram(const void *pData, unsigned int startRow, unsigned int nRows, unsigned int bytesPerElement,
+                              TiledHistogram *pTiles);
+
+//Gaussian-target LUT of every tile, clipping the tile histograms at clipLimit times their mean bin count first (0 disables).
+//Consumes the tile histograms.
+void ReshapeTiles(TiledHistogram *pTiles, double meanVal, double sigma, double clipLimit);
+
+//Map nRows stored image rows starting at startRow, interpolating bilinearly between the LUTs of the four nearest tiles
+void ApplyTiledLUT(const void *pSrc, void *pDst, unsigned int startRow, unsigned int nRows, unsigned int bytesPerElement,
+                   const TiledHistogram *pTiles);
+
+void ReleaseTiledHistogram(TiledHistogram *pTiles);
+
+//Band planes are consecutive blocks of rows x cols stored pixels, as split by DeinterleavePixels.
+//The luminance is the mean of the bands, held as doubles and binned like the bands. With one bin per integer value the
+//bins are shifted down by half a value, so an integer luminance v sits in the middle of bin v like integer pixels do in
+//the tiled mapping.
+void GetLuminanceBinning(const HistogramBinning *pBinning, HistogramBinning *pLumBinning);
+void ComputeLuminance(const void *pPlanes, EncodingType type, unsigned int nPixels, unsigned int nBands, double *pLum);
+
+//Add a block of band planes to nBands histograms, plus a luminance histogram after them for multi-band data.
+//pLum is rows*cols of scratch space.
+void BuildBandHistograms(const HistogramBinning *pBinning, unsigned int nBands, const void *pPlanes, unsigned int rows,
+                         unsigned int cols, double *pLum, unsigned int *pHistos);
+
+//Number of LUTs, histograms or tiled histograms the shaping needs
+unsigned int GetChannelCount(const BandShaping *pShaping);
+
+//Add a block of nRows rows of band planes to the tiled histograms of every channel
+void AccumulateTiledBands(const BandShaping *pShaping, const void *pPlanes, unsigned int startRow, unsigned int nRows, double *pLum);
+
+//Shape a block of nRows rows of band planes into pOutPlanes. pLum and pMappedLum are nRows*cols of scratch space.
+void ShapeBands(const BandShaping *pShaping, const void *pPlanes, void *pOutPlanes, unsigned int startRow, unsigned int nRows,
+                double *pLum, double *pMappedLum);
+
+#endif
@@ -0,0 +1,858 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "AppVerify.h"
+#include "DataAccessorImpl.h"
+#include "ModelServices.h"
+#include "RasterElement.h"
+#include "Slot.h"
+#include "imagelib.h"
+
+#include <boost/any.hpp>
+#include <QtCore/QMutex>
+#include <QtCore/QRunnable>
+#include <QtCore/QThread>
+#include <QtCore/QThreadPool>
+#include <QtCore/QThreadStorage>
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+namespace
+{
+   template<typename T>
+   void ReadRowKernel(const T *pSrc, double *pDst, unsigned int cols)
+   {
+      for (unsigned int j=0; j<cols; j++)
+      {
+         pDst[j] = static_cast<double>(pSrc[j]);
+      }
+   }
+
+   template<typename T>
+   void WriteRowKernel(T *pDst, const double *pSrc, unsigned int cols, double minVal, double maxVal)
+   {
+      double pixelVal;
+
+      for (unsigned int j=0; j<cols; j++)
+      {
+         pixelVal = pSrc[j];
+
+         if (pixelVal < minVal)
+         {
+            pixelVal = minVal;
+         }
+         else if (pixelVal > maxVal)
+         {
+            pixelVal = maxVal;
+         }
+
+         pDst[j] = static_cast<T>(pixelVal);
+      }
+   }
+
+   template<typename T>
+   void DeinterleaveKernel(const T *pSrc, unsigned int nPixels, unsigned int nBands, T *pDst)
+   {
+      for (unsigned int band=0; band<nBands; band++)
+      {
+         T *pPlane = pDst + band*nPixels;
+         for (unsigned int i=0; i<nPixels; i++)
+         {
+            pPlane[i] = pSrc[i*nBands + band];
+         }
+      }
+   }
+
+   template<typename T>
+   void InterleaveKernel(const T *pSrc, unsigned int nPixels, unsigned int nBands, T *pDst)
+   {
+      for (unsigned int band=0; band<nBands; band++)
+      {
+         const T *pPlane = pSrc + band*nPixels;
+         for (unsigned int i=0; i<nPixels; i++)
+         {
+            pDst[i*nBands + band] = pPlane[i];
+         }
+      }
+   }
+
+   //Set on the pool threads running a band, so a band that calls RunRowBands again runs the nested bands itself instead
+   //of starting a pool of its own on every thread
+   QThreadStorage<int*> gInsideBand;
+
+   class RowBandTask : public QRunnable
+   {
+   public:
+      RowBandTask(BandFunc pFunc, void *pContext, int startRow, int endRow) :
+         mpFunc(pFunc), mpContext(pContext), mStartRow(startRow), mEndRow(endRow)
+      {
+      }
+
+      void run()
+      {
+         if (!gInsideBand.hasLocalData())
+         {
+            gInsideBand.setLocalData(new int(1));
+         }
+         mpFunc(mpContext, mStartRow, mEndRow);
+      }
+
+   private:
+      BandFunc mpFunc;
+      void *mpContext;
+      int mStartRow;
+      int mEndRow;
+   };
+
+   //Tracks the revision of every element asked about, bumping it on the element's data-modified signal and
+   //forgetting the element when it is deleted
+   class RevisionWatcher
+   {
+   public:
+      RevisionWatcher() : mNextRevision(1)
+      {
+      }
+
+      ~RevisionWatcher()
+      {
+         for (std::map<Subject*, unsigned int>::iterator it = mRevisions.begin(); it != mRevisions.end(); ++it)
+         {
+            it->first->detach(SIGNAL_NAME(RasterElement, DataModified), Slot(this, &RevisionWatcher::dataModified));
+            it->first->detach(SIGNAL_NAME(Subject, Deleted), Slot(this, &RevisionWatcher::deleted));
+         }
+      }
+
+      unsigned int getRevision(const RasterElement *pElement)
+      {
+         QMutexLocker locker(&mMutex);
+         RasterElement *pSubject = const_cast<RasterElement*>(pElement);
+         std::map<Subject*, unsigned int>::iterator it = mRevisions.find(pSubject);
+         if (it != mRevisions.end())
+         {
+            return it->second;
+         }
+
+         pSubject->attach(SIGNAL_NAME(RasterElement, DataModified), Slot(this, &RevisionWatcher::dataModified));
+         pSubject->attach(SIGNAL_NAME(Subject, Deleted), Slot(this, &RevisionWatcher::deleted));
+         return (mRevisions[pSubject] = mNextRevision++);
+      }
+
+      void dataModified(Subject &subject, const std::string &signal, const boost::any &value)
+      {
+         QMutexLocker locker(&mMutex);
+         mRevisions[&subject] = mNextRevision++;
+      }
+
+      void deleted(Subject &subject, const std::string &signal, const boost::any &value)
+      {
+         QMutexLocker locker(&mMutex);
+         mRevisions.erase(&subject);
+      }
+
+   private:
+      QMutex mMutex;
+      std::map<Subject*, unsigned int> mRevisions;
+      unsigned int mNextRevision;
+   };
+
+   RevisionWatcher gRevisionWatcher;
+};
+
+bool HasFixedGrayScale(EncodingType type)
+{
+   return ((type == INT1UBYTE) || (type == INT1SBYTE) || (type == INT2UBYTES) || (type == INT2SBYTES));
+}
+
+void GetTypeRange(EncodingType type, double *pMin, double *pMax)
+{
+   double minVal = -std::numeric_limits<double>::max();
+   double maxVal = std::numeric_limits<double>::max();
+
+   switch (type)
+   {
+   case INT1UBYTE:
+      minVal = std::numeric_limits<unsigned char>::min();
+      maxVal = std::numeric_limits<unsigned char>::max();
+      break;
+   case INT1SBYTE:
+      minVal = std::numeric_limits<signed char>::min();
+      maxVal = std::numeric_limits<signed char>::max();
+      break;
+   case INT2UBYTES:
+      minVal = std::numeric_limits<unsigned short>::min();
+      maxVal = std::numeric_limits<unsigned short>::max();
+      break;
+   case INT2SBYTES:
+      minVal = std::numeric_limits<signed short>::min();
+      maxVal = std::numeric_limits<signed short>::max();
+      break;
+   case INT4UBYTES:
+      minVal = std::numeric_limits<unsigned int>::min();
+      maxVal = std::numeric_limits<unsigned int>::max();
+      break;
+   case INT4SBYTES:
+      minVal = std::numeric_limits<signed int>::min();
+      maxVal = std::numeric_limits<signed int>::max();
+      break;
+   case FLT4BYTES:
+      minVal = -std::numeric_limits<float>::max();
+      maxVal = std::numeric_limits<float>::max();
+      break;
+   default:
+      break;
+   }
+
+   *pMin = minVal;
+   *pMax = maxVal;
+}
+
+unsigned int GetTypeSize(EncodingType type)
+{
+   switch (type)
+   {
+   case INT1UBYTE:
+   case INT1SBYTE:
+      return 1;
+   case INT2UBYTES:
+   case INT2SBYTES:
+      return 2;
+   case INT4UBYTES:
+   case INT4SBYTES:
+   case FLT4BYTES:
+      return 4;
+   case FLT8BYTES:
+   case INT4SCOMPLEX:
+      return 8;
+   case FLT8COMPLEX:
+      return 16;
+   default:
+      return 0;
+   }
+}
+
+void GetGrayScale(EncodingType type, const double *pData, unsigned int len, double *pMin, double *pMax)
+{
+   if (HasFixedGrayScale(type) || (pData == NULL) || (len == 0))
+   {
+      GetTypeRange(type, pMin, pMax);
+      return;
+   }
+
+   double minVal = std::numeric_limits<double>::max();
+   double maxVal = -minVal;
+
+   for (unsigned int i=0; i<len; i++)
+   {
+      if (pData[i] < minVal)
+      {
+         minVal = pData[i];
+      }
+
+      if (pData[i] > maxVal)
+      {
+         maxVal = pData[i];
+      }
+   }
+
+   //A constant image still needs a non-empty range for the normalizations done by the callers
+   if (maxVal <= minVal)
+   {
+      maxVal = minVal + 1.0;
+   }
+
+   *pMin = minVal;
+   *pMax = maxVal;
+}
+
+bool ReadImageBlock(DataAccessor pSrcAcc, EncodingType type, unsigned int startRow, unsigned int nRows, unsigned int startCol,
+                    unsigned int cols, double *pDst)
+{
+   for (unsigned int i=0; i<nRows; i++)
+   {
+      pSrcAcc->toPixel(startRow+i, 0);
+      VERIFY(pSrcAcc.isValid());
+
+      void *pRow = pSrcAcc->getRow();
+      double *pOut = pDst + i*cols;
+
+      switch (type)
+      {
+      case INT1UBYTE:
+         ReadRowKernel(reinterpret_cast<unsigned char*>(pRow) + startCol, pOut, cols);
+         break;
+      case INT1SBYTE:
+         ReadRowKernel(reinterpret_cast<signed char*>(pRow) + startCol, pOut, cols);
+         break;
+      case INT2UBYTES:
+         ReadRowKernel(reinterpret_cast<unsigned short*>(pRow) + startCol, pOut, cols);
+         break;
+      case INT2SBYTES:
+         ReadRowKernel(reinterpret_cast<signed short*>(pRow) + startCol, pOut, cols);
+         break;
+      case INT4UBYTES:
+         ReadRowKernel(reinterpret_cast<unsigned int*>(pRow) + startCol, pOut, cols);
+         break;
+      case INT4SBYTES:
+         ReadRowKernel(reinterpret_cast<signed int*>(pRow) + startCol, pOut, cols);
+         break;
+      case FLT4BYTES:
+         ReadRowKernel(reinterpret_cast<float*>(pRow) + startCol, pOut, cols);
+         break;
+      case FLT8BYTES:
+         ReadRowKernel(reinterpret_cast<double*>(pRow) + startCol, pOut, cols);
+         break;
+      default:
+         //Complex data is read through the model services to get the magnitude
+         for (unsigned int j=0; j<cols; j++)
+         {
+            pOut[j] = Service<ModelServices>()->getDataValue(type, pRow, COMPLEX_MAGNITUDE, startCol + j);
+         }
+         break;
+      }
+   }
+
+   return true;
+}
+
+bool ReadImageRows(DataAccessor pSrcAcc, EncodingType type, unsigned int startRow, unsigned int nRows, unsigned int cols, double *pDst)
+{
+   return ReadImageBlock(pSrcAcc, type, startRow, nRows, 0, cols, pDst);
+}
+
+bool WriteImageRows(DataAccessor pDestAcc, EncodingType type, unsigned int startRow, unsigned int nRows, unsigned int cols, const double *pSrc)
+{
+   double minVal, maxVal;
+   GetTypeRange(type, &minVal, &maxVal);
+
+   for (unsigned int i=0; i<nRows; i++)
+   {
+      pDestAcc->toPixel(startRow+i, 0);
+      VERIFY(pDestAcc.isValid());
+
+      void *pRow = pDestAcc->getRow();
+      const double *pIn = pSrc + i*cols;
+
+      switch (type)
+      {
+      case INT1UBYTE:
+         WriteRowKernel(reinterpret_cast<unsigned char*>(pRow), pIn, cols, minVal, maxVal);
+         break;
+      case INT1SBYTE:
+         WriteRowKernel(reinterpret_cast<signed char*>(pRow), pIn, cols, minVal, maxVal);
+         break;
+      case INT2UBYTES:
+         WriteRowKernel(reinterpret_cast<unsigned short*>(pRow), pIn, cols, minVal, maxVal);
+         break;
+      case INT2SBYTES:
+         WriteRowKernel(reinterpret_cast<signed short*>(pRow), pIn, cols, minVal, maxVal);
+         break;
+      case INT4UBYTES:
+         WriteRowKernel(reinterpret_cast<unsigned int*>(pRow), pIn, cols, minVal, maxVal);
+         break;
+      case INT4SBYTES:
+         WriteRowKernel(reinterpret_cast<signed int*>(pRow), pIn, cols, minVal, maxVal);
+         break;
+      case FLT4BYTES:
+         WriteRowKernel(reinterpret_cast<float*>(pRow), pIn, cols, minVal, maxVal);
+         break;
+      case FLT8BYTES:
+         WriteRowKernel(reinterpret_cast<double*>(pRow), pIn, cols, minVal, maxVal);
+         break;
+      default:
+         //Complex results are written as their real counterpart by the callers
+         return false;
+      }
+   }
+
+   return true;
+}
+
+bool CopyImageRows(DataAccessor pSrcAcc, unsigned int startRow, unsigned int nRows, unsigned int rowBytes, void *pDst)
+{
+   unsigned char *pOut = reinterpret_cast<unsigned char*>(pDst);
+
+   for (unsigned int i=0; i<nRows; i++)
+   {
+      pSrcAcc->toPixel(startRow+i, 0);
+      VERIFY(pSrcAcc.isValid());
+
+      memcpy(pOut + i*rowBytes, pSrcAcc->getRow(), rowBytes);
+   }
+
+   return true;
+}
+
+bool StoreImageRows(DataAccessor pDestAcc, unsigned int startRow, unsigned int nRows, unsigned int rowBytes, const void *pSrc)
+{
+   const unsigned char *pIn = reinterpret_cast<const unsigned char*>(pSrc);
+
+   for (unsigned int i=0; i<nRows; i++)
+   {
+      pDestAcc->toPixel(startRow+i, 0);
+      VERIFY(pDestAcc.isValid());
+
+      memcpy(pDestAcc->getRow(), pIn + i*rowBytes, rowBytes);
+   }
+
+   return true;
+}
+
+//Only the element size matters when moving pixels around
+void DeinterleavePixels(const void *pSrc, unsigned int nPixels, unsigned int nBands, unsigned int bytesPerElement, void *pDst)
+{
+   switch (bytesPerElement)
+   {
+   case 1:
+      DeinterleaveKernel(reinterpret_cast<const unsigned char*>(pSrc), nPixels, nBands, reinterpret_cast<unsigned char*>(pDst));
+      break;
+   case 2:
+      DeinterleaveKernel(reinterpret_cast<const unsigned short*>(pSrc), nPixels, nBands, reinterpret_cast<unsigned short*>(pDst));
+      break;
+   case 4:
+      DeinterleaveKernel(reinterpret_cast<const unsigned int*>(pSrc), nPixels, nBands, reinterpret_cast<unsigned int*>(pDst));
+      break;
+   case 8:
+      DeinterleaveKernel(reinterpret_cast<const double*>(pSrc), nPixels, nBands, reinterpret_cast<double*>(pDst));
+      break;
+   default:
+      break;
+   }
+}
+
+void InterleavePixels(const void *pSrc, unsigned int nPixels, unsigned int nBands, unsigned int bytesPerElement, void *pDst)
+{
+   switch (bytesPerElement)
+   {
+   case 1:
+      InterleaveKernel(reinterpret_cast<const unsigned char*>(pSrc), nPixels, nBands, reinterpret_cast<unsigned char*>(pDst));
+      break;
+   case 2:
+      InterleaveKernel(reinterpret_cast<const unsigned short*>(pSrc), nPixels, nBands, reinterpret_cast<unsigned short*>(pDst));
+      break;
+   case 4:
+      InterleaveKernel(reinterpret_cast<const unsigned int*>(pSrc), nPixels, nBands, reinterpret_cast<unsigned int*>(pDst));
+      break;
+   case 8:
+      InterleaveKernel(reinterpret_cast<const double*>(pSrc), nPixels, nBands, reinterpret_cast<double*>(pDst));
+      break;
+   default:
+      break;
+   }
+}
+
+void UnpackPixels(const void *pSrc, EncodingType type, unsigned int nPixels, double *pDst)
+{
+   switch (type)
+   {
+   case INT1UBYTE:
+      ReadRowKernel(reinterpret_cast<const unsigned char*>(pSrc), pDst, nPixels);
+      break;
+   case INT1SBYTE:
+      ReadRowKernel(reinterpret_cast<const signed char*>(pSrc), pDst, nPixels);
+      break;
+   case INT2UBYTES:
+      ReadRowKernel(reinterpret_cast<const unsigned short*>(pSrc), pDst, nPixels);
+      break;
+   case INT2SBYTES:
+      ReadRowKernel(reinterpret_cast<const signed short*>(pSrc), pDst, nPixels);
+      break;
+   case INT4UBYTES:
+      ReadRowKernel(reinterpret_cast<const unsigned int*>(pSrc), pDst, nPixels);
+      break;
+   case INT4SBYTES:
+      ReadRowKernel(reinterpret_cast<const int*>(pSrc), pDst, nPixels);
+      break;
+   case FLT4BYTES:
+      ReadRowKernel(reinterpret_cast<const float*>(pSrc), pDst, nPixels);
+      break;
+   case FLT8BYTES:
+      ReadRowKernel(reinterpret_cast<const double*>(pSrc), pDst, nPixels);
+      break;
+   default:
+      memset(pDst, 0, nPixels*sizeof(double));
+      break;
+   }
+}
+
+unsigned int GetElementRevision(const RasterElement *pElement)
+{
+   return (pElement == NULL) ? 0 : gRevisionWatcher.getRevision(pElement);
+}
+
+void BuildIntegralImages(const double *pSrc, int rows, int cols, double offset, double *pSum, double *pSumSq)
+{
+   int stride = cols + 1;
+   double rowSum, rowSumSq, pixelVal;
+
+   for (int j=0; j<stride; j++)
+   {
+      pSum[j] = 0;
+      pSumSq[j] = 0;
+   }
+
+   for (int i=0; i<rows; i++)
+   {
+      const double *pRow = pSrc + i*cols;
+      const double *pPrevSum = pSum + i*stride;
+      const double *pPrevSumSq = pSumSq + i*stride;
+      double *pCurrSum = pSum + (i+1)*stride;
+      double *pCurrSumSq = pSumSq + (i+1)*stride;
+
+      rowSum = 0;
+      rowSumSq = 0;
+      pCurrSum[0] = 0;
+      pCurrSumSq[0] = 0;
+
+      for (int j=0; j<cols; j++)
+      {
+         pixelVal = pRow[j] - offset;
+         rowSum += pixelVal;
+         rowSumSq += pixelVal*pixelVal;
+
+         pCurrSum[j+1] = pPrevSum[j+1] + rowSum;
+         pCurrSumSq[j+1] = pPrevSumSq[j+1] + rowSumSq;
+      }
+   }
+}
+
+void WindowStatistics(const double *pSum, const double *pSumSq, int cols, int top, int left, int bottom, int right, double offset, double *pMean, double *pSigma)
+{
+   int stride = cols + 1;
+   int a = top*stride + left;
+   int b = top*stride + right + 1;
+   int c = (bottom+1)*stride + left;
+   int d = (bottom+1)*stride + right + 1;
+   double nCount = static_cast<double>((bottom-top+1)*(right-left+1));
+
+   double sum = pSum[d] - pSum[b] - pSum[c] + pSum[a];
+   double sumSq = pSumSq[d] - pSumSq[b] - pSumSq[c] + pSumSq[a];
+   double meanVal = sum/nCount;
+   double sigmaVal = 0.0;
+
+   //Unbiased estimate, as the window based implementation used
+   if (nCount > 1)
+   {
+      sigmaVal = (sumSq - sum*meanVal)/(nCount - 1);
+   }
+
+   if (sigmaVal < 0)
+   {
+      sigmaVal = 0;
+   }
+
+   *pMean = meanVal + offset;
+   *pSigma = sqrt(sigmaVal);
+}
+
+void RunningMinMax2D(const double *pSrc, int rows, int cols, int windowSize, double *pMin, double *pMax)
+{
+   int i, j, c;
+   int k = 2*windowSize + 1;
+
+   if ((rows < k) || (cols < k))
+   {
+      return;
+   }
+
+   //Row pass: prefix (g) and suffix (h) extremes within blocks of k columns
+   double *pRowWork = (double *)malloc(sizeof(double)*4*cols);
+   double *gMin = pRowWork;
+   double *hMin = pRowWork + cols;
+   double *gMax = pRowWork + 2*cols;
+   double *hMax = pRowWork + 3*cols;
+
+   for (i=0; i<rows; i++)
+   {
+      const double *pRow = pSrc + i*cols;
+      double *pRowMin = pMin + i*cols;
+      double *pRowMax = pMax + i*cols;
+
+      for (j=0; j<cols; j++)
+      {
+         if (j%k == 0)
+         {
+            gMin[j] = pRow[j];
+            gMax[j] = pRow[j];
+         }
+         else
+         {
+            gMin[j] = std::min(gMin[j-1], pRow[j]);
+            gMax[j] = std::max(gMax[j-1], pRow[j]);
+         }
+      }
+
+      for (j=cols-1; j>=0; j--)
+      {
+         if ((j == cols-1) || ((j+1)%k == 0))
+         {
+            hMin[j] = pRow[j];
+            hMax[j] = pRow[j];
+         }
+         else
+         {
+            hMin[j] = std::min(hMin[j+1], pRow[j]);
+            hMax[j] = std::max(hMax[j+1], pRow[j]);
+         }
+      }
+
+      for (c=windowSize; c<cols-windowSize; c++)
+      {
+         pRowMin[c] = std::min(hMin[c-windowSize], gMin[c+windowSize]);
+         pRowMax[c] = std::max(hMax[c-windowSize], gMax[c+windowSize]);
+      }
+   }
+
+   free(pRowWork);
+
+   //Column pass: the same recurrences with whole rows as elements, so the inner loops run along contiguous columns
+   double *pColWork = (double *)malloc(sizeof(double)*2*rows*cols);
+   double *pG = pColWork;
+   double *pH = pColWork + rows*cols;
+   double *pPass[2] = {pMin, pMax};
+
+   for (int nPass=0; nPass<2; nPass++)
+   {
+      double *pData = pPass[nPass];
+      bool bMin = (nPass == 0);
+
+      for (i=0; i<rows; i++)
+      {
+         const double *pCurr = pData + i*cols;
+         double *pOut = pG + i*cols;
+
+         if (i%k == 0)
+         {
+            memcpy(pOut, pCurr, sizeof(double)*cols);
+         }
+         else if (bMin)
+         {
+            const double *pPrev = pG + (i-1)*cols;
+            for (j=0; j<cols; j++)
+            {
+               pOut[j] = std::min(pPrev[j], pCurr[j]);
+            }
+         }
+         else
+         {
+            const double *pPrev = pG + (i-1)*cols;
+            for (j=0; j<cols; j++)
+            {
+               pOut[j] = std::max(pPrev[j], pCurr[j]);
+            }
+         }
+      }
+
+      for (i=rows-1; i>=0; i--)
+      {
+         const double *pCurr = pData + i*cols;
+         double *pOut = pH + i*cols;
+
+         if ((i == rows-1) || ((i+1)%k == 0))
+         {
+            memcpy(pOut, pCurr, sizeof(double)*cols);
+         }
+         else if (bMin)
+         {
+            const double *pNext = pH + (i+1)*cols;
+            for (j=0; j<cols; j++)
+            {
+               pOut[j] = std::min(pNext[j], pCurr[j]);
+            }
+         }
+         else
+         {
+            const double *pNext = pH + (i+1)*cols;
+            for (j=0; j<cols; j++)
+            {
+               pOut[j] = std::max(pNext[j], pCurr[j]);
+            }
+         }
+      }
+
+      //The row pass results are no longer needed once g and h are built, so the output overwrites them
+      for (c=windowSize; c<rows-windowSize; c++)
+      {
+         const double *pHRow = pH + (c-windowSize)*cols;
+         const double *pGRow = pG + (c+windowSize)*cols;
+         double *pOut = pData + c*cols;
+
+         if (bMin)
+         {
+            for (j=0; j<cols; j++)
+            {
+               pOut[j] = std::min(pHRow[j], pGRow[j]);
+            }
+         }
+         else
+         {
+            for (j=0; j<cols; j++)
+            {
+               pOut[j] = std::max(pHRow[j], pGRow[j]);
+            }
+         }
+      }
+   }
+
+   free(pColWork);
+}
+
+bool RunningMax2D(const double *pSrc, int rows, int cols, int windowSize, double *pMax)
+{
+   int i, j, c;
+   int k = 2*windowSize + 1;
+
+   if ((rows < k) || (cols < k))
+   {
+      return false;
+   }
+
+   double *pWork = (double *)malloc(sizeof(double)*2*rows*cols);
+   if (pWork == NULL)
+   {
+      return false;
+   }
+   double *pG = pWork;
+   double *pH = pWork + rows*cols;
+
+   //Row pass, with the first row of g and h as the block prefix and suffix maxima
+   for (i=0; i<rows; i++)
+   {
+      const double *pRow = pSrc + i*cols;
+      double *pRowMax = pMax + i*cols;
+
+      for (j=0; j<cols; j++)
+      {
+         pG[j] = (j%k == 0) ? pRow[j] : std::max(pG[j-1], pRow[j]);
+      }
+
+      for (j=cols-1; j>=0; j--)
+      {
+         pH[j] = ((j == cols-1) || ((j+1)%k == 0)) ? pRow[j] : std::max(pH[j+1], pRow[j]);
+      }
+
+      for (c=windowSize; c<cols-windowSize; c++)
+      {
+         pRowMax[c] = std::max(pH[c-windowSize], pG[c+windowSize]);
+      }
+   }
+
+   //Column pass over the row maxima
+   for (i=0; i<rows; i++)
+   {
+      const double *pCurr = pMax + i*cols;
+      double *pOut = pG + i*cols;
+
+      if (i%k == 0)
+      {
+         memcpy(pOut, pCurr, sizeof(double)*cols);
+      }
+      else
+      {
+         const double *pPrev = pG + (i-1)*cols;
+         for (j=0; j<cols; j++)
+         {
+            pOut[j] = std::max(pPrev[j], pCurr[j]);
+         }
+      }
+   }
+
+   for (i=rows-1; i>=0; i--)
+   {
+      const double *pCurr = pMax + i*cols;
+      double *pOut = pH + i*cols;
+
+      if ((i == rows-1) || ((i+1)%k == 0))
+      {
+         memcpy(pOut, pCurr, sizeof(double)*cols);
+      }
+      else
+      {
+         const double *pNext = pH + (i+1)*cols;
+         for (j=0; j<cols; j++)
+         {
+            pOut[j] = std::max(pNext[j], pCurr[j]);
+         }
+      }
+   }
+
+   for (c=windowSize; c<rows-windowSize; c++)
+   {
+      const double *pHRow = pH + (c-windowSize)*cols;
+      const double *pGRow = pG + (c+windowSize)*cols;
+      double *pOut = pMax + c*cols;
+
+      for (j=0; j<cols; j++)
+      {
+         pOut[j] = std::max(pHRow[j], pGRow[j]);
+      }
+   }
+
+   free(pWork);
+   return true;
+}
+
+void RunRowBands(BandFunc pFunc, void *pContext, int nRows, int minBandRows)
+{
+   int nBands = std::min(GetBandThreadCount(), std::max(1, nRows/std::max(1, minBandRows)));
+
+   if ((nBands <= 1) || gInsideBand.hasLocalData())
+   {
+      pFunc(pContext, 0, nRows);
+      return;
+   }
+
+   QThreadPool pool;
+   pool.setMaxThreadCount(nBands);
+
+   int bandRows = (nRows + nBands - 1)/nBands;
+   for (int startRow = 0; startRow < nRows; startRow += bandRows)
+   {
+      //The pool deletes each task once it has run
+      pool.start(new RowBandTask(pFunc, pContext, startRow, std::min(nRows, startRow + bandRows)));
+   }
+
+   pool.waitForDone();
+}
+
+int GetBandThreadCount()
+{
+   return std::max(1, QThread::idealThreadCount());
+}
+
+double EstimateNoiseSigma(const double *pData, int rows, int cols)
+{
+   if ((rows <= 0) || (cols < 2))
+   {
+      return 0.0;
+   }
+
+   std::vector<double> diffs;
+   diffs.reserve(rows*(cols-1));
+
+   for (int i=0; i<rows; i++)
+   {
+      const double *pRow = pData + i*cols;
+      for (int j=0; j<cols-1; j++)
+      {
+         diffs.push_back(fabs(pRow[j+1] - pRow[j]));
+      }
+   }
+
+   std::vector<double>::iterator pMedian = diffs.begin() + diffs.size()/2;
+   std::nth_element(diffs.begin(), pMedian, diffs.end());
+
+   //The difference of two pixels has sqrt(2) times the pixel noise, and the median of |N(0,s)| is 0.6745*s
+   return *pMedian/(0.6745*sqrt(2.0));
+}
@@ -0,0 +1,90 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _IMAGELIB_H_
+#define _IMAGELIB_H_
+
+#include "DataAccessor.h"
+#include "TypesFile.h"
+
+class RasterElement;
+
+//True for the 8/16-bit integer encodings whose gray scale is the full range of the type
+bool HasFixedGrayScale(EncodingType type);
+
+//Range of values representable by the encoding
+void GetTypeRange(EncodingType type, double *pMin, double *pMax);
+
+//Bytes per stored element of the encoding
+unsigned int GetTypeSize(EncodingType type);
+
+//Gray scale of the image: the type range for 8/16-bit data, the data range for int32 and float data
+void GetGrayScale(EncodingType type, const double *pData, unsigned int len, double *pMin, double *pMax);
+
+//Read rows [startRow, startRow+nRows) of band 0 into pDst as doubles
+bool ReadImageRows(DataAccessor pSrcAcc, EncodingType type, unsigned int startRow, unsigned int nRows, unsigned int cols, double *pDst);
+
+//Read columns [startCol, startCol+cols) of rows [startRow, startRow+nRows) of band 0 into pDst as doubles
+bool ReadImageBlock(DataAccessor pSrcAcc, EncodingType type, unsigned int startRow, unsigned int nRows, unsigned int startCol,
+                    unsigned int cols, double *pDst);
+
+//Write rows [startRow, startRow+nRows) from pSrc, clamping to the range of the type
+bool WriteImageRows(DataAccessor pDestAcc, EncodingType type, unsigned int startRow, unsigned int nRows, unsigned int cols, const double *pSrc);
+
+//Copy rows [startRow, startRow+nRows) as stored, rowBytes bytes per row
+bool CopyImageRows(DataAccessor pSrcAcc, unsigned int startRow, unsigned int nRows, unsigned int rowBytes, void *pDst);
+
+//Store rows [startRow, startRow+nRows) from a buffer already in the destination encoding
+bool StoreImageRows(DataAccessor pDestAcc, unsigned int startRow, unsigned int nRows, unsigned int rowBytes, const void *pSrc);
+
+//Split nPixels band-interleaved (BIP) pixels into nBands consecutive planes of nPixels elements each
+void DeinterleavePixels(const void *pSrc, unsigned int nPixels, unsigned int nBands, unsigned int bytesPerElement, void *pDst);
+
+//Inverse of DeinterleavePixels
+void InterleavePixels(const void *pSrc, unsigned int nPixels, unsigned int nBands, unsigned int bytesPerElement, void *pDst);
+
+//Convert nPixels stored pixels of a real encoding to doubles
+void UnpackPixels(const void *pSrc, EncodingType type, unsigned int nPixels, double *pDst);
+
+//Revision of the pixels of the element, for keying results cached against it. It changes whenever the element signals
+//that its data were modified, and revisions are never reused, so a new element at the address of a deleted one never
+//matches a stale entry. Costs a map lookup, the pixels are not read.
+unsigned int GetElementRevision(const RasterElement *pElement);
+
+//Summed-area tables of (pSrc-offset) and its square, (rows+1)*(cols+1) entries each with a zero first row and column.
+//Subtracting an offset close to the mean keeps the sum of squares well inside double precision.
+void BuildIntegralImages(const double *pSrc, int rows, int cols, double offset, double *pSum, double *pSumSq);
+
+//Mean and sigma of the window [top, bottom] x [left, right] (inclusive) in O(1) from the summed-area tables
+void WindowStatistics(const double *pSum, const double *pSumSq, int cols, int top, int left, int bottom, int right, double offset, double *pMean, double *pSigma);
+
+//Minimum and maximum of every (2*windowSize+1)^2 window lying inside the rows x cols buffer, stored at the window centre.
+//Uses the van Herk/Gil-Werman recurrences, a row pass then a column pass, so the cost per pixel does not depend on the window size.
+//Entries within windowSize of the buffer edges are left unspecified.
+void RunningMinMax2D(const double *pSrc, int rows, int cols, int windowSize, double *pMin, double *pMax);
+
+//The maximum half of RunningMinMax2D, with half its work and scratch. Returns false if the buffer is smaller than a
+//window or the scratch cannot be allocated.
+bool RunningMax2D(const double *pSrc, int rows, int cols, int windowSize, double *pMax);
+
+//Processes rows [startRow, endRow) of a band; bands never share output rows
+typedef void (*BandFunc)(void *pContext, int startRow, int endRow);
+
+//Split nRows rows into bands of at least minBandRows rows and run them on a thread pool, one band per thread.
+//Returns once every band is done. Data accessors are not thread safe, so bands work on buffers read beforehand.
+//Called from within a band, it runs all the rows on the calling thread, so the outer split is the only one.
+void RunRowBands(BandFunc pFunc, void *pContext, int nRows, int minBandRows);
+
+//The most bands RunRowBands runs at once
+int GetBandThreadCount();
+
+//Robust estimate of the noise sigma from the median absolute difference of horizontally adjacent pixels
+double EstimateNoiseSigma(const double *pData, int rows, int cols);
+
+#endif
@@ -23,7 +23,7 @@ static const uint qt_meta_data_BrightnessMeasurementDlg[] = {
        5,       // revision
        0,       // classname
        0,    0, // classinfo
-       5,   14, // methods
+       6,   14, // methods
        0,    0, // properties
        0,    0, // enums/sets
        0,    0, // constructors
@@ -36,6 +36,7 @@ static const uint qt_meta_data_BrightnessMeasurementDlg[] = {
       85,   25,   25,   25, 0x08,
      112,  105,   25,   25, 0x08,
      136,  105,   25,   25, 0x08,
+     154,  105,   25,   25, 0x08,
 
        0        // eod
 };
@@ -45,6 +46,7 @@ static const char qt_meta_stringdata_BrightnessMeasurementDlg[] = {
     "setInnerRadius(double)\0setOutterRadius(double)\0"
     "ComputeBrightness()\0nIndex\0"
     "setMeasurementMode(int)\0setStarIndex(int)\0"
+    "setZoom(int)\0"
 };
 
 const QMetaObject BrightnessMeasurementDlg::staticMetaObject = {
@@ -81,9 +83,10 @@ int BrightnessMeasurementDlg::qt_metacall(QMetaObject::Call _c, int _id, void **
         case 2: ComputeBrightness(); break;
         case 3: setMeasurementMode((*reinterpret_cast< int(*)>(_a[1]))); break;
         case 4: setStarIndex((*reinterpret_cast< int(*)>(_a[1]))); break;
+        case 5: setZoom((*reinterpret_cast< int(*)>(_a[1]))); break;
         default: ;
         }
-        _id -= 5;
+        _id -= 6;
     }
     return _id;
 }
@@ -23,7 +23,7 @@ static const uint qt_meta_data_HistogramShapingDlg[] = {
        5,       // revision
        0,       // classname
        0,    0, // classinfo
-       2,   14, // methods
+       6,   14, // methods
        0,    0, // properties
        0,    0, // enums/sets
        0,    0, // constructors
@@ -33,13 +33,19 @@ static const uint qt_meta_data_HistogramShapingDlg[] = {
  // slots: signature, parameters, type, tag, flags
       23,   21,   20,   20, 0x08,
       44,   21,   20,   20, 0x08,
+      76,   69,   20,   20, 0x08,
+      98,   96,   20,   20, 0x08,
+     118,   21,   20,   20, 0x08,
+     139,   69,   20,   20, 0x08,
 
        0        // eod
 };
 
 static const char qt_meta_stringdata_HistogramShapingDlg[] = {
     "HistogramShapingDlg\0\0t\0setMeanValue(double)\0"
-    "setSigmaValueBox(double)\0"
+    "setSigmaValueBox(double)\0nIndex\0setShapingMode(int)\0"
+    "n\0setTilesAcross(int)\0setClipLimit(double)\0"
+    "setBandLinking(int)\0"
 };
 
 const QMetaObject HistogramShapingDlg::staticMetaObject = {
@@ -73,9 +79,13 @@ int HistogramShapingDlg::qt_metacall(QMetaObject::Call _c, int _id, void **_a)
         switch (_id) {
         case 0: setMeanValue((*reinterpret_cast< double(*)>(_a[1]))); break;
         case 1: setSigmaValueBox((*reinterpret_cast< double(*)>(_a[1]))); break;
+        case 2: setShapingMode((*reinterpret_cast< int(*)>(_a[1]))); break;
+        case 3: setTilesAcross((*reinterpret_cast< int(*)>(_a[1]))); break;
+        case 4: setClipLimit((*reinterpret_cast< double(*)>(_a[1]))); break;
+        case 5: setBandLinking((*reinterpret_cast< int(*)>(_a[1]))); break;
         default: ;
         }
-        _id -= 2;
+        _id -= 6;
     }
     return _id;
 }
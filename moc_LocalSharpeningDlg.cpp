@@ -23,7 +23,7 @@ static const uint qt_meta_data_LocalSharpeningDlg[] = {
        5,       // revision
        0,       // classname
        0,    0, // classinfo
-       3,   14, // methods
+       4,   14, // methods
        0,    0, // properties
        0,    0, // enums/sets
        0,    0, // constructors
@@ -34,6 +34,7 @@ static const uint qt_meta_data_LocalSharpeningDlg[] = {
       27,   20,   19,   19, 0x08,
       49,   20,   19,   19, 0x08,
       80,   75,   19,   19, 0x08,
+     105,   75,   19,   19, 0x08,
 
        0        // eod
 };
@@ -42,6 +43,7 @@ static const char qt_meta_stringdata_LocalSharpeningDlg[] = {
     "LocalSharpeningDlg\0\0nIndex\0"
     "setCurrentFilter(int)\0setCurrentWindowSize(int)\0"
     "dVal\0setContrastValue(double)\0"
+    "setSnrThreshold(double)\0"
 };
 
 const QMetaObject LocalSharpeningDlg::staticMetaObject = {
@@ -76,9 +78,10 @@ int LocalSharpeningDlg::qt_metacall(QMetaObject::Call _c, int _id, void **_a)
         case 0: setCurrentFilter((*reinterpret_cast< int(*)>(_a[1]))); break;
         case 1: setCurrentWindowSize((*reinterpret_cast< int(*)>(_a[1]))); break;
         case 2: setContrastValue((*reinterpret_cast< double(*)>(_a[1]))); break;
+        case 3: setSnrThreshold((*reinterpret_cast< double(*)>(_a[1]))); break;
         default: ;
         }
-        _id -= 3;
+        _id -= 4;
     }
     return _id;
 }
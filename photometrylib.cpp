@@ -0,0 +1,451 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "photometrylib.h"
+#include "imagelib.h"
+
+#include <algorithm>
+#include <list>
+#include <math.h>
+#include <vector>
+
+#define DEFAULT_APERTURE_RADIUS 4.0
+#define DEFAULT_SKY_INNER_RADIUS 8.0
+#define DEFAULT_SKY_OUTER_RADIUS 14.0
+#define DEFAULT_SKY_TRIM 0.2
+#define DEFAULT_GAIN 1.0
+#define DEFAULT_ZERO_POINT 25.0
+#define MIN_PHOTOMETRY_BAND_STARS 32
+#define MIN_SKY_WEIGHT 0.5
+#define APERTURE_FLUX_FRACTION 0.9
+#define SKY_PROFILE_BINS 3
+#define SKY_TRANSITION_SIGMA 1.0
+#define SKY_AREA_FACTOR 5.0
+
+namespace
+{
+   //Integral of sqrt(r^2 - t^2) from 0 to x, for |x| <= r
+   double ArcIntegral(double x, double r)
+   {
+      return 0.5*(x*sqrt(std::max(r*r - x*x, 0.0)) + r*r*asin(std::min(std::max(x/r, -1.0), 1.0)));
+   }
+
+   //Area of the rectangle [x0, x1] x [y0, y1] inside the circle of radius r about the origin. Across x the circle spans
+   //[-s, s] with s = sqrt(r^2 - x^2); clipped to [y0, y1] each bound is either a constant or +-s between the points where
+   //s crosses y0 or y1, so the area is a sum of closed-form pieces.
+   double CircleOverlap(double x0, double x1, double y0, double y1, double r)
+   {
+      x0 = std::max(x0, -r);
+      x1 = std::min(x1, r);
+      if (x0 >= x1)
+      {
+         return 0.0;
+      }
+
+      double breaks[6];
+      int nBreaks = 0;
+      breaks[nBreaks++] = x0;
+      double ys[2] = {y0, y1};
+      for (int k=0; k<2; k++)
+      {
+         if (fabs(ys[k]) < r)
+         {
+            double xc = sqrt(r*r - ys[k]*ys[k]);
+            if ((xc > x0) && (xc < x1))
+            {
+               breaks[nBreaks++] = xc;
+            }
+            if ((-xc > x0) && (-xc < x1))
+            {
+               breaks[nBreaks++] = -xc;
+            }
+         }
+      }
+      breaks[nBreaks++] = x1;
+      std::sort(breaks, breaks + nBreaks);
+
+      double area = 0.0;
+      for (int k=0; k<nBreaks-1; k++)
+      {
+         double a = breaks[k], b = breaks[k+1];
+         double mid = 0.5*(a + b);
+         double s = sqrt(r*r - mid*mid);
+         double arc = ArcIntegral(b, r) - ArcIntegral(a, r);
+
+         double upper = (s >= y1) ? y1*(b - a) : ((s <= y0) ? y0*(b - a) : arc);
+         double lower = (-s <= y0) ? y0*(b - a) : ((-s >= y1) ? y1*(b - a) : -arc);
+         area += std::max(upper - lower, 0.0);
+      }
+
+      return area;
+   }
+
+   //Fraction of the unit pixel centred at (x, y) from the circle centre that lies inside radius r
+   double PixelOverlap(double x, double y, double r)
+   {
+      double nearX = std::max(fabs(x) - 0.5, 0.0), nearY = std::max(fabs(y) - 0.5, 0.0);
+      if (nearX*nearX + nearY*nearY >= r*r)
+      {
+         return 0.0;
+      }
+
+      double farX = fabs(x) + 0.5, farY = fabs(y) + 0.5;
+      if (farX*farX + farY*farY <= r*r)
+      {
+         return 1.0;
+      }
+
+      return CircleOverlap(x - 0.5, x + 0.5, y - 0.5, y + 0.5, r);
+   }
+
+   void BuildMask(ApertureMask *pMask)
+   {
+      int extent = pMask->extent;
+      int size = 2*extent + 1;
+      pMask->weights.resize(size*size);
+      pMask->area = 0.0;
+
+      for (int i=0; i<size; i++)
+      {
+         for (int j=0; j<size; j++)
+         {
+            double x = j - extent - pMask->offsetCol, y = i - extent - pMask->offsetRow;
+            double weight = PixelOverlap(x, y, pMask->outerRadius);
+            if ((weight > 0.0) && (pMask->innerRadius > 0.0))
+            {
+               weight -= PixelOverlap(x, y, pMask->innerRadius);
+            }
+
+            pMask->weights[i*size + j] = weight;
+            pMask->area += weight;
+         }
+      }
+   }
+
+   typedef struct _PhotometryBand
+   {
+      const double *pData;
+      int rows;
+      int cols;
+      const double (*pPositions)[2];
+      const PhotometryOptions *pOptions;
+      PhotometryResult *pResults;
+   } PhotometryBand;
+
+   //Sum of the image pixels weighted by a mask centred on pixel (row, col), and the mask area inside the image. Each mask
+   //row is a dot product with a contiguous run of an image row.
+   double ApplyMask(const double *pData, int rows, int cols, int row, int col, const ApertureMask *pMask, double *pArea)
+   {
+      int extent = pMask->extent;
+      int size = 2*extent + 1;
+      int startRow = std::max(row - extent, 0), endRow = std::min(row + extent + 1, rows);
+      int startCol = std::max(col - extent, 0), endCol = std::min(col + extent + 1, cols);
+
+      double sum = 0.0, area = 0.0;
+      for (int r=startRow; r<endRow; r++)
+      {
+         const double *pWeights = &pMask->weights[(r - row + extent)*size + (startCol - col + extent)];
+         const double *pPixels = pData + r*cols + startCol;
+         int n = endCol - startCol;
+
+         double rowSum = 0.0, rowArea = 0.0;
+         for (int k=0; k<n; k++)
+         {
+            rowSum += pWeights[k]*pPixels[k];
+            rowArea += pWeights[k];
+         }
+         sum += rowSum;
+         area += rowArea;
+      }
+
+      *pArea = area;
+      return sum;
+   }
+
+   //Trimmed mean and scatter of the values between the skyTrim and 1-skyTrim quantiles
+   void MeasureSky(std::vector<double> &values, double trim, double *pSky, double *pSigma)
+   {
+      unsigned int n = values.size();
+      unsigned int low = static_cast<unsigned int>(trim*n);
+      unsigned int high = std::max(low + 1, n - low);
+
+      //Two partial sorts leave the kept values in [low, high) without ordering them
+      std::nth_element(values.begin(), values.begin() + low, values.end());
+      std::nth_element(values.begin() + low, values.begin() + (high - 1), values.end());
+
+      double sum = 0.0, sumSq = 0.0;
+      for (unsigned int i=low; i<high; i++)
+      {
+         sum += values[i];
+      }
+      double mean = sum/(high - low);
+      for (unsigned int i=low; i<high; i++)
+      {
+         sumSq += (values[i] - mean)*(values[i] - mean);
+      }
+
+      *pSky = mean;
+      *pSigma = sqrt(sumSq/(high - low));
+   }
+
+   typedef struct _ProfileBand
+   {
+      const double *pData;
+      int rows;
+      int cols;
+      const double (*pPositions)[2];
+      int nBins;
+      double maxRadius;
+      ApertureSize *pSizes;
+   } ProfileBand;
+
+   void profileBand(void *pContext, int startStar, int endStar)
+   {
+      const ProfileBand *pBand = reinterpret_cast<const ProfileBand*>(pContext);
+      int rows = pBand->rows, cols = pBand->cols, nBins = pBand->nBins;
+
+      //Running totals through each one-pixel ring: cumSum[b] covers the distances below b + 1
+      std::vector<double> cumSum(nBins), cumSumSq(nBins), cumCount(nBins);
+
+      for (int s=startStar; s<endStar; s++)
+      {
+         ApertureSize *pSize = pBand->pSizes + s;
+         double x = pBand->pPositions[s][0], y = pBand->pPositions[s][1];
+         int row = static_cast<int>(floor(y + 0.5));
+         int col = static_cast<int>(floor(x + 0.5));
+
+         std::fill(cumSum.begin(), cumSum.end(), 0.0);
+         std::fill(cumSumSq.begin(), cumSumSq.end(), 0.0);
+         std::fill(cumCount.begin(), cumCount.end(), 0.0);
+
+         for (int r=std::max(row - nBins, 0); r<=std::min(row + nBins, rows - 1); r++)
+         {
+            for (int c=std::max(col - nBins, 0); c<=std::min(col + nBins, cols - 1); c++)
+            {
+               double dist = sqrt((r - y)*(r - y) + (c - x)*(c - x));
+               int bin = static_cast<int>(dist);
+               if (bin < nBins)
+               {
+                  double val = pBand->pData[r*cols + c];
+                  cumSum[bin] += val;
+                  cumSumSq[bin] += val*val;
+                  cumCount[bin] += 1.0;
+               }
+            }
+         }
+
+         for (int b=1; b<nBins; b++)
+         {
+            cumSum[b] += cumSum[b-1];
+            cumSumSq[b] += cumSumSq[b-1];
+            cumCount[b] += cumCount[b-1];
+         }
+
+         //Sky level and pixel scatter of the outer rings
+         int skyBin = nBins - SKY_PROFILE_BINS - 1;
+         double skyCount = cumCount[nBins-1] - cumCount[skyBin];
+         pSize->valid = false;
+         if ((skyBin < 1) || (skyCount <= 0.0))
+         {
+            pSize->apertureRadius = pSize->skyInnerRadius = pSize->skyOuterRadius = pBand->maxRadius;
+            continue;
+         }
+         double sky = (cumSum[nBins-1] - cumSum[skyBin])/skyCount;
+         double skyVar = std::max((cumSumSq[nBins-1] - cumSumSq[skyBin])/skyCount - sky*sky, 0.0);
+
+         //The star ends at the first ring whose mean is within the noise of that mean from the sky
+         int edge = skyBin;
+         for (int b=1; b<skyBin; b++)
+         {
+            double ringCount = cumCount[b] - cumCount[b-1];
+            if ((ringCount > 0.0) &&
+                ((cumSum[b] - cumSum[b-1])/ringCount - sky <= SKY_TRANSITION_SIGMA*sqrt(skyVar/ringCount)))
+            {
+               edge = b;
+               break;
+            }
+         }
+
+         //Curve of growth up to the edge, read where it reaches the flux fraction, between the rings it falls in
+         double total = cumSum[edge-1] - sky*cumCount[edge-1];
+         double aperture = edge;
+         double prevFlux = 0.0;
+         for (int b=0; b<edge; b++)
+         {
+            double flux = cumSum[b] - sky*cumCount[b];
+            if (flux >= APERTURE_FLUX_FRACTION*total)
+            {
+               aperture = b + (APERTURE_FLUX_FRACTION*total - prevFlux)/(flux - prevFlux);
+               break;
+            }
+            prevFlux = flux;
+         }
+
+         pSize->valid = (total > 0.0);
+         pSize->apertureRadius = std::max(aperture, 1.0);
+         pSize->skyInnerRadius = std::max(static_cast<double>(edge), pSize->apertureRadius + 1.0);
+         pSize->skyOuterRadius = sqrt(pSize->skyInnerRadius*pSize->skyInnerRadius +
+                                      SKY_AREA_FACTOR*pSize->apertureRadius*pSize->apertureRadius);
+         pSize->skyOuterRadius = std::max(std::min(pSize->skyOuterRadius, pBand->maxRadius),
+                                          std::min(pSize->skyInnerRadius + 1.0, pBand->maxRadius));
+      }
+   }
+
+   void photometryBand(void *pContext, int startStar, int endStar)
+   {
+      const PhotometryBand *pBand = reinterpret_cast<const PhotometryBand*>(pContext);
+      const PhotometryOptions *pOptions = pBand->pOptions;
+      int rows = pBand->rows, cols = pBand->cols;
+      std::list<ApertureMask> masks;
+      std::vector<double> skyValues;
+
+      for (int s=startStar; s<endStar; s++)
+      {
+         PhotometryResult *pResult = pBand->pResults + s;
+         double x = pBand->pPositions[s][0], y = pBand->pPositions[s][1];
+         int row = static_cast<int>(floor(y + 0.5));
+         int col = static_cast<int>(floor(x + 0.5));
+
+         const ApertureMask *pAperture = GetApertureMask(0.0, pOptions->apertureRadius, y - row, x - col, &masks);
+         const ApertureMask *pAnnulus = GetApertureMask(pOptions->skyInnerRadius, pOptions->skyOuterRadius, y - row, x - col,
+                                                        &masks);
+
+         double area = 0.0;
+         double sum = ApplyMask(pBand->pData, rows, cols, row, col, pAperture, &area);
+
+         //The sky level is a statistic of whole pixels, so the pixels mostly inside the annulus stand for it
+         skyValues.clear();
+         int extent = pAnnulus->extent;
+         int size = 2*extent + 1;
+         for (int i=0; i<size; i++)
+         {
+            int r = row + i - extent;
+            if ((r < 0) || (r >= rows))
+            {
+               continue;
+            }
+            for (int j=0; j<size; j++)
+            {
+               int c = col + j - extent;
+               if ((c >= 0) && (c < cols) && (pAnnulus->weights[i*size + j] >= MIN_SKY_WEIGHT))
+               {
+                  skyValues.push_back(pBand->pData[r*cols + c]);
+               }
+            }
+         }
+
+         pResult->area = area;
+         pResult->nSkyPixels = skyValues.size();
+         if ((area <= 0.0) || skyValues.empty())
+         {
+            pResult->flux = 0.0;
+            pResult->sky = 0.0;
+            pResult->skySigma = 0.0;
+            pResult->fluxError = 0.0;
+            pResult->magnitude = 0.0;
+            pResult->valid = false;
+            continue;
+         }
+
+         MeasureSky(skyValues, pOptions->skyTrim, &pResult->sky, &pResult->skySigma);
+         pResult->flux = sum - pResult->sky*area;
+
+         //Photon noise of the star, the sky scatter over the aperture and the error of the sky level carried into it
+         double skyVar = pResult->skySigma*pResult->skySigma;
+         double variance = std::max(pResult->flux, 0.0)/pOptions->gain + area*skyVar + area*area*skyVar/pResult->nSkyPixels;
+         pResult->fluxError = sqrt(variance);
+
+         pResult->valid = (pResult->flux > 0.0);
+         pResult->magnitude = pResult->valid ? pOptions->zeroPoint - 2.5*log10(pResult->flux) : 0.0;
+      }
+   }
+};
+
+void GetDefaultPhotometryOptions(PhotometryOptions *pOptions)
+{
+   pOptions->apertureRadius = DEFAULT_APERTURE_RADIUS;
+   pOptions->skyInnerRadius = DEFAULT_SKY_INNER_RADIUS;
+   pOptions->skyOuterRadius = DEFAULT_SKY_OUTER_RADIUS;
+   pOptions->skyTrim = DEFAULT_SKY_TRIM;
+   pOptions->gain = DEFAULT_GAIN;
+   pOptions->zeroPoint = DEFAULT_ZERO_POINT;
+}
+
+const ApertureMask *GetApertureMask(double innerRadius, double outerRadius, double offsetRow, double offsetCol,
+                                    std::list<ApertureMask> *pCache)
+{
+   offsetRow = floor(offsetRow*MASK_OFFSET_STEPS + 0.5)/MASK_OFFSET_STEPS;
+   offsetCol = floor(offsetCol*MASK_OFFSET_STEPS + 0.5)/MASK_OFFSET_STEPS;
+
+   for (std::list<ApertureMask>::iterator it = pCache->begin(); it != pCache->end(); ++it)
+   {
+      if ((it->innerRadius == innerRadius) && (it->outerRadius == outerRadius) &&
+          (it->offsetRow == offsetRow) && (it->offsetCol == offsetCol))
+      {
+         pCache->splice(pCache->begin(), *pCache, it);
+         return &pCache->front();
+      }
+   }
+
+   //Pixels up to half a pixel beyond the radius on either axis can overlap it
+   pCache->push_front(ApertureMask());
+   ApertureMask *pMask = &pCache->front();
+   pMask->innerRadius = innerRadius;
+   pMask->outerRadius = outerRadius;
+   pMask->offsetRow = offsetRow;
+   pMask->offsetCol = offsetCol;
+   pMask->extent = static_cast<int>(ceil(outerRadius + 1.0));
+   BuildMask(pMask);
+
+   if (pCache->size() > MAX_CACHED_MASKS)
+   {
+      pCache->pop_back();
+   }
+
+   return pMask;
+}
+
+void MeasurePhotometry(const double *pData, int rows, int cols, const double (*pPositions)[2], unsigned int n,
+                       const PhotometryOptions *pOptions, PhotometryResult *pResults)
+{
+   if (n == 0)
+   {
+      return;
+   }
+
+   PhotometryBand band;
+   band.pData = pData;
+   band.rows = rows;
+   band.cols = cols;
+   band.pPositions = pPositions;
+   band.pOptions = pOptions;
+   band.pResults = pResults;
+
+   RunRowBands(photometryBand, &band, n, MIN_PHOTOMETRY_BAND_STARS);
+}
+
+void EstimateApertureSizes(const double *pData, int rows, int cols, const double (*pPositions)[2], unsigned int n,
+                           double maxRadius, ApertureSize *pSizes)
+{
+   if (n == 0)
+   {
+      return;
+   }
+
+   ProfileBand band;
+   band.pData = pData;
+   band.rows = rows;
+   band.cols = cols;
+   band.pPositions = pPositions;
+   band.nBins = static_cast<int>(ceil(maxRadius));
+   band.maxRadius = maxRadius;
+   band.pSizes = pSizes;
+
+   RunRowBands(profileBand, &band, n, MIN_PHOTOMETRY_BAND_STARS);
+}
@@ -0,0 +1,90 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _PHOTOMETRYLIB_H_
+#define _PHOTOMETRYLIB_H_
+
+#include <list>
+#include <vector>
+
+#define MASK_OFFSET_STEPS 8   //mask centres are rounded to 1/MASK_OFFSET_STEPS pixel
+#define MAX_CACHED_MASKS (2*(MASK_OFFSET_STEPS + 1)*(MASK_OFFSET_STEPS + 1))   //every offset of an aperture and an annulus
+
+typedef struct _PhotometryOptions PhotometryOptions;
+struct _PhotometryOptions
+{
+   double apertureRadius;   //pixels are summed weighted by the fraction of their area inside this radius
+   double skyInnerRadius;   //the sky is measured on the annulus between the two sky radii
+   double skyOuterRadius;
+   double skyTrim;          //fraction of the annulus pixels dropped at either end before the sky is averaged
+   double gain;             //electrons per data unit, for the photon noise of the star
+   double zeroPoint;        //magnitude of a star with a flux of one data unit
+};
+
+typedef struct _PhotometryResult PhotometryResult;
+struct _PhotometryResult
+{
+   double flux;             //aperture sum less the sky under it
+   double sky;              //sky level per pixel
+   double skySigma;         //scatter of the annulus pixels kept for the sky
+   double fluxError;        //one sigma, from the photon noise, the sky scatter and the error of the sky level
+   double magnitude;        //zeroPoint - 2.5 log10(flux), 0 when the flux is not positive
+   double area;             //aperture area inside the image, in pixels
+   unsigned int nSkyPixels; //annulus pixels inside the image, before trimming
+   bool valid;              //false when the aperture or the annulus lie off the image or the flux is not positive
+};
+
+//Weights of the pixels around a centre: the exact fraction of each pixel's area between the two radii
+typedef struct _ApertureMask ApertureMask;
+struct _ApertureMask
+{
+   double innerRadius;          //0 for a full circle
+   double outerRadius;
+   double offsetRow;            //offset of the centre from the middle of its pixel, in [-0.5, 0.5]
+   double offsetCol;
+   int extent;                  //the mask covers the (2*extent+1)^2 pixels centred on that pixel
+   double area;                 //sum of the weights
+   std::vector<double> weights; //row by row
+};
+
+//Radii sized to a star from its radial profile
+typedef struct _ApertureSize ApertureSize;
+struct _ApertureSize
+{
+   double apertureRadius;   //radius holding APERTURE_FLUX_FRACTION of the star's light
+   double skyInnerRadius;   //where the profile falls to the sky
+   double skyOuterRadius;   //gives the annulus several times the aperture area
+   bool valid;              //false when no star light stands above the sky within the search radius
+};
+
+void GetDefaultPhotometryOptions(PhotometryOptions *pOptions);
+
+//Mask of the annulus between the radii (a circle when innerRadius is 0) centred offsetRow, offsetCol from the middle of a
+//pixel. The offsets are rounded to 1/8 pixel so nearby centres share a mask; moving the centre by up to 1/16 pixel changes
+//the flux of a round star only to second order. Masks are looked up in and added to the caller's cache, most recently
+//used first, which keeps its MAX_CACHED_MASKS latest, enough for every offset of one aperture and one annulus; the returned
+//mask stays valid until that many other masks have been asked for. Each thread keeps its own cache, so lookups take no
+//lock and copy nothing.
+const ApertureMask *GetApertureMask(double innerRadius, double outerRadius, double offsetRow, double offsetCol,
+                                    std::list<ApertureMask> *pCache);
+
+//Aperture photometry of n stars of a rows x cols image at sub-pixel positions (column, row), pixel centres lying on whole
+//numbers. The aperture sum weights every pixel by its exact overlap with the circle, the sky is a trimmed mean found with
+//nth_element over the pixels at least half inside the annulus, and the list is split in bands run on the thread pool,
+//so catalogs of thousands of stars are measured in one call.
+void MeasurePhotometry(const double *pData, int rows, int cols, const double (*pPositions)[2], unsigned int n,
+                       const PhotometryOptions *pOptions, PhotometryResult *pResults);
+
+//Size the apertures of n stars at positions (column, row) from one pass over the pixels within maxRadius, binned by
+//distance. The outer bins give the sky level and scatter, the first ring whose mean comes down to the sky gives the sky
+//inner radius, and the cumulative sums give the curve of growth the aperture radius is read from.
+void EstimateApertureSizes(const double *pData, int rows, int cols, const double (*pPositions)[2], unsigned int n,
+                           double maxRadius, ApertureSize *pSizes);
+
+#endif
@@ -0,0 +1,280 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "pyramidlib.h"
+#include "imagelib.h"
+#include "DataRequest.h"
+#include "ObjectResource.h"
+#include "RasterDataDescriptor.h"
+#include "RasterElement.h"
+
+#include <algorithm>
+#include <list>
+
+#define MIN_REDUCE_BAND_ROWS 16
+#define REDUCE_STRIP_ROWS 512
+#define PYRAMID_CACHE_SIZE 4
+
+namespace
+{
+   //Mirror an index into [0, n) without repeating the edge sample
+   inline int Reflect(int i, int n)
+   {
+      if (i < 0)
+      {
+         i = -i;
+      }
+      if (i >= n)
+      {
+         i = 2*(n - 1) - i;
+      }
+
+      return std::min(std::max(i, 0), n - 1);
+   }
+
+   typedef struct _ReduceBand
+   {
+      const double *pSrc;     //source rows from srcFirstRow on
+      int srcFirstRow;
+      int srcRows;            //of the whole source image
+      int cols;
+      double *pDst;           //output rows from dstFirstRow on
+      int dstFirstRow;
+   } ReduceBand;
+
+   void reduceBand(void *pContext, int startRow, int endRow)
+   {
+      const ReduceBand *pBand = reinterpret_cast<const ReduceBand*>(pContext);
+      static const double weights[5] = {1.0/16, 4.0/16, 6.0/16, 4.0/16, 1.0/16};
+      int cols = pBand->cols;
+      int dstCols = (cols + 1)/2;
+      std::vector<double> blurred(cols);
+
+      for (int row=startRow; row<endRow; row++)
+      {
+         //Vertical pass over the five source rows around row 2*i, then the horizontal pass at the even columns only
+         int i = pBand->dstFirstRow + row;
+         std::fill(blurred.begin(), blurred.end(), 0.0);
+         for (int k=0; k<5; k++)
+         {
+            int srcRow = Reflect(2*i + k - 2, pBand->srcRows) - pBand->srcFirstRow;
+            const double *pRow = pBand->pSrc + srcRow*cols;
+            for (int j=0; j<cols; j++)
+            {
+               blurred[j] += weights[k]*pRow[j];
+            }
+         }
+
+         double *pOut = pBand->pDst + row*dstCols;
+         for (int j=0; j<dstCols; j++)
+         {
+            double sum = 0.0;
+            for (int k=0; k<5; k++)
+            {
+               sum += weights[k]*blurred[Reflect(2*j + k - 2, cols)];
+            }
+            pOut[j] = sum;
+         }
+      }
+   }
+
+   //Most recently used first
+   std::list<ImagePyramid> gPyramidCache;
+
+   bool GetElementLayout(const RasterElement *pElement, int *pRows, int *pCols, EncodingType *pType)
+   {
+      const RasterDataDescriptor *pDesc = dynamic_cast<const RasterDataDescriptor*>(pElement->getDataDescriptor());
+      if (pDesc == NULL)
+      {
+         return false;
+      }
+
+      *pRows = pDesc->getRowCount();
+      *pCols = pDesc->getColumnCount();
+      *pType = pDesc->getDataType();
+      return true;
+   }
+};
+
+void GetPyramidLevelSize(int rows, int cols, int level, int *pRows, int *pCols)
+{
+   for (int i=0; i<level; i++)
+   {
+      rows = (rows + 1)/2;
+      cols = (cols + 1)/2;
+   }
+
+   *pRows = rows;
+   *pCols = cols;
+}
+
+int GetPyramidLevelFor(int rows, int cols, int maxSize)
+{
+   int level = 0;
+   while ((std::max(rows, cols) > maxSize) && (std::min(rows, cols) > 1))
+   {
+      rows = (rows + 1)/2;
+      cols = (cols + 1)/2;
+      level++;
+   }
+
+   return level;
+}
+
+void ReduceImage(const double *pSrc, int rows, int cols, double *pDst)
+{
+   ReduceBand band;
+   band.pSrc = pSrc;
+   band.srcFirstRow = 0;
+   band.srcRows = rows;
+   band.cols = cols;
+   band.pDst = pDst;
+   band.dstFirstRow = 0;
+
+   RunRowBands(reduceBand, &band, (rows + 1)/2, MIN_REDUCE_BAND_ROWS);
+}
+
+bool ReduceImageRows(DataAccessor pSrcAcc, EncodingType type, int rows, int cols, double *pDst)
+{
+   int dstRows = (rows + 1)/2;
+   int dstCols = (cols + 1)/2;
+   int stripRows = REDUCE_STRIP_ROWS/2;
+   std::vector<double> strip((2*stripRows + 4)*cols);
+
+   //Each strip of output rows needs the source rows it lies on plus two on either side
+   for (int startRow = 0; startRow < dstRows; startRow += stripRows)
+   {
+      int nRows = std::min(stripRows, dstRows - startRow);
+      int srcStart = std::max(0, 2*startRow - 2);
+      int srcEnd = std::min(rows, 2*(startRow + nRows - 1) + 3);
+
+      if (!ReadImageRows(pSrcAcc, type, srcStart, srcEnd - srcStart, cols, &strip[0]))
+      {
+         return false;
+      }
+
+      ReduceBand band;
+      band.pSrc = &strip[0];
+      band.srcFirstRow = srcStart;
+      band.srcRows = rows;
+      band.cols = cols;
+      band.pDst = pDst + startRow*dstCols;
+      band.dstFirstRow = startRow;
+
+      RunRowBands(reduceBand, &band, nRows, MIN_REDUCE_BAND_ROWS);
+   }
+
+   return true;
+}
+
+void InitImagePyramid(ImagePyramid *pPyramid, const double *pImage, int rows, int cols)
+{
+   pPyramid->pImage = pImage;
+   pPyramid->pElement = NULL;
+   pPyramid->type = FLT8BYTES;
+   pPyramid->revision = 0;
+   pPyramid->rows = rows;
+   pPyramid->cols = cols;
+   pPyramid->levels.clear();
+}
+
+const double *GetPyramidLevel(ImagePyramid *pPyramid, int level, int *pRows, int *pCols)
+{
+   GetPyramidLevelSize(pPyramid->rows, pPyramid->cols, level, pRows, pCols);
+   if (level == 0)
+   {
+      return pPyramid->pImage;
+   }
+
+   if (static_cast<int>(pPyramid->levels.size()) < level)
+   {
+      pPyramid->levels.resize(level);
+   }
+
+   std::vector<double> &pixels = pPyramid->levels[level-1];
+   if (pixels.empty())
+   {
+      int aboveRows, aboveCols;
+      GetPyramidLevelSize(pPyramid->rows, pPyramid->cols, level - 1, &aboveRows, &aboveCols);
+
+      std::vector<double> reduced((*pRows)*(*pCols));
+      if ((level == 1) && (pPyramid->pImage == NULL))
+      {
+         if (pPyramid->pElement == NULL)
+         {
+            return NULL;
+         }
+
+         FactoryResource<DataRequest> pRequest;
+         pRequest->setInterleaveFormat(BSQ);
+         DataAccessor pSrcAcc = pPyramid->pElement->getDataAccessor(pRequest.release());
+         if (!pSrcAcc.isValid() || !ReduceImageRows(pSrcAcc, pPyramid->type, aboveRows, aboveCols, &reduced[0]))
+         {
+            return NULL;
+         }
+      }
+      else
+      {
+         int unusedRows, unusedCols;
+         const double *pAbove = GetPyramidLevel(pPyramid, level - 1, &unusedRows, &unusedCols);
+         if (pAbove == NULL)
+         {
+            return NULL;
+         }
+         ReduceImage(pAbove, aboveRows, aboveCols, &reduced[0]);
+      }
+
+      //Building the level above may have grown the vector, so index it again
+      pPyramid->levels[level-1].swap(reduced);
+   }
+
+   return &pPyramid->levels[level-1][0];
+}
+
+ImagePyramid *GetElementPyramid(const RasterElement *pElement, const double *pImage)
+{
+   int rows, cols;
+   EncodingType type;
+   if ((pElement == NULL) || !GetElementLayout(pElement, &rows, &cols, &type))
+   {
+      return NULL;
+   }
+   unsigned int revision = GetElementRevision(pElement);
+
+   for (std::list<ImagePyramid>::iterator it = gPyramidCache.begin(); it != gPyramidCache.end(); ++it)
+   {
+      if (it->pElement == pElement)
+      {
+         //An element whose pixels changed starts a new pyramid
+         if ((it->rows != rows) || (it->cols != cols) || (it->type != type) || (it->revision != revision))
+         {
+            gPyramidCache.erase(it);
+            break;
+         }
+
+         gPyramidCache.splice(gPyramidCache.begin(), gPyramidCache, it);
+         gPyramidCache.front().pImage = pImage;
+         return &gPyramidCache.front();
+      }
+   }
+
+   gPyramidCache.push_front(ImagePyramid());
+   ImagePyramid *pPyramid = &gPyramidCache.front();
+   InitImagePyramid(pPyramid, pImage, rows, cols);
+   pPyramid->pElement = pElement;
+   pPyramid->type = type;
+   pPyramid->revision = revision;
+
+   while (gPyramidCache.size() > PYRAMID_CACHE_SIZE)
+   {
+      gPyramidCache.pop_back();
+   }
+
+   return pPyramid;
+}
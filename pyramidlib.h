@@ -0,0 +1,62 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _PYRAMIDLIB_H_
+#define _PYRAMIDLIB_H_
+
+#include "DataAccessor.h"
+#include "TypesFile.h"
+
+#include <vector>
+
+class RasterElement;
+
+//Gaussian pyramid of an image. Level 0 is the image itself and is not held here; each further level is the one above
+//blurred and halved, and is built only when first asked for.
+typedef struct _ImagePyramid ImagePyramid;
+struct _ImagePyramid
+{
+   const double *pImage;        //level 0 when it is in memory, NULL to stream level 1 from pElement
+   const RasterElement *pElement;
+   EncodingType type;           //encoding of pElement
+   unsigned int revision;       //GetElementRevision of pElement when the levels were built
+   int rows;                    //of level 0
+   int cols;
+   std::vector<std::vector<double> > levels;  //levels[k-1] holds level k, empty until built
+};
+
+//Size of a level: every level halves the one above, rounding up
+void GetPyramidLevelSize(int rows, int cols, int level, int *pRows, int *pCols);
+
+//Coarsest level whose longer side does not exceed maxSize
+int GetPyramidLevelFor(int rows, int cols, int maxSize);
+
+//One REDUCE step: blur by the separable binomial kernel [1 4 6 4 1]/16, mirrored at the edges, and keep the even rows
+//and columns. pDst receives (rows+1)/2 x (cols+1)/2 pixels; pixel (i, j) lies on pixel (2i, 2j) of the source.
+//Row bands run on the thread pool.
+void ReduceImage(const double *pSrc, int rows, int cols, double *pDst);
+
+//REDUCE of band 0 read through pSrcAcc in strips of rows, so the full-resolution image is never held in memory
+bool ReduceImageRows(DataAccessor pSrcAcc, EncodingType type, int rows, int cols, double *pDst);
+
+//Pyramid over an image held in memory
+void InitImagePyramid(ImagePyramid *pPyramid, const double *pImage, int rows, int cols);
+
+//Pixels of a level, built from the level above (and those above it) when first asked for. Level 0 is pImage.
+//Returns NULL if the level cannot be built.
+const double *GetPyramidLevel(ImagePyramid *pPyramid, int level, int *pRows, int *pCols);
+
+//Pyramid of band 0 of an element. Pyramids are kept for the few most recently used elements and discarded when the
+//element signals that its data changed, so dialogs and repeated runs on the same image reuse the levels already built.
+//pImage is band 0 as doubles when the caller already holds it: it is level 0 and the levels still to be built are
+//reduced from it, until the next lookup of the element. Without it level 0 is NULL and level 1 is streamed from the
+//element. The pointer stays valid until the element drops out of the cache. Not thread safe.
+ImagePyramid *GetElementPyramid(const RasterElement *pElement, const double *pImage);
+
+#endif
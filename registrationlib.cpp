@@ -0,0 +1,1245 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "registrationlib.h"
+#include "fftlib.h"
+#include "imagelib.h"
+#include "pyramidlib.h"
+
+#include <algorithm>
+#include <limits>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#define DEFAULT_INLIER_THRESHOLD 2.0
+#define DEFAULT_CONFIDENCE 0.999
+#define DEFAULT_MAX_ITERATIONS 2000
+#define DEFAULT_SEED 12345
+
+#define MAX_LOCAL_ITERATIONS 4
+#define MIN_SAMPLE_SEPARATION 1.0
+
+#define MIN_WARP_BAND_ROWS 32
+#define KERNEL_PHASES 1024
+#define MAX_KERNEL_TAPS 6
+#define LANCZOS_LOBES 3
+#define PI 3.14159265358979323846
+
+#define DEFAULT_COARSE_SIZE 256
+#define DEFAULT_CORRELATION_WINDOW 512
+#define MIN_CORRELATION_SIZE 32
+#define MAX_FINE_ITERATIONS 3
+#define FINE_CONVERGENCE 0.01
+#define CROSS_POWER_EPSILON 1e-12
+
+namespace
+{
+   double svd2D(double A[][2], double T[][2])
+   {
+      double B[2][2] = {0.0};
+      double C[2][2] = {0.0};
+
+      B[0][0] = A[0][0]*A[0][0]+A[1][0]*A[1][0];
+      B[0][1] = A[0][0]*A[0][1]+A[1][0]*A[1][1];
+      B[1][1] = A[0][1]*A[0][1]+A[1][1]*A[1][1];
+
+      C[0][0] = A[0][0]*A[0][0]+A[0][1]*A[0][1];
+      C[0][1] = A[0][0]*A[1][0]+A[0][1]*A[1][1];
+
+      double t = B[0][0]+B[1][1];
+      double d = B[0][0]*B[1][1]-B[0][1]*B[0][1];
+      double r1 = (t+sqrt(t*t-4*d))/2;
+      double r2 = d/r1;
+      double h = sqrt(B[0][1]*B[0][1]+(r1-B[0][0])*(r1-B[0][0]));
+
+      double Q1[2][2] = {0.0};
+      double Q2[2][2] = {0.0};
+
+      Q2[0][0] = B[0][1]/h;
+      Q2[1][1] = Q2[0][0];
+      Q2[1][0] = (r1-B[0][0])/h;
+      Q2[0][1] = -Q2[1][0];
+
+      double k = sqrt(C[0][1]*C[0][1]+(r1-C[0][0])*(r1-C[0][0]));
+      Q1[0][0] = C[0][1]/k;
+      Q1[1][1] = Q1[0][0];
+      Q1[1][0] = (r1-C[0][0])/k;
+      Q1[0][1] = -Q1[1][0];
+
+      double temp = Q1[0][1];
+      Q1[0][1] = Q1[1][0];
+      Q1[1][0] = temp;
+      T[0][0] = Q2[0][0]*Q1[0][0] + Q2[0][1]*Q1[1][0];
+      T[1][1] = Q2[1][0]*Q1[0][1] + Q2[1][1]*Q1[1][1];
+      T[0][1] = Q2[0][0]*Q1[0][1] + Q2[0][1]*Q1[1][1];
+      T[1][0] = Q2[1][0]*Q1[0][0] + Q2[1][1]*Q1[1][0];
+
+      return (sqrt(r1)+ sqrt(r2));
+   }
+
+   //Orthogonal procrustes: X ~ dScale * Y * T + shift
+   bool procrustes(const double X[][2], const double Y[][2], int n, TransformModel *pModel)
+   {
+      double muX1 = 0, muX2 = 0;
+      double muY1 = 0, muY2 = 0;
+      double ssqX = 0, ssqY = 0;
+      double matrixA[2][2] = {{0.0, 0.0}, {0.0, 0.0}};
+      double matrixT[2][2];
+
+      if (n < 2)
+      {
+         return false;
+      }
+
+      //center at the origin
+      for (int i=0; i<n; i++)
+      {
+         muX1 += X[i][0];
+         muX2 += X[i][1];
+         muY1 += Y[i][0];
+         muY2 += Y[i][1];
+      }
+
+      muX1 = muX1/n;
+      muX2 = muX2/n;
+      muY1 = muY1/n;
+      muY2 = muY2/n;
+
+      for (int i=0; i<n; i++)
+      {
+         double x0 = X[i][0] - muX1;
+         double x1 = X[i][1] - muX2;
+         double y0 = Y[i][0] - muY1;
+         double y1 = Y[i][1] - muY2;
+
+         ssqX += x0*x0 + x1*x1;
+         ssqY += y0*y0 + y1*y1;
+
+         matrixA[0][0] += x0*y0;
+         matrixA[0][1] += x0*y1;
+         matrixA[1][0] += x1*y0;
+         matrixA[1][1] += x1*y1;
+      }
+
+      // the "centered" Frobenius norm
+      double normX = sqrt(ssqX);
+      double normY = sqrt(ssqY);
+      if ((normX <= 0.0) || (normY <= 0.0))
+      {
+         return false;
+      }
+
+      //optimum rotation matrix of Y, from the cross products of the points scaled to equal (unit) norm
+      for (int i=0; i<2; i++)
+      {
+         for (int j=0; j<2; j++)
+         {
+            matrixA[i][j] /= normX*normY;
+         }
+      }
+
+      double trsAA = svd2D(matrixA, matrixT);
+      double dScale = trsAA * normX / normY;
+
+      for (int i=0; i<2; i++)
+      {
+         for (int j=0; j<2; j++)
+         {
+            pModel->matrix[i][j] = dScale*matrixT[i][j];
+         }
+      }
+
+      pModel->shiftX = muX1 - (muY1*pModel->matrix[0][0] + muY2*pModel->matrix[1][0]);
+      pModel->shiftY = muX2 - (muY1*pModel->matrix[0][1] + muY2*pModel->matrix[1][1]);
+      pModel->rotation = atan2(matrixT[0][1], matrixT[0][0]);
+      pModel->scale = dScale;
+      pModel->affine = false;
+
+      return true;
+   }
+
+   //Solve the 3x3 system A x = b by Cramer's rule
+   bool Solve3x3(const double A[3][3], const double b[3], double x[3])
+   {
+      double det = A[0][0]*(A[1][1]*A[2][2] - A[1][2]*A[2][1]) -
+                   A[0][1]*(A[1][0]*A[2][2] - A[1][2]*A[2][0]) +
+                   A[0][2]*(A[1][0]*A[2][1] - A[1][1]*A[2][0]);
+      if (fabs(det) < 1e-12)
+      {
+         return false;
+      }
+
+      for (int k=0; k<3; k++)
+      {
+         double M[3][3];
+         memcpy(M, A, sizeof(M));
+         for (int i=0; i<3; i++)
+         {
+            M[i][k] = b[i];
+         }
+
+         x[k] = (M[0][0]*(M[1][1]*M[2][2] - M[1][2]*M[2][1]) -
+                 M[0][1]*(M[1][0]*M[2][2] - M[1][2]*M[2][0]) +
+                 M[0][2]*(M[1][0]*M[2][1] - M[1][1]*M[2][0]))/det;
+      }
+
+      return true;
+   }
+
+   double ResidualSq(const TransformModel *pModel, const double X[2], const double Y[2])
+   {
+      double x, y;
+      ApplyTransform(pModel, Y[0], Y[1], &x, &y);
+
+      return (x - X[0])*(x - X[0]) + (y - X[1])*(y - X[1]);
+   }
+
+   unsigned int CountInliers(const TransformModel *pModel, const double X[][2], const double Y[][2], int n, double thresholdSq,
+                             unsigned char *pInliers)
+   {
+      unsigned int nInliers = 0;
+      for (int i=0; i<n; i++)
+      {
+         pInliers[i] = (ResidualSq(pModel, X[i], Y[i]) <= thresholdSq) ? 1 : 0;
+         nInliers += pInliers[i];
+      }
+
+      return nInliers;
+   }
+
+   bool FitModel(const double X[][2], const double Y[][2], int n, bool affine, TransformModel *pModel)
+   {
+      return affine ? FitAffine(X, Y, n, pModel) : FitSimilarity(X, Y, n, pModel);
+   }
+
+   //Least-squares refit on the flagged points
+   bool RefitInliers(const double X[][2], const double Y[][2], int n, const unsigned char *pInliers, bool affine,
+                     double (*pX)[2], double (*pY)[2], TransformModel *pModel)
+   {
+      int m = 0;
+      for (int i=0; i<n; i++)
+      {
+         if (pInliers[i])
+         {
+            pX[m][0] = X[i][0];
+            pX[m][1] = X[i][1];
+            pY[m][0] = Y[i][0];
+            pY[m][1] = Y[i][1];
+            m++;
+         }
+      }
+
+      return FitModel(pX, pY, m, affine, pModel);
+   }
+
+   //Weights of the taps at offsets 1-taps/2 .. taps/2 from the pixel left of a sample, for KERNEL_PHASES+1 evenly spaced
+   //fractional positions. Looking the weights up keeps the trigonometry of the Lanczos kernel out of the pixel loop.
+   void BuildKernelTable(int interpolation, int taps, double *pTable)
+   {
+      for (int phase=0; phase<=KERNEL_PHASES; phase++)
+      {
+         double f = static_cast<double>(phase)/KERNEL_PHASES;
+         double *pWeights = pTable + phase*taps;
+         double sum = 0.0;
+
+         for (int k=0; k<taps; k++)
+         {
+            double d = fabs(f - (k + 1 - taps/2));
+            double w = 0.0;
+
+            if (interpolation == INTERPOLATION_BILINEAR)
+            {
+               w = std::max(0.0, 1.0 - d);
+            }
+            else if (interpolation == INTERPOLATION_BICUBIC)
+            {
+               //Keys cubic convolution with a = -0.5
+               if (d < 1.0)
+               {
+                  w = (1.5*d - 2.5)*d*d + 1.0;
+               }
+               else if (d < 2.0)
+               {
+                  w = ((-0.5*d + 2.5)*d - 4.0)*d + 2.0;
+               }
+            }
+            else if (d < 1e-12)
+            {
+               w = 1.0;
+            }
+            else if (d < LANCZOS_LOBES)
+            {
+               w = LANCZOS_LOBES*sin(PI*d)*sin(PI*d/LANCZOS_LOBES)/(PI*PI*d*d);
+            }
+
+            pWeights[k] = w;
+            sum += w;
+         }
+
+         //Normalised so flat regions stay flat
+         for (int k=0; k<taps; k++)
+         {
+            pWeights[k] /= sum;
+         }
+      }
+   }
+
+   typedef struct _WarpBand
+   {
+      const double *pSrc;
+      int srcRows;
+      int srcCols;
+      const double (*mapping)[3];
+      int interpolation;
+      int taps;
+      const double *pTable;
+      double fillValue;
+      double *pDst;
+      int dstCols;
+   } WarpBand;
+
+   template<int TAPS>
+   void WarpRowKernel(const WarpBand *pBand, int row)
+   {
+      const double *pSrc = pBand->pSrc;
+      int srcRows = pBand->srcRows;
+      int srcCols = pBand->srcCols;
+      double *pDst = pBand->pDst + row*pBand->dstCols;
+
+      //The source position steps by a constant amount along the row
+      double x = pBand->mapping[0][1]*row + pBand->mapping[0][2];
+      double y = pBand->mapping[1][1]*row + pBand->mapping[1][2];
+      double dx = pBand->mapping[0][0];
+      double dy = pBand->mapping[1][0];
+
+      for (int col=0; col<pBand->dstCols; col++, x+=dx, y+=dy)
+      {
+         if ((x < -0.5) || (x > srcCols - 0.5) || (y < -0.5) || (y > srcRows - 0.5))
+         {
+            pDst[col] = pBand->fillValue;
+            continue;
+         }
+
+         int x0 = static_cast<int>(floor(x));
+         int y0 = static_cast<int>(floor(y));
+         const double *pWx = pBand->pTable + static_cast<int>((x - x0)*KERNEL_PHASES + 0.5)*TAPS;
+         const double *pWy = pBand->pTable + static_cast<int>((y - y0)*KERNEL_PHASES + 0.5)*TAPS;
+         int left = x0 + 1 - TAPS/2;
+         int top = y0 + 1 - TAPS/2;
+
+         double sum = 0.0;
+         if ((left >= 0) && (top >= 0) && (left + TAPS <= srcCols) && (top + TAPS <= srcRows))
+         {
+            const double *pRow = pSrc + top*srcCols + left;
+            for (int i=0; i<TAPS; i++, pRow+=srcCols)
+            {
+               double rowSum = 0.0;
+               for (int j=0; j<TAPS; j++)
+               {
+                  rowSum += pWx[j]*pRow[j];
+               }
+               sum += pWy[i]*rowSum;
+            }
+         }
+         else
+         {
+            for (int i=0; i<TAPS; i++)
+            {
+               const double *pRow = pSrc + std::min(std::max(top + i, 0), srcRows - 1)*srcCols;
+               double rowSum = 0.0;
+               for (int j=0; j<TAPS; j++)
+               {
+                  rowSum += pWx[j]*pRow[std::min(std::max(left + j, 0), srcCols - 1)];
+               }
+               sum += pWy[i]*rowSum;
+            }
+         }
+
+         pDst[col] = sum;
+      }
+   }
+
+   void WarpNearestRow(const WarpBand *pBand, int row)
+   {
+      double *pDst = pBand->pDst + row*pBand->dstCols;
+      double x = pBand->mapping[0][1]*row + pBand->mapping[0][2];
+      double y = pBand->mapping[1][1]*row + pBand->mapping[1][2];
+
+      for (int col=0; col<pBand->dstCols; col++, x+=pBand->mapping[0][0], y+=pBand->mapping[1][0])
+      {
+         int srcCol = static_cast<int>(floor(x + 0.5));
+         int srcRow = static_cast<int>(floor(y + 0.5));
+
+         if ((srcCol < 0) || (srcCol >= pBand->srcCols) || (srcRow < 0) || (srcRow >= pBand->srcRows))
+         {
+            pDst[col] = pBand->fillValue;
+         }
+         else
+         {
+            pDst[col] = pBand->pSrc[srcRow*pBand->srcCols + srcCol];
+         }
+      }
+   }
+
+   void warpBand(void *pContext, int startRow, int endRow)
+   {
+      const WarpBand *pBand = reinterpret_cast<const WarpBand*>(pContext);
+
+      for (int row=startRow; row<endRow; row++)
+      {
+         switch (pBand->taps)
+         {
+         case 2:
+            WarpRowKernel<2>(pBand, row);
+            break;
+         case 4:
+            WarpRowKernel<4>(pBand, row);
+            break;
+         case 6:
+            WarpRowKernel<6>(pBand, row);
+            break;
+         default:
+            WarpNearestRow(pBand, row);
+            break;
+         }
+      }
+   }
+
+   //Linear congruential generator; the sampling only needs repeatable, evenly spread indices
+   unsigned int NextRandom(unsigned int *pState)
+   {
+      *pState = *pState*1664525u + 1013904223u;
+      return *pState >> 8;
+   }
+
+   //size x size window of the image with its top left corner at (top, left); pixels off the image are NaN
+   void CropWindow(const double *pSrc, int rows, int cols, int top, int left, int size, double *pDst)
+   {
+      for (int i=0; i<size; i++)
+      {
+         int row = top + i;
+         for (int j=0; j<size; j++)
+         {
+            int col = left + j;
+            pDst[i*size + j] = ((row >= 0) && (row < rows) && (col >= 0) && (col < cols)) ? pSrc[row*cols + col] :
+                               std::numeric_limits<double>::quiet_NaN();
+         }
+      }
+   }
+
+   //Remove the mean of the covered pixels, zero the uncovered ones and taper by a Hann window, so neither the image
+   //borders nor the edge of the coverage produce a correlation peak of their own
+   void TaperWindow(double *pWindow, int size)
+   {
+      double sum = 0.0;
+      int nCount = 0;
+      for (int i=0; i<size*size; i++)
+      {
+         if (pWindow[i] == pWindow[i])
+         {
+            sum += pWindow[i];
+            nCount++;
+         }
+      }
+      double mean = (nCount > 0) ? sum/nCount : 0.0;
+
+      std::vector<double> hann(size);
+      for (int i=0; i<size; i++)
+      {
+         hann[i] = 0.5 - 0.5*cos(2*PI*i/size);
+      }
+
+      for (int i=0; i<size; i++)
+      {
+         double *pRow = pWindow + i*size;
+         for (int j=0; j<size; j++)
+         {
+            pRow[j] = (pRow[j] == pRow[j]) ? (pRow[j] - mean)*hann[i]*hann[j] : 0.0;
+         }
+      }
+   }
+
+   //Offset of the vertex of the parabola through three samples from the middle one
+   double ParabolicOffset(double left, double centre, double right)
+   {
+      double denom = left - 2*centre + right;
+      if (denom >= 0.0)
+      {
+         return 0.0;
+      }
+
+      return std::min(0.5, std::max(-0.5, 0.5*(left - right)/denom));
+   }
+
+   //Phase correlation of two rows x cols arrays (powers of two). The peak position is returned as a signed, wrapped
+   //offset of pB against pA: pB(row, col) ~ pA(row - *pRow, col - *pCol).
+   bool CorrelatePeak(const double *pA, const double *pB, int rows, int cols, double *pRow, double *pCol, double *pPeak)
+   {
+      int nCount = rows*cols;
+      std::vector<double> reA(pA, pA + nCount);
+      std::vector<double> imA(nCount, 0.0);
+      std::vector<double> reB(pB, pB + nCount);
+      std::vector<double> imB(nCount, 0.0);
+
+      if (!FFT2D(&reA[0], &imA[0], rows, cols, false) || !FFT2D(&reB[0], &imB[0], rows, cols, false))
+      {
+         return false;
+      }
+
+      //Normalised cross-power spectrum conj(A)*B, whose inverse is a delta at the shift
+      for (int i=0; i<nCount; i++)
+      {
+         double re = reA[i]*reB[i] + imA[i]*imB[i];
+         double im = reA[i]*imB[i] - imA[i]*reB[i];
+         double mag = sqrt(re*re + im*im);
+         if (mag > CROSS_POWER_EPSILON)
+         {
+            reA[i] = re/mag;
+            imA[i] = im/mag;
+         }
+         else
+         {
+            reA[i] = 0.0;
+            imA[i] = 0.0;
+         }
+      }
+
+      if (!FFT2D(&reA[0], &imA[0], rows, cols, true))
+      {
+         return false;
+      }
+
+      int nBest = static_cast<int>(std::max_element(reA.begin(), reA.end()) - reA.begin());
+      int peakRow = nBest/cols;
+      int peakCol = nBest%cols;
+      const double *pSurface = &reA[0];
+
+      double up = pSurface[((peakRow + rows - 1)%rows)*cols + peakCol];
+      double down = pSurface[((peakRow + 1)%rows)*cols + peakCol];
+      double left = pSurface[peakRow*cols + (peakCol + cols - 1)%cols];
+      double right = pSurface[peakRow*cols + (peakCol + 1)%cols];
+      double centre = pSurface[nBest];
+
+      *pRow = ((peakRow < rows/2) ? peakRow : peakRow - rows) + ParabolicOffset(up, centre, down);
+      *pCol = ((peakCol < cols/2) ? peakCol : peakCol - cols) + ParabolicOffset(left, centre, right);
+      *pPeak = centre;
+
+      return centre > 0.0;
+   }
+
+   //High-passed magnitude spectrum of a tapered size x size window resampled on size angles over [0, pi) by size
+   //radii spaced logarithmically up to the Nyquist radius. Rotating the image shifts it along the angles, scaling it
+   //shifts it along the radii, and translating it leaves it unchanged.
+   bool LogPolarSpectrum(const double *pWindow, int size, double *pDst, double *pLogBase)
+   {
+      int nCount = size*size;
+      std::vector<double> re(pWindow, pWindow + nCount);
+      std::vector<double> im(nCount, 0.0);
+      if (!FFT2D(&re[0], &im[0], size, size, false))
+      {
+         return false;
+      }
+
+      //Magnitude with the low frequencies suppressed, as they carry the window shape rather than the detail
+      std::vector<double> magnitude(nCount);
+      for (int i=0; i<size; i++)
+      {
+         double fy = static_cast<double>((i < size/2) ? i : i - size)/size;
+         for (int j=0; j<size; j++)
+         {
+            double fx = static_cast<double>((j < size/2) ? j : j - size)/size;
+            double x = cos(PI*fx)*cos(PI*fy);
+            int nIndex = i*size + j;
+            magnitude[nIndex] = sqrt(re[nIndex]*re[nIndex] + im[nIndex]*im[nIndex])*(1.0 - x)*(2.0 - x);
+         }
+      }
+
+      double maxRadius = size/2 - 1;
+      double logBase = exp(log(maxRadius)/size);
+      *pLogBase = logBase;
+
+      for (int a=0; a<size; a++)
+      {
+         double theta = PI*a/size;
+         double c = cos(theta);
+         double s = sin(theta);
+         double radius = 1.0;
+
+         for (int r=0; r<size; r++, radius*=logBase)
+         {
+            //Bilinear sample of the periodic spectrum at frequency (u, v)
+            double u = radius*c;
+            double v = radius*s;
+            int u0 = static_cast<int>(floor(u));
+            int v0 = static_cast<int>(floor(v));
+            double fu = u - u0;
+            double fv = v - v0;
+            int j0 = (u0%size + size)%size;
+            int j1 = (j0 + 1)%size;
+            int i0 = (v0%size + size)%size;
+            int i1 = (i0 + 1)%size;
+
+            pDst[a*size + r] = (1 - fv)*((1 - fu)*magnitude[i0*size + j0] + fu*magnitude[i0*size + j1]) +
+                               fv*((1 - fu)*magnitude[i1*size + j0] + fu*magnitude[i1*size + j1]);
+         }
+      }
+
+      return true;
+   }
+
+   TransformModel SimilarityModel(double rotation, double scale)
+   {
+      TransformModel model;
+      model.matrix[0][0] = scale*cos(rotation);
+      model.matrix[0][1] = scale*sin(rotation);
+      model.matrix[1][0] = -scale*sin(rotation);
+      model.matrix[1][1] = scale*cos(rotation);
+      model.shiftX = 0.0;
+      model.shiftY = 0.0;
+      model.rotation = rotation;
+      model.scale = scale;
+      model.rmsResidual = 0.0;
+      model.nInliers = 0;
+      model.nIterations = 0;
+      model.affine = false;
+
+      return model;
+   }
+
+   //Rotation and scale of the frame against the master from the phase correlation of the log-polar spectra of two
+   //tapered size x size windows, as the similarity mapping the frame window onto the master window. The spectrum is the
+   //same after half a turn, so the rotation is only known modulo pi.
+   bool CorrelateLogPolar(const double *pMasterWindow, const double *pFrameWindow, int size, double *pRotation, double *pScale)
+   {
+      std::vector<double> masterPolar(size*size), framePolar(size*size);
+      double logBase = 1.0, shiftAngle = 0.0, shiftRadius = 0.0, peak = 0.0;
+
+      if (!LogPolarSpectrum(pMasterWindow, size, &masterPolar[0], &logBase) ||
+          !LogPolarSpectrum(pFrameWindow, size, &framePolar[0], &logBase) ||
+          !CorrelatePeak(&masterPolar[0], &framePolar[0], size, size, &shiftAngle, &shiftRadius, &peak))
+      {
+         return false;
+      }
+
+      *pRotation = PI*shiftAngle/size;
+      *pScale = pow(logBase, shiftRadius);
+
+      return true;
+   }
+
+   //The central size x size window of the master and the frame warped onto it through pModel, both tapered.
+   //Coordinates are those of the level, rows x cols for the master.
+   bool AlignedWindows(const double *pMaster, int rows, int cols, const double *pFrame, int rowsRef, int colsRef, int size,
+                       int interpolation, const TransformModel *pModel, double *pMasterWindow, double *pFrameWindow)
+   {
+      double mapping[2][3];
+      if (!GetPixelMapping(pModel, rows, cols, mapping))
+      {
+         return false;
+      }
+
+      int top = rows/2 - size/2;
+      int left = cols/2 - size/2;
+      mapping[0][2] += mapping[0][0]*left + mapping[0][1]*top;
+      mapping[1][2] += mapping[1][0]*left + mapping[1][1]*top;
+
+      CropWindow(pMaster, rows, cols, top, left, size, pMasterWindow);
+      WarpImage(pFrame, rowsRef, colsRef, mapping, interpolation, std::numeric_limits<double>::quiet_NaN(), pFrameWindow,
+                size, size);
+      TaperWindow(pMasterWindow, size);
+      TaperWindow(pFrameWindow, size);
+
+      return true;
+   }
+
+   //Move the shift of pModel by the residual translation between the master and the frame warped through it
+   bool RefineTranslation(const double *pMaster, int rows, int cols, const double *pFrame, int rowsRef, int colsRef, int size,
+                          int interpolation, TransformModel *pModel, double *pShiftRow, double *pShiftCol, double *pPeak)
+   {
+      std::vector<double> masterWindow(size*size), frameWindow(size*size);
+      if (!AlignedWindows(pMaster, rows, cols, pFrame, rowsRef, colsRef, size, interpolation, pModel, &masterWindow[0],
+                          &frameWindow[0]) ||
+          !CorrelatePeak(&masterWindow[0], &frameWindow[0], size, size, pShiftRow, pShiftCol, pPeak))
+      {
+         return false;
+      }
+
+      //The warped frame shows the master content shifted by (row, col); y points up in the model
+      pModel->shiftX -= *pShiftCol;
+      pModel->shiftY += *pShiftRow;
+
+      return true;
+   }
+
+   //Compose pModel with the residual rotation and scale between the master and the frame warped through it. The
+   //residual is small, so it needs no disambiguation and is measured at the resolution of the window.
+   bool RefineRotationScale(const double *pMaster, int rows, int cols, const double *pFrame, int rowsRef, int colsRef, int size,
+                            TransformModel *pModel, double *pRotation, double *pScale)
+   {
+      std::vector<double> masterWindow(size*size), frameWindow(size*size);
+      if (!AlignedWindows(pMaster, rows, cols, pFrame, rowsRef, colsRef, size, INTERPOLATION_BICUBIC, pModel, &masterWindow[0],
+                          &frameWindow[0]) ||
+          !CorrelateLogPolar(&masterWindow[0], &frameWindow[0], size, pRotation, pScale))
+      {
+         return false;
+      }
+
+      //Row vectors: the residual similarity R applies after the model, [x y] * M * R + shift * R
+      TransformModel residual = SimilarityModel(*pRotation, *pScale);
+      TransformModel model = *pModel;
+      for (int i=0; i<2; i++)
+      {
+         for (int j=0; j<2; j++)
+         {
+            model.matrix[i][j] = pModel->matrix[i][0]*residual.matrix[0][j] + pModel->matrix[i][1]*residual.matrix[1][j];
+         }
+      }
+      ApplyTransform(&residual, pModel->shiftX, pModel->shiftY, &model.shiftX, &model.shiftY);
+      model.rotation = pModel->rotation + *pRotation;
+      model.scale = pModel->scale * *pScale;
+      *pModel = model;
+
+      return true;
+   }
+
+   //Images of the pyramid levels the phase correlation works on, level 0 first
+   typedef struct _CorrelationLevels
+   {
+      std::vector<const double*> master;
+      std::vector<const double*> frame;
+      std::vector<int> rows;
+      std::vector<int> cols;
+      std::vector<int> rowsRef;
+      std::vector<int> colsRef;
+   } CorrelationLevels;
+
+   //Coarse-to-fine refinement of a starting model. The coarsest level is correlated whole, padded to a power of two, so
+   //any translation within the image is found. Each finer level doubles the translation and corrects it over a central
+   //window. At the finest level the correction is repeated, since the parabolic peak fit is only unbiased near zero
+   //shift, and with logPolar the rotation and scale are refined between the repeats at the resolution of the window.
+   bool RefineCorrelation(const CorrelationLevels &levels, const PhaseCorrelationOptions *pOptions, TransformModel *pModel,
+                          double *pPeak)
+   {
+      int nLevel = levels.master.size() - 1;
+      double shiftRow = 0.0, shiftCol = 0.0;
+      bool bSuccess = true;
+
+      for (int level=nLevel; bSuccess && (level>=0); level--)
+      {
+         int r = levels.rows[level], c = levels.cols[level], rRef = levels.rowsRef[level], cRef = levels.colsRef[level];
+         if (level == nLevel)
+         {
+            int size = NextPowerOfTwo(std::max(std::max(r, c), std::max(rRef, cRef)));
+            bSuccess = RefineTranslation(levels.master[level], r, c, levels.frame[level], rRef, cRef, size,
+                                         INTERPOLATION_BILINEAR, pModel, &shiftRow, &shiftCol, pPeak);
+            if (level > 0)
+            {
+               continue;
+            }
+         }
+         else
+         {
+            pModel->shiftX *= 2;
+            pModel->shiftY *= 2;
+         }
+
+         int size = std::min(pOptions->windowSize, NextPowerOfTwo(std::min(r, c)/2 + 1));
+         int nIterations = (level == 0) ? MAX_FINE_ITERATIONS : 1;
+         bool bRotation = pOptions->logPolar && (level == 0);
+
+         for (int i=0; bSuccess && (i<nIterations); i++)
+         {
+            double rotation = 0.0, scale = 1.0;
+            bSuccess = RefineTranslation(levels.master[level], r, c, levels.frame[level], rRef, cRef, size,
+                                         INTERPOLATION_BICUBIC, pModel, &shiftRow, &shiftCol, pPeak);
+            if (bSuccess && bRotation)
+            {
+               bSuccess = RefineRotationScale(levels.master[level], r, c, levels.frame[level], rRef, cRef, size, pModel,
+                                              &rotation, &scale);
+            }
+
+            if (fabs(shiftRow) + fabs(shiftCol) + fabs(rotation)*size + fabs(log(scale))*size < FINE_CONVERGENCE)
+            {
+               break;
+            }
+         }
+
+         //The last pass leaves the translation matching the final rotation and scale
+         if (bSuccess && bRotation)
+         {
+            bSuccess = RefineTranslation(levels.master[level], r, c, levels.frame[level], rRef, cRef, size,
+                                         INTERPOLATION_BICUBIC, pModel, &shiftRow, &shiftCol, pPeak);
+         }
+      }
+
+      return bSuccess;
+   }
+};
+
+void GetDefaultRansacOptions(RansacOptions *pOptions)
+{
+   pOptions->affine = false;
+   pOptions->inlierThreshold = DEFAULT_INLIER_THRESHOLD;
+   pOptions->confidence = DEFAULT_CONFIDENCE;
+   pOptions->maxIterations = DEFAULT_MAX_ITERATIONS;
+   pOptions->seed = DEFAULT_SEED;
+}
+
+void GetDefaultPhaseCorrelationOptions(PhaseCorrelationOptions *pOptions)
+{
+   pOptions->logPolar = false;
+   pOptions->coarseSize = DEFAULT_COARSE_SIZE;
+   pOptions->windowSize = DEFAULT_CORRELATION_WINDOW;
+}
+
+bool FitSimilarity(const double X[][2], const double Y[][2], int n, TransformModel *pModel)
+{
+   return procrustes(X, Y, n, pModel);
+}
+
+bool FitAffine(const double X[][2], const double Y[][2], int n, TransformModel *pModel)
+{
+   if (n < 3)
+   {
+      return false;
+   }
+
+   //Normal equations of [x y 1] * [a b c]' = X, shared by both output coordinates
+   double A[3][3] = {{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}};
+   double bx[3] = {0.0, 0.0, 0.0};
+   double by[3] = {0.0, 0.0, 0.0};
+
+   for (int i=0; i<n; i++)
+   {
+      double v[3] = {Y[i][0], Y[i][1], 1.0};
+      for (int r=0; r<3; r++)
+      {
+         for (int c=0; c<3; c++)
+         {
+            A[r][c] += v[r]*v[c];
+         }
+         bx[r] += v[r]*X[i][0];
+         by[r] += v[r]*X[i][1];
+      }
+   }
+
+   double cx[3], cy[3];
+   if (!Solve3x3(A, bx, cx) || !Solve3x3(A, by, cy))
+   {
+      return false;
+   }
+
+   pModel->matrix[0][0] = cx[0];
+   pModel->matrix[1][0] = cx[1];
+   pModel->shiftX = cx[2];
+   pModel->matrix[0][1] = cy[0];
+   pModel->matrix[1][1] = cy[1];
+   pModel->shiftY = cy[2];
+
+   double det = pModel->matrix[0][0]*pModel->matrix[1][1] - pModel->matrix[0][1]*pModel->matrix[1][0];
+   pModel->scale = sqrt(fabs(det));
+   pModel->rotation = atan2(pModel->matrix[0][1], pModel->matrix[0][0]);
+   pModel->affine = true;
+
+   return true;
+}
+
+void ApplyTransform(const TransformModel *pModel, double x, double y, double *pX, double *pY)
+{
+   *pX = x*pModel->matrix[0][0] + y*pModel->matrix[1][0] + pModel->shiftX;
+   *pY = x*pModel->matrix[0][1] + y*pModel->matrix[1][1] + pModel->shiftY;
+}
+
+bool InvertTransform(const TransformModel *pModel, TransformModel *pInverse)
+{
+   const double (*M)[2] = pModel->matrix;
+   double det = M[0][0]*M[1][1] - M[0][1]*M[1][0];
+   if (fabs(det) < 1e-12)
+   {
+      return false;
+   }
+
+   *pInverse = *pModel;
+   pInverse->matrix[0][0] = M[1][1]/det;
+   pInverse->matrix[0][1] = -M[0][1]/det;
+   pInverse->matrix[1][0] = -M[1][0]/det;
+   pInverse->matrix[1][1] = M[0][0]/det;
+   pInverse->shiftX = -(pModel->shiftX*pInverse->matrix[0][0] + pModel->shiftY*pInverse->matrix[1][0]);
+   pInverse->shiftY = -(pModel->shiftX*pInverse->matrix[0][1] + pModel->shiftY*pInverse->matrix[1][1]);
+   pInverse->rotation = -pModel->rotation;
+   pInverse->scale = 1.0/pModel->scale;
+
+   return true;
+}
+
+bool EstimateTransform(const double X[][2], const double Y[][2], int n, const RansacOptions *pOptions, TransformModel *pModel,
+                       unsigned char *pInliers)
+{
+   int sampleSize = pOptions->affine ? 3 : 2;
+   if (n < sampleSize)
+   {
+      return false;
+   }
+
+   double thresholdSq = pOptions->inlierThreshold*pOptions->inlierThreshold;
+   unsigned int state = pOptions->seed;
+
+   unsigned char *pFlags = (unsigned char *)malloc(3*n);
+   double (*pX)[2] = (double (*)[2])malloc(sizeof(double)*2*n);
+   double (*pY)[2] = (double (*)[2])malloc(sizeof(double)*2*n);
+   if ((pFlags == NULL) || (pX == NULL) || (pY == NULL))
+   {
+      free(pFlags);
+      free(pX);
+      free(pY);
+      return false;
+   }
+   unsigned char *pBestFlags = pFlags + n;
+   unsigned char *pSavedFlags = pFlags + 2*n;
+
+   TransformModel best;
+   unsigned int bestInliers = 0;
+   unsigned int nRequired = pOptions->maxIterations;
+   unsigned int nIteration = 0;
+
+   for (nIteration=0; (nIteration < nRequired) && (nIteration < pOptions->maxIterations); nIteration++)
+   {
+      //Distinct sample points, rejecting samples too close together to fix the transform
+      int sample[3];
+      for (int s=0; s<sampleSize; s++)
+      {
+         bool bRepeat;
+         do
+         {
+            sample[s] = NextRandom(&state) % n;
+            bRepeat = false;
+            for (int t=0; t<s; t++)
+            {
+               bRepeat = bRepeat || (sample[t] == sample[s]);
+            }
+         } while (bRepeat);
+
+         pX[s][0] = X[sample[s]][0];
+         pX[s][1] = X[sample[s]][1];
+         pY[s][0] = Y[sample[s]][0];
+         pY[s][1] = Y[sample[s]][1];
+      }
+
+      double dx = pY[1][0] - pY[0][0];
+      double dy = pY[1][1] - pY[0][1];
+      if (dx*dx + dy*dy < MIN_SAMPLE_SEPARATION*MIN_SAMPLE_SEPARATION)
+      {
+         continue;
+      }
+
+      TransformModel model;
+      if (!FitModel(pX, pY, sampleSize, pOptions->affine, &model))
+      {
+         continue;
+      }
+
+      unsigned int nInliers = CountInliers(&model, X, Y, n, thresholdSq, pFlags);
+      if (nInliers <= bestInliers)
+      {
+         continue;
+      }
+
+      //Local optimisation: refit on the inliers while that keeps adding inliers
+      for (int nLocal=0; nLocal<MAX_LOCAL_ITERATIONS; nLocal++)
+      {
+         TransformModel refined;
+         if (!RefitInliers(X, Y, n, pFlags, pOptions->affine, pX, pY, &refined))
+         {
+            break;
+         }
+
+         memcpy(pSavedFlags, pFlags, n);
+         unsigned int nRefined = CountInliers(&refined, X, Y, n, thresholdSq, pFlags);
+         if (nRefined < nInliers)
+         {
+            memcpy(pFlags, pSavedFlags, n);
+            break;
+         }
+
+         bool bGrew = (nRefined > nInliers);
+         model = refined;
+         nInliers = nRefined;
+         if (!bGrew)
+         {
+            break;
+         }
+      }
+
+      best = model;
+      bestInliers = nInliers;
+      memcpy(pBestFlags, pFlags, n);
+
+      //Samples needed to draw an all-inlier sample with the requested confidence at this inlier ratio
+      double w = pow(static_cast<double>(bestInliers)/n, sampleSize);
+      if (w >= 1.0)
+      {
+         nRequired = nIteration + 1;
+      }
+      else if (w > 0.0)
+      {
+         double nNeeded = log(1.0 - pOptions->confidence)/log(1.0 - w);
+         nRequired = static_cast<unsigned int>(std::min(nNeeded, static_cast<double>(pOptions->maxIterations))) + 1;
+      }
+   }
+
+   bool bSuccess = (bestInliers >= static_cast<unsigned int>(sampleSize) + 1) ||
+                   ((bestInliers == static_cast<unsigned int>(n)) && (n >= sampleSize));
+   if (bSuccess)
+   {
+      *pModel = best;
+
+      double sumSq = 0.0;
+      for (int i=0; i<n; i++)
+      {
+         if (pBestFlags[i])
+         {
+            sumSq += ResidualSq(&best, X[i], Y[i]);
+         }
+      }
+
+      pModel->rmsResidual = sqrt(sumSq/bestInliers);
+      pModel->nInliers = bestInliers;
+      pModel->nIterations = nIteration;
+
+      if (pInliers != NULL)
+      {
+         memcpy(pInliers, pBestFlags, n);
+      }
+   }
+
+   free(pFlags);
+   free(pX);
+   free(pY);
+
+   return bSuccess;
+}
+
+bool GetPixelMapping(const TransformModel *pModel, int rows, int cols, double mapping[2][3])
+{
+   TransformModel inverse;
+   if (!InvertTransform(pModel, &inverse))
+   {
+      return false;
+   }
+
+   //Master pixel (row, col) sits at x = col - cols/2, y = rows/2 - row; the reference position maps back the same way
+   const double (*M)[2] = inverse.matrix;
+   double cx = cols/2;
+   double cy = rows/2;
+
+   mapping[0][0] = M[0][0];
+   mapping[0][1] = -M[1][0];
+   mapping[0][2] = -cx*M[0][0] + cy*M[1][0] + inverse.shiftX + cx;
+   mapping[1][0] = -M[0][1];
+   mapping[1][1] = M[1][1];
+   mapping[1][2] = cx*M[0][1] - cy*M[1][1] - inverse.shiftY + cy;
+
+   return true;
+}
+
+void WarpImage(const double *pSrc, int srcRows, int srcCols, const double mapping[2][3], int interpolation, double fillValue,
+               double *pDst, int dstRows, int dstCols)
+{
+   WarpBand band;
+   band.pSrc = pSrc;
+   band.srcRows = srcRows;
+   band.srcCols = srcCols;
+   band.mapping = mapping;
+   band.interpolation = interpolation;
+   band.fillValue = fillValue;
+   band.pDst = pDst;
+   band.dstCols = dstCols;
+
+   switch (interpolation)
+   {
+   case INTERPOLATION_BILINEAR:
+      band.taps = 2;
+      break;
+   case INTERPOLATION_BICUBIC:
+      band.taps = 4;
+      break;
+   case INTERPOLATION_LANCZOS:
+      band.taps = 2*LANCZOS_LOBES;
+      break;
+   default:
+      band.taps = 1;
+      break;
+   }
+
+   std::vector<double> table((KERNEL_PHASES + 1)*MAX_KERNEL_TAPS);
+   if (band.taps > 1)
+   {
+      BuildKernelTable(interpolation, band.taps, &table[0]);
+   }
+   band.pTable = &table[0];
+
+   RunRowBands(warpBand, &band, dstRows, MIN_WARP_BAND_ROWS);
+}
+
+bool RegisterStarCatalogs(const StarCatalog *pMasterCatalog, const StarCatalog *pCatalog, int rows, int cols,
+                          const RansacOptions *pOptions, TransformModel *pModel, std::vector<StarMatch> *pMatches)
+{
+   std::vector<StarMatch> matches;
+   MatchStarCatalogs(pMasterCatalog, pCatalog, &matches);
+   if (pMatches != NULL)
+   {
+      *pMatches = matches;
+   }
+
+   int nCount = matches.size();
+   if (nCount < 3)
+   {
+      return false;
+   }
+
+   double (*X)[2] = (double (*)[2])malloc(sizeof(double)*2*nCount);
+   double (*Y)[2] = (double (*)[2])malloc(sizeof(double)*2*nCount);
+   if ((X == NULL) || (Y == NULL))
+   {
+      free(X);
+      free(Y);
+      return false;
+   }
+
+   for (int i=0; i<nCount; i++)
+   {
+      const StarInfo &starMas = pMasterCatalog->stars[matches[i].nIndex];
+      X[i][0] = starMas.x-cols/2;
+      X[i][1] = -starMas.y+rows/2;
+
+      const StarInfo &starRef = pCatalog->stars[matches[i].nRefIndex];
+      Y[i][0] = starRef.x-cols/2;
+      Y[i][1] = -starRef.y+rows/2;
+   }
+
+   bool bSuccess = EstimateTransform(X, Y, nCount, pOptions, pModel, NULL);
+
+   free(X);
+   free(Y);
+
+   return bSuccess;
+}
+
+bool PhaseCorrelate(const double *pMaster, const double *pFrame, int size, double *pShiftRow, double *pShiftCol, double *pPeak)
+{
+   return CorrelatePeak(pMaster, pFrame, size, size, pShiftRow, pShiftCol, pPeak);
+}
+
+bool RegisterPhaseCorrelation(const double *pMaster, ImagePyramid *pMasterPyramid, const double *pFrame,
+                              ImagePyramid *pFramePyramid, const PhaseCorrelationOptions *pOptions, TransformModel *pModel,
+                              double *pPeak)
+{
+   int rows = pMasterPyramid->rows, cols = pMasterPyramid->cols;
+   int rowsRef = pFramePyramid->rows, colsRef = pFramePyramid->cols;
+   if ((std::min(rows, cols) < MIN_CORRELATION_SIZE) || (std::min(rowsRef, colsRef) < MIN_CORRELATION_SIZE))
+   {
+      return false;
+   }
+
+   //The coarsest level is the first at which both images fit the coarse size, as long as they stay large enough to correlate
+   int nLevel = std::max(GetPyramidLevelFor(rows, cols, pOptions->coarseSize),
+                         GetPyramidLevelFor(rowsRef, colsRef, pOptions->coarseSize));
+   while (nLevel > 0)
+   {
+      int r, c, rRef, cRef;
+      GetPyramidLevelSize(rows, cols, nLevel, &r, &c);
+      GetPyramidLevelSize(rowsRef, colsRef, nLevel, &rRef, &cRef);
+      if (std::min(std::min(r, c), std::min(rRef, cRef)) >= MIN_CORRELATION_SIZE)
+      {
+         break;
+      }
+      nLevel--;
+   }
+
+   CorrelationLevels levels;
+   levels.master.resize(nLevel + 1);
+   levels.frame.resize(nLevel + 1);
+   levels.rows.resize(nLevel + 1);
+   levels.cols.resize(nLevel + 1);
+   levels.rowsRef.resize(nLevel + 1);
+   levels.colsRef.resize(nLevel + 1);
+
+   levels.master[0] = pMaster;
+   levels.frame[0] = pFrame;
+   levels.rows[0] = rows;
+   levels.cols[0] = cols;
+   levels.rowsRef[0] = rowsRef;
+   levels.colsRef[0] = colsRef;
+
+   for (int level=1; level<=nLevel; level++)
+   {
+      levels.master[level] = GetPyramidLevel(pMasterPyramid, level, &levels.rows[level], &levels.cols[level]);
+      levels.frame[level] = GetPyramidLevel(pFramePyramid, level, &levels.rowsRef[level], &levels.colsRef[level]);
+      if ((levels.master[level] == NULL) || (levels.frame[level] == NULL))
+      {
+         return false;
+      }
+   }
+
+   std::vector<TransformModel> candidates;
+   if (pOptions->logPolar)
+   {
+      //The log-polar spectra are taken over a window lying inside both images, since a padded border would add a
+      //spectrum that does not rotate. The level is the finest at which the window still spans most of the image.
+      int level = 0;
+      while ((level < nLevel) && (std::max(levels.rows[level], levels.cols[level]) > pOptions->windowSize))
+      {
+         level++;
+      }
+
+      int r = levels.rows[level], c = levels.cols[level], rRef = levels.rowsRef[level], cRef = levels.colsRef[level];
+      int size = NextPowerOfTwo(std::min(std::min(r, c), std::min(rRef, cRef))/2 + 1);
+      std::vector<double> masterWindow(size*size), frameWindow(size*size);
+      double rotation = 0.0, scale = 1.0;
+
+      CropWindow(levels.master[level], r, c, r/2 - size/2, c/2 - size/2, size, &masterWindow[0]);
+      CropWindow(levels.frame[level], rRef, cRef, rRef/2 - size/2, cRef/2 - size/2, size, &frameWindow[0]);
+      TaperWindow(&masterWindow[0], size);
+      TaperWindow(&frameWindow[0], size);
+
+      if (!CorrelateLogPolar(&masterWindow[0], &frameWindow[0], size, &rotation, &scale))
+      {
+         return false;
+      }
+
+      //The spectrum cannot tell the rotation from the same rotation plus half a turn. Images close to symmetric under
+      //half a turn correlate almost as well both ways at a coarse level, so both are carried to full resolution.
+      candidates.push_back(SimilarityModel(rotation, scale));
+      candidates.push_back(SimilarityModel(rotation + PI, scale));
+   }
+   else
+   {
+      candidates.push_back(SimilarityModel(0.0, 1.0));
+   }
+
+   double bestPeak = 0.0;
+   for (unsigned int i=0; i<candidates.size(); i++)
+   {
+      double peak = 0.0;
+      if (RefineCorrelation(levels, pOptions, &candidates[i], &peak) && (peak > bestPeak))
+      {
+         bestPeak = peak;
+         *pModel = candidates[i];
+      }
+   }
+
+   if (pPeak != NULL)
+   {
+      *pPeak = bestPeak;
+   }
+
+   return bestPeak > 0.0;
+}
@@ -0,0 +1,110 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _REGISTRATIONLIB_H_
+#define _REGISTRATIONLIB_H_
+
+#include "pyramidlib.h"
+#include "starlib.h"
+
+//Maps a point of the reference frame onto the master frame as a row vector: [x' y'] = [x y] * matrix + [shiftX shiftY]
+typedef struct _TransformModel TransformModel;
+struct _TransformModel
+{
+   double matrix[2][2];      //rotation times scale for a similarity, the full linear part for an affine transform
+   double shiftX;
+   double shiftY;
+   double rotation;          //radians, counter-clockwise
+   double scale;             //geometric mean of the axis scales for an affine transform
+   double rmsResidual;       //over the inliers, in pixels
+   unsigned int nInliers;
+   unsigned int nIterations; //RANSAC samples drawn
+   bool affine;
+};
+
+//Resampling kernels of WarpImage
+#define INTERPOLATION_NEAREST 0
+#define INTERPOLATION_BILINEAR 1
+#define INTERPOLATION_BICUBIC 2
+#define INTERPOLATION_LANCZOS 3
+
+typedef struct _RansacOptions RansacOptions;
+struct _RansacOptions
+{
+   bool affine;                  //fit an affine transform from 3 point samples instead of a similarity from 2
+   double inlierThreshold;       //largest residual of an inlier, in pixels
+   double confidence;            //stop once an all-inlier sample has been drawn with this probability
+   unsigned int maxIterations;   //bound on the samples drawn whatever the inlier ratio
+   unsigned int seed;            //seed of the sample generator, so runs are repeatable
+};
+
+void GetDefaultRansacOptions(RansacOptions *pOptions);
+
+typedef struct _PhaseCorrelationOptions PhaseCorrelationOptions;
+struct _PhaseCorrelationOptions
+{
+   bool logPolar;       //estimate rotation and scale from the log-polar magnitude spectra before the translation
+   int coarseSize;      //the coarsest pyramid level used is the first whose longer side fits in this many pixels
+   int windowSize;      //side of the central window correlated at the finer levels, a power of two
+};
+
+void GetDefaultPhaseCorrelationOptions(PhaseCorrelationOptions *pOptions);
+
+//Least-squares similarity (procrustes) mapping the n points of Y onto those of X
+bool FitSimilarity(const double X[][2], const double Y[][2], int n, TransformModel *pModel);
+
+//Least-squares affine transform mapping the n points of Y onto those of X
+bool FitAffine(const double X[][2], const double Y[][2], int n, TransformModel *pModel);
+
+void ApplyTransform(const TransformModel *pModel, double x, double y, double *pX, double *pY);
+
+//Inverse of a transform, mapping the master frame back onto the reference frame
+bool InvertTransform(const TransformModel *pModel, TransformModel *pInverse);
+
+//Robust transform mapping the points of Y onto the matching points of X with LO-RANSAC: minimal samples are fitted,
+//every new best model is refined by least squares on its inliers until the inlier set stops growing, and sampling stops
+//once the confidence is reached for the current inlier ratio. pInliers, if not NULL, receives n flags.
+//Returns false if no model with enough inliers was found.
+bool EstimateTransform(const double X[][2], const double Y[][2], int n, const RansacOptions *pOptions, TransformModel *pModel,
+                       unsigned char *pInliers);
+
+//Match the stars of a frame (pCatalog) against those of the master frame (pMasterCatalog) and estimate the transform mapping
+//the frame onto the master, in coordinates centred on an image of rows x cols pixels with y pointing up.
+//pMatches, if not NULL, receives the star matches. Returns false if too few stars match or no consistent transform is found.
+bool RegisterStarCatalogs(const StarCatalog *pMasterCatalog, const StarCatalog *pCatalog, int rows, int cols,
+                          const RansacOptions *pOptions, TransformModel *pModel, std::vector<StarMatch> *pMatches);
+
+//Translation between two size x size windows (size a power of two) such that pFrame(row, col) ~ pMaster(row - *pShiftRow,
+//col - *pShiftCol), from the peak of the inverse transform of the normalised cross-power spectrum. The peak is refined to
+//sub-pixel precision by a parabola through its neighbours along each axis. *pPeak, between 0 and 1, is its height.
+bool PhaseCorrelate(const double *pMaster, const double *pFrame, int size, double *pShiftRow, double *pShiftCol, double *pPeak);
+
+//Transform mapping the frame onto the master, as RegisterStarCatalogs does, for images without stars. pMaster and pFrame
+//are level 0 of the two pyramids, whose coarser levels may already be cached. The coarsest level is phase correlated
+//whole, then each finer level corrects the estimate over a central window after warping the frame with it. With logPolar
+//the rotation and scale are taken first from the phase correlation of the log-polar magnitude spectra, which do not
+//depend on the translation. *pPeak receives the height of the final correlation peak. Returns false if the images are
+//too small or no peak is found.
+bool RegisterPhaseCorrelation(const double *pMaster, ImagePyramid *pMasterPyramid, const double *pFrame,
+                              ImagePyramid *pFramePyramid, const PhaseCorrelationOptions *pOptions, TransformModel *pModel,
+                              double *pPeak);
+
+//Affine map from a pixel (row, col) of the master image to the (column, row) position it samples in the reference image:
+//srcCol = mapping[0][0]*col + mapping[0][1]*row + mapping[0][2], srcRow likewise from mapping[1].
+//The transform works in coordinates centred on an image of rows x cols pixels with y pointing up.
+bool GetPixelMapping(const TransformModel *pModel, int rows, int cols, double mapping[2][3]);
+
+//Inverse-mapped resampling: every pixel of the dstRows x dstCols output takes the interpolated value of the source at its mapped
+//position, so the output has no holes or double hits. Positions off the source are set to fillValue; kernel taps falling off
+//the edge repeat the edge pixels. The source position advances by a constant step along a row, and row bands run on the
+//thread pool.
+void WarpImage(const double *pSrc, int srcRows, int srcCols, const double mapping[2][3], int interpolation, double fillValue,
+               double *pDst, int dstRows, int dstCols);
+
+#endif
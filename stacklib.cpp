@@ -0,0 +1,209 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "stacklib.h"
+#include "imagelib.h"
+
+#include <algorithm>
+#include <limits>
+#include <math.h>
+#include <vector>
+
+#define MIN_COMBINE_BAND_ROWS 8
+#define MAX_CLIP_ITERATIONS 5
+#define MAX_WINSOR_ITERATIONS 10
+#define WINSOR_CONVERGENCE 0.0005
+#define WINSOR_SIGMA_CORRECTION 1.134
+
+namespace
+{
+   double Median(double *pValues, unsigned int n)
+   {
+      unsigned int half = n/2;
+      std::nth_element(pValues, pValues + half, pValues + n);
+      double median = pValues[half];
+
+      if (n%2 == 0)
+      {
+         median = (median + *std::max_element(pValues, pValues + half))/2;
+      }
+
+      return median;
+   }
+
+   double Mean(const double *pValues, unsigned int n)
+   {
+      double sum = 0.0;
+      for (unsigned int i=0; i<n; i++)
+      {
+         sum += pValues[i];
+      }
+
+      return sum/n;
+   }
+
+   double Sigma(const double *pValues, unsigned int n, double centre)
+   {
+      double sumSq = 0.0;
+      for (unsigned int i=0; i<n; i++)
+      {
+         sumSq += (pValues[i] - centre)*(pValues[i] - centre);
+      }
+
+      return sqrt(sumSq/n);
+   }
+
+   //Drop the values farther than kappa sigma from the median until none are dropped
+   double SigmaClip(double *pValues, unsigned int n, double kappa)
+   {
+      for (int nIteration=0; (nIteration<MAX_CLIP_ITERATIONS) && (n > 2); nIteration++)
+      {
+         double centre = Median(pValues, n);
+         double limit = kappa*Sigma(pValues, n, centre);
+
+         unsigned int nKept = 0;
+         for (unsigned int i=0; i<n; i++)
+         {
+            if (fabs(pValues[i] - centre) <= limit)
+            {
+               pValues[nKept++] = pValues[i];
+            }
+         }
+
+         if ((nKept == n) || (nKept == 0))
+         {
+            break;
+         }
+         n = nKept;
+      }
+
+      return Mean(pValues, n);
+   }
+
+   //Sigma of the values clamped at kappa sigma of the median, iterated to convergence, then the mean of the values
+   //within kappa of that sigma. Clamping instead of dropping keeps one bright outlier from inflating sigma.
+   double WinsorizedClip(double *pValues, double *pWork, unsigned int n, double kappa)
+   {
+      if (n <= 2)
+      {
+         return Mean(pValues, n);
+      }
+
+      std::copy(pValues, pValues + n, pWork);
+      double centre = Median(pWork, n);
+      double sigma = Sigma(pValues, n, centre);
+
+      for (int nIteration=0; nIteration<MAX_WINSOR_ITERATIONS; nIteration++)
+      {
+         double low = centre - kappa*sigma;
+         double high = centre + kappa*sigma;
+         for (unsigned int i=0; i<n; i++)
+         {
+            pWork[i] = std::min(std::max(pValues[i], low), high);
+         }
+
+         double newSigma = WINSOR_SIGMA_CORRECTION*Sigma(pWork, n, Mean(pWork, n));
+         bool bConverged = fabs(newSigma - sigma) <= WINSOR_CONVERGENCE*sigma;
+         sigma = newSigma;
+         if (bConverged)
+         {
+            break;
+         }
+      }
+
+      unsigned int nKept = 0;
+      double sum = 0.0;
+      for (unsigned int i=0; i<n; i++)
+      {
+         if (fabs(pValues[i] - centre) <= kappa*sigma)
+         {
+            sum += pValues[i];
+            nKept++;
+         }
+      }
+
+      return (nKept > 0) ? sum/nKept : centre;
+   }
+
+   typedef struct _CombineBand
+   {
+      const double *pFrames;
+      unsigned int nFrames;
+      int cols;
+      unsigned int planeSize;
+      int method;
+      double kappa;
+      double *pDst;
+   } CombineBand;
+
+   void combineBand(void *pContext, int startRow, int endRow)
+   {
+      const CombineBand *pBand = reinterpret_cast<const CombineBand*>(pContext);
+      std::vector<double> values(pBand->nFrames);
+      std::vector<double> work(pBand->nFrames);
+
+      for (unsigned int nIndex=startRow*pBand->cols; nIndex<static_cast<unsigned int>(endRow*pBand->cols); nIndex++)
+      {
+         //Gather the frames covering this pixel
+         unsigned int n = 0;
+         for (unsigned int f=0; f<pBand->nFrames; f++)
+         {
+            double val = pBand->pFrames[f*pBand->planeSize + nIndex];
+            if (val == val)
+            {
+               values[n++] = val;
+            }
+         }
+
+         if (n == 0)
+         {
+            pBand->pDst[nIndex] = std::numeric_limits<double>::quiet_NaN();
+            continue;
+         }
+
+         switch (pBand->method)
+         {
+         case COMBINE_MEDIAN:
+            pBand->pDst[nIndex] = Median(&values[0], n);
+            break;
+         case COMBINE_SIGMA_CLIP:
+            pBand->pDst[nIndex] = SigmaClip(&values[0], n, pBand->kappa);
+            break;
+         case COMBINE_WINSORIZED:
+            pBand->pDst[nIndex] = WinsorizedClip(&values[0], &work[0], n, pBand->kappa);
+            break;
+         default:
+            pBand->pDst[nIndex] = Mean(&values[0], n);
+            break;
+         }
+      }
+   }
+};
+
+void CombineFrames(const double *pFrames, unsigned int nFrames, int rows, int cols, int method, double kappa, double *pDst)
+{
+   CombineBand band;
+   band.pFrames = pFrames;
+   band.nFrames = nFrames;
+   band.cols = cols;
+   band.planeSize = rows*cols;
+   band.method = method;
+   band.kappa = kappa;
+   band.pDst = pDst;
+
+   RunRowBands(combineBand, &band, rows, MIN_COMBINE_BAND_ROWS);
+}
+
+int GetStackStripRows(unsigned int nFrames, int rows, int cols, double maxBytes, int minRows)
+{
+   double rowBytes = static_cast<double>(nFrames)*cols*sizeof(double);
+   int stripRows = static_cast<int>(maxBytes/rowBytes);
+
+   return std::min(rows, std::max(minRows, stripRows));
+}
@@ -0,0 +1,26 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _STACKLIB_H_
+#define _STACKLIB_H_
+
+//How the aligned frames are combined into one pixel
+#define COMBINE_MEAN 0
+#define COMBINE_MEDIAN 1
+#define COMBINE_SIGMA_CLIP 2   //mean of the values within kappa sigma of the median, iterated
+#define COMBINE_WINSORIZED 3   //as COMBINE_SIGMA_CLIP, with sigma measured on values winsorized at kappa sigma
+
+//Combine nFrames aligned planes of rows x cols pixels, stored one after the other, into pDst. NaN marks pixels a frame
+//does not cover; pixels no frame covers are NaN in the result. Row bands run on the thread pool.
+void CombineFrames(const double *pFrames, unsigned int nFrames, int rows, int cols, int method, double kappa, double *pDst);
+
+//Rows of a strip of cols pixels such that nFrames planes of it fit in maxBytes, between minRows and rows
+int GetStackStripRows(unsigned int nFrames, int rows, int cols, double maxBytes, int minRows);
+
+#endif
@@ -0,0 +1,741 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#include "starlib.h"
+#include "imagelib.h"
+
+#include <QtCore/QMutex>
+
+#include <algorithm>
+#include <math.h>
+#include <set>
+#include <stdlib.h>
+
+#define BACKGROUND_CELL_SIZE 64
+#define NOISE_SAMPLE_ROWS 256
+#define MIN_DETECTION_BAND_ROWS 64
+#define DETECTION_STRIP_ROWS 64
+
+#define DEFAULT_WINDOW_SIZE 6
+#define DEFAULT_K_SIGMA 5.0
+#define DEFAULT_MIN_PIXELS 3
+#define DEFAULT_MAX_PIXELS 10000
+
+#define CATALOG_CELL_SIZE 64.0
+
+#define TRIANGLE_NEIGHBOURS 5
+#define TRIANGLE_BIN 0.01
+#define TRIANGLE_TOLERANCE 0.005
+#define TRIANGLE_MIN_SIDE 5.0
+#define TRIANGLE_MAX_RATIO 0.97
+#define MIN_MATCH_VOTES 3
+
+namespace
+{
+   //Median sky level of every BACKGROUND_CELL_SIZE square cell, interpolated bilinearly between cell centres
+   typedef struct _BackgroundGrid
+   {
+      const double *pData;
+      int rows;
+      int cols;
+      int cellsDown;
+      int cellsAcross;
+      double *pLevel;
+   } BackgroundGrid;
+
+   void measureCellRows(void *pContext, int startRow, int endRow)
+   {
+      BackgroundGrid *pGrid = reinterpret_cast<BackgroundGrid*>(pContext);
+      std::vector<double> cell;
+      cell.reserve(BACKGROUND_CELL_SIZE*BACKGROUND_CELL_SIZE);
+
+      for (int cellRow=startRow; cellRow<endRow; cellRow++)
+      {
+         int top = cellRow*BACKGROUND_CELL_SIZE;
+         int bottom = std::min(pGrid->rows, top + BACKGROUND_CELL_SIZE);
+
+         for (int cellCol=0; cellCol<pGrid->cellsAcross; cellCol++)
+         {
+            int left = cellCol*BACKGROUND_CELL_SIZE;
+            int right = std::min(pGrid->cols, left + BACKGROUND_CELL_SIZE);
+
+            cell.clear();
+            for (int i=top; i<bottom; i++)
+            {
+               cell.insert(cell.end(), pGrid->pData + i*pGrid->cols + left, pGrid->pData + i*pGrid->cols + right);
+            }
+
+            //Stars cover a small part of a cell, so the median stays on the sky
+            std::vector<double>::iterator pMedian = cell.begin() + cell.size()/2;
+            std::nth_element(cell.begin(), pMedian, cell.end());
+            pGrid->pLevel[cellRow*pGrid->cellsAcross + cellCol] = *pMedian;
+         }
+      }
+   }
+
+   double BackgroundAt(const BackgroundGrid *pGrid, int row, int col)
+   {
+      double y = (row + 0.5)/BACKGROUND_CELL_SIZE - 0.5;
+      double x = (col + 0.5)/BACKGROUND_CELL_SIZE - 0.5;
+      y = std::min(std::max(y, 0.0), static_cast<double>(pGrid->cellsDown - 1));
+      x = std::min(std::max(x, 0.0), static_cast<double>(pGrid->cellsAcross - 1));
+
+      int y0 = std::min(static_cast<int>(y), pGrid->cellsDown - 1);
+      int x0 = std::min(static_cast<int>(x), pGrid->cellsAcross - 1);
+      int y1 = std::min(y0 + 1, pGrid->cellsDown - 1);
+      int x1 = std::min(x0 + 1, pGrid->cellsAcross - 1);
+      double fy = y - y0;
+      double fx = x - x0;
+
+      const double *pLevel = pGrid->pLevel;
+      int n = pGrid->cellsAcross;
+      double top = pLevel[y0*n + x0]*(1.0 - fx) + pLevel[y0*n + x1]*fx;
+      double bottom = pLevel[y1*n + x0]*(1.0 - fx) + pLevel[y1*n + x1]*fx;
+
+      return top*(1.0 - fy) + bottom*fy;
+   }
+
+   typedef struct _StarSeed
+   {
+      int row;
+      int col;
+      double value;
+      double background;
+   } StarSeed;
+
+   bool BrighterSeed(const StarSeed &a, const StarSeed &b)
+   {
+      return a.value > b.value;
+   }
+
+   bool BrighterStar(const StarInfo &a, const StarInfo &b)
+   {
+      return a.flux > b.flux;
+   }
+
+   int CatalogCell(const StarCatalog *pCatalog, double x, double y)
+   {
+      int cellRow = std::min(std::max(static_cast<int>(floor(y/pCatalog->cellSize)), 0), pCatalog->cellsDown - 1);
+      int cellCol = std::min(std::max(static_cast<int>(floor(x/pCatalog->cellSize)), 0), pCatalog->cellsAcross - 1);
+
+      return cellRow*pCatalog->cellsAcross + cellCol;
+   }
+
+   double StarDistanceSq(const StarInfo &star, double x, double y)
+   {
+      return (star.x - x)*(star.x - x) + (star.y - y)*(star.y - y);
+   }
+
+   typedef struct _StarNeighbour
+   {
+      double distSq;
+      unsigned int nIndex;
+   } StarNeighbour;
+
+   bool CloserNeighbour(const StarNeighbour &a, const StarNeighbour &b)
+   {
+      return a.distSq < b.distSq;
+   }
+
+   //Vertices ordered by the side facing them, longest first. r1 and r2 are the two shorter sides over the longest.
+   typedef struct _StarTriangle
+   {
+      unsigned int vertex[3];
+      double r1;
+      double r2;
+      bool clockwise;
+      int key;
+   } StarTriangle;
+
+   bool TriangleKeyLess(const StarTriangle &a, const StarTriangle &b)
+   {
+      return a.key < b.key;
+   }
+
+   int TriangleKey(int bin1, int bin2)
+   {
+      return bin1*(static_cast<int>(1.0/TRIANGLE_BIN) + 2) + bin2;
+   }
+
+   bool MakeTriangle(const StarCatalog *pCatalog, unsigned int a, unsigned int b, unsigned int c, StarTriangle *pTriangle)
+   {
+      unsigned int v[3] = {a, b, c};
+      double side[3];
+
+      //side[i] faces v[i]
+      for (int i=0; i<3; i++)
+      {
+         const StarInfo &p = pCatalog->stars[v[(i+1)%3]];
+         const StarInfo &q = pCatalog->stars[v[(i+2)%3]];
+         side[i] = sqrt((p.x - q.x)*(p.x - q.x) + (p.y - q.y)*(p.y - q.y));
+      }
+
+      int order[3] = {0, 1, 2};
+      for (int i=0; i<2; i++)
+      {
+         for (int j=i+1; j<3; j++)
+         {
+            if (side[order[j]] > side[order[i]])
+            {
+               std::swap(order[i], order[j]);
+            }
+         }
+      }
+
+      double longest = side[order[0]];
+      if (longest < TRIANGLE_MIN_SIDE)
+      {
+         return false;
+      }
+
+      pTriangle->r1 = side[order[1]]/longest;
+      pTriangle->r2 = side[order[2]]/longest;
+
+      //Nearly equal sides would let noise swap the vertex order
+      if ((pTriangle->r1 > TRIANGLE_MAX_RATIO) || (pTriangle->r2 > TRIANGLE_MAX_RATIO*pTriangle->r1))
+      {
+         return false;
+      }
+
+      for (int i=0; i<3; i++)
+      {
+         pTriangle->vertex[i] = v[order[i]];
+      }
+
+      const StarInfo &p0 = pCatalog->stars[pTriangle->vertex[0]];
+      const StarInfo &p1 = pCatalog->stars[pTriangle->vertex[1]];
+      const StarInfo &p2 = pCatalog->stars[pTriangle->vertex[2]];
+      pTriangle->clockwise = ((p1.x - p0.x)*(p2.y - p0.y) - (p1.y - p0.y)*(p2.x - p0.x)) > 0;
+      pTriangle->key = TriangleKey(static_cast<int>(pTriangle->r1/TRIANGLE_BIN), static_cast<int>(pTriangle->r2/TRIANGLE_BIN));
+
+      return true;
+   }
+
+   bool SameVertices(const StarTriangle &a, const StarTriangle &b)
+   {
+      return (a.vertex[0] == b.vertex[0]) && (a.vertex[1] == b.vertex[1]) && (a.vertex[2] == b.vertex[2]);
+   }
+
+   bool VerticesLess(const StarTriangle &a, const StarTriangle &b)
+   {
+      for (int i=0; i<3; i++)
+      {
+         if (a.vertex[i] != b.vertex[i])
+         {
+            return a.vertex[i] < b.vertex[i];
+         }
+      }
+      return false;
+   }
+
+   //Triangles of every star with pairs of its nearest neighbours. A triangle found from several of its vertices is kept once,
+   //so it does not vote more than once.
+   void BuildTriangles(const StarCatalog *pCatalog, std::vector<StarTriangle> *pTriangles)
+   {
+      std::vector<unsigned int> neighbours;
+      pTriangles->clear();
+
+      for (unsigned int i=0; i<pCatalog->stars.size(); i++)
+      {
+         FindNeighbourStars(pCatalog, i, TRIANGLE_NEIGHBOURS, &neighbours, NULL);
+
+         for (unsigned int j=0; j<neighbours.size(); j++)
+         {
+            for (unsigned int k=j+1; k<neighbours.size(); k++)
+            {
+               StarTriangle triangle;
+               if (MakeTriangle(pCatalog, i, neighbours[j], neighbours[k], &triangle))
+               {
+                  pTriangles->push_back(triangle);
+               }
+            }
+         }
+      }
+
+      std::sort(pTriangles->begin(), pTriangles->end(), VerticesLess);
+      pTriangles->erase(std::unique(pTriangles->begin(), pTriangles->end(), SameVertices), pTriangles->end());
+   }
+
+   typedef struct _MatchVote
+   {
+      unsigned int nIndex;
+      unsigned int nRefIndex;
+   } MatchVote;
+
+   bool VoteLess(const MatchVote &a, const MatchVote &b)
+   {
+      return (a.nIndex < b.nIndex) || ((a.nIndex == b.nIndex) && (a.nRefIndex < b.nRefIndex));
+   }
+
+   bool MoreVotes(const StarMatch &a, const StarMatch &b)
+   {
+      return a.nVotes > b.nVotes;
+   }
+
+   typedef struct _SeedBand
+   {
+      const double *pData;
+      int rows;
+      int cols;
+      int windowSize;
+      double threshold;   //kSigma times the image noise
+      const BackgroundGrid *pGrid;
+      std::vector<StarSeed> *pSeeds;
+      QMutex *pMutex;
+   } SeedBand;
+
+   //Pixels equal to the maximum of their window and clear of the background by the threshold. The window maxima are
+   //filtered strip by strip, each strip read with windowSize rows of halo above and below, so the scratch of a band
+   //is a few strips whatever the image size.
+   void findSeeds(void *pContext, int startRow, int endRow)
+   {
+      SeedBand *pBand = reinterpret_cast<SeedBand*>(pContext);
+      int w = pBand->windowSize;
+      int cols = pBand->cols;
+      int firstRow = std::max(startRow, w);
+      int lastRow = std::min(endRow, pBand->rows - w);
+      if (firstRow >= lastRow)
+      {
+         return;
+      }
+
+      double *pMax = (double *)malloc(sizeof(double)*(std::min(DETECTION_STRIP_ROWS, lastRow - firstRow) + 2*w)*cols);
+      if (pMax == NULL)
+      {
+         return;
+      }
+
+      std::vector<StarSeed> seeds;
+      for (int top = firstRow; top < lastRow; top += DETECTION_STRIP_ROWS)
+      {
+         int nRows = std::min(DETECTION_STRIP_ROWS, lastRow - top);
+         int inStart = top - w;
+         if (!RunningMax2D(pBand->pData + inStart*cols, nRows + 2*w, cols, w, pMax))
+         {
+            break;
+         }
+
+         for (int row=top; row<top + nRows; row++)
+         {
+            const double *pRow = pBand->pData + row*cols;
+            const double *pMaxRow = pMax + (row - inStart)*cols;
+
+            for (int col=w; col<cols - w; col++)
+            {
+               if (pRow[col] != pMaxRow[col])
+               {
+                  continue;
+               }
+
+               double background = BackgroundAt(pBand->pGrid, row, col);
+               if (pRow[col] > background + pBand->threshold)
+               {
+                  StarSeed seed = {row, col, pRow[col], background};
+                  seeds.push_back(seed);
+               }
+            }
+         }
+      }
+
+      free(pMax);
+
+      pBand->pMutex->lock();
+      pBand->pSeeds->insert(pBand->pSeeds->end(), seeds.begin(), seeds.end());
+      pBand->pMutex->unlock();
+   }
+};
+
+void GetDefaultStarDetection(StarDetection *pDetection)
+{
+   pDetection->windowSize = DEFAULT_WINDOW_SIZE;
+   pDetection->kSigma = DEFAULT_K_SIGMA;
+   pDetection->minPixels = DEFAULT_MIN_PIXELS;
+   pDetection->maxPixels = DEFAULT_MAX_PIXELS;
+}
+
+void DetectStars(const double *pData, int rows, int cols, const StarDetection *pDetection, std::vector<StarInfo> *pStars)
+{
+   pStars->clear();
+
+   int w = pDetection->windowSize;
+   if ((rows < 2*w + 1) || (cols < 2*w + 1))
+   {
+      return;
+   }
+
+   BackgroundGrid grid;
+   grid.pData = pData;
+   grid.rows = rows;
+   grid.cols = cols;
+   grid.cellsDown = (rows + BACKGROUND_CELL_SIZE - 1)/BACKGROUND_CELL_SIZE;
+   grid.cellsAcross = (cols + BACKGROUND_CELL_SIZE - 1)/BACKGROUND_CELL_SIZE;
+
+   std::vector<double> level(grid.cellsDown*grid.cellsAcross);
+   grid.pLevel = &level[0];
+   RunRowBands(measureCellRows, &grid, grid.cellsDown, 1);
+
+   //The noise is measured on a band of rows through the middle of the image
+   int nSampleRows = std::min(rows, NOISE_SAMPLE_ROWS);
+   double noiseSigma = EstimateNoiseSigma(pData + ((rows - nSampleRows)/2)*cols, nSampleRows, cols);
+
+   QMutex mutex;
+   std::vector<StarSeed> seeds;
+
+   SeedBand band;
+   band.pData = pData;
+   band.rows = rows;
+   band.cols = cols;
+   band.windowSize = w;
+   band.threshold = pDetection->kSigma*noiseSigma;
+   band.pGrid = &grid;
+   band.pSeeds = &seeds;
+   band.pMutex = &mutex;
+
+   RunRowBands(findSeeds, &band, rows, MIN_DETECTION_BAND_ROWS);
+
+   //Grow the brightest seeds first, so a flat-topped or blended star is claimed whole by its brightest peak.
+   //Only pixels above a threshold are ever claimed, a small part of a star field, so they are kept in a set.
+   std::sort(seeds.begin(), seeds.end(), BrighterSeed);
+
+   std::set<int> claimed;
+   std::vector<int> stack;
+   std::vector<int> members;
+
+   for (unsigned int s=0; s<seeds.size(); s++)
+   {
+      const StarSeed &seed = seeds[s];
+      int seedIndex = seed.row*cols + seed.col;
+      if (claimed.count(seedIndex) > 0)
+      {
+         continue;
+      }
+
+      double threshold = seed.background + band.threshold;
+      bool bExtended = false;
+
+      stack.clear();
+      members.clear();
+      stack.push_back(seedIndex);
+      claimed.insert(seedIndex);
+
+      while (!stack.empty())
+      {
+         int nIndex = stack.back();
+         stack.pop_back();
+         members.push_back(nIndex);
+
+         if (members.size() > pDetection->maxPixels)
+         {
+            bExtended = true;
+            break;
+         }
+
+         int row = nIndex/cols;
+         int col = nIndex - row*cols;
+         for (int i=std::max(0, row-1); i<=std::min(rows-1, row+1); i++)
+         {
+            for (int j=std::max(0, col-1); j<=std::min(cols-1, col+1); j++)
+            {
+               int neighbour = i*cols + j;
+               if ((pData[neighbour] > threshold) && claimed.insert(neighbour).second)
+               {
+                  stack.push_back(neighbour);
+               }
+            }
+         }
+      }
+
+      //Pixels left on the stack of an extended object stay claimed, so its other peaks are not grown again
+      if (bExtended || (members.size() < pDetection->minPixels))
+      {
+         continue;
+      }
+
+      StarInfo star;
+      star.peakRow = seed.row;
+      star.peakCol = seed.col;
+      star.peak = seed.value;
+      star.background = seed.background;
+      star.nPixels = members.size();
+
+      double sumVal = 0.0, sumX = 0.0, sumY = 0.0;
+      for (unsigned int m=0; m<members.size(); m++)
+      {
+         int row = members[m]/cols;
+         int col = members[m] - row*cols;
+         double val = pData[members[m]] - seed.background;
+
+         sumVal += val;
+         sumX += val*col;
+         sumY += val*row;
+      }
+
+      star.flux = sumVal;
+      star.x = sumX/sumVal;
+      star.y = sumY/sumVal;
+
+      pStars->push_back(star);
+   }
+
+   std::sort(pStars->begin(), pStars->end(), BrighterStar);
+}
+
+double GetStarDetectionBytes(int rows, int cols, const StarDetection *pDetection)
+{
+   //The window maxima of a strip and the two strips of RunningMax2D scratch, the noise sample differences and
+   //the background levels
+   int w = pDetection->windowSize;
+   double stripRows = std::min(DETECTION_STRIP_ROWS, rows) + 2*w;
+   double cells = static_cast<double>((rows + BACKGROUND_CELL_SIZE - 1)/BACKGROUND_CELL_SIZE)*
+                  ((cols + BACKGROUND_CELL_SIZE - 1)/BACKGROUND_CELL_SIZE);
+   return sizeof(double)*(3*stripRows*cols + static_cast<double>(std::min(rows, NOISE_SAMPLE_ROWS))*cols + cells);
+}
+
+void CreateStarCatalog(int rows, int cols, double cellSize, StarCatalog *pCatalog)
+{
+   pCatalog->stars.clear();
+   pCatalog->cellSize = cellSize;
+   pCatalog->cellsDown = std::max(1, static_cast<int>(ceil(rows/cellSize)));
+   pCatalog->cellsAcross = std::max(1, static_cast<int>(ceil(cols/cellSize)));
+   pCatalog->cells.assign(pCatalog->cellsDown*pCatalog->cellsAcross, std::vector<unsigned int>());
+}
+
+void BuildStarCatalog(const std::vector<StarInfo> &stars, int rows, int cols, double borderFraction, unsigned int maxStars,
+                      double mergeRadius, StarCatalog *pCatalog)
+{
+   CreateStarCatalog(rows, cols, CATALOG_CELL_SIZE, pCatalog);
+
+   for (unsigned int i=0; (i<stars.size()) && (pCatalog->stars.size()<maxStars); i++)
+   {
+      if ((stars[i].y < borderFraction*rows) || (stars[i].y > (1.0 - borderFraction)*rows))
+      {
+         continue;
+      }
+
+      if ((stars[i].x < borderFraction*cols) || (stars[i].x > (1.0 - borderFraction)*cols))
+      {
+         continue;
+      }
+
+      AddCatalogStar(pCatalog, stars[i], mergeRadius);
+   }
+}
+
+bool AddCatalogStar(StarCatalog *pCatalog, const StarInfo &star, double mergeRadius)
+{
+   int nIndex = FindNearestStar(pCatalog, star.x, star.y, mergeRadius);
+   if (nIndex >= 0)
+   {
+      if (star.flux > pCatalog->stars[nIndex].flux)
+      {
+         std::vector<unsigned int> &oldCell = pCatalog->cells[CatalogCell(pCatalog, pCatalog->stars[nIndex].x, pCatalog->stars[nIndex].y)];
+         oldCell.erase(std::find(oldCell.begin(), oldCell.end(), static_cast<unsigned int>(nIndex)));
+
+         pCatalog->stars[nIndex] = star;
+         pCatalog->cells[CatalogCell(pCatalog, star.x, star.y)].push_back(nIndex);
+      }
+      return false;
+   }
+
+   pCatalog->cells[CatalogCell(pCatalog, star.x, star.y)].push_back(pCatalog->stars.size());
+   pCatalog->stars.push_back(star);
+
+   return true;
+}
+
+int FindNearestStar(const StarCatalog *pCatalog, double x, double y, double radius)
+{
+   int nearest = -1;
+   double nearestSq = radius*radius;
+
+   int top = std::max(0, static_cast<int>(floor((y - radius)/pCatalog->cellSize)));
+   int bottom = std::min(pCatalog->cellsDown - 1, static_cast<int>(floor((y + radius)/pCatalog->cellSize)));
+   int left = std::max(0, static_cast<int>(floor((x - radius)/pCatalog->cellSize)));
+   int right = std::min(pCatalog->cellsAcross - 1, static_cast<int>(floor((x + radius)/pCatalog->cellSize)));
+
+   for (int cellRow=top; cellRow<=bottom; cellRow++)
+   {
+      for (int cellCol=left; cellCol<=right; cellCol++)
+      {
+         const std::vector<unsigned int> &cell = pCatalog->cells[cellRow*pCatalog->cellsAcross + cellCol];
+         for (unsigned int i=0; i<cell.size(); i++)
+         {
+            double distSq = StarDistanceSq(pCatalog->stars[cell[i]], x, y);
+            if (distSq <= nearestSq)
+            {
+               nearestSq = distSq;
+               nearest = cell[i];
+            }
+         }
+      }
+   }
+
+   return nearest;
+}
+
+void FindNeighbourStars(const StarCatalog *pCatalog, unsigned int nIndex, unsigned int k, std::vector<unsigned int> *pNeighbours,
+                        std::vector<double> *pDistances)
+{
+   const StarInfo &star = pCatalog->stars[nIndex];
+   int centre = CatalogCell(pCatalog, star.x, star.y);
+   int centreRow = centre/pCatalog->cellsAcross;
+   int centreCol = centre - centreRow*pCatalog->cellsAcross;
+   int maxRing = std::max(pCatalog->cellsDown, pCatalog->cellsAcross);
+
+   std::vector<StarNeighbour> found;
+
+   //Visit rings of cells around the star until the next ring lies farther away than the kth neighbour found so far
+   for (int ring=0; ring<=maxRing; ring++)
+   {
+      if ((found.size() >= k) && (k > 0))
+      {
+         double reach = (ring - 1)*pCatalog->cellSize;
+         if (reach*reach >= found[k-1].distSq)
+         {
+            break;
+         }
+      }
+
+      for (int cellRow=centreRow-ring; cellRow<=centreRow+ring; cellRow++)
+      {
+         if ((cellRow < 0) || (cellRow >= pCatalog->cellsDown))
+         {
+            continue;
+         }
+
+         //Inner rows of the ring only contribute their two end cells
+         int step = ((cellRow == centreRow-ring) || (cellRow == centreRow+ring)) ? 1 : std::max(1, 2*ring);
+         for (int cellCol=centreCol-ring; cellCol<=centreCol+ring; cellCol+=step)
+         {
+            if ((cellCol < 0) || (cellCol >= pCatalog->cellsAcross))
+            {
+               continue;
+            }
+
+            const std::vector<unsigned int> &cell = pCatalog->cells[cellRow*pCatalog->cellsAcross + cellCol];
+            for (unsigned int i=0; i<cell.size(); i++)
+            {
+               if (cell[i] == nIndex)
+               {
+                  continue;
+               }
+
+               StarNeighbour neighbour = {StarDistanceSq(pCatalog->stars[cell[i]], star.x, star.y), cell[i]};
+               found.push_back(neighbour);
+            }
+         }
+      }
+
+      std::sort(found.begin(), found.end(), CloserNeighbour);
+      if (found.size() > k)
+      {
+         found.resize(k);
+      }
+   }
+
+   pNeighbours->clear();
+   if (pDistances != NULL)
+   {
+      pDistances->clear();
+   }
+
+   for (unsigned int i=0; i<found.size(); i++)
+   {
+      pNeighbours->push_back(found[i].nIndex);
+      if (pDistances != NULL)
+      {
+         pDistances->push_back(found[i].distSq);
+      }
+   }
+}
+
+void MatchStarCatalogs(const StarCatalog *pCatalog, const StarCatalog *pRefCatalog, std::vector<StarMatch> *pMatches)
+{
+   pMatches->clear();
+
+   std::vector<StarTriangle> triangles;
+   std::vector<StarTriangle> refTriangles;
+   BuildTriangles(pCatalog, &triangles);
+   BuildTriangles(pRefCatalog, &refTriangles);
+
+   //The reference triangles sorted by key are the hash index; a lookup is a binary search
+   std::sort(refTriangles.begin(), refTriangles.end(), TriangleKeyLess);
+
+   std::vector<MatchVote> votes;
+   for (unsigned int t=0; t<triangles.size(); t++)
+   {
+      const StarTriangle &triangle = triangles[t];
+      int bin1 = static_cast<int>(triangle.r1/TRIANGLE_BIN);
+      int bin2 = static_cast<int>(triangle.r2/TRIANGLE_BIN);
+
+      //Ratios within the tolerance can fall in the neighbouring bins
+      for (int d1=-1; d1<=1; d1++)
+      {
+         for (int d2=-1; d2<=1; d2++)
+         {
+            StarTriangle probe;
+            probe.key = TriangleKey(bin1 + d1, bin2 + d2);
+
+            std::pair<std::vector<StarTriangle>::const_iterator, std::vector<StarTriangle>::const_iterator> range =
+               std::equal_range(refTriangles.begin(), refTriangles.end(), probe, TriangleKeyLess);
+
+            for (std::vector<StarTriangle>::const_iterator pRef=range.first; pRef!=range.second; ++pRef)
+            {
+               if ((pRef->clockwise != triangle.clockwise) ||
+                   (fabs(pRef->r1 - triangle.r1) > TRIANGLE_TOLERANCE) || (fabs(pRef->r2 - triangle.r2) > TRIANGLE_TOLERANCE))
+               {
+                  continue;
+               }
+
+               for (int v=0; v<3; v++)
+               {
+                  MatchVote vote = {triangle.vertex[v], pRef->vertex[v]};
+                  votes.push_back(vote);
+               }
+            }
+         }
+      }
+   }
+
+   //Count the votes of every pair and keep the best supported reference star of every star
+   std::sort(votes.begin(), votes.end(), VoteLess);
+
+   std::vector<StarMatch> candidates;
+   for (unsigned int i=0; i<votes.size(); )
+   {
+      unsigned int j = i;
+      while ((j < votes.size()) && (votes[j].nIndex == votes[i].nIndex) && (votes[j].nRefIndex == votes[i].nRefIndex))
+      {
+         j++;
+      }
+
+      StarMatch match = {votes[i].nIndex, votes[i].nRefIndex, j - i};
+      if (match.nVotes >= MIN_MATCH_VOTES)
+      {
+         candidates.push_back(match);
+      }
+      i = j;
+   }
+
+   std::stable_sort(candidates.begin(), candidates.end(), MoreVotes);
+
+   std::vector<bool> used(pCatalog->stars.size(), false);
+   std::vector<bool> refUsed(pRefCatalog->stars.size(), false);
+   for (unsigned int i=0; i<candidates.size(); i++)
+   {
+      if (used[candidates[i].nIndex] || refUsed[candidates[i].nRefIndex])
+      {
+         continue;
+      }
+
+      used[candidates[i].nIndex] = true;
+      refUsed[candidates[i].nRefIndex] = true;
+      pMatches->push_back(candidates[i]);
+   }
+}
@@ -0,0 +1,97 @@
+/*
+ * The information in this file is
+ * Copyright(c) 2007 Ball Aerospace & Technologies Corporation
+ * and is subject to the terms and conditions of the
+ * GNU Lesser General Public License Version 2.1
+ * The license text is available from
+ * http://www.gnu.org/licenses/lgpl.html
+ */
+
+#ifndef _STARLIB_H_
+#define _STARLIB_H_
+
+#include <vector>
+
+typedef struct _StarInfo StarInfo;
+struct _StarInfo
+{
+   double x;              //intensity-weighted centroid, column
+   double y;              //intensity-weighted centroid, row
+   int peakRow;           //brightest pixel of the star
+   int peakCol;
+   double peak;           //value of the brightest pixel
+   double background;     //local sky level under the star
+   double flux;           //sum of the pixels above the background
+   unsigned int nPixels;  //connected pixels above the detection threshold
+};
+
+typedef struct _StarDetection StarDetection;
+struct _StarDetection
+{
+   int windowSize;        //a peak is the maximum of its (2*windowSize+1)^2 window, which also separates close stars
+   double kSigma;         //detection threshold above the local background, in units of the image noise
+   unsigned int minPixels;  //smaller components are hot pixels or noise
+   unsigned int maxPixels;  //larger components are extended objects rather than stars
+};
+
+//Stars of one image with a uniform grid index over the image, so that looking up the stars near a position only
+//visits the few cells around it however many stars the catalog holds
+typedef struct _StarCatalog StarCatalog;
+struct _StarCatalog
+{
+   std::vector<StarInfo> stars;
+   double cellSize;
+   int cellsDown;
+   int cellsAcross;
+   std::vector<std::vector<unsigned int> > cells;  //indices of the stars whose centroid lies in each cell, row-major
+};
+
+//A star of one catalog paired with a star of a reference catalog
+typedef struct _StarMatch StarMatch;
+struct _StarMatch
+{
+   unsigned int nIndex;
+   unsigned int nRefIndex;
+   unsigned int nVotes;   //similar triangles that put the two stars on the same vertex
+};
+
+//Detection parameters suitable for registration and photometry
+void GetDefaultStarDetection(StarDetection *pDetection);
+
+//Find the stars of a rows x cols image. Local maxima are found with a running max filter over strips of rows, kept when
+//they rise kSigma above the background, and grown into 8-connected components above that threshold, which are centroided.
+//Besides the image, the working set is a few strips per thread and the pixels of the components.
+//Stars within windowSize of the border are not reported. The list is sorted by decreasing flux.
+void DetectStars(const double *pData, int rows, int cols, const StarDetection *pDetection, std::vector<StarInfo> *pStars);
+
+//Bytes of scratch DetectStars needs on a rows x cols image when it runs on a single thread, as it does inside a band,
+//besides the image and the pixels of the components
+double GetStarDetectionBytes(int rows, int cols, const StarDetection *pDetection);
+
+//Empty catalog covering a rows x cols image with square cells of cellSize pixels
+void CreateStarCatalog(int rows, int cols, double cellSize, StarCatalog *pCatalog);
+
+//Catalog of up to maxStars of the brightest detections at least borderFraction of the size away from the image border.
+//Detections within mergeRadius of a brighter star are merged into it.
+void BuildStarCatalog(const std::vector<StarInfo> &stars, int rows, int cols, double borderFraction, unsigned int maxStars,
+                      double mergeRadius, StarCatalog *pCatalog);
+
+//Add a star unless the catalog already holds one within mergeRadius pixels, in which case the brighter of the two is kept.
+//Returns true if the star was added as a new entry.
+bool AddCatalogStar(StarCatalog *pCatalog, const StarInfo &star, double mergeRadius);
+
+//Index of the star nearest to (x, y) within radius pixels, or -1
+int FindNearestStar(const StarCatalog *pCatalog, double x, double y, double radius);
+
+//Indices of the k stars nearest to star nIndex, excluding itself, ordered by increasing distance.
+//pDistances, if not NULL, receives their squared distances.
+void FindNeighbourStars(const StarCatalog *pCatalog, unsigned int nIndex, unsigned int k, std::vector<unsigned int> *pNeighbours,
+                        std::vector<double> *pDistances);
+
+//Pair the stars of two catalogs by hashing the triangles each star forms with its nearest neighbours on their side ratios,
+//which do not change with shift, rotation or scale. Triangles with matching ratios and orientation vote for the pairs of
+//vertices they put together, so stars missing from either catalog only cost the votes of their own triangles.
+//Each star is paired at most once; the matches are sorted by decreasing votes.
+void MatchStarCatalogs(const StarCatalog *pCatalog, const StarCatalog *pRefCatalog, std::vector<StarMatch> *pMatches);
+
+#endif